@@ -0,0 +1,21 @@
+#!/bin/sh
+# Benchmark the s3 block engine against a local in-memory S3 stand-in
+#
+# Usage: s3bench.sh BBENCH [BLOCKS [BLOCKSIZE]]
+set -e
+
+BBENCH=${1:?Usage: s3bench.sh BBENCH [BLOCKS [BLOCKSIZE]]}
+BLOCKS=${2:-1000}
+BLOCKSIZE=${3:-65536}
+PORT=${PORT:-9000}
+
+python3 "$(dirname "$0")/s3standin.py" "$PORT" &
+SERVER=$!
+trap 'kill $SERVER' EXIT
+sleep 1
+
+# The stand-in doesn't check signatures, but the SDK wants credentials
+export AWS_ACCESS_KEY_ID=${AWS_ACCESS_KEY_ID:-bench}
+export AWS_SECRET_ACCESS_KEY=${AWS_SECRET_ACCESS_KEY:-bench}
+
+BRUCE_BE="s3://bench/blocks/;endpoint=127.0.0.1:$PORT;scheme=http" "$BBENCH" "$BLOCKS" "$BLOCKSIZE"
@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+"""In-memory stand-in for the parts of S3 that the s3 block engine uses.
+
+Serves PUT, GET, HEAD and DELETE of objects (including x-amz-meta-* headers),
+so the s3 engine can be benchmarked without network or credentials:
+
+    s3standin.py 9000
+    BRUCE_BE='s3://bench/blocks/;endpoint=127.0.0.1:9000;scheme=http' bbench 1000 65536
+
+Both path-style (/bucket/key) and virtual-hosted (bucket.host/key) requests are
+accepted; buckets are not checked.
+"""
+import sys
+import threading
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import unquote, urlsplit
+
+objects = {}
+lock = threading.Lock()
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def key(self):
+        path = unquote(urlsplit(self.path).path)
+        host = self.headers.get('Host', '').split(':')[0]
+        if host and not host[0].isdigit() and host.count('.') > 0:
+            # Virtual-hosted: bucket is in the host name
+            return host.split('.')[0] + path
+        return path.lstrip('/')
+
+    def reply(self, status, body=b'', headers=()):
+        self.send_response(status)
+        for name, value in headers:
+            self.send_header(name, value)
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        if self.command != 'HEAD':
+            self.wfile.write(body)
+
+    def do_PUT(self):
+        body = self.rfile.read(int(self.headers.get('Content-Length', 0)))
+        meta = [(k, v) for k, v in self.headers.items()
+                if k.lower().startswith('x-amz-meta-')]
+        with lock:
+            objects[self.key()] = (body, meta)
+        self.reply(200, headers=[('ETag', '"0"')])
+
+    def do_GET(self):
+        with lock:
+            obj = objects.get(self.key())
+        if obj is None:
+            self.reply(404, b'<Error><Code>NoSuchKey</Code></Error>',
+                       [('Content-Type', 'application/xml')])
+            return
+        body, meta = obj
+        self.reply(200, body, [('Content-Type', 'application/octet-stream')] + meta)
+
+    do_HEAD = do_GET
+
+    def do_DELETE(self):
+        with lock:
+            objects.pop(self.key(), None)
+        self.reply(204)
+
+    def log_message(self, format, *args):
+        pass
+
+
+if __name__ == '__main__':
+    port = int(sys.argv[1]) if len(sys.argv) > 1 else 9000
+    ThreadingHTTPServer(('127.0.0.1', port), Handler).serve_forever()
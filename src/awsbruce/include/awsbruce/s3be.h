@@ -12,7 +12,9 @@ namespace awsbruce {
 /**
  * Block engine that stores the blocks in S3
  *
- * The blocks will be zipped to decrease transfer times.
+ * The blocks will be zipped to decrease transfer times. The uncompressed size
+ * is stored in the object metadata, so blocks can be decompressed straight
+ * into a page of the right size.
  *
  * However, since we can't predict with 100% certainty what compression ratio
  * will be gained, the block size limit is whatever you specify, uncompressed.
@@ -20,16 +22,32 @@ namespace awsbruce {
  */
 struct s3be : public libbruce::be::be
 {
-    s3be(const std::shared_ptr<Aws::S3::S3Client> &s3, const std::string &bucket, const std::string &prefix, uint32_t blockSize, uint32_t editQueueSize, uint32_t cacheSize);
+    s3be(const std::shared_ptr<Aws::S3::S3Client> &s3, const std::string &bucket, const std::string &prefix, uint32_t blockSize, uint32_t editQueueSize, uint32_t cacheSize,
+         libbruce::util::cache_policy_t cachePolicy=libbruce::util::CACHE_LRU);
     ~s3be();
 
     virtual libbruce::nodeid_t id(const libbruce::mempage &block);
     virtual libbruce::mempage get(const libbruce::nodeid_t &id);
-    virtual libbruce::be::getblockresult_t get_all(const libbruce::be::blockidlist_t &ids);
     virtual void put_all(libbruce::be::putblocklist_t &blocklist);
     virtual void del_all(libbruce::be::delblocklist_t &ids);
     virtual uint32_t maxBlockSize();
     virtual uint32_t editQueueSize();
+    virtual bool contentAddressed();
+
+    /**
+     * Requests are started immediately; the returned futures are deferred and
+     * collect the responses on the thread that waits for them, so the block
+     * cache is never touched from the SDK's executor threads.
+     */
+    virtual libbruce::be::getfuture_t get_async(const libbruce::nodeid_t &id);
+    virtual libbruce::be::getallfuture_t get_all_async(const libbruce::be::blockidlist_t &ids);
+    virtual libbruce::be::putfuture_t put_all_async(libbruce::be::putblocklist_t &blocklist);
+
+    /**
+     * Blocks fetched with FETCH_SCAN are not added to the cache
+     */
+    virtual libbruce::mempage get(const libbruce::nodeid_t &id, libbruce::be::fetch_hint_t hint);
+    virtual libbruce::be::getallfuture_t get_all_async(const libbruce::be::blockidlist_t &ids, libbruce::be::fetch_hint_t hint);
 private:
     std::shared_ptr<Aws::S3::S3Client> m_s3;
     std::string m_bucket;
@@ -43,7 +61,8 @@ private:
     Aws::S3::Model::PutObjectOutcomeCallable put_one(libbruce::be::putblock_t &block);
     Aws::S3::Model::DeleteObjectOutcomeCallable del_one(libbruce::be::delblock_t &block);
 
-    libbruce::mempage readGetOutcome(const libbruce::nodeid_t &id, Aws::S3::Model::GetObjectOutcome &outcome);
+    libbruce::be::getfuture_t fetch(const libbruce::nodeid_t &id, libbruce::be::fetch_hint_t hint);
+    libbruce::mempage readGetOutcome(const libbruce::nodeid_t &id, Aws::S3::Model::GetObjectOutcome &outcome, libbruce::be::fetch_hint_t hint);
 };
 
 void register_s3_engine();
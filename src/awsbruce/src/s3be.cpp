@@ -6,11 +6,9 @@
 #include <aws/s3/model/GetObjectRequest.h>
 #include <aws/s3/model/PutObjectRequest.h>
 #include <aws/s3/model/DeleteObjectRequest.h>
-#include <boost/iostreams/filtering_stream.hpp>
-#include <boost/iostreams/filter/zlib.hpp>
-#include <boost/iostreams/copy.hpp>
 #include <openssl/sha.h>
-#include <sstream>
+#include <streambuf>
+#include <zlib.h>
 
 #undef to_string
 
@@ -22,12 +20,127 @@ using namespace Aws::Client;
 using namespace Aws::S3;
 using namespace Aws::S3::Model;
 
-namespace io = boost::iostreams;
+// Object metadata holding the uncompressed size of a block
+#define LENGTH_METADATA "bruce-length"
+
+// Largest block we expect from objects written without LENGTH_METADATA
+#define LEGACY_BLOCK_SIZE (64 * 1024 * 1024)
 
 namespace awsbruce {
 
-s3be::s3be(const std::shared_ptr<S3Client> &s3, const std::string &bucket, const std::string &prefix, uint32_t blockSize, uint32_t editQueueSize, uint32_t cacheSize)
-    : m_s3(s3), m_bucket(bucket), m_prefix(prefix), m_blockSize(blockSize), m_editQueueSize(editQueueSize), m_cache(cacheSize)
+namespace {
+
+/**
+ * Seekable read buffer over (the start of) a page
+ */
+class membuf : public std::streambuf
+{
+public:
+    membuf(const mempage &page, size_t size)
+        : m_page(page)
+    {
+        char *begin = (char*)m_page.ptr();
+        setg(begin, begin, begin + size);
+    }
+protected:
+    virtual pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which)
+    {
+        char *base = dir == std::ios_base::beg ? eback() : dir == std::ios_base::cur ? gptr() : egptr();
+        char *target = base + off;
+        if (target < eback() || target > egptr())
+            return pos_type(off_type(-1));
+
+        setg(eback(), target, egptr());
+        return pos_type(target - eback());
+    }
+
+    virtual pos_type seekpos(pos_type pos, std::ios_base::openmode which)
+    {
+        return seekoff(off_type(pos), std::ios_base::beg, which);
+    }
+private:
+    mempage m_page;
+};
+
+struct membuf_holder
+{
+    membuf_holder(const mempage &page, size_t size) : buf(page, size) { }
+    membuf buf;
+};
+
+/**
+ * Request body that reads straight from a page (which it keeps alive)
+ */
+class memstream : private membuf_holder, public std::iostream
+{
+public:
+    memstream(const mempage &page, size_t size)
+        : membuf_holder(page, size), std::iostream(&buf) { }
+};
+
+/**
+ * Compress a page into a new page, returning the compressed size
+ *
+ * The returned page may be larger than the compressed data.
+ */
+mempage deflatePage(const mempage &page, size_t *size)
+{
+    uLongf compressedSize = compressBound(page.size());
+    mempage ret = mempage::uninitialized(compressedSize);
+    if (compress2(ret.ptr(), &compressedSize, page.ptr(), page.size(), Z_DEFAULT_COMPRESSION) != Z_OK)
+        throw be_error("Error compressing block");
+
+    *size = compressedSize;
+    return ret;
+}
+
+/**
+ * Decompress a stream into the given buffer, returning the decompressed size
+ */
+size_t inflateStream(std::istream &in, uint8_t *out, size_t capacity)
+{
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (inflateInit(&z) != Z_OK)
+        throw be_error("Error initializing zlib");
+
+    z.next_out = out;
+    z.avail_out = capacity;
+
+    char chunk[64 * 1024];
+    int r = Z_OK;
+    while (r != Z_STREAM_END)
+    {
+        std::streamsize n = in.rdbuf()->sgetn(chunk, sizeof(chunk));
+        if (n <= 0)
+            break;
+
+        z.next_in = (Bytef*)chunk;
+        z.avail_in = n;
+        while (z.avail_in && r != Z_STREAM_END)
+        {
+            r = inflate(&z, Z_NO_FLUSH);
+            if (r != Z_OK && r != Z_STREAM_END)
+            {
+                inflateEnd(&z);
+                throw be_error("Corrupt block");
+            }
+        }
+    }
+
+    size_t size = z.total_out;
+    inflateEnd(&z);
+
+    if (r != Z_STREAM_END)
+        throw be_error("Truncated block");
+    return size;
+}
+
+}
+
+s3be::s3be(const std::shared_ptr<S3Client> &s3, const std::string &bucket, const std::string &prefix, uint32_t blockSize, uint32_t editQueueSize, uint32_t cacheSize,
+           util::cache_policy_t cachePolicy)
+    : m_s3(s3), m_bucket(bucket), m_prefix(prefix), m_blockSize(blockSize), m_editQueueSize(editQueueSize), m_cache(cacheSize, cachePolicy, 16, blockSize)
 {
 }
 
@@ -45,57 +158,67 @@ nodeid_t s3be::id(const libbruce::mempage &block)
 
 mempage s3be::get(const nodeid_t &id)
 {
-    //std::cerr << "GET " << id << std::endl;
-
-    // Look in the cache
-    {
-        mempage ret;
-        if (m_cache.get(id, &ret))
-            return ret;
-    }
-
-    GetObjectRequest request;
-    request.SetBucket(m_bucket);
-    request.SetKey(m_prefix + boost::lexical_cast<std::string>(id));
+    return get_async(id).get();
+}
 
-    GetObjectOutcome response = m_s3->GetObject(request);
-    return readGetOutcome(id, response);
+mempage s3be::get(const nodeid_t &id, fetch_hint_t hint)
+{
+    return fetch(id, hint).get();
 }
 
-getblockresult_t s3be::get_all(const blockidlist_t &ids)
+getfuture_t s3be::get_async(const nodeid_t &id)
 {
-    getblockresult_t ret;
+    return fetch(id, FETCH_NORMAL);
+}
 
-    std::vector<nodeid_t> queried_ids;
-    std::vector<GetObjectOutcomeCallable> ops;
-    queried_ids.reserve(ids.size());
-    ops.reserve(ids.size());
+getfuture_t s3be::fetch(const nodeid_t &id, fetch_hint_t hint)
+{
+    //std::cerr << "GET " << id << std::endl;
 
-    // Look in the cache, query only if not found in the cache
-    for (int i = 0; i < ids.size(); i++)
+    // Look in the cache
     {
         mempage cached;
-        if (m_cache.get(ids[i], &cached))
-            ret[ids[i]] = cached;
-        else
+        if (m_cache.get(id, &cached))
         {
-            queried_ids.push_back(ids[i]);
-            ops.push_back(get_one(ids[i]));
+            std::promise<mempage> promise;
+            promise.set_value(cached);
+            return promise.get_future();
         }
-
     }
 
-    // Collect results
-    for (int i = 0; i < queried_ids.size(); i++)
-    {
-        GetObjectOutcome response = ops[i].get();
-        ret[queried_ids[i]] = readGetOutcome(queried_ids[i], response);
-    }
+    std::shared_ptr<GetObjectOutcomeCallable> op = std::make_shared<GetObjectOutcomeCallable>(get_one(id));
 
-    return ret;
+    return std::async(std::launch::deferred, [this, id, op, hint]() {
+        GetObjectOutcome response = op->get();
+        return readGetOutcome(id, response, hint);
+    });
+}
+
+getallfuture_t s3be::get_all_async(const blockidlist_t &ids)
+{
+    return get_all_async(ids, FETCH_NORMAL);
+}
+
+getallfuture_t s3be::get_all_async(const blockidlist_t &ids, fetch_hint_t hint)
+{
+    // Start all requests (the ones not in the cache) right away
+    std::shared_ptr<std::vector<getfuture_t> > ops = std::make_shared<std::vector<getfuture_t> >();
+    ops->reserve(ids.size());
+
+    for (int i = 0; i < ids.size(); i++)
+        ops->push_back(fetch(ids[i], hint));
+
+    // Collect results in request order
+    return std::async(std::launch::deferred, [ops]() {
+        mempagelist_t ret;
+        ret.reserve(ops->size());
+        for (int i = 0; i < ops->size(); i++)
+            ret.push_back((*ops)[i].get());
+        return ret;
+    });
 }
 
-mempage s3be::readGetOutcome(const nodeid_t &id, GetObjectOutcome &response)
+mempage s3be::readGetOutcome(const nodeid_t &id, GetObjectOutcome &response, fetch_hint_t hint)
 {
     if (!response.IsSuccess())
         throw be_error((std::string("Error fetching ") +
@@ -103,19 +226,33 @@ mempage s3be::readGetOutcome(const nodeid_t &id, GetObjectOutcome &response)
                        ": " +
                        response.GetError().GetMessage()).c_str());
 
-    std::stringstream ss;
+    GetObjectResult &result = response.GetResult();
 
-    // Decompress into the stringstream
-    io::filtering_ostreambuf in;
-    in.push(io::zlib_decompressor());
-    in.push(ss);
-    io::copy(response.GetResult().GetBody(), in);
+    size_t length = 0;
+    auto meta = result.GetMetadata().find(LENGTH_METADATA);
+    if (meta != result.GetMetadata().end())
+        length = boost::lexical_cast<size_t>(meta->second);
 
-    mempage ret(ss.str().size());
-    memcpy((void*)ret.ptr(), ss.str().data(), ss.str().size());
+    mempage ret;
+    if (length)
+    {
+        // Decompress straight into a page of the right size
+        ret = mempage::uninitialized(length);
+        if (inflateStream(result.GetBody(), ret.ptr(), length) != length)
+            throw be_error((std::string("Unexpected size of ") + boost::lexical_cast<std::string>(id)).c_str());
+    }
+    else
+    {
+        // Written before we stored the length, so go through a scratch page
+        mempage scratch = mempage::uninitialized(m_blockSize ? m_blockSize : LEGACY_BLOCK_SIZE);
+        size_t size = inflateStream(result.GetBody(), scratch.ptr(), scratch.size());
+        ret = mempage::uninitialized(size);
+        memcpy(ret.ptr(), scratch.ptr(), size);
+    }
 
-    // Put in the cache
-    m_cache.put(id, ret);
+    // Put in the cache, unless this is part of a scan
+    if (hint != FETCH_SCAN)
+        m_cache.put(id, ret);
     return ret;
 }
 
@@ -130,46 +267,49 @@ Aws::S3::Model::GetObjectOutcomeCallable s3be::get_one(const libbruce::nodeid_t
 
 void s3be::put_all(putblocklist_t &blocklist)
 {
-    std::vector<PutObjectOutcomeCallable> ops;
-    ops.reserve(blocklist.size());
+    put_all_async(blocklist).get();
+}
+
+putfuture_t s3be::put_all_async(putblocklist_t &blocklist)
+{
+    std::shared_ptr<std::vector<PutObjectOutcomeCallable> > ops = std::make_shared<std::vector<PutObjectOutcomeCallable> >();
+    ops->reserve(blocklist.size());
 
     for (int i = 0; i < blocklist.size(); i++)
     {
-        ops.push_back(put_one(blocklist[i]));
+        ops->push_back(put_one(blocklist[i]));
     }
 
     // Collect results
-    for (int i = 0; i < blocklist.size(); i++)
-    {
-        PutObjectOutcome response = ops[i].get();
-        blocklist[i].success = response.IsSuccess();
-
-        // Only cache succesful puts
-        if (response.IsSuccess())
-            m_cache.put(blocklist[i].id, blocklist[i].mem);
-        else
-            blocklist[i].failureReason = response.GetError().GetMessage();
-    }
+    putblocklist_t *blocks = &blocklist;
+    return std::async(std::launch::deferred, [this, ops, blocks]() {
+        for (int i = 0; i < blocks->size(); i++)
+        {
+            PutObjectOutcome response = (*ops)[i].get();
+            (*blocks)[i].success = response.IsSuccess();
+
+            // Only cache succesful puts
+            if (response.IsSuccess())
+                m_cache.put((*blocks)[i].id, (*blocks)[i].mem);
+            else
+                (*blocks)[i].failureReason = response.GetError().GetMessage();
+        }
+    });
 }
 
 PutObjectOutcomeCallable s3be::put_one(libbruce::be::putblock_t &block)
 {
     //std::cerr << "PUT " << block.id << std::endl;
-    io::basic_array_source<char> memstream((char*)block.mem.ptr(), block.mem.size());
-
-    std::shared_ptr<std::stringstream> ss = std::make_shared<std::stringstream>();
-
-    io::filtering_ostream in;
-    in.push(io::zlib_compressor());
-    in.push(*ss);
-    io::copy(memstream, in);
+    size_t compressedSize;
+    mempage compressed = deflatePage(block.mem, &compressedSize);
 
     PutObjectRequest request;
     request.SetBucket(m_bucket);
     request.SetKey(m_prefix + boost::lexical_cast<std::string>(block.id));
     request.SetContentType("application/octet-stream");
-    request.SetBody(ss);
-    request.SetContentLength(ss->str().size());
+    request.SetBody(std::make_shared<memstream>(compressed, compressedSize));
+    request.SetContentLength(compressedSize);
+    request.AddMetadata(LENGTH_METADATA, boost::lexical_cast<std::string>(block.mem.size()).c_str());
 
     return m_s3->PutObjectCallable(request);
 }
@@ -218,6 +358,11 @@ uint32_t s3be::editQueueSize()
     return m_editQueueSize;
 }
 
+bool s3be::contentAddressed()
+{
+    return true;
+}
+
 be_ptr create_s3_engine(const std::string &location, size_t block_size, size_t queue_size, const util::options_t &options)
 {
     ClientConfiguration config;
@@ -226,6 +371,13 @@ be_ptr create_s3_engine(const std::string &location, size_t block_size, size_t q
     config.connectTimeoutMs = options.get("timeout", 10000);
     config.requestTimeoutMs = options.get("timeout", 10000);
 
+    // To talk to an S3-compatible server other than AWS, e.g. for benchmarking
+    std::string endpoint = options.get<std::string>("endpoint", "");
+    if (!endpoint.empty())
+        config.endpointOverride = endpoint.c_str();
+    if (options.get<std::string>("scheme", "https") == "http")
+        config.scheme = Scheme::HTTP;
+
     auto clientFactory = Aws::MakeShared<HttpClientFactory>(NULL);
     auto s3 = Aws::MakeShared<S3Client>(NULL, Aws::MakeShared<DefaultAWSCredentialsProviderChain>(NULL), config, clientFactory);
 
@@ -233,8 +385,9 @@ be_ptr create_s3_engine(const std::string &location, size_t block_size, size_t q
     std::string bucket = location.substr(0, slash);
     std::string prefix = slash == std::string::npos ? "" : location.substr(slash + 1);
     size_t cache_size = options.get("cache", 100 * 1024 * 1024);
+    util::cache_policy_t cache_policy = util::parse_cache_policy(options.get<std::string>("cachepolicy", "lru"));
 
-    return boost::make_shared<s3be>(s3, bucket, prefix, block_size, queue_size, cache_size);
+    return boost::make_shared<s3be>(s3, bucket, prefix, block_size, queue_size, cache_size, cache_policy);
 }
 
 void register_s3_engine()
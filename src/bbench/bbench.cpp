@@ -0,0 +1,156 @@
+/**
+ * Block engine benchmark
+ *
+ * Puts, gets and deletes a batch of random blocks through the engine given in
+ * BRUCE_BE, so different engines can be compared on the same workload:
+ *
+ *     BRUCE_BE=file:///mnt/nvme/blocks/ bbench 1000 65536
+ *     BRUCE_BE=uring:///mnt/nvme/blocks/ bbench 1000 65536
+ *     BRUCE_BE=pack:///mnt/nvme/pack bbench 1000 65536
+ *     BRUCE_BE='parallel://file:///mnt/nvme/blocks/;threads=8' bbench 1000 65536
+ *     BRUCE_BE='compress://file:///mnt/nvme/blocks/;codec=zlib' bbench 1000 65536
+ *     BRUCE_BE='cache://file:///mnt/nvme/blocks/;cache=67108864;pinned=8388608' bbench 1000 65536
+ *     BRUCE_BE='tiered://file:///mnt/nfs/blocks/;tier=/mnt/nvme/tier/' bbench 1000 65536
+ *
+ * The s3 engine can be benchmarked offline with awsbruce/bench/s3bench.sh.
+ */
+#include <libbruce/bruce.h>
+#include <libbruce/util/be_registry.h>
+#include <libbruce/be/cache.h>
+#include <libbruce/be/compress.h>
+#include <libbruce/be/pack.h>
+#include <libbruce/be/parallel.h>
+#include <libbruce/be/tiered.h>
+
+#ifdef HAVE_URING
+#include <libbruce/be/uring.h>
+#endif
+
+#ifdef HAVE_AWSBRUCE
+#include <awsbruce/awsbruce.h>
+#endif
+
+#include <sys/time.h>
+#include <cstdlib>
+#include <cstdio>
+
+using namespace libbruce;
+
+double now()
+{
+    timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + (tv.tv_usec / 1e6);
+}
+
+void report(const char *op, size_t blocks, size_t blockSize, double seconds)
+{
+    printf("%-8s %8zu blocks %10.1f ms %10.1f blocks/s %10.1f MB/s\n",
+           op, blocks, seconds * 1000, blocks / seconds,
+           blocks * blockSize / seconds / (1024 * 1024));
+}
+
+int main(int argc, char* argv[])
+{
+    be::register_disk_engine();
+    be::register_mem_engine();
+    be::register_pack_engine();
+    be::register_parallel_engine();
+    be::register_compress_engine();
+    be::register_cache_engine();
+    be::register_tiered_engine();
+#ifdef HAVE_URING
+    be::register_uring_engine();
+#endif
+#ifdef HAVE_AWSBRUCE
+    awsbruce::register_s3_engine();
+#endif
+
+    const char *be_spec = std::getenv("BRUCE_BE");
+    if (!be_spec)
+    {
+        std::cerr << "Set BRUCE_BE variable to block engine spec" << std::endl;
+        return 1;
+    }
+
+    if (argc != 3)
+    {
+        fprintf(stderr, "Usage: bbench BLOCKS BLOCKSIZE\n");
+        return 1;
+    }
+
+    size_t count = atoi(argv[1]);
+    size_t blockSize = atoi(argv[2]);
+
+    try
+    {
+        be::be_ptr be = util::create_be(std::string(be_spec));
+
+        be::putblocklist_t blocks;
+        be::blockidlist_t ids;
+        blocks.reserve(count);
+        ids.reserve(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            mempage page(blockSize);
+            for (size_t j = 0; j < blockSize; j++)
+                *page.at<uint8_t>(j) = rand();
+            blocks.push_back(be::putblock_t(be->id(page), page));
+            ids.push_back(blocks.back().id);
+        }
+
+        double start = now();
+        be->put_all(blocks);
+        report("put_all", count, blockSize, now() - start);
+
+        start = now();
+        be::mempagelist_t pages = be->get_all_async(ids).get();
+        report("get_all", count, blockSize, now() - start);
+
+        start = now();
+        for (size_t i = 0; i < count; i++)
+            be->get(ids[i]);
+        report("get", count, blockSize, now() - start);
+
+        be::delblocklist_t dels;
+        dels.reserve(count);
+        for (size_t i = 0; i < count; i++)
+            dels.push_back(be::delblock_t(ids[i]));
+
+        start = now();
+        be->del_all(dels);
+        report("del_all", count, blockSize, now() - start);
+
+        boost::shared_ptr<be::compress> compress = boost::dynamic_pointer_cast<be::compress>(be);
+        if (compress)
+        {
+            be::compress_stats stats = compress->stats();
+            printf("compression ratio %.2f, %.1f ms compressing, %.1f ms decompressing\n",
+                   stats.ratio(), stats.compressSeconds * 1000, stats.decompressSeconds * 1000);
+        }
+
+        boost::shared_ptr<be::cache> cache = boost::dynamic_pointer_cast<be::cache>(be);
+        if (cache)
+        {
+            be::cache_stats stats = cache->stats();
+            printf("cache %llu hits (%llu pinned), %llu misses, %zu pages pinned\n",
+                   (unsigned long long)stats.hits, (unsigned long long)stats.pinnedHits,
+                   (unsigned long long)stats.misses, stats.pinnedCount);
+        }
+
+        boost::shared_ptr<be::tiered> tiered = boost::dynamic_pointer_cast<be::tiered>(be);
+        if (tiered)
+        {
+            be::tiered_stats stats = tiered->stats();
+            printf("tier %llu hits, %llu misses, %zu blocks on disk\n",
+                   (unsigned long long)stats.hits, (unsigned long long)stats.misses, stats.count);
+        }
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -1,5 +1,13 @@
 #include <libbruce/bruce.h>
 #include <libbruce/util/be_registry.h>
+#include <libbruce/be/cache.h>
+#include <libbruce/be/compress.h>
+#include <libbruce/be/pack.h>
+#include <libbruce/be/parallel.h>
+#include <libbruce/be/tiered.h>
+#ifdef HAVE_URING
+#include <libbruce/be/uring.h>
+#endif
 
 #include <sys/time.h>
 #include <fstream>
@@ -164,7 +172,7 @@ int queryKey(stringbruce &b, Params &params)
 int fullScan(stringbruce &b, Params &params)
 {
     auto query = b.query(*params.root);
-    stringbruce::iterator it = query->begin();
+    stringbruce::iterator it = query->begin(be::FETCH_SCAN);
 
     while (it)
     {
@@ -179,6 +187,14 @@ int main(int argc, char* argv[])
 {
     be::register_disk_engine();
     be::register_mem_engine();
+    be::register_pack_engine();
+    be::register_parallel_engine();
+    be::register_compress_engine();
+    be::register_cache_engine();
+    be::register_tiered_engine();
+#ifdef HAVE_URING
+    be::register_uring_engine();
+#endif
 #ifdef HAVE_AWSBRUCE
     awsbruce::register_s3_engine();
 
@@ -57,7 +57,14 @@ void StatsCollector::visitLeaf(const nodeid_t &id, const leafnode_ptr &leaf, int
     LeafNodeSize s(leaf, 0);
     m_leafSizes.push_back(s.size());
 
-    m_leafValues += leaf->pairs.size();
+    m_leafValues += leaf->pairCount();
+
+    // Blobs belong to the tree as well
+    for (keycount_t i = 0; i < leaf->pairCount(); i++)
+    {
+        if (leaf->value(i).blob)
+            m_ids.push_back(BlobID(leaf->value(i)));
+    }
 
     m_lastLeafDepth = depth;
 }
@@ -72,6 +79,12 @@ void StatsCollector::visitOverflow(const nodeid_t &id, const overflownode_ptr &o
     m_overflowSizes.push_back(s.size());
 
     m_overflowValues += overflow->values.size();
+
+    for (valuelist_t::const_iterator it = overflow->values.begin(); it != overflow->values.end(); ++it)
+    {
+        if (it->blob)
+            m_ids.push_back(BlobID(*it));
+    }
 }
 
 std::string human_bytes(size_t s)
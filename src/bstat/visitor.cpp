@@ -11,7 +11,7 @@ BruceVisitor::~BruceVisitor()
 
 void doWalk(const nodeid_t &id, BruceVisitor &visitor, be::be &blockEngine, const tree_functions &fns, int depth)
 {
-    mempage mem = blockEngine.get(id);
+    mempage mem = blockEngine.get(id, be::FETCH_SCAN);
     node_ptr node = ParseNode(mem, fns);
     switch (node->nodeType())
     {
@@ -6,6 +6,7 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <future>
 #include <stdexcept>
 
 #include <boost/range.hpp>
@@ -57,6 +58,21 @@ typedef std::vector<mempage> mempagelist_t;
 typedef std::vector<nodeid_t> blockidlist_t;
 typedef std::map<nodeid_t, mempage> getblockresult_t;
 
+typedef std::future<mempage> getfuture_t;
+typedef std::future<mempagelist_t> getallfuture_t;
+typedef std::future<void> putfuture_t;
+
+/**
+ * How fetched blocks are going to be used
+ *
+ * FETCH_SCAN is for bulk scans: the blocks are unlikely to be needed again
+ * soon, so engines that cache blocks shouldn't add them to the cache.
+ */
+enum fetch_hint_t {
+    FETCH_NORMAL,
+    FETCH_SCAN
+};
+
 /**
  * Base block engine class
  */
@@ -66,12 +82,62 @@ public:
     virtual ~be() {}
 
     virtual nodeid_t id(const mempage &block) = 0;
+
+    /**
+     * Return the IDs of a batch of blocks, in the same order
+     *
+     * The default implementation calls id() for every block. Engines that can
+     * hash several blocks at once should override this.
+     */
+    virtual blockidlist_t ids(const mempagelist_t &blocks);
+
     virtual mempage get(const nodeid_t &id) = 0;
-    virtual getblockresult_t get_all(const blockidlist_t &ids) = 0;
+
+    /**
+     * Return a batch of blocks by ID
+     *
+     * Adapter over get_all_async for callers that want to look blocks up by
+     * ID. Engines should override get_all_async instead.
+     */
+    virtual getblockresult_t get_all(const blockidlist_t &ids);
     virtual void put_all(putblocklist_t &blocklist) = 0;
     virtual void del_all(delblocklist_t &ids) = 0;
     virtual uint32_t maxBlockSize() = 0;
     virtual uint32_t editQueueSize() = 0;
+
+    /**
+     * Whether block IDs are derived from the block contents
+     *
+     * If so, an ID refers to the same contents in every engine and process,
+     * and what was parsed from a block can be shared between trees.
+     */
+    virtual bool contentAddressed() { return false; }
+
+    /**
+     * Asynchronous variants of get, get_all and put_all
+     *
+     * get_all_async returns the blocks in the same order as the requested
+     * IDs. For put_all_async, the block list must stay alive until the future
+     * has resolved, at which point the success flags have been filled in.
+     *
+     * The default implementations do the work synchronously and return a
+     * future that has already resolved; get_all_async calls get() for every
+     * block. Engines that can fetch several blocks at once should override
+     * get_all_async, and engines that go over the network should override
+     * these to start the requests and return immediately.
+     */
+    virtual getfuture_t get_async(const nodeid_t &id);
+    virtual getallfuture_t get_all_async(const blockidlist_t &ids);
+    virtual putfuture_t put_all_async(putblocklist_t &blocklist);
+
+    /**
+     * Variants of get and get_all_async with a fetch hint
+     *
+     * The default implementations ignore the hint. Engines that cache blocks,
+     * and decorators, should override these.
+     */
+    virtual mempage get(const nodeid_t &id, fetch_hint_t hint);
+    virtual getallfuture_t get_all_async(const blockidlist_t &ids, fetch_hint_t hint);
 };
 
 }}
@@ -0,0 +1,104 @@
+#pragma once
+#ifndef BRUCE_BE_CACHE_H
+#define BRUCE_BE_CACHE_H
+
+#include <atomic>
+#include <future>
+#include <mutex>
+#include <boost/unordered_map.hpp>
+
+#include <libbruce/be/be.h>
+#include <libbruce/util/blockcache.h>
+
+namespace libbruce { namespace be {
+
+struct cache_stats
+{
+    cache_stats() : hits(0), misses(0), pinnedHits(0), pinnedSize(0), pinnedCount(0) { }
+
+    uint64_t hits;       // Including pinned hits
+    uint64_t misses;
+    uint64_t pinnedHits;
+    size_t pinnedSize;
+    size_t pinnedCount;
+};
+
+/**
+ * Block engine that caches the blocks of another engine in memory
+ *
+ * Internal pages go into a pinned set of their own, which is never evicted:
+ * once it is full, further internal pages are cached like any other page.
+ * With a pinned budget that fits the upper levels of the tree, a point lookup
+ * in steady state only fetches its leaf. Leaf and overflow pages go through
+ * a regular BlockCache with the given policy.
+ *
+ * The page type is read from the flags at the start of every page, so the
+ * inner engine has to return pages as the tree wrote them (put cache:// in
+ * front of compress://, not behind it).
+ *
+ * If a hot file is given, the IDs of the cached blocks are written to it when
+ * the engine is destroyed, and prefetched from the inner engine when the next
+ * one is created, so a restarted process doesn't start with a cold cache.
+ *
+ * Created from a spec like "cache://s3://bucket/prefix/;cache=268435456;pinned=33554432",
+ * where the inner engine gets the options of the outer spec as well, but for
+ * the ones the cache uses itself. The hot file is set with hotfile=PATH.
+ */
+class cache : public be
+{
+public:
+    cache(const be_ptr &inner, size_t cacheSize, size_t pinnedSize, util::cache_policy_t policy=util::CACHE_LRU,
+          const std::string &hotFile="");
+    ~cache();
+
+    virtual mempage get(const nodeid_t &id);
+    virtual getallfuture_t get_all_async(const blockidlist_t &ids);
+    virtual mempage get(const nodeid_t &id, fetch_hint_t hint);
+    virtual getallfuture_t get_all_async(const blockidlist_t &ids, fetch_hint_t hint);
+    virtual nodeid_t id(const mempage &block);
+    virtual blockidlist_t ids(const mempagelist_t &blocks);
+    virtual void put_all(putblocklist_t &blocklist);
+    virtual void del_all(delblocklist_t &ids);
+    virtual uint32_t maxBlockSize();
+    virtual uint32_t editQueueSize();
+    virtual bool contentAddressed();
+
+    cache_stats stats() const;
+
+    /**
+     * IDs of all cached blocks, pinned ones first
+     */
+    blockidlist_t hotIDs() const;
+
+    /**
+     * Load blocks into the cache, with all requests in flight at once
+     *
+     * Blocks that can't be fetched anymore are skipped.
+     */
+    void prefetch(const blockidlist_t &ids);
+private:
+    be_ptr m_inner;
+    util::BlockCache m_cache;
+
+    mutable std::mutex m_pinnedMutex;
+    boost::unordered_map<nodeid_t, mempage> m_pinned;
+    size_t m_pinnedSize;
+    size_t m_pinnedMaxSize;
+    std::string m_hotFile;
+
+    std::atomic<uint64_t> m_hits;
+    std::atomic<uint64_t> m_misses;
+    std::atomic<uint64_t> m_pinnedHits;
+
+    bool lookup(const nodeid_t &id, mempage *page);
+    void store(const nodeid_t &id, const mempage &page, fetch_hint_t hint);
+    mempagelist_t completeFetch(mempagelist_t pages, const std::vector<size_t> &indexes,
+                                const blockidlist_t &ids, std::shared_future<mempagelist_t> fetched,
+                                fetch_hint_t hint);
+};
+
+void register_cache_engine();
+
+}}
+
+#endif
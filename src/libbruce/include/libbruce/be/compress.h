@@ -0,0 +1,127 @@
+#pragma once
+#ifndef BRUCE_BE_COMPRESS_H
+#define BRUCE_BE_COMPRESS_H
+
+#include <map>
+#include <mutex>
+
+#include <libbruce/be/be.h>
+
+namespace libbruce { namespace be {
+
+struct compress_dict;
+typedef boost::shared_ptr<compress_dict> compress_dict_ptr;
+
+/**
+ * Compression counters, accumulated over the lifetime of the engine
+ */
+struct compress_stats
+{
+    compress_stats()
+        : pagesCompressed(0), rawBytes(0), compressedBytes(0), compressSeconds(0),
+          pagesDecompressed(0), decompressSeconds(0) { }
+
+    uint64_t pagesCompressed;
+    uint64_t rawBytes;
+    uint64_t compressedBytes;
+    double compressSeconds;
+    uint64_t pagesDecompressed;
+    double decompressSeconds;
+
+    double ratio() const { return compressedBytes ? (double)rawBytes / compressedBytes : 0; }
+};
+
+/**
+ * Block engine that compresses pages before handing them to another engine
+ *
+ * Every stored block starts with a small header:
+ *
+ *   [ uint16 ]   magic ("BZ")
+ *   [ uint8 ]    codec
+ *   [ uint8 ]    flags (0x01: a dictionary ID follows)
+ *   [ uint32 ]   uncompressed length
+ *   [ hash160 ]  dictionary block ID (only if flagged)
+ *
+ * so pages are decompressed straight into a page of the right size. Pages
+ * that don't get smaller are stored as they are (codec NONE), and blocks
+ * without the magic are passed through, so an existing store can be
+ * wrapped without converting it.
+ *
+ * The columnar page layout compresses well already, but small pages do a
+ * lot better with a dictionary. train() builds one from sample leaf pages
+ * and stores it as a block in the inner engine; blocks refer to it by ID,
+ * so readers load it by themselves. Setting trainSamples makes the engine
+ * collect that many leaf pages from its own writes and train on those.
+ *
+ * Dictionaries belong to the engine, not to a tree: one is used for every
+ * tree written through the engine, and they aren't part of any mutation, so
+ * they're never deleted along with the blocks that refer to them. Whoever
+ * removes the store can find the ones this engine stored in dictionaries().
+ *
+ * zstd is only available if libbruce was built with HAVE_ZSTD; zlib
+ * always is.
+ */
+class compress : public be
+{
+public:
+    enum codec_t { CODEC_NONE = 0, CODEC_ZLIB = 1, CODEC_ZSTD = 2 };
+
+    compress(const be_ptr &inner, codec_t codec, int level, size_t trainSamples=0, size_t dictSize=64 * 1024);
+    ~compress();
+
+    virtual mempage get(const nodeid_t &id);
+    virtual getallfuture_t get_all_async(const blockidlist_t &ids);
+    virtual mempage get(const nodeid_t &id, fetch_hint_t hint);
+    virtual getallfuture_t get_all_async(const blockidlist_t &ids, fetch_hint_t hint);
+    virtual nodeid_t id(const mempage &block);
+    virtual blockidlist_t ids(const mempagelist_t &blocks);
+    virtual void put_all(putblocklist_t &blocklist);
+    virtual void del_all(delblocklist_t &ids);
+    virtual uint32_t maxBlockSize();
+    virtual uint32_t editQueueSize();
+    virtual bool contentAddressed();
+
+    /**
+     * Build a dictionary from sample pages and use it for all further writes
+     *
+     * Returns the ID of the dictionary block, which can be passed to
+     * useDictionary() (or the dict= option) later.
+     */
+    nodeid_t train(const mempagelist_t &samples);
+
+    /**
+     * Compress all further writes with a previously stored dictionary
+     */
+    void useDictionary(const nodeid_t &id);
+
+    /**
+     * IDs of the dictionaries this engine stored, in the order it trained them
+     */
+    blockidlist_t dictionaries() const;
+
+    compress_stats stats() const;
+private:
+    be_ptr m_inner;
+    codec_t m_codec;
+    int m_level;
+    size_t m_trainSamples;
+    size_t m_dictSize;
+
+    mutable std::mutex m_mutex;
+    compress_dict_ptr m_dict;
+    std::map<nodeid_t, compress_dict_ptr> m_dicts;
+    blockidlist_t m_trained;
+    mempagelist_t m_samples;
+    compress_stats m_stats;
+
+    compress_dict_ptr dictionary(const nodeid_t &id);
+    void sample(const putblocklist_t &blocklist);
+    mempage encode(const mempage &page, const compress_dict_ptr &dict, compress_stats *stats);
+    mempage decode(const mempage &page);
+};
+
+void register_compress_engine();
+
+}}
+
+#endif
@@ -9,25 +9,31 @@
 namespace libbruce { namespace be {
 
 /**
- * Memory block engine
+ * Disk block engine, storing every block in its own file
+ *
+ * If mmap is set, blocks are mapped into memory instead of being read, so
+ * nodes are parsed straight from the page cache without copying them.
  */
 class disk : public be
 {
 public:
-    disk(std::string pathPrefix, uint32_t maxBlockSize, uint32_t editQueueSize=0);
+    disk(std::string pathPrefix, uint32_t maxBlockSize, uint32_t editQueueSize=0, bool mmap=false);
 
     virtual mempage get(const nodeid_t &id);
-    virtual getblockresult_t get_all(const blockidlist_t &ids);
+    using be::get;
     virtual nodeid_t id(const mempage &block);
+    virtual blockidlist_t ids(const mempagelist_t &blocks);
     virtual void put_all(putblocklist_t &blocklist);
     virtual void del_all(delblocklist_t &ids);
     virtual uint32_t maxBlockSize();
     virtual uint32_t editQueueSize();
-private:
+    virtual bool contentAddressed();
+protected:
     std::string m_pathPrefix;
     uint32_t m_maxBlockSize;
     uint32_t m_editQueueSize;
-
+    bool m_mmap;
+private:
     void put_one(putblock_t &block);
     void del_one(delblock_t &block);
 };
@@ -20,7 +20,7 @@ public:
     size_t blockCount() const;
 
     virtual mempage get(const nodeid_t &id);
-    virtual getblockresult_t get_all(const blockidlist_t &ids);
+    using be::get;
     virtual nodeid_t id(const mempage &block);
     virtual void put_all(putblocklist_t &blocklist);
     virtual void del_all(delblocklist_t &ids);
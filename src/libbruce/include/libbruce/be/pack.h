@@ -0,0 +1,133 @@
+#pragma once
+#ifndef BRUCE_BE_PACK_H
+#define BRUCE_BE_PACK_H
+
+#include <map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <boost/unordered_map.hpp>
+
+#include <libbruce/be/be.h>
+
+namespace libbruce { namespace be {
+
+struct pack_segment;
+typedef boost::shared_ptr<pack_segment> pack_segment_ptr;
+
+/**
+ * Where a block lives in a pack directory
+ */
+struct pack_location
+{
+    pack_location() : segment(0), offset(0), length(0) { }
+    pack_location(uint32_t segment, uint32_t offset, uint32_t length)
+        : segment(segment), offset(offset), length(length) { }
+
+    uint32_t segment;
+    uint32_t offset;
+    uint32_t length;
+};
+
+/**
+ * Append-only block engine that packs blocks into large segment files
+ *
+ * Instead of one file per block, put_all appends a whole batch to the
+ * active segment with a single write, and records where every block ended
+ * up in an index file in the same directory. The index is replayed into
+ * memory on startup; reads are a lookup plus a single pread.
+ *
+ * Deleting only writes a tombstone to the index. Once the live fraction of
+ * a (non-active) segment drops below compactThreshold, a background thread
+ * copies its remaining blocks to the active segment and removes the file.
+ * A threshold of 0 disables compaction.
+ *
+ * A read-only pack (maxBlockSize 0) can map its segments into memory by
+ * setting mmap, in which case get hands out pages that point straight into
+ * the mapping.
+ *
+ * Blocks are addressed by their SHA1 hash, like with the disk engine.
+ * A pack directory must not be written by more than one process at a time.
+ */
+class pack : public be
+{
+public:
+    pack(const std::string &directory, uint32_t maxBlockSize, uint32_t editQueueSize=0,
+         uint32_t segmentSize=256 * 1024 * 1024, double compactThreshold=0.5, bool mmap=false);
+    ~pack();
+
+    virtual mempage get(const nodeid_t &id);
+    using be::get;
+    virtual getallfuture_t get_all_async(const blockidlist_t &ids);
+    using be::get_all_async;
+    virtual nodeid_t id(const mempage &block);
+    virtual blockidlist_t ids(const mempagelist_t &blocks);
+    virtual void put_all(putblocklist_t &blocklist);
+    virtual void del_all(delblocklist_t &ids);
+    virtual uint32_t maxBlockSize();
+    virtual uint32_t editQueueSize();
+    virtual bool contentAddressed();
+
+    /**
+     * Rewrite all segments whose live fraction is below the threshold
+     */
+    void compact();
+
+    size_t blockCount() const;
+    size_t segmentCount() const;
+
+    /**
+     * How often background compaction failed, and why it last did
+     *
+     * A failed compaction leaves its segments as they are until the next
+     * attempt.
+     */
+    size_t compactFailures() const;
+    std::string lastCompactError() const;
+private:
+    typedef boost::unordered_map<nodeid_t, pack_location> index_t;
+    typedef std::map<uint32_t, pack_segment_ptr> segmentmap_t;
+
+    std::string m_directory;
+    uint32_t m_maxBlockSize;
+    uint32_t m_editQueueSize;
+    uint32_t m_segmentSize;
+    double m_compactThreshold;
+    bool m_mmap;
+
+    mutable std::mutex m_mutex;
+    std::mutex m_compactMutex;
+    index_t m_index;
+    segmentmap_t m_segments;
+    pack_segment_ptr m_active;
+    uint32_t m_nextSegment;
+    int m_indexFile;
+
+    std::thread m_compactor;
+    std::condition_variable m_wakeup;
+    bool m_compactRequested;
+    bool m_stopping;
+    size_t m_compactFailures;
+    std::string m_compactError;
+
+    std::string path(const std::string &name) const;
+    void openSegments();
+    void loadIndex();
+    void appendIndex(const void *records, size_t size);
+    void rewriteIndex();
+    void newSegment();
+    void append(putblocklist_t &blocklist, const std::vector<size_t> &which);
+    void writeRun(putblocklist_t &blocklist, const std::vector<size_t> &run);
+    void setLocation(const nodeid_t &id, const pack_location &loc);
+    mempage read(const pack_segment_ptr &segment, const pack_location &loc);
+    mempagelist_t read_all(const blockidlist_t &ids);
+    bool needsCompaction(const pack_segment_ptr &segment) const;
+    void compactSegment(const pack_segment_ptr &segment);
+    void compactLoop();
+};
+
+void register_pack_engine();
+
+}}
+
+#endif
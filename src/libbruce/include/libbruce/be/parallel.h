@@ -0,0 +1,60 @@
+#pragma once
+#ifndef BRUCE_BE_PARALLEL_H
+#define BRUCE_BE_PARALLEL_H
+
+#include <boost/scoped_ptr.hpp>
+
+#include <libbruce/be/be.h>
+
+namespace libbruce {
+
+namespace util { class thread_pool; }
+
+namespace be {
+
+/**
+ * Block engine that spreads batches over a pool of threads
+ *
+ * Wraps any other engine: get_all_async, put_all and del_all batches are split
+ * into one part per thread, and the parts are handed to the inner engine
+ * at the same time. Per-block success flags and failure reasons are copied
+ * back into the caller's list. put_all_async returns as soon as the parts
+ * have been queued; the flags are copied back when its future is waited on.
+ *
+ * The inner engine must be safe to call from multiple threads at once,
+ * which the disk, pack and uring engines are (the mem engine is not).
+ *
+ * Created from a spec like "parallel://file:///data/blocks/;threads=8",
+ * where the inner engine gets the other options of the outer spec as well.
+ */
+class parallel : public be
+{
+public:
+    parallel(const be_ptr &inner, unsigned threads);
+    ~parallel();
+
+    virtual mempage get(const nodeid_t &id);
+    virtual getallfuture_t get_all_async(const blockidlist_t &ids);
+    virtual mempage get(const nodeid_t &id, fetch_hint_t hint);
+    virtual getallfuture_t get_all_async(const blockidlist_t &ids, fetch_hint_t hint);
+    virtual nodeid_t id(const mempage &block);
+    virtual blockidlist_t ids(const mempagelist_t &blocks);
+    virtual void put_all(putblocklist_t &blocklist);
+    virtual putfuture_t put_all_async(putblocklist_t &blocklist);
+    virtual void del_all(delblocklist_t &ids);
+    virtual uint32_t maxBlockSize();
+    virtual uint32_t editQueueSize();
+    virtual bool contentAddressed();
+private:
+    be_ptr m_inner;
+    unsigned m_threads;
+    boost::scoped_ptr<util::thread_pool> m_pool;
+
+    size_t partCount(size_t size) const;
+};
+
+void register_parallel_engine();
+
+}}
+
+#endif
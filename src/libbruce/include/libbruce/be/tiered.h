@@ -0,0 +1,107 @@
+#pragma once
+#ifndef BRUCE_BE_TIERED_H
+#define BRUCE_BE_TIERED_H
+
+#include <atomic>
+#include <future>
+#include <list>
+#include <mutex>
+#include <boost/unordered_map.hpp>
+
+#include <libbruce/be/be.h>
+
+namespace libbruce { namespace be {
+
+struct tiered_stats
+{
+    tiered_stats() : hits(0), misses(0), size(0), count(0) { }
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t size;
+    size_t count;
+};
+
+/**
+ * Block engine that keeps a bounded copy of a remote engine's blocks on local disk
+ *
+ * Meant to sit between an in-memory cache and a slow remote engine, on a
+ * local SSD. Reads are served from the local directory if possible, and
+ * copied there when they have to go to the remote engine (except for reads
+ * with FETCH_SCAN). put_all writes to the remote engine and then stores the
+ * blocks locally; del_all removes them from both.
+ *
+ * Blocks are stored one file per block, written to a temporary name and
+ * renamed into place. If the remote engine is content-addressed, local copies
+ * are checked against their ID when read, and fetched from the remote engine
+ * again if they don't match, so a block cut short by a crash is harmless and
+ * nothing is synced. Otherwise every batch is synced before it is renamed,
+ * so a crash never leaves a truncated block behind. The directory is scanned at
+ * startup, so the cache survives restarts; recency is kept in the file
+ * modification times. Once the local blocks take up more than maxSize bytes,
+ * the least recently used ones are removed.
+ *
+ * Blocks have to be content-addressed and immutable, or the local copies
+ * could go stale. A cache directory must not be shared between processes.
+ *
+ * Created from a spec like "tiered://s3://bucket/prefix/;tier=/mnt/ssd/bruce/;tiersize=10737418240".
+ */
+class tiered : public be
+{
+public:
+    tiered(const be_ptr &remote, const std::string &directory, uint64_t maxSize);
+    ~tiered();
+
+    virtual mempage get(const nodeid_t &id);
+    virtual getallfuture_t get_all_async(const blockidlist_t &ids);
+    virtual mempage get(const nodeid_t &id, fetch_hint_t hint);
+    virtual getallfuture_t get_all_async(const blockidlist_t &ids, fetch_hint_t hint);
+    virtual nodeid_t id(const mempage &block);
+    virtual blockidlist_t ids(const mempagelist_t &blocks);
+    virtual void put_all(putblocklist_t &blocklist);
+    virtual void del_all(delblocklist_t &ids);
+    virtual uint32_t maxBlockSize();
+    virtual uint32_t editQueueSize();
+    virtual bool contentAddressed();
+
+    tiered_stats stats() const;
+private:
+    struct entry
+    {
+        entry(const nodeid_t &id, uint64_t size) : id(id), size(size) { }
+
+        nodeid_t id;
+        uint64_t size;
+    };
+    typedef std::list<entry> lru_t;
+    typedef boost::unordered_map<nodeid_t, lru_t::iterator> index_t;
+
+    be_ptr m_remote;
+    std::string m_directory;
+    uint64_t m_maxSize;
+    bool m_verify; // Whether IDs are hashes we can check local copies against
+
+    mutable std::mutex m_mutex;
+    lru_t m_lru; // Least recently used first
+    index_t m_index;
+    uint64_t m_size;
+
+    std::atomic<uint64_t> m_hits;
+    std::atomic<uint64_t> m_misses;
+    std::atomic<uint64_t> m_tempCounter;
+
+    std::string path(const nodeid_t &id) const;
+    void scan();
+    bool lookup(const nodeid_t &id, mempage *page);
+    void store_all(const blockidlist_t &ids, const mempagelist_t &pages, fetch_hint_t hint);
+    void forget(const nodeid_t &id);
+    mempagelist_t completeFetch(mempagelist_t pages, const std::vector<size_t> &indexes,
+                                const blockidlist_t &ids, std::shared_future<mempagelist_t> fetched,
+                                fetch_hint_t hint);
+};
+
+void register_tiered_engine();
+
+}}
+
+#endif
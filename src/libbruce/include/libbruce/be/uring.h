@@ -0,0 +1,58 @@
+#pragma once
+#ifndef BRUCE_BE_URING_H
+#define BRUCE_BE_URING_H
+
+#include <mutex>
+#include <boost/scoped_ptr.hpp>
+
+#include <libbruce/be/disk.h>
+
+namespace libbruce { namespace be {
+
+class uring_queue;
+
+/**
+ * Disk block engine that does its I/O through io_uring
+ *
+ * Uses the same file layout and IDs as the disk engine, but every get_all_async,
+ * put_all and del_all batch is submitted to the kernel at once (split up in
+ * rounds only if it exceeds the queue depth), so fast devices can work on
+ * many blocks in parallel.
+ *
+ * If direct is set, blocks are read with O_DIRECT into aligned pages,
+ * bypassing the page cache. Writes always go through the page cache, since
+ * O_DIRECT would require padding the block files.
+ *
+ * Thread safe: there is one ring, which batches from different threads take
+ * turns on, a batch at a time.
+ *
+ * Only available if libbruce was built with HAVE_URING.
+ */
+class uring : public disk
+{
+public:
+    uring(std::string pathPrefix, uint32_t maxBlockSize, uint32_t editQueueSize=0, unsigned queueDepth=256, bool direct=false);
+    ~uring();
+
+    virtual mempage get(const nodeid_t &id);
+    using be::get;
+    virtual getallfuture_t get_all_async(const blockidlist_t &ids);
+    using be::get_all_async;
+    virtual void put_all(putblocklist_t &blocklist);
+    virtual void del_all(delblocklist_t &ids);
+private:
+    boost::scoped_ptr<uring_queue> m_queue;
+    std::mutex m_queueMutex; // Held for all rounds of a batch
+    bool m_direct;
+
+    void read_batch(const blockidlist_t &ids, size_t begin, size_t end, mempagelist_t *pages);
+    void write_batch(putblocklist_t &blocklist, size_t begin, size_t end);
+    void del_batch(delblocklist_t &ids, size_t begin, size_t end);
+    size_t batchSize() const;
+};
+
+void register_uring_engine();
+
+}}
+
+#endif
@@ -11,10 +11,12 @@
 #include <libbruce/be/mem.h>
 #include <libbruce/be/disk.h>
 #include <libbruce/tree.h>
+#include <libbruce/bulk_loader.h>
 
 namespace libbruce {
 
 bool finish_mutation(be::be &blockEngine, mutation &mut, bool success);
+size_t warm_tree(be::be &blockEngine, const nodeid_t &root, unsigned levels, const tree_functions &fns);
 
 template<typename K, typename V>
 class bruce
@@ -55,6 +57,24 @@ public:
         return boost::make_shared<tree<K,V> >(id, boost::ref(m_blockEngine));
     }
 
+    /**
+     * Build a new bruce tree from a range of pairs
+     *
+     * The range holds std::pair<K, V>s, such as a std::map, in key order
+     * unless options.sorted is false. For pairs that come from a stream, use a
+     * bulk_loader directly.
+     *
+     * The returned mutation should be finished like any other.
+     */
+    template<typename Iterator>
+    mutation bulk_load(Iterator begin, Iterator end, const bulk_options &options=bulk_options())
+    {
+        bulk_loader<K, V> loader(m_blockEngine, options);
+        for (; begin != end; ++begin)
+            loader.add(begin->first, begin->second);
+        return loader.finish();
+    }
+
     /**
      * Commit or abort a given mutation.
      *
@@ -75,13 +95,27 @@ public:
         return finish_mutation(m_blockEngine, mut, success);
     }
 
+    /**
+     * Load the top levels of a tree into the block engine's cache
+     *
+     * Walks the tree breadth-first with a single get_all per level, so the
+     * first lookups after a restart don't pay for a round trip per level.
+     * The internal nodes are also put in the shared node cache, if enabled.
+     *
+     * Returns the number of blocks loaded.
+     */
+    size_t warm(const nodeid_t &root, unsigned levels)
+    {
+        return warm_tree(m_blockEngine, root, levels, fns);
+    }
+
     static tree_functions fns;
 private:
     be::be &m_blockEngine;
 };
 
 template<typename K, typename V>
-tree_functions bruce<K, V>::fns(&traits::convert<K>::compare, &traits::convert<V>::compare, &traits::convert<K>::size, &traits::convert<V>::size);
+tree_functions bruce<K, V>::fns(&traits::convert<K>::compare, &traits::convert<V>::compare, &traits::convert<K>::size, &traits::convert<V>::size, traits::separator<K>::function());
 
 }
 
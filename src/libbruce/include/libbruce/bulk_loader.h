@@ -0,0 +1,114 @@
+/**
+ * Building a new tree from a large number of pairs at once
+ *
+ * Inserting pairs one at a time sends every one of them through the edit
+ * queues and the leaf splits. The bulk loader instead fills the leaves in key
+ * order and builds the internal levels on top of them as it goes, writing
+ * the blocks in batches while the input is still coming in. Only the nodes
+ * that are being filled are kept in memory.
+ *
+ * Input that isn't sorted by key is sorted first, in runs that are spilled to
+ * temporary files and merged at the end.
+ */
+#pragma once
+#ifndef BRUCE_BULK_LOADER_H
+#define BRUCE_BULK_LOADER_H
+
+#include <string>
+#include <libbruce/mutation.h>
+#include <libbruce/mempool.h>
+#include <libbruce/traits.h>
+#include <libbruce/be/be.h>
+
+namespace libbruce {
+
+class bulk_loader_impl;
+typedef boost::shared_ptr<bulk_loader_impl> bulk_loader_impl_ptr;
+
+class external_sort;
+typedef boost::shared_ptr<external_sort> external_sort_ptr;
+
+struct bulk_options
+{
+    bulk_options()
+        : sorted(true), fill(0.9), batchSize(256), sortMemory(64 * 1024 * 1024),
+          overflowMemory(16 * 1024 * 1024), tempDir("/tmp") { }
+
+    // Whether the pairs are added in key order (pairs with the same key keep
+    // the order they were added in either way)
+    bool sorted;
+
+    // How full to make the nodes, as a fraction of the block size. Leaving
+    // some room means later inserts don't split every leaf they touch.
+    double fill;
+
+    // Number of blocks to hand to the block engine at once
+    size_t batchSize;
+
+    // For unsorted input: bytes of pairs to sort in memory before spilling a
+    // run to a file in tempDir
+    size_t sortMemory;
+
+    // Bytes of values of a single key that doesn't fit in its leaf to keep in
+    // memory before spilling them to a file in tempDir
+    size_t overflowMemory;
+
+    std::string tempDir;
+};
+
+/**
+ * Type-unsafe bulk loader
+ *
+ * This class is an implementation detail and should not be used directly.
+ */
+struct bulk_loader_unsafe
+{
+    bulk_loader_unsafe(be::be &be, const tree_functions &fns, const bulk_options &options);
+
+    void add(const memslice &key, const memslice &value);
+    mutation finish();
+private:
+    bulk_loader_impl_ptr m_impl;
+    external_sort_ptr m_sort;
+};
+
+/**
+ * Typesafe bulk loader
+ *
+ * Add all pairs, then call finish() to write the rest of the tree. The
+ * mutation it returns is finished like the one of tree::write(), so that the
+ * blocks are deleted again if the load is aborted.
+ *
+ * With sorted input, adding a key that sorts before the previous one throws
+ * a std::runtime_error.
+ */
+template<typename K, typename V>
+struct bulk_loader
+{
+    bulk_loader(be::be &be, const bulk_options &options=bulk_options())
+        : m_unsafe(be, fns, options) { }
+
+    void add(const K &key, const V &value)
+    {
+        // The loader copies what it keeps, so the pool only has to hold one pair
+        m_mempool.clear();
+        m_unsafe.add(traits::convert<K>::to_bytes(key, m_mempool), traits::convert<V>::to_bytes(value, m_mempool));
+    }
+
+    mutation finish()
+    {
+        return m_unsafe.finish();
+    }
+
+    static tree_functions fns;
+private:
+    mempool m_mempool;
+    bulk_loader_unsafe m_unsafe;
+};
+
+template<typename K, typename V>
+tree_functions bulk_loader<K, V>::fns(&traits::convert<K>::compare, &traits::convert<V>::compare, &traits::convert<K>::size, &traits::convert<V>::size, traits::separator<K>::function());
+
+}
+
+#endif
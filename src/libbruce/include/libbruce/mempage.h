@@ -6,6 +6,7 @@
 #include <boost/smart_ptr/make_shared_array.hpp>
 #include <iostream>
 #include <stdint.h>
+#include <stdlib.h>
 #include <stdexcept>
 
 #include <libbruce/memslice.h>
@@ -38,6 +39,42 @@ struct mempage
     {
     }
 
+    /**
+     * Allocate a page without zeroing it, for callers that fill all of it
+     */
+    static mempage uninitialized(size_t size)
+    {
+        return mempage(memptr(new uint8_t[size]), size);
+    }
+
+    /**
+     * Allocate an uninitialized page whose memory is aligned to the given boundary
+     *
+     * The allocation is rounded up to a multiple of the alignment, so the
+     * memory can be used as the target of O_DIRECT reads.
+     */
+    static mempage aligned(size_t size, size_t alignment)
+    {
+        void *mem;
+        size_t capacity = (size + alignment - 1) / alignment * alignment;
+        if (posix_memalign(&mem, alignment, capacity ? capacity : alignment) != 0)
+            throw std::bad_alloc();
+        return mempage(memptr((uint8_t*)mem, &free), size);
+    }
+
+    /**
+     * Wrap memory that is owned by someone else
+     *
+     * No copy is made. release(mem) is called when the last copy of the page
+     * goes away, and can be used to unmap the memory or drop a reference to
+     * whatever owns it.
+     */
+    template<typename Release>
+    static mempage external(uint8_t *mem, size_t size, Release release)
+    {
+        return mempage(memptr(mem, release), size);
+    }
+
     bool empty() const { return m_size == 0; }
     uint8_t *ptr() { return m_mem.get(); }
     const uint8_t *ptr() const { return m_mem.get(); }
@@ -77,6 +114,11 @@ struct mempage
     }
 
 private:
+    mempage(const memptr &mem, size_t size)
+        : m_size(size), m_mem(mem)
+    {
+    }
+
     size_t m_size;
     memptr m_mem;
 };
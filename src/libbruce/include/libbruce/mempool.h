@@ -28,6 +28,14 @@ struct mempool : private boost::noncopyable
      * Allocate a memslice of the given size
      */
     memslice alloc(size_t size);
+
+    /**
+     * Drop everything allocated or retained so far
+     *
+     * Memslices out of the pool are no longer valid after this. The current
+     * allocation page is reused, so this is cheap to do often.
+     */
+    void clear();
 private:
     std::list<mempage> m_pages;
     mempage m_allocPage;
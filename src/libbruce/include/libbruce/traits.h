@@ -85,6 +85,24 @@ struct convert<std::string>
     {
         return strlen((char*)x) + 1;
     }
+
+    /**
+     * The shortest prefix of right that is still larger than left
+     */
+    static memslice separator(const memslice &left, const memslice &right, mempool &pool)
+    {
+        const char *l = (const char*)left.ptr();
+        const char *r = (const char*)right.ptr();
+
+        size_t n = 0;
+        while (l[n] && l[n] == r[n]) n++;
+        if (r[n] == 0 || r[n + 1] == 0) return right;
+
+        memslice m = pool.alloc(n + 2);
+        memcpy((void*)m.ptr(), r, n + 1);
+        *m.at<char>(n + 1) = 0;
+        return m;
+    }
 };
 
 //----------------------------------------------------------------------
@@ -116,6 +134,41 @@ struct convert<binary>
     {
         return *(uint32_t*)x + sizeof(uint32_t);
     }
+
+    /**
+     * The shortest prefix of right that is still larger than left
+     */
+    static memslice separator(const memslice &left, const memslice &right, mempool &pool)
+    {
+        const uint8_t *l = left.ptr() + sizeof(uint32_t);
+        const uint8_t *r = right.ptr() + sizeof(uint32_t);
+        uint32_t lsize = *left.at<uint32_t>(0);
+        uint32_t rsize = *right.at<uint32_t>(0);
+
+        uint32_t n = 0;
+        while (n < lsize && n < rsize && l[n] == r[n]) n++;
+        if (n + 1 >= rsize) return right;
+
+        memslice m = pool.alloc(n + 1 + sizeof(uint32_t));
+        *m.at<uint32_t>(0) = n + 1;
+        memcpy((void*)(m.ptr() + sizeof(uint32_t)), r, n + 1);
+        return m;
+    }
+};
+
+//----------------------------------------------------------------------
+
+/**
+ * The separator function of convert<T>, or NULL if it doesn't have one
+ */
+template<typename T>
+class separator
+{
+    template<typename U, fn::separatinator *> struct check;
+    template<typename U> static fn::separatinator *get(check<U, &U::separator> *) { return &U::separator; }
+    template<typename U> static fn::separatinator *get(...) { return NULL; }
+public:
+    static fn::separatinator *function() { return get<convert<T> >(0); }
 };
 
 }}
@@ -43,12 +43,16 @@ struct tree_unsafe
     void upsert(const memslice &key, const memslice &value, bool guaranteed);
     void remove(const memslice &key, bool guaranteed);
     void remove(const memslice &key, const memslice &value, bool guaranteed);
+    void insert_many(const std::vector<memslice> &keys, const std::vector<memslice> &values);
+    void upsert_many(const std::vector<memslice> &keys, const std::vector<memslice> &values, bool guaranteed);
+    void remove_many(const std::vector<memslice> &keys, bool guaranteed);
+    void setBlobThreshold(uint32_t threshold);
     mutation write();
 
     bool get(const memslice &key, memslice *value);
-    tree_iterator_unsafe find(const memslice &key);
-    tree_iterator_unsafe seek(itemcount_t n);
-    tree_iterator_unsafe begin();
+    tree_iterator_unsafe find(const memslice &key, be::fetch_hint_t hint);
+    tree_iterator_unsafe seek(itemcount_t n, be::fetch_hint_t hint);
+    tree_iterator_unsafe begin(be::fetch_hint_t hint);
     tree_iterator_unsafe end();
 private:
     tree_impl_ptr m_impl;
@@ -87,6 +91,54 @@ struct tree
         m_unsafe.remove(traits::convert<K>::to_bytes(key, m_mempool), traits::convert<V>::to_bytes(value, m_mempool), guaranteed);
     }
 
+    /**
+     * Insert a range of std::pair<K, V>s at once
+     *
+     * The same as inserting them one by one, but the batch is sorted once and
+     * merged into the tree in a single pass, which is a lot faster for large
+     * batches.
+     */
+    template<typename Iterator>
+    void insert_many(Iterator begin, Iterator end)
+    {
+        std::vector<memslice> keys, values;
+        toBytes(begin, end, &keys, &values);
+        m_unsafe.insert_many(keys, values);
+    }
+
+    template<typename Iterator>
+    void upsert_many(Iterator begin, Iterator end, bool guaranteed)
+    {
+        std::vector<memslice> keys, values;
+        toBytes(begin, end, &keys, &values);
+        m_unsafe.upsert_many(keys, values, guaranteed);
+    }
+
+    /**
+     * Remove a range of keys at once
+     */
+    template<typename Iterator>
+    void remove_many(Iterator begin, Iterator end, bool guaranteed)
+    {
+        std::vector<memslice> keys;
+        for (; begin != end; ++begin)
+            keys.push_back(traits::convert<K>::to_bytes(*begin, m_mempool));
+        m_unsafe.remove_many(keys, guaranteed);
+    }
+
+    /**
+     * Write values larger than the given size to blocks of their own
+     *
+     * The leaves then only hold a reference to the value, so they fit many
+     * more keys, and the value is only fetched when an iterator is asked for
+     * it. Such values can also take up nearly a whole block. The default of 0
+     * keeps all values in the leaves.
+     */
+    void setBlobThreshold(uint32_t threshold)
+    {
+        m_unsafe.setBlobThreshold(threshold);
+    }
+
     mutation write()
     {
         return m_unsafe.write();
@@ -101,19 +153,23 @@ struct tree
             return maybe_v();
     }
 
-    iterator find(const K &key)
+    /**
+     * Pass be::FETCH_SCAN for iterators that will read large ranges, so that
+     * caching engines don't fill their cache with the scanned blocks.
+     */
+    iterator find(const K &key, be::fetch_hint_t hint=be::FETCH_NORMAL)
     {
-        return iterator(m_unsafe.find(traits::convert<K>::to_bytes(key, m_mempool)));
+        return iterator(m_unsafe.find(traits::convert<K>::to_bytes(key, m_mempool), hint));
     }
 
-    iterator seek(itemcount_t n)
+    iterator seek(itemcount_t n, be::fetch_hint_t hint=be::FETCH_NORMAL)
     {
-        return iterator(m_unsafe.seek(n));
+        return iterator(m_unsafe.seek(n, hint));
     }
 
-    iterator begin()
+    iterator begin(be::fetch_hint_t hint=be::FETCH_NORMAL)
     {
-        return iterator(m_unsafe.begin());
+        return iterator(m_unsafe.begin(hint));
     }
 
     iterator end()
@@ -125,10 +181,20 @@ struct tree
 private:
     tree_unsafe m_unsafe;
     mempool m_mempool;
+
+    template<typename Iterator>
+    void toBytes(Iterator begin, Iterator end, std::vector<memslice> *keys, std::vector<memslice> *values)
+    {
+        for (; begin != end; ++begin)
+        {
+            keys->push_back(traits::convert<K>::to_bytes(begin->first, m_mempool));
+            values->push_back(traits::convert<V>::to_bytes(begin->second, m_mempool));
+        }
+    }
 };
 
 template<typename K, typename V>
-tree_functions tree<K, V>::fns(&traits::convert<K>::compare, &traits::convert<V>::compare, &traits::convert<K>::size, &traits::convert<V>::size);
+tree_functions tree<K, V>::fns(&traits::convert<K>::compare, &traits::convert<V>::compare, &traits::convert<K>::size, &traits::convert<V>::size, traits::separator<K>::function());
 
 }
 
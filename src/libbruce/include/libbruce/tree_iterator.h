@@ -15,8 +15,8 @@ struct tree_iterator_unsafe
     tree_iterator_unsafe(const tree_iterator_unsafe &rhs);
     tree_iterator_unsafe &operator=(const tree_iterator_unsafe &rhs);
 
-    const memslice &key() const;
-    const memslice &value() const;
+    memslice key() const;
+    memslice value() const;
     itemcount_t rank() const;
     bool valid() const;
 
@@ -7,6 +7,7 @@
 #include <boost/optional.hpp>
 
 #include <libbruce/memslice.h>
+#include <libbruce/mempool.h>
 
 // Standard types
 
@@ -50,6 +51,19 @@ private:
     unsigned char m_bytes[20];
 };
 
+/**
+ * Hash for node IDs, so they can be used as keys in boost::unordered_map
+ *
+ * The leading bytes of an ID are either a content hash or a counter, so
+ * they make for a good enough hash by themselves.
+ */
+inline size_t hash_value(const nodeid_t &id)
+{
+    size_t h;
+    memcpy(&h, id.data(), sizeof(h));
+    return h;
+}
+
 std::ostream &operator <<(std::ostream &os, const libbruce::nodeid_t &id);
 std::istream &operator >>(std::istream &is, libbruce::nodeid_t &id);
 
@@ -70,18 +84,28 @@ namespace fn {
 
 typedef uint32_t sizeinator(const void *);
 typedef int comparinator(const memslice &, const memslice &);
+typedef memslice separatinator(const memslice &, const memslice &, mempool &);
 
 }
 
 struct tree_functions
 {
-    tree_functions(fn::comparinator *keyCompare, fn::comparinator *valueCompare, fn::sizeinator *keySize, fn::sizeinator *valueSize)
-        : keyCompare(keyCompare), valueCompare(valueCompare), keySize(keySize), valueSize(valueSize) { }
+    tree_functions(fn::comparinator *keyCompare, fn::comparinator *valueCompare, fn::sizeinator *keySize, fn::sizeinator *valueSize,
+                   fn::separatinator *keySeparator=NULL)
+        : keyCompare(keyCompare), valueCompare(valueCompare), keySize(keySize), valueSize(valueSize), keySeparator(keySeparator) { }
 
     fn::comparinator *keyCompare;
     fn::comparinator *valueCompare;
     fn::sizeinator *keySize;
     fn::sizeinator *valueSize;
+
+    /**
+     * Optional, returns a key s such that left < s <= right
+     *
+     * Used to pick the shortest key that separates two nodes after a split.
+     * If NULL, the smallest key of the right node is used.
+     */
+    fn::separatinator *keySeparator;
 };
 
 /**
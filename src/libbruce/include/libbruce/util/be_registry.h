@@ -25,6 +25,16 @@ struct options_t : public std::map<std::string, std::string>
             return def;
         return boost::lexical_cast<T>(it->second);
     }
+
+    /**
+     * A copy of the options without the given one
+     */
+    options_t without(const std::string &key) const
+    {
+        options_t ret(*this);
+        ret.erase(key);
+        return ret;
+    }
 };
 
 typedef be::be_ptr (*be_factory)(const std::string &location, size_t block_size, size_t queue_size, const options_t &options);
@@ -39,6 +49,16 @@ void register_be_factory(const char *scheme, be_factory factory);
  */
 be::be_ptr create_be(const std::string &spec);
 
+/**
+ * Instantiate the engine wrapped by a decorating engine
+ *
+ * The location of a decorator is the spec of the engine it wraps, which
+ * gets the options of the decorator as well (the block and queue sizes among
+ * them). Decorators leave out the options they use themselves, so that an
+ * inner engine that knows the same option doesn't act on it a second time.
+ */
+be::be_ptr create_inner_be(const std::string &location, const options_t &options);
+
 
 struct FactoryRegistration
 {
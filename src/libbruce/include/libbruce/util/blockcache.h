@@ -2,48 +2,105 @@
 #ifndef LIBBRUCE_BLOCKCCACHE_H
 #define LIBBRUCE_BLOCKCCACHE_H
 
-#include <boost/multi_index_container.hpp>
-#include <boost/multi_index/ordered_index.hpp>
-#include <boost/multi_index/sequenced_index.hpp>
-#include <boost/multi_index/member.hpp>
+#include <mutex>
+#include <string>
+#include <boost/intrusive/list.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/unordered_map.hpp>
 
 #include <libbruce/bruce.h>
 
 namespace libbruce { namespace util {
 
-struct CacheEntry
+/**
+ * Which blocks a cache keeps when it is full
+ *
+ * - CACHE_LRU evicts the least recently used block.
+ * - CACHE_2Q only keeps blocks for long that are used again after their
+ *   first use has been forgotten, so a single scan can't flush the cache.
+ * - CACHE_TINYLFU (W-TinyLFU) admits a block into the main cache only if it
+ *   has been used more often recently than the block it would replace.
+ */
+enum cache_policy_t {
+    CACHE_LRU,
+    CACHE_2Q,
+    CACHE_TINYLFU
+};
+
+/**
+ * Parse a policy name ("lru", "2q" or "tinylfu")
+ */
+cache_policy_t parse_cache_policy(const std::string &name);
+
+struct CacheEntry : public boost::intrusive::list_base_hook<>
 {
-    CacheEntry(nodeid_t id, const mempage &block) : id(id), block(block) { }
+    CacheEntry(nodeid_t id, const mempage &block) : id(id), block(block), queue(0) { }
 
     nodeid_t id;
     mempage block;
+    int queue; // Which of the policy's lists the entry is on
 };
 
-typedef boost::multi_index_container<
-            CacheEntry,
-            boost::multi_index::indexed_by<
-                boost::multi_index::ordered_unique<boost::multi_index::member<CacheEntry, nodeid_t, &CacheEntry::id> >,
-                boost::multi_index::sequenced<>
-            > > cache_t;
+typedef boost::unordered_map<nodeid_t, CacheEntry> cachemap_t;
 
-typedef cache_t::nth_index<0>::type map_t;
-typedef cache_t::nth_index<1>::type list_T;
+class CachePolicy;
+
+/**
+ * One independently locked part of the cache
+ *
+ * The shard owns the entries; its policy links them into its own lists in
+ * place, so keeping track of their use doesn't allocate.
+ */
+struct CacheShard
+{
+    CacheShard();
+    ~CacheShard();
+
+    mutable std::mutex mutex;
+    cachemap_t map;
+    boost::scoped_ptr<CachePolicy> policy;
+    size_t maxSize;
+    size_t size;
+};
 
 /**
  * Block cache for block engines that need to traverse the network
+ *
+ * Thread safe. Blocks are spread over a number of shards by ID, each with its
+ * own lock, an equal share of the total size and its own policy state.
+ *
+ * If maxBlockSize is given, there are no more shards than blocks of that size
+ * fit in the cache, so that every share can hold the largest block.
  */
 class BlockCache
 {
 public:
-    BlockCache(size_t maxSize);
+    BlockCache(size_t maxSize, cache_policy_t policy=CACHE_LRU, unsigned shards=16, size_t maxBlockSize=0);
 
-    bool get(nodeid_t id, mempage *mem);
-    void put(nodeid_t id, const mempage &mem);
-    void del(nodeid_t id);
+    bool get(const nodeid_t &id, mempage *mem);
+    void put(const nodeid_t &id, const mempage &mem);
+    void del(const nodeid_t &id);
+
+    /**
+     * Total size of the cached blocks
+     */
+    size_t size() const;
+
+    /**
+     * Number of cached blocks
+     */
+    size_t count() const;
+
+    /**
+     * IDs of the cached blocks, in no particular order
+     */
+    std::vector<nodeid_t> ids() const;
 private:
-    cache_t m_cache;
-    size_t m_maxSize;
-    size_t m_size;
+    CacheShard &shard(const nodeid_t &id);
+
+    boost::scoped_array<CacheShard> m_shards;
+    unsigned m_shardCount;
 };
 
 }}
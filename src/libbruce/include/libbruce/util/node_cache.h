@@ -0,0 +1,35 @@
+#pragma once
+#ifndef LIBBRUCE_NODE_CACHE_H
+#define LIBBRUCE_NODE_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace libbruce { namespace util {
+
+struct node_cache_stats
+{
+    node_cache_stats() : hits(0), misses(0), size(0), count(0), capacity(0) { }
+
+    uint64_t hits;
+    uint64_t misses;
+    size_t size;     // Bytes of the pages the cached nodes were parsed from
+    size_t count;    // Number of cached nodes
+    size_t capacity;
+};
+
+/**
+ * Control the process-wide cache of parsed nodes
+ *
+ * Trees on content-addressed block engines look up the nodes they load in
+ * this cache before fetching and parsing the block, so hot upper levels of a
+ * tree are only parsed once instead of on every query. The capacity is
+ * counted in page bytes; setting it to 0 disables the cache.
+ */
+void set_node_cache_capacity(size_t bytes);
+node_cache_stats get_node_cache_stats();
+void clear_node_cache();
+
+}}
+
+#endif
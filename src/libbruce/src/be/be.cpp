@@ -0,0 +1,82 @@
+#include <libbruce/be/be.h>
+
+namespace libbruce { namespace be {
+
+blockidlist_t be::ids(const mempagelist_t &blocks)
+{
+    blockidlist_t ret;
+    ret.reserve(blocks.size());
+    for (mempagelist_t::const_iterator it = blocks.begin(); it != blocks.end(); ++it)
+        ret.push_back(id(*it));
+    return ret;
+}
+
+getfuture_t be::get_async(const nodeid_t &id)
+{
+    std::promise<mempage> promise;
+    try
+    {
+        promise.set_value(get(id));
+    }
+    catch (...)
+    {
+        promise.set_exception(std::current_exception());
+    }
+    return promise.get_future();
+}
+
+getblockresult_t be::get_all(const blockidlist_t &ids)
+{
+    mempagelist_t pages = get_all_async(ids).get();
+
+    getblockresult_t ret;
+    for (size_t i = 0; i < ids.size(); i++)
+        ret[ids[i]] = pages[i];
+    return ret;
+}
+
+getallfuture_t be::get_all_async(const blockidlist_t &ids)
+{
+    std::promise<mempagelist_t> promise;
+    try
+    {
+        mempagelist_t ret;
+        ret.reserve(ids.size());
+        for (blockidlist_t::const_iterator it = ids.begin(); it != ids.end(); ++it)
+            ret.push_back(get(*it));
+
+        promise.set_value(ret);
+    }
+    catch (...)
+    {
+        promise.set_exception(std::current_exception());
+    }
+    return promise.get_future();
+}
+
+mempage be::get(const nodeid_t &id, fetch_hint_t)
+{
+    return get(id);
+}
+
+getallfuture_t be::get_all_async(const blockidlist_t &ids, fetch_hint_t)
+{
+    return get_all_async(ids);
+}
+
+putfuture_t be::put_all_async(putblocklist_t &blocklist)
+{
+    std::promise<void> promise;
+    try
+    {
+        put_all(blocklist);
+        promise.set_value();
+    }
+    catch (...)
+    {
+        promise.set_exception(std::current_exception());
+    }
+    return promise.get_future();
+}
+
+}}
@@ -0,0 +1,296 @@
+#include <libbruce/be/cache.h>
+#include <libbruce/util/be_registry.h>
+#include "../serializing.h"
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+
+namespace libbruce { namespace be {
+
+namespace {
+
+bool isInternal(const mempage &page)
+{
+    return page.size() >= sizeof(flags_t) && PageNodeType(page) == TYPE_INTERNAL;
+}
+
+}
+
+// Number of blocks per request when prefetching
+#define PREFETCH_BATCH 256
+
+cache::cache(const be_ptr &inner, size_t cacheSize, size_t pinnedSize, util::cache_policy_t policy,
+             const std::string &hotFile)
+    : m_inner(inner), m_cache(cacheSize, policy, 16, inner->maxBlockSize()), m_pinnedSize(0), m_pinnedMaxSize(pinnedSize),
+      m_hotFile(hotFile), m_hits(0), m_misses(0), m_pinnedHits(0)
+{
+    if (m_hotFile.empty())
+        return;
+
+    blockidlist_t ids;
+    std::ifstream is(m_hotFile.c_str());
+    nodeid_t id;
+    while (is >> id)
+        ids.push_back(id);
+    prefetch(ids);
+}
+
+cache::~cache()
+{
+    if (m_hotFile.empty())
+        return;
+
+    // Replace the file in one go, so a crash leaves the previous list
+    std::string temp = m_hotFile + ".tmp";
+    {
+        blockidlist_t ids = hotIDs();
+        std::ofstream os(temp.c_str());
+        for (blockidlist_t::const_iterator it = ids.begin(); it != ids.end(); ++it)
+            os << *it << std::endl;
+        if (!os)
+        {
+            std::remove(temp.c_str());
+            return;
+        }
+    }
+    std::rename(temp.c_str(), m_hotFile.c_str());
+}
+
+bool cache::lookup(const nodeid_t &id, mempage *page)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_pinnedMutex);
+        boost::unordered_map<nodeid_t, mempage>::const_iterator it = m_pinned.find(id);
+        if (it != m_pinned.end())
+        {
+            *page = it->second;
+            m_hits++;
+            m_pinnedHits++;
+            return true;
+        }
+    }
+
+    if (m_cache.get(id, page))
+    {
+        m_hits++;
+        return true;
+    }
+
+    m_misses++;
+    return false;
+}
+
+void cache::store(const nodeid_t &id, const mempage &page, fetch_hint_t hint)
+{
+    if (isInternal(page))
+    {
+        std::lock_guard<std::mutex> lock(m_pinnedMutex);
+        if (m_pinned.count(id))
+            return;
+        if (m_pinnedSize + page.size() <= m_pinnedMaxSize)
+        {
+            m_pinned[id] = page;
+            m_pinnedSize += page.size();
+            return;
+        }
+    }
+
+    if (hint != FETCH_SCAN)
+        m_cache.put(id, page);
+}
+
+mempage cache::get(const nodeid_t &id)
+{
+    return get(id, FETCH_NORMAL);
+}
+
+mempage cache::get(const nodeid_t &id, fetch_hint_t hint)
+{
+    mempage ret;
+    if (lookup(id, &ret))
+        return ret;
+
+    ret = m_inner->get(id, hint);
+    store(id, ret, hint);
+    return ret;
+}
+
+getallfuture_t cache::get_all_async(const blockidlist_t &ids)
+{
+    return get_all_async(ids, FETCH_NORMAL);
+}
+
+getallfuture_t cache::get_all_async(const blockidlist_t &ids, fetch_hint_t hint)
+{
+    mempagelist_t pages(ids.size());
+    std::vector<size_t> indexes;
+    blockidlist_t missing;
+    for (size_t i = 0; i < ids.size(); i++)
+    {
+        if (!lookup(ids[i], &pages[i]))
+        {
+            indexes.push_back(i);
+            missing.push_back(ids[i]);
+        }
+    }
+
+    if (missing.empty())
+    {
+        std::promise<mempagelist_t> promise;
+        promise.set_value(pages);
+        return promise.get_future();
+    }
+
+    // Start fetching the misses now, and fill them in when the result is needed
+    std::shared_future<mempagelist_t> fetched = m_inner->get_all_async(missing, hint).share();
+    return std::async(std::launch::deferred,
+                      boost::bind(&cache::completeFetch, this, pages, indexes, missing, fetched, hint));
+}
+
+mempagelist_t cache::completeFetch(mempagelist_t pages, const std::vector<size_t> &indexes,
+                                   const blockidlist_t &ids, std::shared_future<mempagelist_t> fetched,
+                                   fetch_hint_t hint)
+{
+    const mempagelist_t &got = fetched.get();
+    for (size_t i = 0; i < indexes.size(); i++)
+    {
+        pages[indexes[i]] = got[i];
+        store(ids[i], got[i], hint);
+    }
+    return pages;
+}
+
+nodeid_t cache::id(const mempage &block)
+{
+    return m_inner->id(block);
+}
+
+blockidlist_t cache::ids(const mempagelist_t &blocks)
+{
+    return m_inner->ids(blocks);
+}
+
+void cache::put_all(putblocklist_t &blocklist)
+{
+    m_inner->put_all(blocklist);
+
+    // Freshly written pages are likely to be read again soon
+    for (putblocklist_t::const_iterator it = blocklist.begin(); it != blocklist.end(); ++it)
+    {
+        if (it->success)
+            store(it->id, it->mem, FETCH_NORMAL);
+    }
+}
+
+void cache::del_all(delblocklist_t &ids)
+{
+    // Forget the blocks even if the delete fails, we can always fetch them again
+    for (delblocklist_t::const_iterator it = ids.begin(); it != ids.end(); ++it)
+    {
+        m_cache.del(it->id);
+
+        std::lock_guard<std::mutex> lock(m_pinnedMutex);
+        boost::unordered_map<nodeid_t, mempage>::iterator pinned = m_pinned.find(it->id);
+        if (pinned != m_pinned.end())
+        {
+            m_pinnedSize -= pinned->second.size();
+            m_pinned.erase(pinned);
+        }
+    }
+
+    m_inner->del_all(ids);
+}
+
+uint32_t cache::maxBlockSize()
+{
+    return m_inner->maxBlockSize();
+}
+
+uint32_t cache::editQueueSize()
+{
+    return m_inner->editQueueSize();
+}
+
+bool cache::contentAddressed()
+{
+    return m_inner->contentAddressed();
+}
+
+cache_stats cache::stats() const
+{
+    cache_stats ret;
+    ret.hits = m_hits;
+    ret.misses = m_misses;
+    ret.pinnedHits = m_pinnedHits;
+
+    std::lock_guard<std::mutex> lock(m_pinnedMutex);
+    ret.pinnedSize = m_pinnedSize;
+    ret.pinnedCount = m_pinned.size();
+    return ret;
+}
+
+blockidlist_t cache::hotIDs() const
+{
+    blockidlist_t ret;
+    {
+        std::lock_guard<std::mutex> lock(m_pinnedMutex);
+        for (boost::unordered_map<nodeid_t, mempage>::const_iterator it = m_pinned.begin(); it != m_pinned.end(); ++it)
+            ret.push_back(it->first);
+    }
+
+    blockidlist_t cached = m_cache.ids();
+    ret.insert(ret.end(), cached.begin(), cached.end());
+    return ret;
+}
+
+void cache::prefetch(const blockidlist_t &ids)
+{
+    std::vector<getallfuture_t> batches;
+    for (size_t i = 0; i < ids.size(); i += PREFETCH_BATCH)
+    {
+        blockidlist_t batch(ids.begin() + i, ids.begin() + std::min(ids.size(), i + PREFETCH_BATCH));
+        batches.push_back(get_all_async(batch));
+    }
+
+    for (size_t i = 0; i < batches.size(); i++)
+    {
+        try
+        {
+            batches[i].get();
+        }
+        catch (std::runtime_error &)
+        {
+            // Fall back to one by one, to find out which ones are gone
+            size_t end = std::min(ids.size(), (i + 1) * PREFETCH_BATCH);
+            for (size_t j = i * PREFETCH_BATCH; j < end; j++)
+            {
+                try
+                {
+                    get(ids[j]);
+                }
+                catch (std::runtime_error &)
+                {
+                }
+            }
+        }
+    }
+}
+
+be_ptr create_cache_engine(const std::string &location, size_t, size_t, const util::options_t &options)
+{
+    util::options_t inner = options.without("cache").without("pinned").without("cachepolicy").without("hotfile");
+    return boost::make_shared<cache>(util::create_inner_be(location, inner),
+                                     options.get<size_t>("cache", 100 * 1024 * 1024),
+                                     options.get<size_t>("pinned", 16 * 1024 * 1024),
+                                     util::parse_cache_policy(options.get<std::string>("cachepolicy", "lru")),
+                                     options.get<std::string>("hotfile", ""));
+}
+
+void register_cache_engine()
+{
+    util::register_be_factory("cache", &create_cache_engine);
+}
+
+}}
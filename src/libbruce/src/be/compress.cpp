@@ -0,0 +1,578 @@
+#include <libbruce/be/compress.h>
+#include <libbruce/util/be_registry.h>
+#include "../serializing.h"
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/static_assert.hpp>
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+
+#define HEADER_MAGIC 0x5a42  // "BZ"
+#define HEADER_DICT 0x01
+
+// zlib only looks at the last 32k of a dictionary
+#define ZLIB_MAX_DICT (32 * 1024)
+
+namespace libbruce { namespace be {
+
+namespace {
+
+struct block_header
+{
+    uint16_t magic;
+    uint8_t codec;
+    uint8_t flags;
+    uint32_t length;
+};
+
+BOOST_STATIC_ASSERT(sizeof(block_header) == 8);
+
+#define MAX_HEADER_SIZE (sizeof(block_header) + sizeof(nodeid_t))
+
+typedef std::chrono::steady_clock codec_clock;
+
+double secondsSince(const codec_clock::time_point &start)
+{
+    return std::chrono::duration<double>(codec_clock::now() - start).count();
+}
+
+void accumulate(compress_stats &into, const compress_stats &from)
+{
+    into.pagesCompressed += from.pagesCompressed;
+    into.rawBytes += from.rawBytes;
+    into.compressedBytes += from.compressedBytes;
+    into.compressSeconds += from.compressSeconds;
+    into.pagesDecompressed += from.pagesDecompressed;
+    into.decompressSeconds += from.decompressSeconds;
+}
+
+/**
+ * Keeps a page alive for as long as an external page points into it
+ */
+struct page_ref
+{
+    page_ref(const mempage &page) : page(page) { }
+    void operator()(uint8_t *) { page = mempage(); }
+
+    mempage page;
+};
+
+}
+
+/**
+ * A dictionary, with whatever the codecs precompute from it
+ */
+struct compress_dict : private boost::noncopyable
+{
+    compress_dict(const nodeid_t &id, const mempage &content, int level)
+        : id(id), content(content)
+    {
+#ifdef HAVE_ZSTD
+        cdict = ZSTD_createCDict(content.ptr(), content.size(), level);
+        ddict = ZSTD_createDDict(content.ptr(), content.size());
+        if (!cdict || !ddict)
+        {
+            ZSTD_freeCDict(cdict);
+            ZSTD_freeDDict(ddict);
+            throw be_error("Error loading zstd dictionary");
+        }
+#else
+        (void)level; // Only zstd precomputes anything
+#endif
+    }
+
+    ~compress_dict()
+    {
+#ifdef HAVE_ZSTD
+        ZSTD_freeCDict(cdict);
+        ZSTD_freeDDict(ddict);
+#endif
+    }
+
+    nodeid_t id;
+    mempage content;
+#ifdef HAVE_ZSTD
+    ZSTD_CDict *cdict;
+    ZSTD_DDict *ddict;
+#endif
+};
+
+namespace {
+
+//----------------------------------------------------------------------
+//  Codecs
+//
+//  Compressing returns 0 if the result doesn't fit in the destination,
+//  in which case the page is stored uncompressed.
+//
+
+size_t zlibCompress(const mempage &src, uint8_t *dst, size_t capacity, int level, const compress_dict *dict)
+{
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (deflateInit(&z, level) != Z_OK)
+        throw be_error("Error initializing zlib");
+
+    if (dict)
+    {
+        size_t dictSize = std::min(dict->content.size(), (size_t)ZLIB_MAX_DICT);
+        deflateSetDictionary(&z, dict->content.ptr() + dict->content.size() - dictSize, dictSize);
+    }
+
+    z.next_in = (Bytef*)src.ptr();
+    z.avail_in = src.size();
+    z.next_out = dst;
+    z.avail_out = capacity;
+
+    int r = deflate(&z, Z_FINISH);
+    size_t size = z.total_out;
+    deflateEnd(&z);
+
+    return r == Z_STREAM_END ? size : 0;
+}
+
+void zlibDecompress(const uint8_t *src, size_t size, mempage &dst, const compress_dict *dict)
+{
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (inflateInit(&z) != Z_OK)
+        throw be_error("Error initializing zlib");
+
+    z.next_in = (Bytef*)src;
+    z.avail_in = size;
+    z.next_out = dst.ptr();
+    z.avail_out = dst.size();
+
+    int r = inflate(&z, Z_FINISH);
+    if (r == Z_NEED_DICT && dict)
+    {
+        size_t dictSize = std::min(dict->content.size(), (size_t)ZLIB_MAX_DICT);
+        inflateSetDictionary(&z, dict->content.ptr() + dict->content.size() - dictSize, dictSize);
+        r = inflate(&z, Z_FINISH);
+    }
+    size_t total = z.total_out;
+    inflateEnd(&z);
+
+    if (r != Z_STREAM_END || total != dst.size())
+        throw be_error("Corrupt zlib block");
+}
+
+#ifdef HAVE_ZSTD
+size_t zstdCompress(const mempage &src, uint8_t *dst, size_t capacity, int level, const compress_dict *dict)
+{
+    ZSTD_CCtx *ctx = ZSTD_createCCtx();
+    if (!ctx)
+        throw be_error("Error initializing zstd");
+
+    size_t r = dict
+        ? ZSTD_compress_usingCDict(ctx, dst, capacity, src.ptr(), src.size(), dict->cdict)
+        : ZSTD_compressCCtx(ctx, dst, capacity, src.ptr(), src.size(), level);
+    ZSTD_freeCCtx(ctx);
+
+    return ZSTD_isError(r) ? 0 : r;
+}
+
+void zstdDecompress(const uint8_t *src, size_t size, mempage &dst, const compress_dict *dict)
+{
+    ZSTD_DCtx *ctx = ZSTD_createDCtx();
+    if (!ctx)
+        throw be_error("Error initializing zstd");
+
+    size_t r = dict
+        ? ZSTD_decompress_usingDDict(ctx, dst.ptr(), dst.size(), src, size, dict->ddict)
+        : ZSTD_decompressDCtx(ctx, dst.ptr(), dst.size(), src, size);
+    ZSTD_freeDCtx(ctx);
+
+    if (ZSTD_isError(r) || r != dst.size())
+        throw be_error("Corrupt zstd block");
+}
+#endif
+
+/**
+ * Build a dictionary from sample pages
+ *
+ * zstd can select the most useful content itself; otherwise the dictionary
+ * is just the tail end of the samples.
+ */
+mempage buildDictionary(const mempagelist_t &samples, compress::codec_t codec, size_t maxSize)
+{
+    std::vector<uint8_t> joined;
+    std::vector<size_t> sizes;
+    for (mempagelist_t::const_iterator it = samples.begin(); it != samples.end(); ++it)
+    {
+        joined.insert(joined.end(), it->ptr(), it->ptr() + it->size());
+        sizes.push_back(it->size());
+    }
+
+#ifdef HAVE_ZSTD
+    if (codec == compress::CODEC_ZSTD)
+    {
+        mempage dict = mempage::uninitialized(maxSize);
+        size_t size = ZDICT_trainFromBuffer(dict.ptr(), dict.size(), joined.data(), sizes.data(), sizes.size());
+        if (!ZDICT_isError(size))
+        {
+            mempage ret(size);
+            memcpy(ret.ptr(), dict.ptr(), size);
+            return ret;
+        }
+        // Too few samples to train on; fall back to raw content
+    }
+#endif
+
+    if (codec == compress::CODEC_ZLIB)
+        maxSize = std::min(maxSize, (size_t)ZLIB_MAX_DICT);
+
+    size_t size = std::min(maxSize, joined.size());
+    mempage ret(size);
+    memcpy(ret.ptr(), joined.data() + joined.size() - size, size);
+    return ret;
+}
+
+}
+
+compress::compress(const be_ptr &inner, codec_t codec, int level, size_t trainSamples, size_t dictSize)
+    : m_inner(inner), m_codec(codec), m_level(level), m_trainSamples(trainSamples), m_dictSize(dictSize)
+{
+#ifndef HAVE_ZSTD
+    if (codec == CODEC_ZSTD)
+        throw be_error("libbruce was built without zstd");
+#endif
+}
+
+compress::~compress()
+{
+}
+
+mempage compress::get(const nodeid_t &id)
+{
+    return decode(m_inner->get(id));
+}
+
+getallfuture_t compress::get_all_async(const blockidlist_t &ids)
+{
+    return get_all_async(ids, FETCH_NORMAL);
+}
+
+mempage compress::get(const nodeid_t &id, fetch_hint_t hint)
+{
+    return decode(m_inner->get(id, hint));
+}
+
+getallfuture_t compress::get_all_async(const blockidlist_t &ids, fetch_hint_t hint)
+{
+    std::promise<mempagelist_t> promise;
+    try
+    {
+        mempagelist_t pages = m_inner->get_all_async(ids, hint).get();
+        for (mempagelist_t::iterator it = pages.begin(); it != pages.end(); ++it)
+            *it = decode(*it);
+        promise.set_value(pages);
+    }
+    catch (...)
+    {
+        promise.set_exception(std::current_exception());
+    }
+    return promise.get_future();
+}
+
+nodeid_t compress::id(const mempage &block)
+{
+    return m_inner->id(block);
+}
+
+blockidlist_t compress::ids(const mempagelist_t &blocks)
+{
+    return m_inner->ids(blocks);
+}
+
+void compress::put_all(putblocklist_t &blocklist)
+{
+    sample(blocklist);
+
+    compress_dict_ptr dict;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        dict = m_dict;
+    }
+
+    compress_stats stats;
+    putblocklist_t encoded;
+    encoded.reserve(blocklist.size());
+    for (putblocklist_t::const_iterator it = blocklist.begin(); it != blocklist.end(); ++it)
+        encoded.push_back(putblock_t(it->id, encode(it->mem, dict, &stats)));
+
+    m_inner->put_all(encoded);
+
+    for (size_t i = 0; i < blocklist.size(); i++)
+    {
+        blocklist[i].success = encoded[i].success;
+        blocklist[i].failureReason = encoded[i].failureReason;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    accumulate(m_stats, stats);
+}
+
+void compress::del_all(delblocklist_t &ids)
+{
+    m_inner->del_all(ids);
+}
+
+uint32_t compress::maxBlockSize()
+{
+    // Leave room for the header, in case a page doesn't compress
+    uint32_t innerSize = m_inner->maxBlockSize();
+    return innerSize > MAX_HEADER_SIZE ? innerSize - MAX_HEADER_SIZE : innerSize;
+}
+
+uint32_t compress::editQueueSize()
+{
+    return m_inner->editQueueSize();
+}
+
+bool compress::contentAddressed()
+{
+    return m_inner->contentAddressed();
+}
+
+nodeid_t compress::train(const mempagelist_t &samples)
+{
+    size_t maxSize = m_dictSize;
+    if (m_inner->maxBlockSize())
+        maxSize = std::min(maxSize, (size_t)m_inner->maxBlockSize());
+
+    mempage content = buildDictionary(samples, m_codec, maxSize);
+    nodeid_t id = m_inner->id(content);
+
+    putblocklist_t put;
+    put.push_back(putblock_t(id, content));
+    m_inner->put_all(put);
+    if (!put[0].success)
+        throw be_error(("Error storing dictionary: " + put[0].failureReason).c_str());
+
+    compress_dict_ptr dict = boost::make_shared<compress_dict>(id, content, m_level);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_dicts[id] = dict;
+    m_dict = dict;
+    m_trained.push_back(id);
+    return id;
+}
+
+void compress::useDictionary(const nodeid_t &id)
+{
+    compress_dict_ptr dict = dictionary(id);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_dict = dict;
+}
+
+blockidlist_t compress::dictionaries() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_trained;
+}
+
+compress_stats compress::stats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
+
+compress_dict_ptr compress::dictionary(const nodeid_t &id)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::map<nodeid_t, compress_dict_ptr>::const_iterator it = m_dicts.find(id);
+        if (it != m_dicts.end())
+            return it->second;
+    }
+
+    compress_dict_ptr dict = boost::make_shared<compress_dict>(id, m_inner->get(id), m_level);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_dicts[id] = dict;
+    return dict;
+}
+
+/**
+ * Collect leaf pages to train on, and train once we have enough
+ */
+void compress::sample(const putblocklist_t &blocklist)
+{
+    mempagelist_t samples;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_trainSamples || m_dict)
+            return;
+
+        for (putblocklist_t::const_iterator it = blocklist.begin(); it != blocklist.end() && m_samples.size() < m_trainSamples; ++it)
+        {
+            if (it->mem.size() >= sizeof(flags_t) && PageNodeType(it->mem) == TYPE_LEAF)
+                m_samples.push_back(it->mem);
+        }
+
+        if (m_samples.size() < m_trainSamples)
+            return;
+
+        // Only train once
+        samples.swap(m_samples);
+        m_trainSamples = 0;
+    }
+
+    train(samples);
+}
+
+mempage compress::encode(const mempage &page, const compress_dict_ptr &dict, compress_stats *stats)
+{
+    codec_clock::time_point start = codec_clock::now();
+
+    size_t headerSize = sizeof(block_header) + (dict ? sizeof(nodeid_t) : 0);
+    mempage scratch = mempage::uninitialized(page.size());
+
+    size_t size = 0;
+    if (m_codec == CODEC_ZLIB)
+        size = zlibCompress(page, scratch.ptr(), scratch.size(), m_level, dict.get());
+#ifdef HAVE_ZSTD
+    else if (m_codec == CODEC_ZSTD)
+        size = zstdCompress(page, scratch.ptr(), scratch.size(), m_level, dict.get());
+#endif
+
+    block_header header;
+    header.magic = HEADER_MAGIC;
+    header.length = page.size();
+
+    mempage ret;
+    if (size && headerSize + size < sizeof(block_header) + page.size())
+    {
+        header.codec = m_codec;
+        header.flags = dict ? HEADER_DICT : 0;
+
+        ret = mempage::uninitialized(headerSize + size);
+        memcpy(ret.ptr(), &header, sizeof(header));
+        if (dict)
+            memcpy(ret.ptr() + sizeof(header), dict->id.data(), sizeof(nodeid_t));
+        memcpy(ret.ptr() + headerSize, scratch.ptr(), size);
+    }
+    else
+    {
+        header.codec = CODEC_NONE;
+        header.flags = 0;
+
+        ret = mempage::uninitialized(sizeof(header) + page.size());
+        memcpy(ret.ptr(), &header, sizeof(header));
+        memcpy(ret.ptr() + sizeof(header), page.ptr(), page.size());
+    }
+
+    stats->pagesCompressed++;
+    stats->rawBytes += page.size();
+    stats->compressedBytes += ret.size();
+    stats->compressSeconds += secondsSince(start);
+    return ret;
+}
+
+mempage compress::decode(const mempage &page)
+{
+    block_header header;
+    if (page.size() < sizeof(header))
+        return page;
+    memcpy(&header, page.ptr(), sizeof(header));
+    if (header.magic != HEADER_MAGIC)
+        return page;
+
+    codec_clock::time_point start = codec_clock::now();
+
+    size_t offset = sizeof(header);
+    compress_dict_ptr dict;
+    if (header.flags & HEADER_DICT)
+    {
+        if (page.size() < offset + sizeof(nodeid_t))
+            throw be_error("Truncated compressed block");
+        dict = dictionary(nodeid_t((const char*)page.ptr() + offset));
+        offset += sizeof(nodeid_t);
+    }
+
+    mempage ret;
+    switch (header.codec)
+    {
+        case CODEC_NONE:
+            if (page.size() - offset != header.length)
+                throw be_error("Truncated uncompressed block");
+            ret = mempage::external((uint8_t*)page.ptr() + offset, header.length, page_ref(page));
+            break;
+        case CODEC_ZLIB:
+            ret = mempage::uninitialized(header.length);
+            zlibDecompress(page.ptr() + offset, page.size() - offset, ret, dict.get());
+            break;
+#ifdef HAVE_ZSTD
+        case CODEC_ZSTD:
+            ret = mempage::uninitialized(header.length);
+            zstdDecompress(page.ptr() + offset, page.size() - offset, ret, dict.get());
+            break;
+#endif
+        default:
+            throw be_error("Block was compressed with an unsupported codec");
+    }
+
+    double seconds = secondsSince(start);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stats.pagesDecompressed++;
+    m_stats.decompressSeconds += seconds;
+    return ret;
+}
+
+be_ptr create_compress_engine(const std::string &location, size_t, size_t, const util::options_t &options)
+{
+#ifdef HAVE_ZSTD
+    std::string codecName = options.get<std::string>("codec", "zstd");
+#else
+    std::string codecName = options.get<std::string>("codec", "zlib");
+#endif
+
+    compress::codec_t codec;
+    int defaultLevel;
+    if (codecName == "zlib")
+    {
+        codec = compress::CODEC_ZLIB;
+        defaultLevel = Z_DEFAULT_COMPRESSION;
+    }
+    else if (codecName == "zstd")
+    {
+        codec = compress::CODEC_ZSTD;
+        defaultLevel = 3;
+    }
+    else if (codecName == "none")
+    {
+        codec = compress::CODEC_NONE;
+        defaultLevel = 0;
+    }
+    else
+        throw util::factory_error(("Unknown compression codec: " + codecName).c_str());
+
+    util::options_t inner = options.without("codec").without("level").without("train").without("dictsize").without("dict");
+    boost::shared_ptr<compress> ret = boost::make_shared<compress>(
+        util::create_inner_be(location, inner), codec,
+        options.get<int>("level", defaultLevel),
+        options.get<size_t>("train", 0),
+        options.get<size_t>("dictsize", 64 * 1024));
+
+    if (options.count("dict"))
+        ret->useDictionary(boost::lexical_cast<nodeid_t>(options.find("dict")->second));
+
+    return ret;
+}
+
+void register_compress_engine()
+{
+    util::register_be_factory("compress", &create_compress_engine);
+}
+
+}}
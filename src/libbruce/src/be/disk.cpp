@@ -1,50 +1,30 @@
 #include <libbruce/be/disk.h>
 #include <libbruce/util/be_registry.h>
+#include "sha1.h"
 #include <boost/make_shared.hpp>
 #include <cstdio>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 
-void sha1_compress(uint32_t state[5], const uint8_t block[64]) asm ("sha1_compress");
+namespace libbruce { namespace be {
+
+namespace {
 
-void sha1_hash(const uint8_t *message, uint32_t len, uint32_t hash[5])
+struct unmapper
 {
-	hash[0] = UINT32_C(0x67452301);
-	hash[1] = UINT32_C(0xEFCDAB89);
-	hash[2] = UINT32_C(0x98BADCFE);
-	hash[3] = UINT32_C(0x10325476);
-	hash[4] = UINT32_C(0xC3D2E1F0);
-
-	uint32_t i;
-	for (i = 0; len - i >= 64; i += 64)
-		sha1_compress(hash, message + i);
-
-	uint8_t block[64];
-	uint32_t rem = len - i;
-	memcpy(block, message + i, rem);
-
-	block[rem] = 0x80;
-	rem++;
-	if (64 - rem >= 8)
-		memset(block + rem, 0, 56 - rem);
-	else {
-		memset(block + rem, 0, 64 - rem);
-		sha1_compress(hash, block);
-		memset(block, 0, 56);
-	}
-
-	uint64_t longLen = ((uint64_t)len) << 3;
-	for (i = 0; i < 8; i++)
-		block[64 - 1 - i] = (uint8_t)(longLen >> (i * 8));
-	sha1_compress(hash, block);
-}
+    unmapper(size_t size) : size(size) { }
+    void operator()(uint8_t *mem) { munmap(mem, size); }
 
-namespace libbruce { namespace be {
+    size_t size;
+};
 
-disk::disk(std::string pathPrefix, uint32_t maxBlockSize, uint32_t editQueueSize)
-    : m_pathPrefix(pathPrefix), m_maxBlockSize(maxBlockSize), m_editQueueSize(editQueueSize)
+}
+
+disk::disk(std::string pathPrefix, uint32_t maxBlockSize, uint32_t editQueueSize, bool mmap)
+    : m_pathPrefix(pathPrefix), m_maxBlockSize(maxBlockSize), m_editQueueSize(editQueueSize), m_mmap(mmap)
 {
 }
 
@@ -57,30 +37,31 @@ mempage disk::get(const nodeid_t &id)
     if (fstat(f, &stat_info) != 0)
         throw std::runtime_error("Error stat'ing file");
 
+    if (m_mmap && stat_info.st_size)
+    {
+        // Private and writable, so that a consumer scribbling on the page
+        // doesn't crash or end up in the file.
+        void *mem = ::mmap(0, stat_info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, f, 0);
+        close(f);
+        if (mem == MAP_FAILED)
+            throw std::runtime_error("Error mapping file");
+        return mempage::external((uint8_t*)mem, stat_info.st_size, unmapper(stat_info.st_size));
+    }
+
     mempage ret(stat_info.st_size);
     read(f, ret.ptr(), stat_info.st_size); // FIXME: Check return code
     close(f);
     return ret;
 }
 
-getblockresult_t disk::get_all(const blockidlist_t &ids)
+nodeid_t disk::id(const mempage &block)
 {
-    getblockresult_t ret;
-    for (blockidlist_t::const_iterator it = ids.begin(); it != ids.end(); ++it)
-        ret[*it] = get(*it);
-    return ret;
+    return sha1_id(block);
 }
 
-nodeid_t disk::id(const mempage &block)
+blockidlist_t disk::ids(const mempagelist_t &blocks)
 {
-    uint32_t hash[5];
-    sha1_hash(block.ptr(), block.size(), hash);
-
-    BOOST_STATIC_ASSERT(sizeof(nodeid_t) == sizeof(hash));
-
-    nodeid_t ret;
-    memcpy(ret.data(), hash, sizeof(hash));
-    return ret;
+    return sha1_ids(blocks);
 }
 
 void disk::put_all(putblocklist_t &blocklist)
@@ -132,9 +113,14 @@ uint32_t disk::editQueueSize()
     return m_editQueueSize;
 }
 
+bool disk::contentAddressed()
+{
+    return true;
+}
+
 be_ptr create_disk_engine(const std::string &location, size_t block_size, size_t queue_size, const util::options_t &options)
 {
-    return boost::make_shared<disk>(location, block_size, queue_size);
+    return boost::make_shared<disk>(location, block_size, queue_size, options.get<int>("mmap", 0) != 0);
 }
 
 void register_disk_engine()
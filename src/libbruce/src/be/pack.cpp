@@ -0,0 +1,770 @@
+#include <libbruce/be/pack.h>
+#include <libbruce/util/be_registry.h>
+#include "sha1.h"
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/unordered_set.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#define INDEX_FILE "index"
+
+// Segment number used for tombstones in the index
+#define TOMBSTONE 0
+
+namespace libbruce { namespace be {
+
+/**
+ * An open segment file
+ *
+ * Readers hold on to a pointer while reading, so a segment that is
+ * compacted away stays readable until the last reader is done with it.
+ */
+struct pack_segment : private boost::noncopyable
+{
+    pack_segment(uint32_t number, const std::string &path, int fd, uint64_t size)
+        : number(number), path(path), fd(fd), size(size), liveBytes(0), map(0) { }
+    ~pack_segment()
+    {
+        if (map) munmap(map, size);
+        close(fd);
+    }
+
+    uint32_t number;
+    std::string path;
+    int fd;
+    uint64_t size;
+    uint64_t liveBytes;
+    uint8_t *map;
+};
+
+namespace {
+
+/**
+ * On-disk index record
+ *
+ * The index is a log of these: a record with segment TOMBSTONE removes the
+ * block, any other record (re)places it.
+ */
+struct index_record
+{
+    index_record() { }
+    index_record(const nodeid_t &id, const pack_location &loc)
+        : id(id), segment(loc.segment), offset(loc.offset), length(loc.length) { }
+
+    pack_location location() const { return pack_location(segment, offset, length); }
+
+    nodeid_t id;
+    uint32_t segment;
+    uint32_t offset;
+    uint32_t length;
+};
+
+BOOST_STATIC_ASSERT(sizeof(index_record) == 32);
+
+std::string errorString(const char *what)
+{
+    return std::string(what) + ": " + strerror(errno);
+}
+
+void syncDirectory(const std::string &directory)
+{
+    int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd == -1)
+        throw be_error(errorString("Error opening pack directory").c_str());
+    int ret = fsync(fd);
+    close(fd);
+    if (ret != 0)
+        throw be_error(errorString("Error syncing pack directory").c_str());
+}
+
+std::string segmentName(uint32_t number)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%08u.seg", number);
+    return name;
+}
+
+void writeFully(int fd, const void *data, size_t size)
+{
+    const char *p = (const char*)data;
+    while (size)
+    {
+        ssize_t written = write(fd, p, size);
+        if (written < 0)
+        {
+            if (errno == EINTR) continue;
+            throw be_error(errorString("Error writing pack index").c_str());
+        }
+        p += written;
+        size -= written;
+    }
+}
+
+void pwriteFully(int fd, std::vector<iovec> &iov, off_t offset)
+{
+    size_t i = 0;
+    while (i < iov.size())
+    {
+        ssize_t written = pwritev(fd, &iov[i], std::min(iov.size() - i, (size_t)IOV_MAX), offset);
+        if (written < 0)
+        {
+            if (errno == EINTR) continue;
+            throw be_error(errorString("Error writing segment").c_str());
+        }
+        offset += written;
+
+        // Skip over whatever made it, and continue halfway the next buffer
+        while (i < iov.size() && (size_t)written >= iov[i].iov_len)
+        {
+            written -= iov[i].iov_len;
+            i++;
+        }
+        if (written)
+        {
+            iov[i].iov_base = (char*)iov[i].iov_base + written;
+            iov[i].iov_len -= written;
+        }
+    }
+}
+
+void preadFully(int fd, void *data, size_t size, off_t offset)
+{
+    char *p = (char*)data;
+    while (size)
+    {
+        ssize_t n = pread(fd, p, size, offset);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            throw be_error(errorString("Error reading segment").c_str());
+        }
+        if (n == 0)
+            throw be_error("Unexpected end of segment");
+        p += n;
+        offset += n;
+        size -= n;
+    }
+}
+
+/**
+ * Keeps a mapped segment alive for as long as pages point into it
+ */
+struct segment_ref
+{
+    segment_ref(const pack_segment_ptr &segment) : segment(segment) { }
+    void operator()(uint8_t *) { segment.reset(); }
+
+    pack_segment_ptr segment;
+};
+
+template<typename T>
+bool byPosition(const std::pair<T, pack_location> &a, const std::pair<T, pack_location> &b)
+{
+    if (a.second.segment != b.second.segment)
+        return a.second.segment < b.second.segment;
+    return a.second.offset < b.second.offset;
+}
+
+}
+
+pack::pack(const std::string &directory, uint32_t maxBlockSize, uint32_t editQueueSize,
+           uint32_t segmentSize, double compactThreshold, bool mmap)
+    : m_directory(directory), m_maxBlockSize(maxBlockSize), m_editQueueSize(editQueueSize),
+      m_segmentSize(segmentSize), m_compactThreshold(compactThreshold), m_mmap(mmap),
+      m_nextSegment(1), m_indexFile(-1), m_compactRequested(true), m_stopping(false),
+      m_compactFailures(0)
+{
+    // Segments are mapped once, so they can't grow afterwards
+    if (m_mmap && m_maxBlockSize)
+        throw be_error("Can only mmap a read-only pack");
+
+    if (m_maxBlockSize && mkdir(m_directory.c_str(), 0755) != 0 && errno != EEXIST)
+        throw be_error(errorString("Error creating pack directory").c_str());
+
+    openSegments();
+    loadIndex();
+
+    // Starts out with a request, to pick up segments left over from a previous run
+    if (m_maxBlockSize && m_compactThreshold > 0)
+        m_compactor = std::thread(&pack::compactLoop, this);
+}
+
+pack::~pack()
+{
+    if (m_compactor.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+        m_wakeup.notify_one();
+        m_compactor.join();
+    }
+
+    if (m_indexFile != -1)
+        close(m_indexFile);
+}
+
+std::string pack::path(const std::string &name) const
+{
+    return m_directory + "/" + name;
+}
+
+void pack::openSegments()
+{
+    DIR *dir = opendir(m_directory.c_str());
+    if (!dir)
+        throw be_error(errorString("Error opening pack directory").c_str());
+
+    int flags = m_maxBlockSize ? O_RDWR : O_RDONLY;
+    struct dirent *entry;
+    while ((entry = readdir(dir)))
+    {
+        unsigned number;
+        if (sscanf(entry->d_name, "%u", &number) != 1 || segmentName(number) != entry->d_name)
+            continue;
+
+        std::string segmentPath = path(entry->d_name);
+        int fd = open(segmentPath.c_str(), flags);
+        struct stat stat_info;
+        if (fd == -1 || fstat(fd, &stat_info) != 0)
+        {
+            closedir(dir);
+            throw be_error(errorString("Error opening segment").c_str());
+        }
+
+        pack_segment_ptr segment = boost::make_shared<pack_segment>(number, segmentPath, fd, stat_info.st_size);
+        m_segments[number] = segment;
+
+        if (m_mmap && segment->size)
+        {
+            void *mem = ::mmap(0, segment->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (mem == MAP_FAILED)
+            {
+                closedir(dir);
+                throw be_error(errorString("Error mapping segment").c_str());
+            }
+            segment->map = (uint8_t*)mem;
+        }
+
+        m_nextSegment = std::max(m_nextSegment, (uint32_t)number + 1);
+    }
+    closedir(dir);
+
+    // Keep appending to the last segment if it has room left
+    if (m_maxBlockSize && !m_segments.empty() && m_segments.rbegin()->second->size < m_segmentSize)
+        m_active = m_segments.rbegin()->second;
+}
+
+void pack::loadIndex()
+{
+    std::string indexPath = path(INDEX_FILE);
+    if (m_maxBlockSize)
+        m_indexFile = open(indexPath.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    else
+        m_indexFile = open(indexPath.c_str(), O_RDONLY);
+
+    if (m_indexFile == -1)
+    {
+        // Reading a pack that was never written to
+        if (!m_maxBlockSize && errno == ENOENT)
+            return;
+        throw be_error(errorString("Error opening pack index").c_str());
+    }
+
+    struct stat stat_info;
+    if (fstat(m_indexFile, &stat_info) != 0)
+        throw be_error(errorString("Error stat'ing pack index").c_str());
+
+    // A torn record at the end (from crashing halfway an append) is dropped,
+    // so that new records line up again.
+    std::vector<index_record> records(stat_info.st_size / sizeof(index_record));
+    preadFully(m_indexFile, records.data(), records.size() * sizeof(index_record), 0);
+    if (m_maxBlockSize && stat_info.st_size % sizeof(index_record))
+        ftruncate(m_indexFile, records.size() * sizeof(index_record));
+
+    for (std::vector<index_record>::const_iterator it = records.begin(); it != records.end(); ++it)
+    {
+        if (it->segment == TOMBSTONE)
+        {
+            index_t::iterator found = m_index.find(it->id);
+            if (found == m_index.end()) continue;
+
+            m_segments[found->second.segment]->liveBytes -= found->second.length;
+            m_index.erase(found);
+        }
+        else
+        {
+            if (!m_segments.count(it->segment))
+                throw be_error(("Pack index refers to missing segment " + segmentName(it->segment)).c_str());
+            setLocation(it->id, it->location());
+        }
+    }
+}
+
+void pack::appendIndex(const void *records, size_t size)
+{
+    off_t end = lseek(m_indexFile, 0, SEEK_END);
+    try
+    {
+        writeFully(m_indexFile, records, size);
+    }
+    catch (be_error &e)
+    {
+        // Don't leave a partial record behind
+        ftruncate(m_indexFile, end);
+        throw;
+    }
+}
+
+void pack::rewriteIndex()
+{
+    std::vector<index_record> records;
+    records.reserve(m_index.size());
+    for (index_t::const_iterator it = m_index.begin(); it != m_index.end(); ++it)
+        records.push_back(index_record(it->first, it->second));
+
+    std::string indexPath = path(INDEX_FILE);
+    std::string tmpPath = indexPath + ".tmp";
+
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd == -1)
+        throw be_error(errorString("Error creating pack index").c_str());
+
+    try
+    {
+        writeFully(fd, records.data(), records.size() * sizeof(index_record));
+        if (fsync(fd) != 0 || rename(tmpPath.c_str(), indexPath.c_str()) != 0)
+            throw be_error(errorString("Error replacing pack index").c_str());
+    }
+    catch (be_error &e)
+    {
+        close(fd);
+        unlink(tmpPath.c_str());
+        throw;
+    }
+
+    close(m_indexFile);
+    m_indexFile = fd;
+}
+
+void pack::newSegment()
+{
+    uint32_t number = m_nextSegment++;
+    std::string segmentPath = path(segmentName(number));
+
+    int fd = open(segmentPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        throw be_error(errorString("Error creating segment").c_str());
+
+    m_active = boost::make_shared<pack_segment>(number, segmentPath, fd, 0);
+    m_segments[number] = m_active;
+}
+
+void pack::setLocation(const nodeid_t &id, const pack_location &loc)
+{
+    std::pair<index_t::iterator, bool> inserted = m_index.insert(std::make_pair(id, loc));
+    if (!inserted.second)
+    {
+        // Block was moved by the compactor
+        segmentmap_t::iterator old = m_segments.find(inserted.first->second.segment);
+        if (old != m_segments.end())
+            old->second->liveBytes -= inserted.first->second.length;
+        inserted.first->second = loc;
+    }
+
+    m_segments[loc.segment]->liveBytes += loc.length;
+}
+
+void pack::append(putblocklist_t &blocklist, const std::vector<size_t> &which)
+{
+    std::vector<size_t> run;
+    uint64_t runSize = 0;
+
+    for (std::vector<size_t>::const_iterator it = which.begin(); it != which.end(); ++it)
+    {
+        uint64_t end = (m_active ? m_active->size : 0) + runSize;
+        uint32_t size = blocklist[*it].mem.size();
+
+        // Blocks larger than a segment get a segment to themselves
+        if (!m_active || (end && end + size > m_segmentSize))
+        {
+            writeRun(blocklist, run);
+            run.clear();
+            runSize = 0;
+            newSegment();
+        }
+
+        run.push_back(*it);
+        runSize += size;
+    }
+
+    writeRun(blocklist, run);
+}
+
+void pack::writeRun(putblocklist_t &blocklist, const std::vector<size_t> &run)
+{
+    if (run.empty()) return;
+
+    std::vector<iovec> iov;
+    std::vector<index_record> records;
+    uint64_t offset = m_active->size;
+
+    for (std::vector<size_t>::const_iterator it = run.begin(); it != run.end(); ++it)
+    {
+        putblock_t &block = blocklist[*it];
+
+        iovec v = { (void*)block.mem.ptr(), block.mem.size() };
+        iov.push_back(v);
+
+        records.push_back(index_record(block.id, pack_location(m_active->number, offset, block.mem.size())));
+        offset += block.mem.size();
+    }
+
+    try
+    {
+        pwriteFully(m_active->fd, iov, m_active->size);
+        appendIndex(records.data(), records.size() * sizeof(index_record));
+    }
+    catch (be_error &e)
+    {
+        // Whatever part of the run made it into the segment is garbage now,
+        // so don't append to it anymore.
+        m_active.reset();
+        for (std::vector<size_t>::const_iterator it = run.begin(); it != run.end(); ++it)
+            blocklist[*it].failureReason = e.what();
+        return;
+    }
+
+    m_active->size = offset;
+    for (size_t i = 0; i < run.size(); i++)
+    {
+        setLocation(records[i].id, records[i].location());
+        blocklist[run[i]].success = true;
+    }
+}
+
+mempage pack::read(const pack_segment_ptr &segment, const pack_location &loc)
+{
+    if (segment->map)
+    {
+        if ((uint64_t)loc.offset + loc.length > segment->size)
+            throw be_error("Unexpected end of segment");
+        return mempage::external(segment->map + loc.offset, loc.length, segment_ref(segment));
+    }
+
+    mempage ret(loc.length);
+    preadFully(segment->fd, ret.ptr(), loc.length, loc.offset);
+    return ret;
+}
+
+mempage pack::get(const nodeid_t &id)
+{
+    pack_segment_ptr segment;
+    pack_location loc;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        index_t::const_iterator it = m_index.find(id);
+        if (it == m_index.end())
+            throw block_not_found(id);
+
+        loc = it->second;
+        segment = m_segments[loc.segment];
+    }
+
+    return read(segment, loc);
+}
+
+getallfuture_t pack::get_all_async(const blockidlist_t &ids)
+{
+    std::promise<mempagelist_t> promise;
+    try
+    {
+        promise.set_value(read_all(ids));
+    }
+    catch (...)
+    {
+        promise.set_exception(std::current_exception());
+    }
+    return promise.get_future();
+}
+
+mempagelist_t pack::read_all(const blockidlist_t &ids)
+{
+    // Locations by index in the request
+    std::vector<std::pair<size_t, pack_location> > locations;
+    segmentmap_t segments;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (size_t i = 0; i < ids.size(); i++)
+        {
+            index_t::const_iterator found = m_index.find(ids[i]);
+            if (found == m_index.end())
+                throw block_not_found(ids[i]);
+
+            locations.push_back(std::make_pair(i, found->second));
+            segments[found->second.segment] = m_segments[found->second.segment];
+        }
+    }
+
+    // Read in file order, which keeps the disk access mostly sequential
+    std::sort(locations.begin(), locations.end(), &byPosition<size_t>);
+
+    mempagelist_t ret(ids.size());
+    for (std::vector<std::pair<size_t, pack_location> >::const_iterator it = locations.begin(); it != locations.end(); ++it)
+        ret[it->first] = read(segments[it->second.segment], it->second);
+    return ret;
+}
+
+nodeid_t pack::id(const mempage &block)
+{
+    return sha1_id(block);
+}
+
+blockidlist_t pack::ids(const mempagelist_t &blocks)
+{
+    return sha1_ids(blocks);
+}
+
+void pack::put_all(putblocklist_t &blocklist)
+{
+    if (!m_maxBlockSize)
+        throw be_error("Can't put; engine is read-only");
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // Blocks are addressed by content, so anything we already have (or that
+    // appears twice in this batch) needs to be written only once.
+    std::vector<size_t> which;
+    boost::unordered_set<nodeid_t> batch;
+    for (size_t i = 0; i < blocklist.size(); i++)
+    {
+        if (!m_index.count(blocklist[i].id) && batch.insert(blocklist[i].id).second)
+            which.push_back(i);
+    }
+
+    append(blocklist, which);
+
+    for (putblocklist_t::iterator it = blocklist.begin(); it != blocklist.end(); ++it)
+    {
+        if (!it->success)
+            it->success = m_index.count(it->id) > 0;
+    }
+}
+
+void pack::del_all(delblocklist_t &ids)
+{
+    if (!m_maxBlockSize)
+        throw be_error("Can't delete; engine is read-only");
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    std::vector<index_record> tombstones;
+    for (delblocklist_t::const_iterator it = ids.begin(); it != ids.end(); ++it)
+    {
+        if (m_index.count(it->id))
+            tombstones.push_back(index_record(it->id, pack_location()));
+    }
+    appendIndex(tombstones.data(), tombstones.size() * sizeof(index_record));
+
+    for (delblocklist_t::iterator it = ids.begin(); it != ids.end(); ++it)
+    {
+        it->success = true;
+
+        index_t::iterator found = m_index.find(it->id);
+        if (found == m_index.end()) continue;
+
+        pack_segment_ptr segment = m_segments[found->second.segment];
+        segment->liveBytes -= found->second.length;
+        m_index.erase(found);
+
+        if (needsCompaction(segment))
+            m_compactRequested = true;
+    }
+
+    if (m_compactRequested)
+        m_wakeup.notify_one();
+}
+
+uint32_t pack::maxBlockSize()
+{
+    return m_maxBlockSize;
+}
+
+uint32_t pack::editQueueSize()
+{
+    return m_editQueueSize;
+}
+
+bool pack::contentAddressed()
+{
+    return true;
+}
+
+size_t pack::blockCount() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_index.size();
+}
+
+size_t pack::segmentCount() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_segments.size();
+}
+
+size_t pack::compactFailures() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_compactFailures;
+}
+
+std::string pack::lastCompactError() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_compactError;
+}
+
+bool pack::needsCompaction(const pack_segment_ptr &segment) const
+{
+    return segment != m_active && segment->size && segment->liveBytes < segment->size * m_compactThreshold;
+}
+
+void pack::compact()
+{
+    std::lock_guard<std::mutex> compacting(m_compactMutex);
+
+    std::vector<pack_segment_ptr> candidates;
+    uint32_t firstTarget;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        firstTarget = m_active ? m_active->number : m_nextSegment;
+        for (segmentmap_t::const_iterator it = m_segments.begin(); it != m_segments.end(); ++it)
+        {
+            if (needsCompaction(it->second))
+                candidates.push_back(it->second);
+        }
+    }
+
+    if (candidates.empty()) return;
+
+    for (std::vector<pack_segment_ptr>::const_iterator it = candidates.begin(); it != candidates.end(); ++it)
+        compactSegment(*it);
+
+    // Only remove the old segments once the index doesn't mention them
+    // anymore, so that crashing halfway leaves a readable pack. That takes
+    // the copies and their index records being on disk first.
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (segmentmap_t::const_iterator it = m_segments.lower_bound(firstTarget); it != m_segments.end(); ++it)
+    {
+        if (fsync(it->second->fd) != 0)
+            throw be_error(errorString("Error syncing segment").c_str());
+    }
+    if (fsync(m_indexFile) != 0)
+        throw be_error(errorString("Error syncing pack index").c_str());
+
+    rewriteIndex();
+    syncDirectory(m_directory);
+
+    for (std::vector<pack_segment_ptr>::const_iterator it = candidates.begin(); it != candidates.end(); ++it)
+        unlink((*it)->path.c_str());
+    syncDirectory(m_directory);
+}
+
+void pack::compactSegment(const pack_segment_ptr &segment)
+{
+    std::vector<std::pair<nodeid_t, pack_location> > live;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (index_t::const_iterator it = m_index.begin(); it != m_index.end(); ++it)
+        {
+            if (it->second.segment == segment->number)
+                live.push_back(*it);
+        }
+    }
+
+    // The segment isn't written to anymore, so it can be read without the lock
+    std::sort(live.begin(), live.end(), &byPosition<nodeid_t>);
+    putblocklist_t blocks;
+    for (std::vector<std::pair<nodeid_t, pack_location> >::const_iterator it = live.begin(); it != live.end(); ++it)
+        blocks.push_back(putblock_t(it->first, read(segment, it->second)));
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // Skip blocks that were deleted in the meantime
+    std::vector<size_t> which;
+    for (size_t i = 0; i < blocks.size(); i++)
+    {
+        index_t::const_iterator found = m_index.find(blocks[i].id);
+        if (found != m_index.end() && found->second.segment == segment->number)
+            which.push_back(i);
+    }
+
+    append(blocks, which);
+
+    for (std::vector<size_t>::const_iterator it = which.begin(); it != which.end(); ++it)
+    {
+        if (!blocks[*it].success)
+            throw be_error(("Error compacting segment: " + blocks[*it].failureReason).c_str());
+    }
+
+    m_segments.erase(segment->number);
+}
+
+void pack::compactLoop()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+        while (!m_stopping && !m_compactRequested)
+            m_wakeup.wait(lock);
+        if (m_stopping)
+            return;
+        m_compactRequested = false;
+
+        lock.unlock();
+        std::string error;
+        try
+        {
+            compact();
+        }
+        catch (std::exception &e)
+        {
+            // Segments stay as they are until the next attempt
+            error = e.what();
+        }
+        lock.lock();
+
+        if (!error.empty())
+        {
+            m_compactFailures++;
+            m_compactError = error;
+        }
+    }
+}
+
+be_ptr create_pack_engine(const std::string &location, size_t block_size, size_t queue_size, const util::options_t &options)
+{
+    return boost::make_shared<pack>(location, block_size, queue_size,
+                                    options.get<uint32_t>("segment", 256 * 1024 * 1024),
+                                    options.get<double>("compact", 0.5),
+                                    options.get<int>("mmap", 0) != 0);
+}
+
+void register_pack_engine()
+{
+    util::register_be_factory("pack", &create_pack_engine);
+}
+
+}}
@@ -0,0 +1,251 @@
+#include <libbruce/be/parallel.h>
+#include <libbruce/util/be_registry.h>
+#include "../util/thread_pool.h"
+#include <boost/make_shared.hpp>
+#include <boost/bind.hpp>
+#include <algorithm>
+
+namespace libbruce { namespace be {
+
+namespace {
+
+void getPart(const be_ptr &inner, const blockidlist_t *ids, fetch_hint_t hint, mempagelist_t *result)
+{
+    *result = inner->get_all_async(*ids, hint).get();
+}
+
+void putPart(const be_ptr &inner, putblocklist_t *blocks)
+{
+    inner->put_all(*blocks);
+}
+
+/**
+ * The parts of a put_all_async that is still in flight
+ */
+struct pending_put
+{
+    std::vector<putblocklist_t> parts;
+    std::vector<std::future<void> > futures;
+};
+
+void putPendingPart(const be_ptr &inner, const boost::shared_ptr<pending_put> &pending, size_t i)
+{
+    inner->put_all(pending->parts[i]);
+}
+
+void delPart(const be_ptr &inner, delblocklist_t *ids)
+{
+    inner->del_all(*ids);
+}
+
+/**
+ * Split a list into consecutive parts of (nearly) equal size
+ */
+template<typename T>
+std::vector<std::vector<T> > split(const std::vector<T> &list, size_t parts)
+{
+    std::vector<std::vector<T> > ret(parts);
+    for (size_t i = 0; i < list.size(); i++)
+        ret[i * parts / list.size()].push_back(list[i]);
+    return ret;
+}
+
+/**
+ * Copy the results of a split list back into the original
+ */
+template<typename T>
+void join(std::vector<T> &list, const std::vector<std::vector<T> > &parts)
+{
+    size_t i = 0;
+    for (typename std::vector<std::vector<T> >::const_iterator part = parts.begin(); part != parts.end(); ++part)
+    {
+        for (typename std::vector<T>::const_iterator it = part->begin(); it != part->end(); ++it, ++i)
+        {
+            list[i].success = it->success;
+            list[i].failureReason = it->failureReason;
+        }
+    }
+}
+
+}
+
+parallel::parallel(const be_ptr &inner, unsigned threads)
+    : m_inner(inner), m_threads(std::max(threads, 1u)), m_pool(new util::thread_pool(m_threads))
+{
+}
+
+parallel::~parallel()
+{
+}
+
+size_t parallel::partCount(size_t size) const
+{
+    return std::min(size, (size_t)m_threads);
+}
+
+mempage parallel::get(const nodeid_t &id)
+{
+    return m_inner->get(id);
+}
+
+mempage parallel::get(const nodeid_t &id, fetch_hint_t hint)
+{
+    return m_inner->get(id, hint);
+}
+
+getallfuture_t parallel::get_all_async(const blockidlist_t &ids)
+{
+    return get_all_async(ids, FETCH_NORMAL);
+}
+
+getallfuture_t parallel::get_all_async(const blockidlist_t &ids, fetch_hint_t hint)
+{
+    size_t parts = partCount(ids.size());
+    if (parts < 2)
+        return m_inner->get_all_async(ids, hint);
+
+    std::promise<mempagelist_t> promise;
+    try
+    {
+        std::vector<blockidlist_t> idParts = split(ids, parts);
+        std::vector<mempagelist_t> results(parts);
+
+        std::vector<std::future<void> > futures;
+        for (size_t i = 0; i < parts; i++)
+            futures.push_back(m_pool->submit(boost::bind(&getPart, m_inner, &idParts[i], hint, &results[i])));
+        util::thread_pool::wait_all(futures);
+
+        // The parts are consecutive, so this is request order again
+        mempagelist_t ret;
+        ret.reserve(ids.size());
+        for (std::vector<mempagelist_t>::const_iterator it = results.begin(); it != results.end(); ++it)
+            ret.insert(ret.end(), it->begin(), it->end());
+        promise.set_value(ret);
+    }
+    catch (...)
+    {
+        promise.set_exception(std::current_exception());
+    }
+    return promise.get_future();
+}
+
+nodeid_t parallel::id(const mempage &block)
+{
+    return m_inner->id(block);
+}
+
+blockidlist_t parallel::ids(const mempagelist_t &blocks)
+{
+    return m_inner->ids(blocks);
+}
+
+void parallel::put_all(putblocklist_t &blocklist)
+{
+    size_t parts = partCount(blocklist.size());
+    if (parts < 2)
+        return m_inner->put_all(blocklist);
+
+    std::vector<putblocklist_t> blockParts = split(blocklist, parts);
+
+    std::vector<std::future<void> > futures;
+    for (size_t i = 0; i < parts; i++)
+        futures.push_back(m_pool->submit(boost::bind(&putPart, m_inner, &blockParts[i])));
+
+    // Copy back whatever was done, even if some part threw
+    try
+    {
+        util::thread_pool::wait_all(futures);
+    }
+    catch (...)
+    {
+        join(blocklist, blockParts);
+        throw;
+    }
+    join(blocklist, blockParts);
+}
+
+namespace {
+
+void finishPut(putblocklist_t *blocklist, const boost::shared_ptr<pending_put> &pending)
+{
+    try
+    {
+        util::thread_pool::wait_all(pending->futures);
+    }
+    catch (...)
+    {
+        join(*blocklist, pending->parts);
+        throw;
+    }
+    join(*blocklist, pending->parts);
+}
+
+}
+
+putfuture_t parallel::put_all_async(putblocklist_t &blocklist)
+{
+    size_t parts = partCount(blocklist.size());
+    if (parts < 2)
+        return be::put_all_async(blocklist);
+
+    // The parts are owned by the tasks as well, so they outlive a future
+    // that is dropped without being waited on.
+    boost::shared_ptr<pending_put> pending = boost::make_shared<pending_put>();
+    pending->parts = split(blocklist, parts);
+    for (size_t i = 0; i < parts; i++)
+        pending->futures.push_back(m_pool->submit(boost::bind(&putPendingPart, m_inner, pending, i)));
+
+    return std::async(std::launch::deferred, boost::bind(&finishPut, &blocklist, pending));
+}
+
+void parallel::del_all(delblocklist_t &ids)
+{
+    size_t parts = partCount(ids.size());
+    if (parts < 2)
+        return m_inner->del_all(ids);
+
+    std::vector<delblocklist_t> idParts = split(ids, parts);
+
+    std::vector<std::future<void> > futures;
+    for (size_t i = 0; i < parts; i++)
+        futures.push_back(m_pool->submit(boost::bind(&delPart, m_inner, &idParts[i])));
+
+    try
+    {
+        util::thread_pool::wait_all(futures);
+    }
+    catch (...)
+    {
+        join(ids, idParts);
+        throw;
+    }
+    join(ids, idParts);
+}
+
+uint32_t parallel::maxBlockSize()
+{
+    return m_inner->maxBlockSize();
+}
+
+uint32_t parallel::editQueueSize()
+{
+    return m_inner->editQueueSize();
+}
+
+bool parallel::contentAddressed()
+{
+    return m_inner->contentAddressed();
+}
+
+be_ptr create_parallel_engine(const std::string &location, size_t, size_t, const util::options_t &options)
+{
+    return boost::make_shared<parallel>(util::create_inner_be(location, options.without("threads")),
+                                        options.get<unsigned>("threads", 8));
+}
+
+void register_parallel_engine()
+{
+    util::register_be_factory("parallel", &create_parallel_engine);
+}
+
+}}
@@ -0,0 +1,49 @@
+#pragma once
+#ifndef BRUCE_BE_SHA1_H
+#define BRUCE_BE_SHA1_H
+
+#include <libbruce/be/be.h>
+
+namespace libbruce { namespace be {
+
+/**
+ * SHA1 implementations, picked at runtime depending on the CPU
+ *
+ * - SCALAR: the assembly compression function, one block at a time.
+ * - AVX2: hashes 8 blocks side by side, one per vector lane.
+ * - SHANI: the SHA instruction set extensions, one block at a time.
+ */
+enum sha1_impl { SHA1_SCALAR, SHA1_AVX2, SHA1_SHANI };
+
+bool sha1_supported(sha1_impl impl);
+
+/**
+ * The fastest implementation this CPU supports for a batch of this many blocks
+ *
+ * The SHA extensions if the CPU has them, unless the batch is large enough
+ * for the multi-buffer implementation to keep its lanes busy.
+ */
+sha1_impl sha1_best(size_t blocks);
+
+/**
+ * Return the SHA1 hash of the block as a node ID
+ *
+ * Used by the engines that address blocks by content.
+ */
+nodeid_t sha1_id(const mempage &block);
+
+/**
+ * Return the node IDs of a batch of blocks, in the same order
+ *
+ * Uses whichever implementation sha1_best picks for the size of the batch.
+ */
+blockidlist_t sha1_ids(const mempagelist_t &blocks);
+
+/**
+ * Hash a batch with a specific implementation (for testing and benchmarking)
+ */
+blockidlist_t sha1_ids(const mempagelist_t &blocks, sha1_impl impl);
+
+}}
+
+#endif
@@ -0,0 +1,455 @@
+#include <libbruce/be/tiered.h>
+#include <libbruce/util/be_registry.h>
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/make_shared.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <sstream>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+namespace libbruce { namespace be {
+
+namespace {
+
+std::string errorString(const char *what)
+{
+    return std::string(what) + ": " + strerror(errno);
+}
+
+bool writeFully(int fd, const uint8_t *data, size_t size)
+{
+    while (size)
+    {
+        ssize_t written = write(fd, data, size);
+        if (written < 0)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+/**
+ * Make the entries of a directory (such as a file just renamed into it) durable
+ */
+bool syncDirectory(const std::string &directory)
+{
+    int f = open(directory.c_str(), O_RDONLY|O_DIRECTORY);
+    if (f == -1)
+        return false;
+    bool synced = fsync(f) == 0;
+    close(f);
+    return synced;
+}
+
+bool readFully(int fd, uint8_t *data, size_t size)
+{
+    while (size)
+    {
+        ssize_t n = read(fd, data, size);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (n == 0)
+            return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+/**
+ * A block written under a temporary name, to be renamed into place
+ */
+struct temp_file
+{
+    temp_file(size_t index, const std::string &path, int fd)
+        : index(index), path(path), fd(fd) { }
+
+    size_t index;
+    std::string path;
+    int fd;
+};
+
+struct scanned_file
+{
+    scanned_file(const nodeid_t &id, uint64_t size, const timespec &mtime)
+        : id(id), size(size), mtime(mtime) { }
+
+    nodeid_t id;
+    uint64_t size;
+    timespec mtime;
+};
+
+bool byMtime(const scanned_file &a, const scanned_file &b)
+{
+    if (a.mtime.tv_sec != b.mtime.tv_sec)
+        return a.mtime.tv_sec < b.mtime.tv_sec;
+    return a.mtime.tv_nsec < b.mtime.tv_nsec;
+}
+
+}
+
+tiered::tiered(const be_ptr &remote, const std::string &directory, uint64_t maxSize)
+    : m_remote(remote), m_directory(directory), m_maxSize(maxSize),
+      m_verify(remote->contentAddressed()), m_size(0),
+      m_hits(0), m_misses(0), m_tempCounter(0)
+{
+    if (!m_directory.empty() && m_directory[m_directory.size() - 1] == '/')
+        m_directory.erase(m_directory.size() - 1);
+
+    if (mkdir(m_directory.c_str(), 0755) != 0 && errno != EEXIST)
+        throw be_error(errorString("Error creating cache directory").c_str());
+
+    scan();
+}
+
+tiered::~tiered()
+{
+}
+
+std::string tiered::path(const nodeid_t &id) const
+{
+    return m_directory + "/" + boost::lexical_cast<std::string>(id);
+}
+
+void tiered::scan()
+{
+    DIR *dir = opendir(m_directory.c_str());
+    if (!dir)
+        throw be_error(errorString("Error opening cache directory").c_str());
+
+    std::vector<scanned_file> files;
+    while (dirent *ent = readdir(dir))
+    {
+        std::string name(ent->d_name);
+        std::string full = m_directory + "/" + name;
+
+        // Leftovers from writes that didn't finish
+        if (name.find(".tmp.") != std::string::npos)
+        {
+            unlink(full.c_str());
+            continue;
+        }
+
+        if (name.size() != sizeof(nodeid_t) * 2)
+            continue;
+
+        struct stat stat_info;
+        if (stat(full.c_str(), &stat_info) != 0 || !S_ISREG(stat_info.st_mode))
+            continue;
+
+        nodeid_t id;
+        std::istringstream is(name);
+        is >> id;
+        files.push_back(scanned_file(id, stat_info.st_size, stat_info.st_mtim));
+    }
+    closedir(dir);
+
+    std::sort(files.begin(), files.end(), byMtime);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (std::vector<scanned_file>::const_iterator it = files.begin(); it != files.end(); ++it)
+    {
+        m_index[it->id] = m_lru.insert(m_lru.end(), entry(it->id, it->size));
+        m_size += it->size;
+    }
+
+    // The limit may have been lowered since the last run
+    while (m_size > m_maxSize && !m_lru.empty())
+    {
+        unlink(path(m_lru.front().id).c_str());
+        m_size -= m_lru.front().size;
+        m_index.erase(m_lru.front().id);
+        m_lru.pop_front();
+    }
+}
+
+bool tiered::lookup(const nodeid_t &id, mempage *page)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        index_t::iterator it = m_index.find(id);
+        if (it == m_index.end())
+        {
+            m_misses++;
+            return false;
+        }
+        m_lru.splice(m_lru.end(), m_lru, it->second);
+    }
+
+    int f = open(path(id).c_str(), O_RDONLY);
+    if (f != -1)
+    {
+        struct stat stat_info;
+        if (fstat(f, &stat_info) == 0)
+        {
+            mempage ret(stat_info.st_size);
+            if (readFully(f, ret.ptr(), ret.size()) && (!m_verify || m_remote->id(ret) == id))
+            {
+                // Bump the modification time, so the order survives a restart
+                futimens(f, NULL);
+                close(f);
+
+                *page = ret;
+                m_hits++;
+                return true;
+            }
+        }
+        close(f);
+    }
+
+    // Removed or damaged; the remote engine still has it
+    forget(id);
+    m_misses++;
+    return false;
+}
+
+void tiered::store_all(const blockidlist_t &ids, const mempagelist_t &pages, fetch_hint_t hint)
+{
+    if (hint == FETCH_SCAN)
+        return;
+
+    // Failing to cache a block isn't worth failing the request for
+    std::vector<temp_file> written;
+    for (size_t i = 0; i < ids.size(); i++)
+    {
+        if (pages[i].size() > m_maxSize)
+            continue;
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_index.count(ids[i]))
+                continue;
+        }
+
+        std::string temp = path(ids[i]) + ".tmp." + boost::lexical_cast<std::string>(m_tempCounter++);
+        int f = open(temp.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if (f == -1)
+            continue;
+
+        if (!writeFully(f, pages[i].ptr(), pages[i].size()))
+        {
+            close(f);
+            unlink(temp.c_str());
+            continue;
+        }
+        written.push_back(temp_file(i, temp, f));
+    }
+
+    if (written.empty())
+        return;
+
+    // Unless a damaged copy can be told by its ID, the contents must be on disk
+    // before the names are, and the names before we count on them. Both are
+    // synced once for the whole batch.
+    bool synced = m_verify ||
+        (written.size() == 1 ? fsync(written[0].fd) : syncfs(written[0].fd)) == 0;
+
+    std::vector<size_t> stored;
+    for (std::vector<temp_file>::const_iterator it = written.begin(); it != written.end(); ++it)
+    {
+        if (close(it->fd) == 0 && synced && rename(it->path.c_str(), path(ids[it->index]).c_str()) == 0)
+            stored.push_back(it->index);
+        else
+            unlink(it->path.c_str());
+    }
+
+    if (!m_verify && !stored.empty() && !syncDirectory(m_directory))
+    {
+        for (std::vector<size_t>::const_iterator it = stored.begin(); it != stored.end(); ++it)
+            unlink(path(ids[*it]).c_str());
+        return;
+    }
+
+    std::vector<nodeid_t> victims;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (std::vector<size_t>::const_iterator it = stored.begin(); it != stored.end(); ++it)
+        {
+            if (m_index.count(ids[*it]))
+                continue;
+
+            m_index[ids[*it]] = m_lru.insert(m_lru.end(), entry(ids[*it], pages[*it].size()));
+            m_size += pages[*it].size();
+        }
+
+        while (m_size > m_maxSize)
+        {
+            victims.push_back(m_lru.front().id);
+            m_size -= m_lru.front().size;
+            m_index.erase(m_lru.front().id);
+            m_lru.pop_front();
+        }
+    }
+
+    for (std::vector<nodeid_t>::const_iterator it = victims.begin(); it != victims.end(); ++it)
+        unlink(path(*it).c_str());
+}
+
+void tiered::forget(const nodeid_t &id)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        index_t::iterator it = m_index.find(id);
+        if (it == m_index.end())
+            return;
+
+        m_size -= it->second->size;
+        m_lru.erase(it->second);
+        m_index.erase(it);
+    }
+
+    unlink(path(id).c_str());
+}
+
+mempage tiered::get(const nodeid_t &id)
+{
+    return get(id, FETCH_NORMAL);
+}
+
+mempage tiered::get(const nodeid_t &id, fetch_hint_t hint)
+{
+    mempage ret;
+    if (lookup(id, &ret))
+        return ret;
+
+    ret = m_remote->get(id, hint);
+    store_all(blockidlist_t(1, id), mempagelist_t(1, ret), hint);
+    return ret;
+}
+
+getallfuture_t tiered::get_all_async(const blockidlist_t &ids)
+{
+    return get_all_async(ids, FETCH_NORMAL);
+}
+
+getallfuture_t tiered::get_all_async(const blockidlist_t &ids, fetch_hint_t hint)
+{
+    mempagelist_t pages(ids.size());
+    std::vector<size_t> indexes;
+    blockidlist_t missing;
+    for (size_t i = 0; i < ids.size(); i++)
+    {
+        if (!lookup(ids[i], &pages[i]))
+        {
+            indexes.push_back(i);
+            missing.push_back(ids[i]);
+        }
+    }
+
+    if (missing.empty())
+    {
+        std::promise<mempagelist_t> promise;
+        promise.set_value(pages);
+        return promise.get_future();
+    }
+
+    std::shared_future<mempagelist_t> fetched = m_remote->get_all_async(missing, hint).share();
+    return std::async(std::launch::deferred,
+                      boost::bind(&tiered::completeFetch, this, pages, indexes, missing, fetched, hint));
+}
+
+mempagelist_t tiered::completeFetch(mempagelist_t pages, const std::vector<size_t> &indexes,
+                                    const blockidlist_t &ids, std::shared_future<mempagelist_t> fetched,
+                                    fetch_hint_t hint)
+{
+    const mempagelist_t &got = fetched.get();
+    for (size_t i = 0; i < indexes.size(); i++)
+        pages[indexes[i]] = got[i];
+    store_all(ids, got, hint);
+    return pages;
+}
+
+nodeid_t tiered::id(const mempage &block)
+{
+    return m_remote->id(block);
+}
+
+blockidlist_t tiered::ids(const mempagelist_t &blocks)
+{
+    return m_remote->ids(blocks);
+}
+
+void tiered::put_all(putblocklist_t &blocklist)
+{
+    m_remote->put_all(blocklist);
+
+    blockidlist_t ids;
+    mempagelist_t pages;
+    for (putblocklist_t::const_iterator it = blocklist.begin(); it != blocklist.end(); ++it)
+    {
+        if (it->success)
+        {
+            ids.push_back(it->id);
+            pages.push_back(it->mem);
+        }
+    }
+    store_all(ids, pages, FETCH_NORMAL);
+}
+
+void tiered::del_all(delblocklist_t &ids)
+{
+    for (delblocklist_t::const_iterator it = ids.begin(); it != ids.end(); ++it)
+        forget(it->id);
+
+    m_remote->del_all(ids);
+}
+
+uint32_t tiered::maxBlockSize()
+{
+    return m_remote->maxBlockSize();
+}
+
+uint32_t tiered::editQueueSize()
+{
+    return m_remote->editQueueSize();
+}
+
+bool tiered::contentAddressed()
+{
+    return m_remote->contentAddressed();
+}
+
+tiered_stats tiered::stats() const
+{
+    tiered_stats ret;
+    ret.hits = m_hits;
+    ret.misses = m_misses;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ret.size = m_size;
+    ret.count = m_index.size();
+    return ret;
+}
+
+// The block and queue sizes are options, so the remote engine gets them as well
+be_ptr create_tiered_engine(const std::string &location, size_t, size_t, const util::options_t &options)
+{
+    std::string directory = options.get<std::string>("tier", "");
+    if (directory.empty())
+        throw util::factory_error("tiered engine needs a tier=DIRECTORY option");
+
+    util::options_t inner = options.without("tier").without("tiersize");
+    return boost::make_shared<tiered>(util::create_inner_be(location, inner),
+                                      directory,
+                                      options.get<uint64_t>("tiersize", 1024ULL * 1024 * 1024));
+}
+
+void register_tiered_engine()
+{
+    util::register_be_factory("tiered", &create_tiered_engine);
+}
+
+}}
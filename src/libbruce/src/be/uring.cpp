@@ -0,0 +1,431 @@
+#include <libbruce/be/uring.h>
+#include <libbruce/util/be_registry.h>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#define to_string boost::lexical_cast<std::string>
+
+// Alignment of buffers and lengths for O_DIRECT reads
+#define DIRECT_ALIGNMENT 4096
+
+namespace libbruce { namespace be {
+
+/**
+ * Minimal io_uring submission/completion queue pair
+ *
+ * Talks to the kernel directly so we don't depend on liburing. Entries are
+ * prepared with next(), after which run() submits all of them in one go and
+ * waits until every one of them has completed.
+ */
+class uring_queue : private boost::noncopyable
+{
+public:
+    uring_queue(unsigned entries)
+        : m_pending(0)
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+
+        m_fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (m_fd < 0)
+            throw be_error((std::string("Error setting up io_uring: ") + strerror(errno)).c_str());
+
+        m_entries = params.sq_entries;
+        m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+
+        m_sqRing = (uint8_t*)mmap(0, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+        m_cqRing = (uint8_t*)mmap(0, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+        m_sqes = (io_uring_sqe*)mmap(0, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+        if (m_sqRing == MAP_FAILED || m_cqRing == MAP_FAILED || m_sqes == MAP_FAILED)
+        {
+            unmap();
+            throw be_error("Error mapping io_uring queues");
+        }
+
+        m_sqTail = (unsigned*)(m_sqRing + params.sq_off.tail);
+        m_sqMask = (unsigned*)(m_sqRing + params.sq_off.ring_mask);
+        m_sqArray = (unsigned*)(m_sqRing + params.sq_off.array);
+        m_cqHead = (unsigned*)(m_cqRing + params.cq_off.head);
+        m_cqTail = (unsigned*)(m_cqRing + params.cq_off.tail);
+        m_cqMask = (unsigned*)(m_cqRing + params.cq_off.ring_mask);
+        m_cqes = (io_uring_cqe*)(m_cqRing + params.cq_off.cqes);
+    }
+
+    ~uring_queue()
+    {
+        unmap();
+    }
+
+    unsigned entries() const { return m_entries; }
+
+    /**
+     * Return a cleared submission entry, tagged with the given index
+     *
+     * The result of the operation will end up at this index in the result
+     * list passed to run().
+     */
+    io_uring_sqe *next(size_t index)
+    {
+        assert(m_pending < m_entries);
+
+        unsigned slot = (*m_sqTail + m_pending) & *m_sqMask;
+        io_uring_sqe *sqe = &m_sqes[slot];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->user_data = index;
+        m_sqArray[slot] = slot;
+        m_pending++;
+        return sqe;
+    }
+
+    /**
+     * Submit all prepared entries and wait for them to complete
+     */
+    void run(std::vector<int> *results)
+    {
+        unsigned toSubmit = m_pending;
+        unsigned toComplete = m_pending;
+        m_pending = 0;
+
+        __atomic_store_n(m_sqTail, *m_sqTail + toSubmit, __ATOMIC_RELEASE);
+
+        while (toComplete)
+        {
+            int ret = syscall(__NR_io_uring_enter, m_fd, toSubmit, toComplete, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (ret < 0)
+            {
+                if (errno == EINTR) continue;
+                throw be_error((std::string("Error submitting to io_uring: ") + strerror(errno)).c_str());
+            }
+            toSubmit -= ret;
+            toComplete -= reap(results);
+        }
+    }
+private:
+    int m_fd;
+    unsigned m_entries;
+    unsigned m_pending;
+
+    uint8_t *m_sqRing;
+    uint8_t *m_cqRing;
+    io_uring_sqe *m_sqes;
+    size_t m_sqRingSize;
+    size_t m_cqRingSize;
+    size_t m_sqesSize;
+
+    unsigned *m_sqTail;
+    unsigned *m_sqMask;
+    unsigned *m_sqArray;
+    unsigned *m_cqHead;
+    unsigned *m_cqTail;
+    unsigned *m_cqMask;
+    io_uring_cqe *m_cqes;
+
+    unsigned reap(std::vector<int> *results)
+    {
+        unsigned head = *m_cqHead;
+        unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+        unsigned count = 0;
+
+        for (; head != tail; head++, count++)
+        {
+            const io_uring_cqe &cqe = m_cqes[head & *m_cqMask];
+            (*results)[cqe.user_data] = cqe.res;
+        }
+
+        __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+        return count;
+    }
+
+    void unmap()
+    {
+        if (m_sqRing != MAP_FAILED) munmap(m_sqRing, m_sqRingSize);
+        if (m_cqRing != MAP_FAILED) munmap(m_cqRing, m_cqRingSize);
+        if ((void*)m_sqes != MAP_FAILED) munmap(m_sqes, m_sqesSize);
+        close(m_fd);
+    }
+};
+
+//----------------------------------------------------------------------
+
+uring::uring(std::string pathPrefix, uint32_t maxBlockSize, uint32_t editQueueSize, unsigned queueDepth, bool direct)
+    : disk(pathPrefix, maxBlockSize, editQueueSize), m_queue(new uring_queue(queueDepth)), m_direct(direct)
+{
+}
+
+uring::~uring()
+{
+}
+
+size_t uring::batchSize() const
+{
+    // Every block takes two queue entries per round
+    return m_queue->entries() / 2;
+}
+
+mempage uring::get(const nodeid_t &id)
+{
+    blockidlist_t ids(1, id);
+    mempagelist_t pages(1);
+    read_batch(ids, 0, 1, &pages);
+    return pages[0];
+}
+
+getallfuture_t uring::get_all_async(const blockidlist_t &ids)
+{
+    std::promise<mempagelist_t> promise;
+    try
+    {
+        mempagelist_t pages(ids.size());
+        for (size_t i = 0; i < ids.size(); i += batchSize())
+            read_batch(ids, i, std::min(i + batchSize(), ids.size()), &pages);
+        promise.set_value(pages);
+    }
+    catch (...)
+    {
+        promise.set_exception(std::current_exception());
+    }
+    return promise.get_future();
+}
+
+/**
+ * Read a range of blocks in two rounds
+ *
+ * First, all files are opened and stat'ed, then all of them are read and
+ * closed.
+ */
+void uring::read_batch(const blockidlist_t &ids, size_t begin, size_t end, mempagelist_t *pages)
+{
+    std::lock_guard<std::mutex> lock(m_queueMutex);
+
+    size_t n = end - begin;
+    std::vector<std::string> paths;
+    std::vector<struct statx> stats(n);
+    std::vector<int> fds(n);
+    std::vector<int> results(2 * n);
+    paths.reserve(n);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        paths.push_back(m_pathPrefix + to_string(ids[begin + i]));
+
+        io_uring_sqe *sqe = m_queue->next(2 * i);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)paths[i].c_str();
+        sqe->open_flags = O_RDONLY | (m_direct ? O_DIRECT : 0);
+
+        sqe = m_queue->next(2 * i + 1);
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)paths[i].c_str();
+        sqe->len = STATX_SIZE;
+        sqe->off = (uint64_t)&stats[i];
+    }
+
+    m_queue->run(&results);
+
+    int error = 0;
+    size_t failed = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        fds[i] = results[2 * i];
+        if (!error && (results[2 * i] < 0 || results[2 * i + 1] < 0))
+        {
+            error = results[2 * i] < 0 ? -results[2 * i] : -results[2 * i + 1];
+            failed = i;
+        }
+    }
+
+    if (error)
+    {
+        for (size_t i = 0; i < n; i++)
+            if (fds[i] >= 0) close(fds[i]);
+
+        if (error == ENOENT) throw block_not_found(ids[begin + failed]);
+        throw be_error((std::string("Error opening block ") + paths[failed] + ": " + strerror(error)).c_str());
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        size_t size = stats[i].stx_size;
+        size_t length = size;
+        if (m_direct)
+        {
+            (*pages)[begin + i] = mempage::aligned(size, DIRECT_ALIGNMENT);
+            length = (size + DIRECT_ALIGNMENT - 1) / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+        }
+        else
+            (*pages)[begin + i] = mempage(size);
+
+        io_uring_sqe *sqe = m_queue->next(2 * i);
+        sqe->opcode = IORING_OP_READ;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->fd = fds[i];
+        sqe->addr = (uint64_t)(*pages)[begin + i].ptr();
+        sqe->len = length;
+        sqe->off = 0;
+
+        sqe = m_queue->next(2 * i + 1);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = fds[i];
+    }
+
+    m_queue->run(&results);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        // A failed read cancels the linked close
+        if (results[2 * i + 1] == -ECANCELED) close(fds[i]);
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (results[2 * i] < 0)
+            throw be_error((std::string("Error reading block ") + paths[i] + ": " + strerror(-results[2 * i])).c_str());
+        if ((size_t)results[2 * i] != (*pages)[begin + i].size())
+            throw be_error((std::string("Short read on block ") + paths[i]).c_str());
+    }
+}
+
+void uring::put_all(putblocklist_t &blocklist)
+{
+    if (!m_maxBlockSize)
+        throw be_error("Can't put; engine is read-only");
+
+    for (size_t i = 0; i < blocklist.size(); i += batchSize())
+        write_batch(blocklist, i, std::min(i + batchSize(), blocklist.size()));
+}
+
+/**
+ * Write a range of blocks in two rounds
+ *
+ * First, all files are created, then all of them are written and closed.
+ * Failures are reported per block.
+ */
+void uring::write_batch(putblocklist_t &blocklist, size_t begin, size_t end)
+{
+    std::lock_guard<std::mutex> lock(m_queueMutex);
+
+    size_t n = end - begin;
+    std::vector<std::string> paths;
+    std::vector<int> results(2 * n);
+    paths.reserve(n);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        paths.push_back(m_pathPrefix + to_string(blocklist[begin + i].id));
+
+        io_uring_sqe *sqe = m_queue->next(2 * i);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)paths[i].c_str();
+        sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+        sqe->len = 0644;
+    }
+
+    m_queue->run(&results);
+
+    std::vector<int> fds(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        putblock_t &block = blocklist[begin + i];
+        fds[i] = results[2 * i];
+        if (fds[i] < 0)
+        {
+            block.success = false;
+            block.failureReason = strerror(-fds[i]);
+            continue;
+        }
+
+        io_uring_sqe *sqe = m_queue->next(2 * i);
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->fd = fds[i];
+        sqe->addr = (uint64_t)block.mem.ptr();
+        sqe->len = block.mem.size();
+        sqe->off = 0;
+
+        sqe = m_queue->next(2 * i + 1);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = fds[i];
+    }
+
+    m_queue->run(&results);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (fds[i] < 0) continue;
+
+        putblock_t &block = blocklist[begin + i];
+        if (results[2 * i + 1] == -ECANCELED) close(fds[i]);
+
+        block.success = results[2 * i] >= 0 && (size_t)results[2 * i] == block.mem.size();
+        if (results[2 * i] < 0)
+            block.failureReason = strerror(-results[2 * i]);
+        else if (!block.success)
+            block.failureReason = "Short write";
+    }
+}
+
+void uring::del_all(delblocklist_t &ids)
+{
+    if (!m_maxBlockSize)
+        throw be_error("Can't delete; engine is read-only");
+
+    for (size_t i = 0; i < ids.size(); i += batchSize())
+        del_batch(ids, i, std::min(i + batchSize(), ids.size()));
+}
+
+void uring::del_batch(delblocklist_t &ids, size_t begin, size_t end)
+{
+    std::lock_guard<std::mutex> lock(m_queueMutex);
+
+    size_t n = end - begin;
+    std::vector<std::string> paths;
+    std::vector<int> results(n);
+    paths.reserve(n);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        paths.push_back(m_pathPrefix + to_string(ids[begin + i].id));
+
+        io_uring_sqe *sqe = m_queue->next(i);
+        sqe->opcode = IORING_OP_UNLINKAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)paths[i].c_str();
+    }
+
+    m_queue->run(&results);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        // Like the disk engine, a block that's already gone counts as deleted
+        ids[begin + i].success = results[i] == 0 || results[i] == -ENOENT;
+        if (!ids[begin + i].success)
+            ids[begin + i].failureReason = strerror(-results[i]);
+    }
+}
+
+be_ptr create_uring_engine(const std::string &location, size_t block_size, size_t queue_size, const util::options_t &options)
+{
+    return boost::make_shared<uring>(location, block_size, queue_size,
+                                     options.get<unsigned>("depth", 256),
+                                     options.get<int>("direct", 0) != 0);
+}
+
+void register_uring_engine()
+{
+    util::register_be_factory("uring", &create_uring_engine);
+}
+
+}}
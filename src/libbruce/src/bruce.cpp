@@ -1,4 +1,6 @@
 #include <libbruce/bruce.h>
+#include "node_cache.h"
+#include "serializing.h"
 
 #include <algorithm>
 
@@ -37,4 +39,36 @@ bool finish_mutation(be::be &blockEngine, mutation &mut, bool success)
     }
 }
 
+size_t warm_tree(be::be &blockEngine, const nodeid_t &root, unsigned levels, const tree_functions &fns)
+{
+    bool shareNodes = blockEngine.contentAddressed() && NodeCache::instance().enabled();
+    size_t loaded = 0;
+
+    be::blockidlist_t level(1, root);
+    for (unsigned depth = 0; depth < levels && !level.empty(); depth++)
+    {
+        be::mempagelist_t pages = blockEngine.get_all_async(level).get();
+        loaded += pages.size();
+
+        be::blockidlist_t next;
+        for (size_t i = 0; i < pages.size(); i++)
+        {
+            const mempage &page = pages[i];
+            if (page.size() < sizeof(flags_t) || PageNodeType(page) != TYPE_INTERNAL)
+                continue;
+
+            node_ptr node = ParseNode(page, fns);
+            if (shareNodes)
+                NodeCache::instance().put(level[i], fns, node, page);
+
+            const InternalNode *internal = static_cast<const InternalNode*>(node.get());
+            for (branchlist_t::const_iterator it = internal->branches.begin(); it != internal->branches.end(); ++it)
+                next.push_back(it->nodeID);
+        }
+        level.swap(next);
+    }
+
+    return loaded;
+}
+
 }
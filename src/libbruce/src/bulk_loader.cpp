@@ -0,0 +1,513 @@
+#include <libbruce/bulk_loader.h>
+
+#include "bulk_loader.h"
+#include "external_sort.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+
+namespace libbruce {
+
+namespace {
+
+// Put batches that may be in flight at the same time
+const size_t MAX_IN_FLIGHT = 2;
+
+memslice copy(const memslice &slice, mempool &pool)
+{
+    memslice ret = pool.alloc(slice.size());
+    memcpy(ret.ptr(), slice.ptr(), slice.size());
+    return ret;
+}
+
+mempage copyPage(const memslice &slice)
+{
+    mempage ret(slice.size());
+    memcpy(ret.ptr(), slice.ptr(), slice.size());
+    return ret;
+}
+
+/**
+ * Spilled overflow values are a sequence of [uint32 size][value]
+ */
+void writeValue(FILE *f, const memslice &value)
+{
+    uint32_t size = value.size();
+    if (fwrite(&size, sizeof(size), 1, f) != 1
+        || (size && fwrite(value.ptr(), size, 1, f) != 1))
+        throw std::runtime_error("Error writing overflow values");
+}
+
+memslice readValue(FILE *f, mempool &pool)
+{
+    uint32_t size;
+    if (fread(&size, sizeof(size), 1, f) != 1)
+        throw std::runtime_error("Error reading overflow values");
+
+    memslice ret = pool.alloc(size);
+    if (size && fread(ret.ptr(), size, 1, f) != 1)
+        throw std::runtime_error("Error reading overflow values");
+    return ret;
+}
+
+}
+
+bulk_loader_impl::bulk_loader_impl(be::be &be, const tree_functions &fns, const bulk_options &options)
+    : m_be(be), m_fns(fns), m_options(options), m_overflowSize(0), m_overflowFile(NULL),
+      m_mutation(maybe_nodeid())
+{
+    if (!(options.fill > 0 && options.fill <= 1))
+        throw std::runtime_error("Bulk load fill factor must be in (0, 1]");
+
+    m_leafTarget = options.fill * be.maxBlockSize();
+    m_internalTarget = options.fill * (be.maxBlockSize() - be.editQueueSize());
+}
+
+bulk_loader_impl::~bulk_loader_impl()
+{
+    if (m_overflowFile)
+        fclose(m_overflowFile);
+}
+
+void bulk_loader_impl::validateKVSize(const memslice &key, const memslice &value)
+{
+    uint32_t maxSize = m_be.maxBlockSize();
+
+    if (key.size() + value.size() > maxSize)
+        throw std::runtime_error("Key/value too large to insert, max size: " +
+                                 boost::lexical_cast<std::string>(maxSize));
+}
+
+void bulk_loader_impl::add(const memslice &key, const memslice &value)
+{
+    validateKVSize(key, value);
+
+    int cmp = m_pairs.empty() ? 1 : m_fns.keyCompare(key, m_pairs.back().first);
+    if (cmp < 0)
+        throw std::runtime_error("Bulk load input is not sorted by key");
+
+    if (!m_overflow.empty())
+    {
+        // The leaf is full, so it's done as soon as the last key is
+        if (cmp == 0)
+        {
+            addOverflow(value);
+            return;
+        }
+        emitLeaf(&key);
+    }
+
+    kv_pair pair(copy(key, m_mempool), copy(value, m_mempool));
+    track(pair);
+
+    if (m_pairs.size() && leafSize() > m_leafTarget)
+    {
+        if (cmp == 0)
+        {
+            startOverflow(pair.second);
+            return;
+        }
+
+        emitLeaf(&key);
+        pair = kv_pair(copy(key, m_mempool), copy(value, m_mempool));
+        track(pair);
+    }
+
+    m_pairs.push_back(pair);
+}
+
+void bulk_loader_impl::track(const kv_pair &pair)
+{
+    m_keys.addKey(pair.first);
+    m_values.add(pair.second.size());
+}
+
+/**
+ * Size of the leaf with the pairs tracked so far (as LeafNodeSize has it)
+ */
+uint32_t bulk_loader_impl::leafSize() const
+{
+    return sizeof(flags_t) + sizeof(keycount_t) + sizeof(itemcount_t) + sizeof(nodeid_t)
+        + m_keys.size() + m_values.size();
+}
+
+/**
+ * Size of an internal node (as InternalNodeSize has it, without edits)
+ */
+uint32_t bulk_loader_impl::internalSize(const level &l) const
+{
+    return sizeof(flags_t) + 2 * sizeof(keycount_t)
+        + l.node->branchCount() * (sizeof(nodeid_t) + sizeof(itemcount_t))
+        + l.keys.size();
+}
+
+/**
+ * Move the values of the last key to the overflow chain, but for the first
+ *
+ * Leaves with an overflow chain have just one pair with the last key, which
+ * is the same thing a split does.
+ */
+void bulk_loader_impl::startOverflow(const memslice &value)
+{
+    pairlist_t::iterator first = m_pairs.end() - 1;
+    while (first != m_pairs.begin() && m_fns.keyCompare((first - 1)->first, first->first) == 0)
+        --first;
+
+    for (pairlist_t::const_iterator it = first + 1; it != m_pairs.end(); ++it)
+    {
+        m_overflow.push_back(it->second);
+        m_overflowSize += it->second.size() + sizeof(stored_value);
+    }
+    m_pairs.erase(first + 1, m_pairs.end());
+
+    m_overflow.push_back(value);
+    m_overflowSize += value.size() + sizeof(stored_value);
+}
+
+void bulk_loader_impl::addOverflow(const memslice &value)
+{
+    m_overflow.push_back(copy(value, m_overflowPool));
+    m_overflowSize += value.size() + sizeof(stored_value);
+
+    if (m_overflowSize > m_options.overflowMemory)
+        spillOverflow();
+}
+
+/**
+ * Write the full nodes of the overflow chain to the temporary file, keeping the last one to add to
+ */
+void bulk_loader_impl::spillOverflow()
+{
+    if (!m_overflowFile)
+        m_overflowFile = createTempFile(m_options.tempDir, "bruce-overflow");
+
+    valuelist_t::const_iterator begin = m_overflow.begin();
+    while (true)
+    {
+        size_t count = overflowNodeSize(begin, m_overflow.end());
+        if (begin + count == m_overflow.end())
+            break;
+
+        m_spilled.push_back(spilled_node(ftello(m_overflowFile), count));
+        for (size_t i = 0; i < count; i++, ++begin)
+            writeValue(m_overflowFile, *begin);
+    }
+
+    // Copy the rest out of the pool, so that its memory can be used again
+    size_t size = 0;
+    for (valuelist_t::const_iterator it = begin; it != m_overflow.end(); ++it)
+        size += it->size();
+
+    mempage rest(size);
+    valuelist_t values;
+    size_t offset = 0;
+    for (valuelist_t::const_iterator it = begin; it != m_overflow.end(); ++it)
+    {
+        if (it->size())
+            memcpy(rest.at<uint8_t>(offset), it->ptr(), it->size());
+        values.push_back(rest.slice(offset, it->size()));
+        offset += it->size();
+    }
+
+    m_overflowPool.clear();
+    m_overflowPool.retain(rest);
+    m_overflow.swap(values);
+    m_overflowSize = size + m_overflow.size() * sizeof(stored_value);
+}
+
+void bulk_loader_impl::closeOverflow()
+{
+    if (m_overflowFile)
+        fclose(m_overflowFile);
+    m_overflowFile = NULL;
+    m_spilled.clear();
+
+    m_overflow.clear();
+    m_overflowSize = 0;
+    m_overflowPool.clear();
+}
+
+/**
+ * Number of values from begin that go into the first node of an overflow chain
+ *
+ * Only as many values as could fit in a block are looked at, so that a long
+ * chain is split in linear time.
+ */
+size_t bulk_loader_impl::overflowNodeSize(valuelist_t::const_iterator begin, valuelist_t::const_iterator end) const
+{
+    uint32_t blockSize = m_be.maxBlockSize();
+
+    valuelist_t::const_iterator window = begin;
+    size_t bytes = 0;
+    while (window != end && bytes <= blockSize)
+        bytes += (window++)->size();
+
+    OverflowNodeSize size(boost::make_shared<OverflowNode>(begin, window), blockSize);
+    if (!size.shouldSplit())
+        return window - begin;
+
+    // At least one value per node, or we'd never get to the end
+    return std::max(size.splitIndex(), (keycount_t)1);
+}
+
+/**
+ * Serialize the leaf, and start a new one for the given key (if any)
+ */
+void bulk_loader_impl::emitLeaf(const memslice *nextKey)
+{
+    memslice lastKey = m_pairs.back().first;
+
+    leafnode_ptr leaf = boost::make_shared<LeafNode>(&m_pairs, m_fns);
+    if (!m_overflow.empty())
+        leaf->overflow = emitOverflow();
+
+    addBranch(0, m_leafMinKey.all(), SerializeNode(leaf), leaf->itemCount());
+
+    if (nextKey)
+        m_leafMinKey = copyPage(m_fns.keySeparator ? m_fns.keySeparator(lastKey, *nextKey, m_mempool) : *nextKey);
+
+    m_pairs.clear();
+    m_keys = ColumnSize();
+    m_values = ColumnSize();
+    closeOverflow();
+    m_mempool.clear();
+}
+
+/**
+ * Write the overflow chain, back to front, as every node needs the ID of the next
+ */
+overflow_t bulk_loader_impl::emitOverflow()
+{
+    // The values still in memory are the end of the chain
+    std::vector<overflownode_ptr> chain;
+    for (valuelist_t::const_iterator it = m_overflow.begin(); it != m_overflow.end(); )
+    {
+        valuelist_t::const_iterator end = it + overflowNodeSize(it, m_overflow.end());
+        chain.push_back(boost::make_shared<OverflowNode>(it, end));
+        it = end;
+    }
+    overflow_t next = emitChain(chain, overflow_t());
+
+    // Then the spilled nodes, a batch at a time
+    size_t batchSize = std::max(m_options.batchSize, (size_t)1);
+    std::vector<spilled_node>::const_iterator end = m_spilled.end();
+    while (end != m_spilled.begin())
+    {
+        std::vector<spilled_node>::const_iterator begin = end - std::min(batchSize, (size_t)(end - m_spilled.begin()));
+        if (fseeko(m_overflowFile, begin->offset, SEEK_SET) != 0)
+            throw std::runtime_error("Error reading overflow values");
+
+        m_overflowPool.clear();
+        chain.clear();
+        for (std::vector<spilled_node>::const_iterator it = begin; it != end; ++it)
+        {
+            chain.push_back(boost::make_shared<OverflowNode>(it->count));
+            for (size_t i = 0; i < it->count; i++)
+                chain.back()->append(readValue(m_overflowFile, m_overflowPool));
+        }
+        next = emitChain(chain, next);
+        end = begin;
+    }
+
+    return next;
+}
+
+/**
+ * Write a piece of an overflow chain, back to front, followed by the given next node
+ *
+ * The ID of a content-addressed node covers the ID of the next one, so those
+ * can only be hashed one at a time. Other engines don't look at the contents,
+ * and give the IDs of the whole piece at once.
+ */
+overflow_t bulk_loader_impl::emitChain(std::vector<overflownode_ptr> &chain, const overflow_t &next)
+{
+    be::blockidlist_t ids;
+    if (!m_be.contentAddressed())
+    {
+        be::mempagelist_t pages;
+        pages.reserve(chain.size());
+        for (std::vector<overflownode_ptr>::const_iterator it = chain.begin(); it != chain.end(); ++it)
+            pages.push_back(SerializeNode(*it));
+        ids = m_be.ids(pages);
+    }
+
+    overflow_t ret = next;
+    for (size_t i = chain.size(); i-- > 0; )
+    {
+        chain[i]->next.count = ret.count;
+        chain[i]->next.nodeID = ret.nodeID;
+
+        mempage page = SerializeNode(chain[i]);
+        ret.nodeID = ids.empty() ? m_be.id(page) : ids[i];
+        ret.count = chain[i]->itemCount();
+        put(ret.nodeID, page);
+    }
+    return ret;
+}
+
+/**
+ * Add a branch to the node being filled on level h, emitting that node first if it's full
+ */
+void bulk_loader_impl::addBranch(size_t h, const memslice &minKey, const mempage &page, itemcount_t itemCount)
+{
+    if (m_levels.size() == h)
+        m_levels.push_back(boost::make_shared<level>());
+    level &l = *m_levels[h];
+
+    memslice key = copy(minKey, l.keyPool);
+    if (l.node->branchCount())
+    {
+        l.keys.addKey(key);
+        if (internalSize(l) + sizeof(nodeid_t) + sizeof(itemcount_t) > m_internalTarget && l.node->branchCount() > 1)
+        {
+            emitInternal(h);
+            key = copy(minKey, l.keyPool);
+        }
+    }
+
+    l.node->append(node_branch(key, nodeid_t(), itemCount));
+    m_pending.push_back(pending_page(page, h, l.node->branchCount() - 1));
+
+    if (m_pending.size() >= m_options.batchSize)
+        flushPending();
+}
+
+/**
+ * Serialize the node on level h, and add it to the level above
+ */
+void bulk_loader_impl::emitInternal(size_t h)
+{
+    // The node needs the IDs of its children
+    flushPending();
+
+    level &l = *m_levels[h];
+    addBranch(h + 1, l.node->minKey(), SerializeNode(l.node), l.node->itemCount());
+
+    l.node = boost::make_shared<InternalNode>();
+    l.keys = ColumnSize();
+    l.keyPool.clear();
+}
+
+/**
+ * Get the IDs of the serialized nodes, fill them into their branches and start writing them
+ */
+void bulk_loader_impl::flushPending()
+{
+    if (m_pending.empty())
+        return;
+
+    be::mempagelist_t pages;
+    pages.reserve(m_pending.size());
+    for (std::vector<pending_page>::const_iterator it = m_pending.begin(); it != m_pending.end(); ++it)
+        pages.push_back(it->page);
+
+    be::blockidlist_t ids = m_be.ids(pages);
+    for (size_t i = 0; i < m_pending.size(); i++)
+    {
+        m_levels[m_pending[i].level]->node->branch(m_pending[i].index).nodeID = ids[i];
+        put(ids[i], pages[i]);
+    }
+    m_pending.clear();
+}
+
+void bulk_loader_impl::put(const nodeid_t &id, const mempage &page)
+{
+    m_outgoing.push_back(be::putblock_t(id, page));
+    if (m_outgoing.size() >= m_options.batchSize)
+        sendBatch();
+}
+
+/**
+ * Hand the outgoing blocks to the block engine, and wait only if too many batches are in flight
+ */
+void bulk_loader_impl::sendBatch()
+{
+    if (m_outgoing.empty())
+        return;
+
+    m_inFlight.push_back(be::putblocklist_t());
+    m_inFlight.back().swap(m_outgoing);
+    m_futures.push_back(m_be.put_all_async(m_inFlight.back()));
+
+    while (m_futures.size() > MAX_IN_FLIGHT)
+        finishOldest();
+}
+
+void bulk_loader_impl::finishOldest()
+{
+    bool failed = false;
+    try
+    {
+        m_futures.front().get();
+    }
+    catch (std::exception &e)
+    {
+        m_mutation.fail(e.what());
+    }
+
+    const be::putblocklist_t &batch = m_inFlight.front();
+    for (be::putblocklist_t::const_iterator it = batch.begin(); it != batch.end(); ++it)
+    {
+        if (it->success)
+            m_mutation.addCreated(it->id);
+        else
+            failed = true;
+    }
+    if (failed)
+        m_mutation.fail("Failed to write some blocks to the block engine");
+
+    m_futures.pop_front();
+    m_inFlight.pop_front();
+}
+
+mutation bulk_loader_impl::finish()
+{
+    // Nothing added, so there is no tree
+    if (m_pairs.empty())
+        return m_mutation;
+
+    emitLeaf(NULL);
+
+    // Close the levels until one of them has a single node
+    for (size_t h = 0; h + 1 < m_levels.size() || m_levels[h]->node->branchCount() > 1; h++)
+        emitInternal(h);
+
+    flushPending();
+    m_mutation.setRoot(m_levels.back()->node->branch(0).nodeID);
+
+    sendBatch();
+    while (!m_futures.empty())
+        finishOldest();
+
+    return m_mutation;
+}
+
+//----------------------------------------------------------------------
+
+bulk_loader_unsafe::bulk_loader_unsafe(be::be &be, const tree_functions &fns, const bulk_options &options)
+    : m_impl(new bulk_loader_impl(be, fns, options))
+{
+    if (!options.sorted)
+        m_sort.reset(new external_sort(fns, options.sortMemory, options.tempDir));
+}
+
+void bulk_loader_unsafe::add(const memslice &key, const memslice &value)
+{
+    if (m_sort)
+        m_sort->add(key, value);
+    else
+        m_impl->add(key, value);
+}
+
+mutation bulk_loader_unsafe::finish()
+{
+    if (m_sort)
+        m_sort->finish(boost::bind(&bulk_loader_impl::add, m_impl.get(), _1, _2));
+
+    return m_impl->finish();
+}
+
+}
@@ -0,0 +1,121 @@
+#pragma once
+#ifndef BRUCE_BULK_LOADER_IMPL_H
+#define BRUCE_BULK_LOADER_IMPL_H
+
+#include <cstdio>
+#include <list>
+#include <sys/types.h>
+#include <boost/noncopyable.hpp>
+
+#include <libbruce/bulk_loader.h>
+#include "internal_node.h"
+#include "leaf_node.h"
+#include "overflow_node.h"
+#include "serializing.h"
+
+namespace libbruce {
+
+/**
+ * Builds a tree bottom-up from pairs in key order
+ *
+ * Only the rightmost node of every level is being filled at any time; when
+ * the next item doesn't fit in it, the node is serialized and becomes a
+ * branch of the node above it. The pages wait for their IDs in a batch,
+ * which is hashed before any node that refers to them is serialized, and
+ * then put to the block engine without waiting for the result.
+ *
+ * The values of a key that doesn't fit in its leaf go into an overflow chain.
+ * Once they take more memory than allowed, the nodes of the chain that are
+ * full are spilled to a temporary file, and read back from it back to front
+ * when the key changes, as every node needs the ID of the next.
+ */
+class bulk_loader_impl : private boost::noncopyable
+{
+public:
+    bulk_loader_impl(be::be &be, const tree_functions &fns, const bulk_options &options);
+    ~bulk_loader_impl();
+
+    void add(const memslice &key, const memslice &value);
+    mutation finish();
+private:
+    // The node being filled on one of the internal levels
+    struct level
+    {
+        level() : node(boost::make_shared<InternalNode>()) { }
+
+        internalnode_ptr node;
+        ColumnSize keys; // All keys but the first one are stored
+        mempool keyPool; // Holds the keys of the branches
+    };
+    typedef boost::shared_ptr<level> level_ptr;
+
+    // Overflow nodes that were spilled, front to back
+    struct spilled_node
+    {
+        spilled_node(off_t offset, size_t count) : offset(offset), count(count) { }
+
+        off_t offset;
+        size_t count;
+    };
+
+    // A serialized node, and the branch its ID goes into
+    struct pending_page
+    {
+        pending_page(const mempage &page, size_t level, keycount_t index) : page(page), level(level), index(index) { }
+
+        mempage page;
+        size_t level;
+        keycount_t index;
+    };
+
+    be::be &m_be;
+    tree_functions m_fns;
+    bulk_options m_options;
+    uint32_t m_leafTarget;
+    uint32_t m_internalTarget;
+
+    // The leaf being filled
+    pairlist_t m_pairs;
+    ColumnSize m_keys;
+    ColumnSize m_values;
+    valuelist_t m_overflow; // Values of the last key that didn't fit anymore, after the spilled ones
+    size_t m_overflowSize;
+    mempool m_overflowPool; // Holds the overflow values added after the chain started
+    FILE *m_overflowFile;
+    std::vector<spilled_node> m_spilled;
+    mempool m_mempool;      // Holds the pairs of the leaf
+    mempage m_leafMinKey;   // Key of the branch that will refer to the leaf
+
+    std::vector<level_ptr> m_levels; // Lowest first
+
+    std::vector<pending_page> m_pending;
+    be::putblocklist_t m_outgoing;
+    std::list<be::putblocklist_t> m_inFlight;
+    std::list<be::putfuture_t> m_futures;
+    mutation m_mutation;
+
+    void validateKVSize(const memslice &key, const memslice &value);
+    void track(const kv_pair &pair);
+    uint32_t leafSize() const;
+    uint32_t internalSize(const level &l) const;
+    void startOverflow(const memslice &value);
+    void addOverflow(const memslice &value);
+    void spillOverflow();
+    void closeOverflow();
+    size_t overflowNodeSize(valuelist_t::const_iterator begin, valuelist_t::const_iterator end) const;
+
+    void emitLeaf(const memslice *nextKey);
+    overflow_t emitOverflow();
+    overflow_t emitChain(std::vector<overflownode_ptr> &chain, const overflow_t &next);
+    void addBranch(size_t h, const memslice &minKey, const mempage &page, itemcount_t itemCount);
+    void emitInternal(size_t h);
+
+    void flushPending();
+    void put(const nodeid_t &id, const mempage &page);
+    void sendBatch();
+    void finishOldest();
+};
+
+}
+
+#endif
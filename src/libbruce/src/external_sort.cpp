@@ -0,0 +1,226 @@
+#include "external_sort.h"
+
+#include <algorithm>
+#include <cstring>
+#include <queue>
+#include <stdexcept>
+#include <stdlib.h>
+#include <unistd.h>
+#include <boost/bind.hpp>
+
+namespace libbruce {
+
+namespace {
+
+// Runs merged at once; if there are more, the oldest ones are merged into a
+// bigger run first, so we don't run out of file handles
+const size_t MAX_MERGE_RUNS = 64;
+
+struct KeyBefore
+{
+    KeyBefore(const tree_functions &fns) : fns(fns) { }
+
+    bool operator()(const std::pair<memslice, memslice> &a, const std::pair<memslice, memslice> &b) const
+    {
+        return fns.keyCompare(a.first, b.first) < 0;
+    }
+
+    tree_functions fns;
+};
+
+memslice copy(const memslice &slice, mempool &pool)
+{
+    memslice ret = pool.alloc(slice.size());
+    memcpy(ret.ptr(), slice.ptr(), slice.size());
+    return ret;
+}
+
+/**
+ * Runs are a sequence of [uint32 key size][uint32 value size][key][value]
+ */
+void writeRecord(FILE *f, const memslice &key, const memslice &value)
+{
+    uint32_t sizes[2] = { (uint32_t)key.size(), (uint32_t)value.size() };
+    if (fwrite(sizes, sizeof(sizes), 1, f) != 1
+        || (key.size() && fwrite(key.ptr(), key.size(), 1, f) != 1)
+        || (value.size() && fwrite(value.ptr(), value.size(), 1, f) != 1))
+        throw std::runtime_error("Error writing sort run");
+}
+
+/**
+ * Reads the pairs of a run back, one at a time
+ */
+struct run_reader
+{
+    run_reader(FILE *f, size_t index)
+        : f(f), index(index)
+    {
+        if (fflush(f) != 0 || fseek(f, 0, SEEK_SET) != 0)
+            throw std::runtime_error("Error rewinding sort run");
+    }
+
+    bool next()
+    {
+        uint32_t sizes[2];
+        if (fread(sizes, sizeof(sizes), 1, f) != 1)
+        {
+            if (ferror(f)) throw std::runtime_error("Error reading sort run");
+            return false;
+        }
+
+        buffer.resize(sizes[0] + sizes[1]);
+        if (!buffer.empty() && fread(&buffer[0], buffer.size(), 1, f) != 1)
+            throw std::runtime_error("Error reading sort run");
+
+        key = memslice(buffer.data(), sizes[0]);
+        value = memslice(buffer.data() + sizes[0], sizes[1]);
+        return true;
+    }
+
+    FILE *f;
+    size_t index;
+    std::vector<uint8_t> buffer;
+    memslice key;
+    memslice value;
+};
+
+/**
+ * Heap order: the smallest key comes out first, and for equal keys, the oldest run
+ */
+struct ReaderAfter
+{
+    ReaderAfter(const tree_functions &fns) : fns(fns) { }
+
+    bool operator()(const run_reader *a, const run_reader *b) const
+    {
+        int c = fns.keyCompare(a->key, b->key);
+        return c > 0 || (c == 0 && a->index > b->index);
+    }
+
+    tree_functions fns;
+};
+
+}
+
+FILE *createTempFile(const std::string &directory, const std::string &prefix)
+{
+    std::string path = directory + "/" + prefix + ".XXXXXX";
+    std::vector<char> name(path.begin(), path.end());
+    name.push_back('\0');
+
+    int fd = mkstemp(&name[0]);
+    if (fd == -1)
+        throw std::runtime_error("Error creating temporary file in " + directory);
+    unlink(&name[0]);
+
+    FILE *f = fdopen(fd, "w+b");
+    if (!f)
+    {
+        close(fd);
+        throw std::runtime_error("Error opening temporary file");
+    }
+    return f;
+}
+
+external_sort::external_sort(const tree_functions &fns, size_t memory, const std::string &tempDir)
+    : m_fns(fns), m_memory(memory), m_tempDir(tempDir), m_size(0)
+{
+}
+
+external_sort::~external_sort()
+{
+    for (std::vector<FILE*>::const_iterator it = m_runs.begin(); it != m_runs.end(); ++it)
+        fclose(*it);
+}
+
+void external_sort::add(const memslice &key, const memslice &value)
+{
+    m_pairs.push_back(pair_t(copy(key, m_mempool), copy(value, m_mempool)));
+    m_size += key.size() + value.size() + sizeof(pair_t);
+
+    if (m_size >= m_memory)
+        spill();
+}
+
+void external_sort::sortPairs()
+{
+    std::stable_sort(m_pairs.begin(), m_pairs.end(), KeyBefore(m_fns));
+}
+
+void external_sort::spill()
+{
+    sortPairs();
+
+    FILE *run = createRun();
+    for (std::vector<pair_t>::const_iterator it = m_pairs.begin(); it != m_pairs.end(); ++it)
+        writeRecord(run, it->first, it->second);
+
+    m_pairs.clear();
+    m_mempool.clear();
+    m_size = 0;
+}
+
+FILE *external_sort::createRun()
+{
+    FILE *f = createTempFile(m_tempDir, "bruce-sort");
+    m_runs.push_back(f);
+    return f;
+}
+
+void external_sort::finish(const sink_t &sink)
+{
+    if (m_runs.empty())
+    {
+        // Everything fit in memory
+        sortPairs();
+        for (std::vector<pair_t>::const_iterator it = m_pairs.begin(); it != m_pairs.end(); ++it)
+            sink(it->first, it->second);
+        return;
+    }
+
+    if (!m_pairs.empty())
+        spill();
+
+    while (m_runs.size() > MAX_MERGE_RUNS)
+    {
+        // The merged run takes the place of the runs it came from
+        std::vector<FILE*> oldest(m_runs.begin(), m_runs.begin() + MAX_MERGE_RUNS);
+        FILE *merged = createRun(); // At the back until it's done, so it's closed if this throws
+        merge(oldest, boost::bind(&writeRecord, merged, _1, _2));
+        m_runs.pop_back();
+
+        for (std::vector<FILE*>::const_iterator it = oldest.begin(); it != oldest.end(); ++it)
+            fclose(*it);
+        m_runs.erase(m_runs.begin(), m_runs.begin() + MAX_MERGE_RUNS);
+        m_runs.insert(m_runs.begin(), merged);
+    }
+
+    merge(m_runs, sink);
+}
+
+void external_sort::merge(const std::vector<FILE*> &runs, const sink_t &sink)
+{
+    std::vector<run_reader> readers;
+    readers.reserve(runs.size()); // The heap points into this
+    std::priority_queue<run_reader*, std::vector<run_reader*>, ReaderAfter> heap((ReaderAfter(m_fns)));
+
+    for (size_t i = 0; i < runs.size(); i++)
+    {
+        readers.push_back(run_reader(runs[i], i));
+        if (readers.back().next())
+            heap.push(&readers.back());
+    }
+
+    while (!heap.empty())
+    {
+        run_reader *reader = heap.top();
+        heap.pop();
+
+        sink(reader->key, reader->value);
+
+        if (reader->next())
+            heap.push(reader);
+    }
+}
+
+}
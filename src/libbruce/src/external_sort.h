@@ -0,0 +1,67 @@
+#pragma once
+#ifndef BRUCE_EXTERNAL_SORT_H
+#define BRUCE_EXTERNAL_SORT_H
+
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+#include <boost/noncopyable.hpp>
+
+#include <libbruce/mempool.h>
+#include <libbruce/types.h>
+
+namespace libbruce {
+
+/**
+ * Create an unlinked temporary file in the given directory, to write and read back
+ */
+FILE *createTempFile(const std::string &directory, const std::string &prefix);
+
+/**
+ * Sorts more pairs by key than fit in memory
+ *
+ * Pairs are collected until they take up the memory budget, then sorted and
+ * written to a temporary file as a run. At the end, the runs are merged and
+ * the pairs are passed on in order. Pairs with the same key keep the order
+ * they were added in.
+ *
+ * The run files are unlinked as soon as they're created, so nothing is left
+ * behind if the process dies.
+ */
+class external_sort : private boost::noncopyable
+{
+public:
+    typedef std::function<void(const memslice&, const memslice&)> sink_t;
+
+    external_sort(const tree_functions &fns, size_t memory, const std::string &tempDir);
+    ~external_sort();
+
+    void add(const memslice &key, const memslice &value);
+
+    /**
+     * Pass all pairs to the sink, in order
+     */
+    void finish(const sink_t &sink);
+private:
+    typedef std::pair<memslice, memslice> pair_t;
+
+    tree_functions m_fns;
+    size_t m_memory;
+    std::string m_tempDir;
+
+    mempool m_mempool;
+    std::vector<pair_t> m_pairs;
+    size_t m_size;
+
+    std::vector<FILE*> m_runs; // In the order they were written
+
+    void sortPairs();
+    void spill();
+    FILE *createRun();
+    void merge(const std::vector<FILE*> &runs, const sink_t &sink);
+};
+
+}
+
+#endif
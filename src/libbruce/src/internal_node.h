@@ -3,7 +3,9 @@
 #define INTERNALNODE_H
 
 #include "nodes.h"
+#include "pages.h"
 #include "priv_types.h"
+#include <libbruce/mempage.h>
 
 namespace libbruce {
 
@@ -33,6 +35,9 @@ struct InternalNode : public Node
 
     branchlist_t branches;
     editlist_t editQueue;
+
+    // The column the keys were read from, which holds them if they were decoded
+    Column keyData;
 };
 
 /**
@@ -4,35 +4,64 @@
 namespace libbruce {
 
 LeafNode::LeafNode(const tree_functions &fns)
-    : Node(TYPE_LEAF), m_before(fns), m_elementsSize(0)
+    : Node(TYPE_LEAF), m_before(fns), m_elementsSize(0), m_lazy(false)
 {
 }
 
 LeafNode::LeafNode(pairlist_t::const_iterator begin, pairlist_t::const_iterator end, const tree_functions &fns)
-    : Node(TYPE_LEAF), m_before(fns), pairs(begin, end), m_elementsSize(0)
+    : Node(TYPE_LEAF), m_before(fns), m_pairs(begin, end), m_elementsSize(0), m_lazy(false)
 {
     calcSize();
 }
 
 LeafNode::LeafNode(std::vector<kv_pair> *v, const tree_functions &fns)
-    : Node(TYPE_LEAF), m_before(fns), m_elementsSize(0)
+    : Node(TYPE_LEAF), m_before(fns), m_elementsSize(0), m_lazy(false)
 {
     // Do a swap to avoid memory copies
-    pairs.swap(*v);
+    m_pairs.swap(*v);
     calcSize();
 }
 
-void LeafNode::calcSize()
+LeafNode::LeafNode(const LeafPage &page, const tree_functions &fns)
+    : Node(TYPE_LEAF), m_before(fns), m_elementsSize(0), m_lazy(true), m_page(page)
 {
-    for (pairlist_t::const_iterator it = pairs.begin(); it != pairs.end(); ++it)
+    if (page.count()) m_minKey = page.key(0);
+    overflow.count = page.overflowCount();
+    overflow.nodeID = page.overflowID();
+}
+
+void LeafNode::calcSize() const
+{
+    for (pairlist_t::const_iterator it = m_pairs.begin(); it != m_pairs.end(); ++it)
     {
         m_elementsSize += it->first.size() + it->second.size();
     }
 }
 
+void LeafNode::copyFromPage() const
+{
+    m_pairs.reserve(m_page->count());
+    for (keycount_t i = 0; i < m_page->count(); i++)
+        m_pairs.push_back(kv_pair(m_page->key(i), stored_value(m_page->value(i), m_page->blob(i))));
+    m_lazy = false;
+    calcSize();
+}
+
+bool LeafNode::hasBlobs() const
+{
+    if (m_lazy) return m_page->hasBlobs();
+
+    for (pairlist_t::const_iterator it = m_pairs.begin(); it != m_pairs.end(); ++it)
+    {
+        if (it->second.blob) return true;
+    }
+    return false;
+}
+
 const memslice &LeafNode::minKey() const
 {
-    if (pairs.size()) return pairs.begin()->first;
+    if (m_lazy) return m_minKey;
+    if (m_pairs.size()) return m_pairs.begin()->first;
     return g_emptyMemory;
 }
 
@@ -54,22 +83,36 @@ void LeafNode::setOverflow(const node_ptr &node)
 
 pairlist_t::const_iterator LeafNode::get_at(int n) const
 {
-    pairlist_t::const_iterator it = pairs.begin();
-    for (int i = 0; i < n && it != pairs.end(); ++it, ++i);
+    pairlist_t::const_iterator it = pairs().begin();
+    for (int i = 0; i < n && it != m_pairs.end(); ++it, ++i);
     return it;
 }
 
 pairlist_t::iterator LeafNode::get_at(int n)
 {
-    pairlist_t::iterator it = pairs.begin();
-    for (int i = 0; i < n && it != pairs.end(); ++it, ++i);
+    pairlist_t::iterator it = pairs().begin();
+    for (int i = 0; i < n && it != m_pairs.end(); ++it, ++i);
     return it;
 }
 
 void LeafNode::findRange(const memslice &key, pairlist_t::iterator *begin, pairlist_t::iterator *end)
 {
-    *begin = std::lower_bound(pairs.begin(), pairs.end(), key, m_before);
-    *end = std::upper_bound(pairs.begin(), pairs.end(), key, m_before);
+    materialize();
+    *begin = std::lower_bound(m_pairs.begin(), m_pairs.end(), key, m_before);
+    *end = std::upper_bound(m_pairs.begin(), m_pairs.end(), key, m_before);
+}
+
+void LeafNode::findRange(const memslice &key, keycount_t *begin, keycount_t *end) const
+{
+    if (m_lazy)
+    {
+        *begin = m_page->lowerBound(key, m_before.fns);
+        *end = m_page->upperBound(key, m_before.fns);
+        return;
+    }
+
+    *begin = std::lower_bound(m_pairs.begin(), m_pairs.end(), key, m_before) - m_pairs.begin();
+    *end = std::upper_bound(m_pairs.begin(), m_pairs.end(), key, m_before) - m_pairs.begin();
 }
 
 /**
@@ -78,8 +121,9 @@ void LeafNode::findRange(const memslice &key, pairlist_t::iterator *begin, pairl
  * This is necessary for getting good performance (so we don't have to shift too many array items
  * on every insert).
  */
-void LeafNode::applyAll(const editlist_t::iterator &editBegin, const editlist_t::iterator &editEnd)
+void LeafNode::applyAll(const editlist_t::iterator &editBegin, const editlist_t::iterator &editEnd, std::vector<stored_value> *dropped)
 {
+    pairlist_t &pairs = this->pairs();
     pairlist_t::iterator copy = pairs.begin();
     editlist_t::iterator edit = editBegin;
 
@@ -104,6 +148,7 @@ void LeafNode::applyAll(const editlist_t::iterator &editBegin, const editlist_t:
 
                 if (edit->edit == UPSERT)
                 {
+                    if (dropped) dropped->push_back(it->second);
                     newSize -= it->second.size();
                     newSize += edit->value.size();
                     it->second = edit->value;
@@ -114,6 +159,7 @@ void LeafNode::applyAll(const editlist_t::iterator &editBegin, const editlist_t:
                 // Deletes
                 if (edit->edit == REMOVE_KEY || (edit->edit == REMOVE_KV && edit->value == it->second))
                 {
+                    if (dropped) dropped->push_back(it->second);
                     newSize -= it->first.size() + it->second.size();
                     updated.erase(it);
                     break;
@@ -164,7 +210,7 @@ void LeafNode::applyAll(const editlist_t::iterator &editBegin, const editlist_t:
 void LeafNode::print(std::ostream &os) const
 {
     os << "LEAF(" << pairCount() << ")" << std::endl;
-    BOOST_FOREACH(const libbruce::kv_pair &p, pairs)
+    BOOST_FOREACH(const libbruce::kv_pair &p, pairs())
         os << "  " << p.first << " -> " << p.second << std::endl;
     if (!overflow.empty())
         os << "  Overflow " << overflow.count << " @ " << overflow.nodeID << std::endl;
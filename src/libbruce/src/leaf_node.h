@@ -8,6 +8,8 @@
 #include <boost/container/container_fwd.hpp>
 #include <boost/container/flat_map.hpp>
 #include "priv_types.h"
+#include "pages.h"
+#include <boost/optional.hpp>
 
 namespace libbruce {
 
@@ -21,31 +23,52 @@ typedef std::vector<kv_pair> pairlist_t;
 
 /**
  * Leaf node type
+ *
+ * A leaf parsed from a page with columns starts out lazy: lookups are answered
+ * from the page, and the pairs are only copied out when they are asked for,
+ * which is what every edit does.
  */
 struct LeafNode : public Node
 {
     LeafNode(const tree_functions &fns);
     LeafNode(std::vector<kv_pair> *v, const tree_functions &fns);
     LeafNode(pairlist_t::const_iterator begin, pairlist_t::const_iterator end, const tree_functions &fns);
+    LeafNode(const LeafPage &page, const tree_functions &fns);
 
-    keycount_t pairCount() const { return pairs.size(); }
+    keycount_t pairCount() const { return m_lazy ? m_page->count() : m_pairs.size(); }
     virtual const memslice &minKey() const;
     virtual itemcount_t itemCount() const;
 
+    memslice key(keycount_t i) const { return m_lazy ? m_page->key(i) : m_pairs[i].first; }
+    stored_value value(keycount_t i) const { return m_lazy ? stored_value(m_page->value(i), m_page->blob(i)) : m_pairs[i].second; }
+
+    // Whether any of the values are references to blobs
+    bool hasBlobs() const;
+
+    /**
+     * The pairs, copied out of the page first if the node is still lazy
+     */
+    pairlist_t &pairs() { materialize(); return m_pairs; }
+    const pairlist_t &pairs() const { materialize(); return m_pairs; }
+
+    // Whether the pairs are still in the page
+    bool lazy() const { return m_lazy; }
+
     void insert(const kv_pair &item)
     {
-        pairlist_t::iterator it = std::upper_bound(pairs.begin(), pairs.end(), item.first, m_before);
-        pairs.insert(it, item);
+        materialize();
+        pairlist_t::iterator it = std::upper_bound(m_pairs.begin(), m_pairs.end(), item.first, m_before);
+        m_pairs.insert(it, item);
         m_elementsSize += item.first.size() + item.second.size();
     }
 
     pairlist_t::iterator erase(const pairlist_t::iterator &it)
     {
         m_elementsSize -= it->first.size() + it->second.size();
-        return pairs.erase(it);
+        return pairs().erase(it);
     }
 
-    void update_value(pairlist_t::iterator &it, const memslice &value)
+    void update_value(pairlist_t::iterator &it, const stored_value &value)
     {
         m_elementsSize -= it->second.size();
         m_elementsSize += value.size();
@@ -54,12 +77,18 @@ struct LeafNode : public Node
 
     pairlist_t::iterator find(const memslice &key)
     {
-        pairlist_t::iterator it = std::lower_bound(pairs.begin(), pairs.end(), key, m_before);
-        if (it != pairs.end() && key == it->first) return it;
-        return pairs.end();
+        materialize();
+        pairlist_t::iterator it = std::lower_bound(m_pairs.begin(), m_pairs.end(), key, m_before);
+        if (it != m_pairs.end() && key == it->first) return it;
+        return m_pairs.end();
     }
 
-    void applyAll(const editlist_t::iterator &begin, const editlist_t::iterator &end);
+    /**
+     * Apply a range of edits at once
+     *
+     * Values that are removed or replaced are added to dropped, if given.
+     */
+    void applyAll(const editlist_t::iterator &begin, const editlist_t::iterator &end, std::vector<stored_value> *dropped=NULL);
 
     // Return a value by index (slow, only for testing!)
     pairlist_t::const_iterator get_at(int n) const;
@@ -67,21 +96,30 @@ struct LeafNode : public Node
 
     void setOverflow(const node_ptr &node);
 
-    pairlist_t pairs;
     overflow_t overflow;
 
-    size_t elementsSize() const { return m_elementsSize; }
+    size_t elementsSize() const { materialize(); return m_elementsSize; }
 
     void print(std::ostream &os) const;
     void findRange(const memslice &key, pairlist_t::iterator *begin, pairlist_t::iterator *end);
 
+    /**
+     * Indexes of the pairs with the given key, without materializing the node
+     */
+    void findRange(const memslice &key, keycount_t *begin, keycount_t *end) const;
+
 private:
     PairOrder m_before;
-    size_t m_elementsSize;
-    void calcSize();
+    mutable pairlist_t m_pairs;
+    mutable size_t m_elementsSize;
+    mutable bool m_lazy;
+    boost::optional<LeafPage> m_page; // Kept after materializing, decoded keys live there
+    memslice m_minKey; // While lazy
+    void calcSize() const;
+    void materialize() const { if (m_lazy) copyFromPage(); }
+    void copyFromPage() const;
 };
 
-
 }
 
 #endif
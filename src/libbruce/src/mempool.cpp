@@ -39,4 +39,10 @@ memslice mempool::alloc(size_t size)
     return m_allocPage.slice(offset, size);
 }
 
+void mempool::clear()
+{
+    m_pages.clear();
+    m_allocOffset = 0;
+}
+
 }
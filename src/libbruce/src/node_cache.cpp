@@ -0,0 +1,151 @@
+#include "node_cache.h"
+
+#include "leaf_node.h"
+#include "internal_node.h"
+#include "overflow_node.h"
+
+// Default capacity of the process-wide cache
+#define DEFAULT_NODE_CACHE_SIZE (32 * 1024 * 1024)
+
+namespace libbruce {
+
+namespace {
+
+bool sameFunctions(const tree_functions &a, const tree_functions &b)
+{
+    return a.keyCompare == b.keyCompare
+        && a.valueCompare == b.valueCompare
+        && a.keySize == b.keySize
+        && a.valueSize == b.valueSize;
+}
+
+}
+
+NodeCache::NodeCache(size_t capacity)
+    : m_capacity(capacity), m_size(0), m_hits(0), m_misses(0)
+{
+}
+
+NodeCache &NodeCache::instance()
+{
+    static NodeCache cache(DEFAULT_NODE_CACHE_SIZE);
+    return cache;
+}
+
+bool NodeCache::get(const nodeid_t &id, const tree_functions &fns, node_ptr *node, mempage *page)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    entrymap_t::iterator it = m_entries.find(id);
+    if (it == m_entries.end() || !sameFunctions(it->second.fns, fns))
+    {
+        m_misses++;
+        return false;
+    }
+
+    m_hits++;
+    m_lru.splice(m_lru.end(), m_lru, m_lru.iterator_to(it->second));
+    *node = it->second.node;
+    *page = it->second.page;
+    return true;
+}
+
+void NodeCache::put(const nodeid_t &id, const tree_functions &fns, const node_ptr &node, const mempage &page)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (page.size() > m_capacity)
+        return;
+
+    std::pair<entrymap_t::iterator, bool> ins = m_entries.insert(std::make_pair(id, entry(id, fns, node, page)));
+    if (!ins.second)
+        return;
+
+    node->markShared();
+    m_lru.push_back(ins.first->second);
+    m_size += page.size();
+    evict();
+}
+
+bool NodeCache::enabled() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_capacity > 0;
+}
+
+void NodeCache::setCapacity(size_t capacity)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_capacity = capacity;
+    evict();
+}
+
+util::node_cache_stats NodeCache::stats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    util::node_cache_stats ret;
+    ret.hits = m_hits;
+    ret.misses = m_misses;
+    ret.size = m_size;
+    ret.count = m_entries.size();
+    ret.capacity = m_capacity;
+    return ret;
+}
+
+void NodeCache::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_lru.clear();
+    m_entries.clear();
+    m_size = 0;
+    m_hits = 0;
+    m_misses = 0;
+}
+
+void NodeCache::evict()
+{
+    while (m_size > m_capacity && !m_lru.empty())
+    {
+        entry &oldest = m_lru.front();
+        m_size -= oldest.page.size();
+        m_lru.pop_front();
+        m_entries.erase(oldest.id);
+    }
+}
+
+node_ptr CopyNode(const node_ptr &node)
+{
+    switch (node->nodeType())
+    {
+        case TYPE_LEAF:
+            return boost::make_shared<LeafNode>(*boost::static_pointer_cast<LeafNode>(node));
+        case TYPE_INTERNAL:
+            return boost::make_shared<InternalNode>(*boost::static_pointer_cast<InternalNode>(node));
+        case TYPE_OVERFLOW:
+            return boost::make_shared<OverflowNode>(*boost::static_pointer_cast<OverflowNode>(node));
+        case TYPE_BLOB:
+            throw std::runtime_error("Blob pages are not nodes");
+    }
+    throw std::runtime_error("Unknown node type");
+}
+
+namespace util {
+
+void set_node_cache_capacity(size_t bytes)
+{
+    NodeCache::instance().setCapacity(bytes);
+}
+
+node_cache_stats get_node_cache_stats()
+{
+    return NodeCache::instance().stats();
+}
+
+void clear_node_cache()
+{
+    NodeCache::instance().clear();
+}
+
+}
+
+}
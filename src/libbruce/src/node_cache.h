@@ -0,0 +1,86 @@
+#pragma once
+#ifndef BRUCE_NODE_CACHE_H
+#define BRUCE_NODE_CACHE_H
+
+#include <mutex>
+#include <boost/intrusive/list.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/unordered_map.hpp>
+
+#include <libbruce/mempage.h>
+#include <libbruce/types.h>
+#include <libbruce/util/node_cache.h>
+#include "nodes.h"
+
+namespace libbruce {
+
+/**
+ * Cache of parsed nodes, shared by all trees in the process
+ *
+ * Only blocks from content-addressed engines may be put in here, since the
+ * node ID is the only key (together with the functions it was parsed with).
+ *
+ * The cached nodes are handed out as they are, and marked shared so that no
+ * tree changes them: a tree copies a node (see CopyNode) before the first
+ * edit to it, including applying queued edits while querying. Read-only
+ * traversals skip the block fetch, the parse and the copy.
+ */
+class NodeCache : private boost::noncopyable
+{
+public:
+    NodeCache(size_t capacity);
+
+    static NodeCache &instance();
+
+    /**
+     * Return the cached node and the page it refers to
+     *
+     * The node is shared and must not be modified.
+     */
+    bool get(const nodeid_t &id, const tree_functions &fns, node_ptr *node, mempage *page);
+
+    /**
+     * Cache a node that was just parsed and not modified yet
+     *
+     * Once cached, the node is marked shared.
+     */
+    void put(const nodeid_t &id, const tree_functions &fns, const node_ptr &node, const mempage &page);
+
+    bool enabled() const;
+    void setCapacity(size_t capacity);
+    util::node_cache_stats stats() const;
+    void clear();
+private:
+    struct entry : public boost::intrusive::list_base_hook<>
+    {
+        entry(const nodeid_t &id, const tree_functions &fns, const libbruce::node_ptr &node, const mempage &page)
+            : id(id), fns(fns), node(node), page(page) { }
+
+        nodeid_t id;
+        tree_functions fns;
+        libbruce::node_ptr node;
+        mempage page;
+    };
+
+    typedef boost::unordered_map<nodeid_t, entry> entrymap_t;
+    typedef boost::intrusive::list<entry> lrulist_t;
+
+    mutable std::mutex m_mutex;
+    entrymap_t m_entries;
+    lrulist_t m_lru; // Least recently used at the front
+    size_t m_capacity;
+    size_t m_size;
+    uint64_t m_hits;
+    uint64_t m_misses;
+
+    void evict();
+};
+
+/**
+ * Shallow copy of a node, sharing keys and values but not children
+ */
+node_ptr CopyNode(const node_ptr &node);
+
+}
+
+#endif
@@ -16,7 +16,12 @@ int pending_edit::delta() const
 //----------------------------------------------------------------------
 
 Node::Node(node_type_t nodeType)
-    : m_nodeType(nodeType)
+    : m_nodeType(nodeType), m_dirty(true), m_shared(false)
+{
+}
+
+Node::Node(const Node &other)
+    : m_nodeType(other.m_nodeType), m_dirty(other.m_dirty), m_shared(false)
 {
 }
 
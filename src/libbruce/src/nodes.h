@@ -7,6 +7,7 @@
 #include <libbruce/types.h>
 #include <boost/make_shared.hpp>
 
+#include <cassert>
 #include <vector>
 #include <map>
 
@@ -29,7 +30,8 @@ typedef boost::shared_ptr<InternalNode> internalnode_ptr;
 enum node_type_t {
     TYPE_LEAF,
     TYPE_INTERNAL,
-    TYPE_OVERFLOW
+    TYPE_OVERFLOW,
+    TYPE_BLOB // A value that didn't go in its leaf, not a node
 };
 
 enum edit_t {
@@ -69,6 +71,7 @@ struct overflow_t
 struct Node
 {
     Node(node_type_t nodeType);
+    Node(const Node &other);
     virtual ~Node();
 
     virtual itemcount_t itemCount() const = 0; // Items in this node and below
@@ -76,9 +79,31 @@ struct Node
 
     node_type_t nodeType() const { return m_nodeType; }
 
+    /**
+     * Whether this node differs from the block it was parsed from
+     *
+     * New nodes start out dirty, parsed nodes start out clean. Only dirty
+     * nodes are serialized and written when the tree is flushed.
+     */
+    bool dirty() const { return m_dirty; }
+    void markDirty() { assert(!m_shared); m_dirty = true; }
+    void markClean() { m_dirty = false; }
+
+    /**
+     * Whether this node may be in use in more than one place
+     *
+     * Nodes in the process-wide node cache are shared between trees. Shared
+     * nodes must not be changed; trees edit a copy instead. Copies start out
+     * unshared.
+     */
+    bool shared() const { return m_shared; }
+    void markShared() { m_shared = true; }
+
     virtual void print(std::ostream &os) const = 0;
 private:
     node_type_t m_nodeType;
+    bool m_dirty;
+    bool m_shared;
 };
 
 std::ostream &operator <<(std::ostream &os, const libbruce::Node &x);
@@ -7,7 +7,7 @@
 
 namespace libbruce {
 
-typedef std::vector<memslice> valuelist_t;
+typedef std::vector<stored_value> valuelist_t;
 
 /**
  * Overflow nodes contain lists of values with the same key as the last key in a leaf
@@ -23,7 +23,7 @@ struct OverflowNode : public Node
 
     keycount_t valueCount() const { return values.size(); }
 
-    void append(const memslice &item) { values.push_back(item); }
+    void append(const stored_value &item) { values.push_back(item); }
     void erase(size_t i) { values.erase(values.begin() + i); }
 
     valuelist_t::const_iterator at(keycount_t i) const { return values.begin() + i; }
@@ -0,0 +1,478 @@
+#include "pages.h"
+
+#include <algorithm>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include <string.h>
+#include <boost/lexical_cast.hpp>
+#include <boost/make_shared.hpp>
+
+#define to_string boost::lexical_cast<std::string>
+
+#define THROW_END_OF_BLOCK(offset, size) \
+    throw std::runtime_error((std::string("End of block while parsing node data: ") + to_string(offset) + " >= " + to_string(size)).c_str())
+
+namespace libbruce {
+
+//----------------------------------------------------------------------
+//  Blobs
+//
+
+mempage MakeBlobPage(const memslice &value, uint64_t salt)
+{
+    mempage page = mempage::uninitialized(BLOB_HEADER_SIZE + value.size());
+    *page.at<flags_t>(0) = TYPE_BLOB;
+    *page.at<uint64_t>(sizeof(flags_t)) = salt;
+    if (value.size())
+        memcpy(page.at<char>(BLOB_HEADER_SIZE), value.ptr(), value.size());
+    return page;
+}
+
+memslice BlobPageValue(const mempage &page, const memslice &ref)
+{
+    if (page.size() < BLOB_HEADER_SIZE || PageNodeType(page) != TYPE_BLOB)
+        throw std::runtime_error("Not a blob page: " + to_string(BlobID(ref)));
+    if (page.size() - BLOB_HEADER_SIZE != BlobSize(ref))
+        throw std::runtime_error("Blob page size doesn't match its reference: " + to_string(BlobID(ref)));
+    return page.slice(BLOB_HEADER_SIZE, BlobSize(ref));
+}
+
+BlobBitmap::BlobBitmap(const mempage &page, size_t offset, size_t count)
+    : m_page(page), m_offset(offset)
+{
+    if (offset + size(count) > page.size())
+        THROW_END_OF_BLOCK(offset + size(count), page.size());
+}
+
+//----------------------------------------------------------------------
+//  Columns
+//
+
+Column::Column(const mempage &page, size_t offset, size_t count)
+    : m_page(page), m_count(count), m_distinct(count), m_runTable(0), m_restartInterval(1)
+{
+    if (offset + sizeof(uint32_t) > page.size())
+        THROW_END_OF_BLOCK(offset, page.size());
+    m_width = *page.at<uint32_t>(offset);
+    m_dataOffset = offset + sizeof(uint32_t);
+
+    if (m_width == COLUMN_RUN_LENGTH)
+    {
+        readRuns(page, offset);
+        return;
+    }
+
+    if (m_width == COLUMN_FRONT_CODED)
+    {
+        readRestarts(page, offset);
+        return;
+    }
+
+    if (m_width)
+        m_end = m_dataOffset + m_count * m_width;
+    else if (m_count)
+    {
+        size_t tableEnd = m_dataOffset + (m_count + 1) * sizeof(offset_t);
+        if (tableEnd > page.size())
+            THROW_END_OF_BLOCK(tableEnd, page.size());
+        if (*page.at<offset_t>(m_dataOffset) != tableEnd)
+            throw std::runtime_error("Corrupt column offset table");
+        m_end = *page.at<offset_t>(m_dataOffset + m_count * sizeof(offset_t));
+    }
+    else
+        m_end = m_dataOffset;
+
+    if (m_end > page.size())
+        THROW_END_OF_BLOCK(m_end, page.size());
+    m_dataEnd = m_end;
+}
+
+/**
+ * The blocks of a front-coded column that were decoded so far
+ */
+struct Column::decoded_blocks
+{
+    decoded_blocks(size_t count) : pages(count) { }
+
+    std::mutex mutex;
+    std::vector<mempage> pages; // Empty until decoded
+};
+
+/**
+ * Check the restart table of a front-coded column
+ *
+ * The items are checked when their block is decoded.
+ */
+void Column::readRestarts(const mempage &page, size_t offset)
+{
+    size_t table = offset + 2 * sizeof(uint32_t);
+    if (table > page.size())
+        THROW_END_OF_BLOCK(table, page.size());
+
+    m_restartInterval = *page.at<uint32_t>(offset + sizeof(uint32_t));
+    if (!m_restartInterval)
+        throw std::runtime_error("Corrupt column restart interval");
+
+    size_t restarts = (m_count + m_restartInterval - 1) / m_restartInterval;
+    size_t tableEnd = table + (restarts + 1) * sizeof(offset_t);
+    if (tableEnd > page.size())
+        THROW_END_OF_BLOCK(tableEnd, page.size());
+    m_dataOffset = table;
+    m_dataEnd = tableEnd;
+
+    // Every block has at least one item, which takes at least its header
+    for (size_t b = 0; b <= restarts; b++)
+    {
+        size_t start = restart(b);
+        if (b == 0 ? start != tableEnd : start < restart(b - 1) + 2 * sizeof(uint16_t))
+            throw std::runtime_error("Corrupt column restart table");
+    }
+
+    m_end = restart(restarts);
+    if (m_end > page.size())
+        THROW_END_OF_BLOCK(m_end, page.size());
+
+    m_blocks = boost::make_shared<decoded_blocks>(restarts);
+}
+
+size_t Column::restart(size_t b) const
+{
+    return *m_page.at<offset_t>(m_dataOffset + b * sizeof(offset_t));
+}
+
+/**
+ * The item at a restart point, which is stored whole
+ */
+memslice Column::restartItem(size_t b) const
+{
+    size_t pos = restart(b);
+    size_t end = restart(b + 1);
+    if (pos + 2 * sizeof(uint16_t) > end)
+        THROW_END_OF_BLOCK(pos, end);
+
+    uint16_t shared = *m_page.at<uint16_t>(pos);
+    uint16_t rest = *m_page.at<uint16_t>(pos + sizeof(uint16_t));
+    if (shared)
+        throw std::runtime_error((std::string("Corrupt shared prefix: ") + to_string(b * m_restartInterval)).c_str());
+    if (pos + 2 * sizeof(uint16_t) + rest > end)
+        THROW_END_OF_BLOCK(pos + 2 * sizeof(uint16_t) + rest, end);
+
+    return m_page.slice(pos + 2 * sizeof(uint16_t), rest);
+}
+
+memslice Column::frontCoded(size_t i) const
+{
+    size_t b = i / m_restartInterval;
+    size_t j = i % m_restartInterval;
+    if (!j)
+        return restartItem(b);
+
+    mempage block;
+    {
+        std::lock_guard<std::mutex> lock(m_blocks->mutex);
+        mempage &decoded = m_blocks->pages[b];
+        if (!decoded.size())
+            decoded = decodeBlock(b);
+        block = decoded;
+    }
+
+    offset_t begin = *block.at<offset_t>(j * sizeof(offset_t));
+    offset_t end = *block.at<offset_t>((j + 1) * sizeof(offset_t));
+    return block.slice(begin, end - begin);
+}
+
+/**
+ * Decode the items of one block into an offset table of its own
+ */
+mempage Column::decodeBlock(size_t b) const
+{
+    size_t first = b * m_restartInterval;
+    size_t count = std::min(m_restartInterval, m_distinct - first);
+    size_t end = restart(b + 1);
+
+    // Validate everything and find the decoded size first
+    size_t pos = restart(b);
+    size_t total = 0;
+    size_t previous = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (pos + 2 * sizeof(uint16_t) > end)
+            THROW_END_OF_BLOCK(pos, end);
+
+        uint16_t shared = *m_page.at<uint16_t>(pos);
+        uint16_t rest = *m_page.at<uint16_t>(pos + sizeof(uint16_t));
+        if (i == 0 ? shared != 0 : shared > previous)
+            throw std::runtime_error((std::string("Corrupt shared prefix: ") + to_string(first + i)).c_str());
+
+        pos += 2 * sizeof(uint16_t) + rest;
+        if (pos > end)
+            THROW_END_OF_BLOCK(pos, end);
+
+        previous = shared + rest;
+        total += previous;
+    }
+    if (pos != end)
+        throw std::runtime_error("Front-coded column block size doesn't match its items");
+
+    size_t out = (count + 1) * sizeof(offset_t);
+    mempage decoded = mempage::uninitialized(out + total);
+
+    pos = restart(b);
+    size_t previousStart = out;
+    for (size_t i = 0; i < count; i++)
+    {
+        uint16_t shared = *m_page.at<uint16_t>(pos);
+        uint16_t rest = *m_page.at<uint16_t>(pos + sizeof(uint16_t));
+        pos += 2 * sizeof(uint16_t);
+
+        *decoded.at<offset_t>(i * sizeof(offset_t)) = out;
+        if (shared)
+            memcpy(decoded.at<uint8_t>(out), decoded.at<uint8_t>(previousStart), shared);
+        if (rest)
+            memcpy(decoded.at<uint8_t>(out + shared), m_page.at<uint8_t>(pos), rest);
+
+        pos += rest;
+        previousStart = out;
+        out += shared + rest;
+    }
+    *decoded.at<offset_t>(count * sizeof(offset_t)) = out;
+
+    return decoded;
+}
+
+/**
+ * Read the run table, and take the column of distinct items after it as our own
+ */
+void Column::readRuns(const mempage &page, size_t offset)
+{
+    size_t table = offset + 2 * sizeof(uint32_t);
+    if (table > page.size())
+        THROW_END_OF_BLOCK(table, page.size());
+
+    size_t runs = *page.at<uint32_t>(offset + sizeof(uint32_t));
+    if (runs > m_count || (m_count && !runs))
+        throw std::runtime_error("Corrupt column run count");
+
+    size_t tableEnd = table + (runs + 1) * sizeof(uint32_t);
+    if (tableEnd + sizeof(uint32_t) > page.size())
+        THROW_END_OF_BLOCK(tableEnd, page.size());
+
+    // Runs are never empty, and together hold all items
+    for (size_t r = 0; r <= runs; r++)
+    {
+        uint32_t start = *page.at<uint32_t>(table + r * sizeof(uint32_t));
+        if (r == 0 ? start != 0 : start <= *page.at<uint32_t>(table + (r - 1) * sizeof(uint32_t)))
+            throw std::runtime_error((std::string("Corrupt column run: ") + to_string(r)).c_str());
+    }
+    if (*page.at<uint32_t>(table + runs * sizeof(uint32_t)) != m_count)
+        throw std::runtime_error("Column runs don't match its items");
+
+    if (*page.at<uint32_t>(tableEnd) == COLUMN_RUN_LENGTH)
+        throw std::runtime_error("Corrupt column, runs of runs");
+
+    size_t count = m_count;
+    *this = Column(page, tableEnd, runs);
+    m_count = count;
+    m_runPage = page;
+    m_runTable = table;
+}
+
+size_t Column::runStart(size_t r) const
+{
+    if (!m_runTable)
+        return r;
+    return *m_runPage.at<uint32_t>(m_runTable + r * sizeof(uint32_t));
+}
+
+size_t Column::run(size_t i) const
+{
+    if (!m_runTable)
+        return i;
+
+    // The last run that starts at or before i
+    size_t lo = 0, hi = m_distinct;
+    while (hi - lo > 1)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (runStart(mid) <= i)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+memslice Column::distinct(size_t i) const
+{
+    if (m_width == COLUMN_FRONT_CODED)
+        return frontCoded(i);
+
+    if (m_width)
+        return m_page.slice(m_dataOffset + i * m_width, m_width);
+
+    offset_t begin = *m_page.at<offset_t>(m_dataOffset + i * sizeof(offset_t));
+    offset_t end = *m_page.at<offset_t>(m_dataOffset + (i + 1) * sizeof(offset_t));
+    if (begin > end || end > m_dataEnd)
+        throw std::runtime_error((std::string("Corrupt column offset: ") + to_string(i)).c_str());
+    return m_page.slice(begin, end - begin);
+}
+
+//----------------------------------------------------------------------
+//  Page views
+//
+
+LeafPage::LeafPage(const mempage &page)
+    : m_page(page)
+{
+    if (page.size() < sizeof(flags_t) + sizeof(keycount_t))
+        THROW_END_OF_BLOCK(page.size(), page.size());
+    m_count = *page.at<keycount_t>(sizeof(flags_t));
+    m_keys = Column(page, sizeof(flags_t) + sizeof(keycount_t), m_count);
+    m_values = Column(page, m_keys.end(), m_count);
+
+    m_overflowOffset = m_values.end();
+    if (*page.at<flags_t>(0) & FLAG_BLOBS)
+    {
+        m_blobs = BlobBitmap(page, m_overflowOffset, m_count);
+        m_overflowOffset += BlobBitmap::size(m_count);
+    }
+
+    if (m_overflowOffset + sizeof(itemcount_t) + sizeof(nodeid_t) != page.size())
+        throw std::runtime_error("Leaf page size doesn't match its columns");
+}
+
+itemcount_t LeafPage::overflowCount() const
+{
+    return *m_page.at<itemcount_t>(m_overflowOffset);
+}
+
+nodeid_t LeafPage::overflowID() const
+{
+    return *m_page.at<nodeid_t>(m_overflowOffset + sizeof(itemcount_t));
+}
+
+keycount_t LeafPage::lowerBound(const memslice &key, const tree_functions &fns) const
+{
+    KeyOrder before(fns);
+    keycount_t interval = m_keys.restartInterval();
+    keycount_t count = m_keys.distinctCount();
+
+    // Binary search over the restart points...
+    keycount_t lo = 0, hi = (count + interval - 1) / interval;
+    while (lo < hi)
+    {
+        keycount_t mid = lo + (hi - lo) / 2;
+        if (before(m_keys.distinct(mid * interval), key))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    // ...then scan the keys after the last one that is smaller
+    keycount_t r = lo ? (lo - 1) * interval : 0;
+    keycount_t end = std::min(count, lo * interval);
+    while (r < end && before(m_keys.distinct(r), key))
+        r++;
+    return m_keys.runStart(r);
+}
+
+keycount_t LeafPage::upperBound(const memslice &key, const tree_functions &fns) const
+{
+    KeyOrder before(fns);
+    keycount_t interval = m_keys.restartInterval();
+    keycount_t count = m_keys.distinctCount();
+
+    keycount_t lo = 0, hi = (count + interval - 1) / interval;
+    while (lo < hi)
+    {
+        keycount_t mid = lo + (hi - lo) / 2;
+        if (before(key, m_keys.distinct(mid * interval)))
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    keycount_t r = lo ? (lo - 1) * interval : 0;
+    keycount_t end = std::min(count, lo * interval);
+    while (r < end && !before(key, m_keys.distinct(r)))
+        r++;
+    return m_keys.runStart(r);
+}
+
+InternalPage::InternalPage(const mempage &page)
+    : m_page(page)
+{
+    size_t header = sizeof(flags_t) + 2 * sizeof(keycount_t);
+    if (page.size() < header)
+        THROW_END_OF_BLOCK(page.size(), page.size());
+    m_count = *page.at<keycount_t>(sizeof(flags_t));
+    m_editCount = *page.at<keycount_t>(sizeof(flags_t) + sizeof(keycount_t));
+
+    m_keys = Column(page, header, m_count ? m_count - 1 : 0);
+    m_idsOffset = m_keys.end();
+    m_countsOffset = m_idsOffset + (size_t)m_count * sizeof(nodeid_t);
+    m_typesOffset = m_countsOffset + (size_t)m_count * sizeof(itemcount_t);
+
+    size_t end = m_typesOffset + (size_t)m_editCount * sizeof(uint8_t);
+    if (m_editCount)
+    {
+        m_editKeys = Column(page, end, m_editCount);
+        m_editValues = Column(page, m_editKeys.end(), m_editCount);
+        end = m_editValues.end();
+    }
+
+    if (end != page.size())
+        throw std::runtime_error("Internal page size doesn't match its columns");
+}
+
+nodeid_t InternalPage::nodeID(keycount_t i) const
+{
+    return *m_page.at<nodeid_t>(m_idsOffset + i * sizeof(nodeid_t));
+}
+
+itemcount_t InternalPage::itemCount(keycount_t i) const
+{
+    return *m_page.at<itemcount_t>(m_countsOffset + i * sizeof(itemcount_t));
+}
+
+edit_t InternalPage::editType(keycount_t j) const
+{
+    return (edit_t)(*m_page.at<uint8_t>(m_typesOffset + j * sizeof(uint8_t)) & ~EDIT_GUARANTEED);
+}
+
+bool InternalPage::editGuaranteed(keycount_t j) const
+{
+    return (*m_page.at<uint8_t>(m_typesOffset + j * sizeof(uint8_t)) & EDIT_GUARANTEED) != 0;
+}
+
+OverflowPage::OverflowPage(const mempage &page)
+    : m_page(page)
+{
+    if (page.size() < sizeof(flags_t) + sizeof(keycount_t))
+        THROW_END_OF_BLOCK(page.size(), page.size());
+    m_count = *page.at<keycount_t>(sizeof(flags_t));
+    m_values = Column(page, sizeof(flags_t) + sizeof(keycount_t), m_count);
+
+    m_nextOffset = m_values.end();
+    if (*page.at<flags_t>(0) & FLAG_BLOBS)
+    {
+        m_blobs = BlobBitmap(page, m_nextOffset, m_count);
+        m_nextOffset += BlobBitmap::size(m_count);
+    }
+
+    if (m_nextOffset + sizeof(itemcount_t) + sizeof(nodeid_t) != page.size())
+        throw std::runtime_error("Overflow page size doesn't match its columns");
+}
+
+itemcount_t OverflowPage::nextCount() const
+{
+    return *m_page.at<itemcount_t>(m_nextOffset);
+}
+
+nodeid_t OverflowPage::nextID() const
+{
+    return *m_page.at<nodeid_t>(m_nextOffset + sizeof(itemcount_t));
+}
+
+}
@@ -0,0 +1,241 @@
+#pragma once
+#ifndef BRUCE_PAGES_H
+#define BRUCE_PAGES_H
+
+/**
+ * Read-only views on serialized pages
+ *
+ * The page layout is described in serializing.h. The views only work on pages
+ * with FLAG_COLUMNS set, and read keys and values in place.
+ */
+
+#include <stdint.h>
+#include <boost/shared_ptr.hpp>
+
+#include <libbruce/mempage.h>
+#include <libbruce/types.h>
+
+#include "nodes.h"
+#include "priv_types.h"
+
+namespace libbruce {
+
+// Sizes of types inside the block
+typedef uint16_t flags_t;
+typedef uint32_t offset_t;
+
+// The node type is in the low byte of the flags, format bits are above it
+#define NODE_TYPE_MASK 0x00FF
+#define FLAG_COLUMNS 0x0100
+
+// Column width that marks a front-coded column, and its restart interval
+#define COLUMN_FRONT_CODED 0xFFFFFFFF
+#define RESTART_INTERVAL 16
+
+// Column width that marks a run-length encoded column
+#define COLUMN_RUN_LENGTH 0xFFFFFFFE
+
+// Set on the type of a queued edit that is guaranteed
+#define EDIT_GUARANTEED 0x80
+
+// Set on leaf and overflow pages that have values in blob pages
+#define FLAG_BLOBS 0x0200
+
+// A reference to a blob: the ID of its page and the size of the value
+#define BLOB_REF_SIZE (sizeof(nodeid_t) + sizeof(uint32_t))
+
+// Bytes of a blob page before the value
+#define BLOB_HEADER_SIZE (sizeof(flags_t) + sizeof(uint64_t))
+
+inline node_type_t PageNodeType(const mempage &page)
+{
+    return (node_type_t)(*page.at<flags_t>(0) & NODE_TYPE_MASK);
+}
+
+inline bool HasColumns(const mempage &page)
+{
+    return (*page.at<flags_t>(0) & FLAG_COLUMNS) != 0;
+}
+
+inline nodeid_t BlobID(const memslice &ref) { return *ref.at<nodeid_t>(0); }
+inline uint32_t BlobSize(const memslice &ref) { return *ref.at<uint32_t>(sizeof(nodeid_t)); }
+
+/**
+ * A page that holds a single value
+ *
+ * The salt makes every blob page unique, so equal values never share a block
+ * in a content-addressed engine and each can be deleted on its own.
+ */
+mempage MakeBlobPage(const memslice &value, uint64_t salt);
+
+/**
+ * The value in a blob page, checked against the reference to it
+ */
+memslice BlobPageValue(const mempage &page, const memslice &ref);
+
+/**
+ * Which values of a page are references to blobs
+ */
+struct BlobBitmap
+{
+    BlobBitmap() : m_offset(0) { }
+    BlobBitmap(const mempage &page, size_t offset, size_t count);
+
+    bool at(size_t i) const { return m_offset && (*m_page.at<uint8_t>(m_offset + i / 8) >> (i % 8)) & 1; }
+    bool any() const { return m_offset != 0; }
+
+    // Bytes taken by the bitmap of a page with the given number of values
+    static size_t size(size_t count) { return (count + 7) / 8; }
+private:
+    mempage m_page;
+    size_t m_offset; // 0 if the page has no blobs
+};
+
+/**
+ * A column of keys or values in a page
+ *
+ * Items are validated when they are accessed. A front-coded column is read
+ * in blocks: the item at each restart point is stored whole and read in
+ * place, so searching the restart points doesn't decode anything. The other
+ * items of a block are decoded the first time one of them is asked for, into
+ * memory that lives as long as the column (and any copy of it) does. This is
+ * thread safe, since parsed nodes are shared between trees.
+ *
+ * A run-length encoded column stores every run of equal items once. Those
+ * are the distinct items; in other columns every item is a distinct item.
+ */
+struct Column
+{
+    Column() : m_count(0), m_distinct(0), m_runTable(0), m_width(0), m_dataOffset(0), m_dataEnd(0), m_end(0), m_restartInterval(1) { }
+    Column(const mempage &page, size_t offset, size_t count);
+
+    size_t count() const { return m_count; }
+    memslice at(size_t i) const { return distinct(run(i)); }
+
+    size_t distinctCount() const { return m_distinct; }
+    memslice distinct(size_t r) const;
+
+    // Index of the first item of a distinct item, or the count if r is past the end
+    size_t runStart(size_t r) const;
+
+    // Distinct items that can be compared without decoding the ones before them
+    size_t restartInterval() const { return m_restartInterval; }
+
+    // First byte after the column
+    size_t end() const { return m_end; }
+private:
+    struct decoded_blocks;
+
+    mempage m_page;
+    size_t m_count;
+    size_t m_distinct;
+    mempage m_runPage;
+    size_t m_runTable; // Offset of the run starts in m_runPage, 0 if not run-length encoded
+    uint32_t m_width;
+    size_t m_dataOffset; // Items if fixed width, offset table otherwise, restart table if front-coded
+    size_t m_dataEnd;
+    size_t m_end;
+    size_t m_restartInterval;
+    boost::shared_ptr<decoded_blocks> m_blocks; // Of a front-coded column, shared by copies
+
+    void readRestarts(const mempage &page, size_t offset);
+    void readRuns(const mempage &page, size_t offset);
+    size_t run(size_t i) const;
+
+    size_t restart(size_t b) const;
+    memslice restartItem(size_t b) const;
+    memslice frontCoded(size_t i) const;
+    mempage decodeBlock(size_t b) const;
+};
+
+/**
+ * Direct access to a leaf page with columns, without parsing it
+ */
+struct LeafPage
+{
+    LeafPage(const mempage &page);
+
+    keycount_t count() const { return m_count; }
+    memslice key(keycount_t i) const { return m_keys.at(i); }
+    memslice value(keycount_t i) const { return m_values.at(i); }
+    bool blob(keycount_t i) const { return m_blobs.at(i); }
+    bool hasBlobs() const { return m_blobs.any(); }
+    itemcount_t overflowCount() const;
+    nodeid_t overflowID() const;
+
+    /**
+     * First index whose key is not less than the given key
+     */
+    keycount_t lowerBound(const memslice &key, const tree_functions &fns) const;
+
+    /**
+     * First index whose key is greater than the given key
+     */
+    keycount_t upperBound(const memslice &key, const tree_functions &fns) const;
+private:
+    mempage m_page;
+    keycount_t m_count;
+    Column m_keys;
+    Column m_values;
+    BlobBitmap m_blobs;
+    size_t m_overflowOffset;
+};
+
+/**
+ * Direct access to an internal page with columns, without parsing it
+ *
+ * Internal nodes are always parsed in full from this: their branches hold
+ * the children a tree loads, and the node cache shares the parsed nodes.
+ */
+struct InternalPage
+{
+    InternalPage(const mempage &page);
+
+    keycount_t count() const { return m_count; }
+    memslice minKey(keycount_t i) const { return i ? m_keys.at(i - 1) : memslice(); }
+    nodeid_t nodeID(keycount_t i) const;
+    itemcount_t itemCount(keycount_t i) const;
+
+    keycount_t editCount() const { return m_editCount; }
+    edit_t editType(keycount_t j) const;
+    bool editGuaranteed(keycount_t j) const;
+    memslice editKey(keycount_t j) const { return m_editKeys.at(j); }
+    memslice editValue(keycount_t j) const { return m_editValues.at(j); }
+
+    // The key column, which has to be kept alive with the keys if they were decoded
+    const Column &keyData() const { return m_keys; }
+private:
+    mempage m_page;
+    keycount_t m_count;
+    keycount_t m_editCount;
+    Column m_keys; // Without the first one, which is always empty
+    size_t m_idsOffset;
+    size_t m_countsOffset;
+    size_t m_typesOffset;
+    Column m_editKeys;
+    Column m_editValues;
+};
+
+/**
+ * Direct access to an overflow page with columns, without parsing it
+ */
+struct OverflowPage
+{
+    OverflowPage(const mempage &page);
+
+    keycount_t count() const { return m_count; }
+    memslice value(keycount_t i) const { return m_values.at(i); }
+    bool blob(keycount_t i) const { return m_blobs.at(i); }
+    itemcount_t nextCount() const;
+    nodeid_t nextID() const;
+private:
+    mempage m_page;
+    keycount_t m_count;
+    Column m_values;
+    BlobBitmap m_blobs;
+    size_t m_nextOffset;
+};
+
+}
+
+#endif
@@ -3,6 +3,7 @@
 #define PRIVATE_TYPES_H
 
 #include <libbruce/types.h>
+#include "nodes.h"
 
 namespace libbruce {
 
@@ -33,9 +34,29 @@ struct EditOrder : public KeyOrder
     {
         return KeyOrder::operator()(a.key, b);
     }
+
+    bool operator()(const pending_edit &a, const pending_edit &b) const
+    {
+        return KeyOrder::operator()(a.key, b.key);
+    }
+};
+
+/**
+ * A value as it is kept in a leaf or overflow node
+ *
+ * Large values are moved to blob pages of their own when the tree is written.
+ * The node then holds a reference to the blob in place of the value, and the
+ * value has to be fetched before it can be used.
+ */
+struct stored_value : public memslice
+{
+    stored_value() : blob(false) { }
+    stored_value(const memslice &value, bool blob=false) : memslice(value), blob(blob) { }
+
+    bool blob;
 };
 
-typedef std::pair<memslice, memslice> kv_pair;
+typedef std::pair<memslice, stored_value> kv_pair;
 
 struct PairOrder : public KeyOrder
 {
@@ -52,6 +73,9 @@ struct node_branch {
 
     void inc() { itemCount++; }
 
+    // Whether the child was loaded and has changed since, so it needs a new ID
+    bool dirty() const { return child && child->dirty(); }
+
     memslice minKey;
     nodeid_t nodeID;
     itemcount_t itemCount;
@@ -14,6 +14,7 @@
 #include "internal_node.h"
 #include "overflow_node.h"
 
+#include <algorithm>
 #include <cmath>
 #include <boost/lexical_cast.hpp>
 
@@ -25,7 +26,324 @@
 
 namespace libbruce {
 
+#define THROW_END_OF_BLOCK(offset, size) \
+    throw std::runtime_error((std::string("End of block while parsing node data: ") + to_string(offset) + " >= " + to_string(size)).c_str())
 
+namespace {
+
+/**
+ * Bytes a key shares with the previous one in a front-coded column
+ */
+uint32_t sharedPrefix(const memslice &previous, const memslice &key)
+{
+    size_t max = std::min(std::min(previous.size(), key.size()), (size_t)UINT16_MAX);
+    size_t i = 0;
+    while (i < max && previous.ptr()[i] == key.ptr()[i])
+        i++;
+    return i;
+}
+
+}
+
+void ColumnSize::add(uint32_t size)
+{
+    if (!m_count)
+        m_width = size;
+    else if (size != m_width)
+        m_sameWidth = false;
+
+    m_count++;
+    m_dataSize += size;
+}
+
+void ColumnSize::addKey(const memslice &key)
+{
+    if (!m_distinct)
+        m_distinct = boost::make_shared<ColumnSize>();
+
+    bool newRun = !m_count || !(key == m_previous);
+    if (newRun)
+        m_distinct->addFrontCoded(key);
+    m_runs.push_back(m_distinct->count() - 1);
+
+    addFrontCoded(key);
+}
+
+void ColumnSize::addFrontCoded(const memslice &key)
+{
+    bool restart = m_count % RESTART_INTERVAL == 0;
+    if (!m_count)
+    {
+        m_frontCodable = true;
+        m_frontSize = 3 * sizeof(uint32_t); // Marker, interval and end of the last block
+    }
+    add(key.size());
+
+    uint32_t suffix = key.size() - (restart ? 0 : sharedPrefix(m_previous, key));
+    if (suffix > UINT16_MAX)
+        m_frontCodable = false;
+    m_suffixSizes.push_back(suffix);
+    m_frontSize += 2 * sizeof(uint16_t) + suffix + (restart ? sizeof(offset_t) : 0);
+    m_previous = key;
+}
+
+bool ColumnSize::runLength() const
+{
+    if (!m_distinct || m_distinct->count() == m_count)
+        return false;
+    return runLengthSize() < (frontSmaller() ? m_frontSize : plainSize());
+}
+
+uint32_t ColumnSize::itemSize(size_t i, uint32_t size) const
+{
+    if (runLength())
+    {
+        // The first key of a run pays for the run and the stored key
+        if (i && m_runs[i] == m_runs[i - 1])
+            return 0;
+        return sizeof(uint32_t) + m_distinct->itemSize(m_runs[i], size);
+    }
+    if (frontCoded())
+        return 2 * sizeof(uint16_t) + m_suffixSizes[i] + (i % RESTART_INTERVAL == 0 ? sizeof(offset_t) : 0);
+    return size + itemOverhead();
+}
+
+uint32_t ColumnSize::headerSize() const
+{
+    if (runLength())
+        return 3 * sizeof(uint32_t) + m_distinct->headerSize(); // Marker, run count, end of the last run
+    if (frontCoded())
+        return 3 * sizeof(uint32_t);
+    return sizeof(uint32_t) + (fixedIfPlain() || !m_count ? 0 : sizeof(offset_t));
+}
+
+uint32_t ColumnSize::size() const
+{
+    if (runLength())
+        return runLengthSize();
+    return frontCoded() ? m_frontSize : plainSize();
+}
+
+uint32_t ColumnSize::runLengthSize() const
+{
+    return 2 * sizeof(uint32_t) + (m_distinct->count() + 1) * sizeof(uint32_t) + m_distinct->size();
+}
+
+uint32_t ColumnSize::plainSize() const
+{
+    uint32_t header = sizeof(uint32_t) + (fixedIfPlain() || !m_count ? 0 : sizeof(offset_t));
+    return header + m_dataSize + (fixedIfPlain() ? 0 : m_count * sizeof(offset_t));
+}
+
+/**
+ * Writes a column whose size was calculated up front
+ */
+struct ColumnWriter
+{
+    ColumnWriter(mempage &mem, uint32_t offset, const ColumnSize &size)
+        : mem(mem), m_fixed(size.fixed()), m_frontCoded(size.frontCoded()), m_count(size.count()), m_index(0),
+          m_entry(offset + sizeof(uint32_t)), m_offset(m_entry)
+    {
+        if (size.runLength())
+        {
+            // The run table, followed by a column with the key of every run
+            *mem.at<uint32_t>(offset) = COLUMN_RUN_LENGTH;
+            *mem.at<uint32_t>(m_entry) = size.distinct().count();
+            m_entry += sizeof(uint32_t);
+            m_offset = m_entry + (size.distinct().count() + 1) * sizeof(uint32_t);
+            m_runs = boost::make_shared<ColumnWriter>(mem, m_offset, size.distinct());
+            return;
+        }
+
+        if (m_frontCoded)
+        {
+            *mem.at<uint32_t>(offset) = COLUMN_FRONT_CODED;
+            *mem.at<uint32_t>(m_entry) = RESTART_INTERVAL;
+            m_entry += sizeof(uint32_t);
+            m_offset = m_entry + ((m_count + RESTART_INTERVAL - 1) / RESTART_INTERVAL + 1) * sizeof(offset_t);
+            return;
+        }
+
+        *mem.at<uint32_t>(offset) = size.width();
+        if (!m_fixed && m_count)
+        {
+            m_offset += (m_count + 1) * sizeof(offset_t);
+            mark();
+        }
+    }
+
+    void append(const memslice &slice)
+    {
+        if (m_runs)
+        {
+            appendRunLength(slice);
+            return;
+        }
+
+        if (m_frontCoded)
+        {
+            appendFrontCoded(slice);
+            return;
+        }
+
+        copy(slice);
+        if (!m_fixed)
+            mark();
+    }
+
+    // First byte after what has been written
+    uint32_t offset() const { return m_runs ? m_runs->offset() : m_offset; }
+private:
+    void mark()
+    {
+        *mem.at<offset_t>(m_entry) = m_offset;
+        m_entry += sizeof(offset_t);
+    }
+
+    void copy(const memslice &slice)
+    {
+        if (slice.size())
+            memcpy(mem.at<char>(m_offset), slice.ptr(), slice.size());
+        m_offset += slice.size();
+    }
+
+    void appendFrontCoded(const memslice &slice)
+    {
+        uint16_t shared = 0;
+        if (m_index % RESTART_INTERVAL == 0)
+            mark();
+        else
+            shared = sharedPrefix(m_previous, slice);
+
+        *mem.at<uint16_t>(m_offset) = shared;
+        *mem.at<uint16_t>(m_offset + sizeof(uint16_t)) = slice.size() - shared;
+        m_offset += 2 * sizeof(uint16_t);
+        copy(memslice(slice.ptr() + shared, slice.size() - shared));
+
+        m_previous = slice;
+        if (++m_index == m_count)
+            mark();
+    }
+
+    void appendRunLength(const memslice &slice)
+    {
+        if (!m_index || !(slice == m_previous))
+        {
+            *mem.at<uint32_t>(m_entry) = m_index;
+            m_entry += sizeof(uint32_t);
+            m_runs->append(slice);
+        }
+
+        m_previous = slice;
+        if (++m_index == m_count)
+            *mem.at<uint32_t>(m_entry) = m_count;
+    }
+
+    mempage &mem;
+    bool m_fixed;
+    bool m_frontCoded;
+    uint32_t m_count;
+    uint32_t m_index;
+    uint32_t m_entry;
+    uint32_t m_offset;
+    memslice m_previous;
+    boost::shared_ptr<ColumnWriter> m_runs;
+};
+
+/**
+ * Collects which values are references to blobs, for the bitmap of a page
+ */
+struct BlobBits
+{
+    BlobBits() : m_any(false) { }
+
+    void add(const stored_value &value)
+    {
+        m_bits.push_back(value.blob);
+        m_any = m_any || value.blob;
+    }
+
+    flags_t flags() const { return m_any ? FLAG_BLOBS : 0; }
+
+    // Pages without blobs don't have the bitmap
+    uint32_t size() const { return m_any ? BlobBitmap::size(m_bits.size()) : 0; }
+
+    // Returns the first byte after the bitmap
+    uint32_t write(mempage &mem, uint32_t offset) const
+    {
+        for (size_t i = 0; m_any && i < m_bits.size(); i++)
+        {
+            if (m_bits[i])
+                *mem.at<uint8_t>(offset + i / 8) |= 1 << (i % 8);
+        }
+        return offset + size();
+    }
+private:
+    std::vector<bool> m_bits;
+    bool m_any;
+};
+
+//----------------------------------------------------------------------
+//  Parsing
+//
+
+/**
+ * Parser for pages with columns
+ *
+ * Only slices the columns, the type functions aren't needed to find the
+ * keys and values.
+ */
+struct ColumnParser
+{
+    ColumnParser(const mempage &input, const tree_functions &fns)
+        : m_input(input), fns(fns) { }
+
+    leafnode_ptr parseLeafNode()
+    {
+        // Keys and values stay in the page until the leaf is edited
+        return boost::make_shared<LeafNode>(LeafPage(m_input), fns);
+    }
+
+    overflownode_ptr parseOverflowNode()
+    {
+        OverflowPage page(m_input);
+
+        overflownode_ptr ret = boost::make_shared<OverflowNode>(page.count());
+        for (keycount_t i = 0; i < page.count(); i++)
+            ret->values.push_back(stored_value(page.value(i), page.blob(i)));
+
+        ret->next.count = page.nextCount();
+        ret->next.nodeID = page.nextID();
+        return ret;
+    }
+
+    internalnode_ptr parseInternalNode()
+    {
+        InternalPage page(m_input);
+
+        internalnode_ptr ret = boost::make_shared<InternalNode>(page.count());
+        ret->keyData = page.keyData();
+        for (keycount_t i = 0; i < page.count(); i++)
+            ret->branches.push_back(node_branch(page.minKey(i), page.nodeID(i), page.itemCount(i)));
+
+        ret->editQueue.reserve(page.editCount());
+        for (keycount_t j = 0; j < page.editCount(); j++)
+        {
+            edit_t type = page.editType(j);
+            ret->editQueue.push_back(pending_edit(type, page.editKey(j),
+                                                  type != REMOVE_KEY ? page.editValue(j) : memslice(),
+                                                  page.editGuaranteed(j)));
+        }
+        return ret;
+    }
+private:
+    const mempage &m_input;
+    const tree_functions &fns;
+};
+
+/**
+ * Parser for pages in the original layout
+ */
 struct NodeParser
 {
     NodeParser(const mempage &input, const tree_functions &fns)
@@ -222,11 +540,10 @@ private:
 
 //----------------------------------------------------------------------
 
-node_ptr ParseNode(const mempage &input, const tree_functions &fns)
+template<typename P>
+node_ptr parseWith(P &parser, node_type_t type)
 {
-    NodeParser parser(input, fns);
-
-    switch (*input.at<flags_t>(0))
+    switch (type)
     {
         case TYPE_INTERNAL:
             return parser.parseInternalNode();
@@ -234,11 +551,34 @@ node_ptr ParseNode(const mempage &input, const tree_functions &fns)
             return parser.parseLeafNode();
         case TYPE_OVERFLOW:
             return parser.parseOverflowNode();
+        case TYPE_BLOB:
+            throw std::runtime_error("Blob pages are not nodes");
     }
-
     throw std::runtime_error("Unknown node type");
 }
 
+node_ptr ParseNode(const mempage &input, const tree_functions &fns)
+{
+    if (input.size() < sizeof(flags_t))
+        THROW_END_OF_BLOCK(0, input.size());
+
+    node_ptr ret;
+    if (HasColumns(input))
+    {
+        ColumnParser parser(input, fns);
+        ret = parseWith(parser, PageNodeType(input));
+    }
+    else
+    {
+        NodeParser parser(input, fns);
+        ret = parseWith(parser, PageNodeType(input));
+    }
+
+    // The node is identical to its block until someone edits it
+    ret->markClean();
+    return ret;
+}
+
 //----------------------------------------------------------------------
 
 NodeSize::NodeSize(uint32_t blockSize)
@@ -256,24 +596,36 @@ bool NodeSize::shouldSplit()
 LeafNodeSize::LeafNodeSize(const leafnode_ptr &node, uint32_t blockSize)
     : NodeSize(blockSize)
 {
+    ColumnSize keys, values;
+    BlobBits blobs;
+    for (pairlist_t::const_iterator it = node->pairs().begin(); it != node->pairs().end(); ++it)
+    {
+        keys.addKey(it->first);
+        values.add(it->second.size());
+        blobs.add(it->second);
+    }
+
     m_size += sizeof(itemcount_t) + sizeof(nodeid_t);  // For the chained overflow block
+    m_size += keys.headerSize() + values.headerSize();
+    m_size += blobs.size(); // Counted whole, though a split only needs part of it
     uint32_t splitSize = m_size; // Header
 
-    m_size += node->elementsSize();
+    m_size += keys.size() - keys.headerSize() + values.size() - values.headerSize();
 
-    if (shouldSplit() && !node->pairs.empty())
+    if (shouldSplit() && !node->pairs().empty())
     {
         uint32_t pieceSize = std::ceil(m_blockSize / 2.0);
 
         pairlist_t::const_iterator here;
-        pairlist_t::const_iterator startOfThisKey = node->pairs.begin();
+        pairlist_t::const_iterator startOfThisKey = node->pairs().begin();
 
-        for (pairlist_t::const_iterator it = node->pairs.begin(); it != node->pairs.end(); ++it)
+        for (pairlist_t::const_iterator it = node->pairs().begin(); it != node->pairs().end(); ++it)
         {
             if (!(it->first == startOfThisKey->first))
                 startOfThisKey = it;
 
-            splitSize += it->first.size() + it->second.size();
+            size_t i = it - node->pairs().begin();
+            splitSize += keys.itemSize(i, it->first.size()) + values.itemSize(i, it->second.size());
             if (splitSize > pieceSize)
             {
                 here = it;
@@ -290,7 +642,7 @@ LeafNodeSize::LeafNodeSize(const leafnode_ptr &node, uint32_t blockSize)
 
         // Move the split index forwards while we're on the same key
         m_splitStart = here;
-        while (m_splitStart != node->pairs.end() && m_splitStart->first == here->first)
+        while (m_splitStart != node->pairs().end() && m_splitStart->first == here->first)
             ++m_splitStart;
 
         // Move the overflow start back while there is still a key before it that is the same
@@ -304,14 +656,20 @@ LeafNodeSize::LeafNodeSize(const leafnode_ptr &node, uint32_t blockSize)
 OverflowNodeSize::OverflowNodeSize(const overflownode_ptr &node, uint32_t blockSize)
     : NodeSize(blockSize)
 {
-    m_size += sizeof(itemcount_t) + sizeof(nodeid_t);  // For the chained overflow block
-    uint32_t baseSize = m_size;
-
+    ColumnSize values;
+    BlobBits blobs;
     for (valuelist_t::const_iterator it = node->values.begin(); it != node->values.end(); ++it)
     {
-        m_size += it->size();
+        values.add(it->size());
+        blobs.add(*it);
     }
 
+    m_size += sizeof(itemcount_t) + sizeof(nodeid_t);  // For the chained overflow block
+    m_size += values.headerSize() + blobs.size();
+    uint32_t baseSize = m_size;
+
+    m_size += values.size() - values.headerSize();
+
     if (shouldSplit())
     {
         uint32_t pieceSize = m_blockSize;
@@ -320,7 +678,7 @@ OverflowNodeSize::OverflowNodeSize(const overflownode_ptr &node, uint32_t blockS
         // Find the split index
         for (m_splitIndex = 0; m_splitIndex < node->valueCount(); m_splitIndex++)
         {
-            splitSize += node->values[m_splitIndex].size();
+            splitSize += values.itemSize(m_splitIndex, node->values[m_splitIndex].size());
             if (splitSize > pieceSize)
                 break;
         }
@@ -334,18 +692,28 @@ InternalNodeSize::InternalNodeSize(const internalnode_ptr &node, uint32_t blockS
 
     m_size += sizeof(keycount_t); // Size of edit queue
 
+    ColumnSize keys;
     for (branchlist_t::const_iterator it = node->branches.begin(); it != node->branches.end(); ++it)
     {
         // We never store the first key
         if (it != node->branches.begin())
-            m_size += it->minKey.size();
+            keys.addKey(it->minKey);
         m_size += sizeof(nodeid_t) + sizeof(itemcount_t);
     }
+    m_size += keys.size();
 
-    for (editlist_t::const_iterator it = node->editQueue.begin(); it != node->editQueue.end(); ++it)
+    if (!node->editQueue.empty())
     {
-        m_editQueueSize += sizeof(uint8_t); // 1 byte for the edit type
-        m_editQueueSize += it->key.size() + it->value.size();
+        ColumnSize editKeys, editValues;
+        for (editlist_t::const_iterator it = node->editQueue.begin(); it != node->editQueue.end(); ++it)
+        {
+            m_editQueueSize += sizeof(uint8_t); // 1 byte for the edit type
+            editKeys.add(it->key.size());
+            editValues.add(it->edit != REMOVE_KEY ? it->value.size() : 0);
+        }
+        // The column headers don't grow with the queue, so they are part of the node
+        m_size += editKeys.headerSize() + editValues.headerSize();
+        m_editQueueSize += editKeys.size() - editKeys.headerSize() + editValues.size() - editValues.headerSize();
     }
 
     if (shouldSplit())
@@ -355,7 +723,7 @@ InternalNodeSize::InternalNodeSize(const internalnode_ptr &node, uint32_t blockS
 
         for (m_splitIndex = 1; m_splitIndex < node->branchCount(); m_splitIndex++)
         {
-            if (m_splitIndex != 1) splitSize += node->branch(m_splitIndex-1).minKey.size();
+            if (m_splitIndex != 1) splitSize += keys.itemSize(m_splitIndex-2, node->branch(m_splitIndex-1).minKey.size());
             splitSize += sizeof(nodeid_t) + sizeof(itemcount_t);
 
             if (splitSize > pieceSize)
@@ -378,8 +746,17 @@ mempage SerializeLeafNode(const leafnode_ptr &node)
 
     uint32_t offset = 0;
 
+    ColumnSize keySize, valueSize;
+    BlobBits blobs;
+    for (pairlist_t::const_iterator it = node->pairs().begin(); it != node->pairs().end(); ++it)
+    {
+        keySize.addKey(it->first);
+        valueSize.add(it->second.size());
+        blobs.add(it->second);
+    }
+
     // Flags
-    *mem.at<flags_t>(offset) = node->nodeType();
+    *mem.at<flags_t>(offset) = node->nodeType() | FLAG_COLUMNS | blobs.flags();
     offset += sizeof(flags_t);
 
     // Count
@@ -387,18 +764,16 @@ mempage SerializeLeafNode(const leafnode_ptr &node)
     offset += sizeof(keycount_t);
 
     // Keys
-    for (pairlist_t::const_iterator it = node->pairs.begin(); it != node->pairs.end(); ++it)
-    {
-        memcpy(mem.at<char>(offset), it->first.ptr(), it->first.size());
-        offset += it->first.size();
-    }
+    ColumnWriter keys(mem, offset, keySize);
+    for (pairlist_t::const_iterator it = node->pairs().begin(); it != node->pairs().end(); ++it)
+        keys.append(it->first);
+    offset = keys.offset();
 
     // Values
-    for (pairlist_t::const_iterator it = node->pairs.begin(); it != node->pairs.end(); ++it)
-    {
-        memcpy(mem.at<char>(offset), it->second.ptr(), it->second.size());
-        offset += it->second.size();
-    }
+    ColumnWriter values(mem, offset, valueSize);
+    for (pairlist_t::const_iterator it = node->pairs().begin(); it != node->pairs().end(); ++it)
+        values.append(it->second);
+    offset = blobs.write(mem, values.offset());
 
     // Overflow block
     *mem.at<itemcount_t>(offset) = node->overflow.count;
@@ -407,6 +782,8 @@ mempage SerializeLeafNode(const leafnode_ptr &node)
     *mem.at<nodeid_t>(offset) = node->overflow.nodeID;
     offset += sizeof(nodeid_t);
 
+    assert(offset == mem.size());
+
     return mem;
 }
 
@@ -417,8 +794,16 @@ mempage SerializeOverflowNode(const overflownode_ptr &node)
 
     uint32_t offset = 0;
 
+    ColumnSize valueSize;
+    BlobBits blobs;
+    for (valuelist_t::const_iterator it = node->values.begin(); it != node->values.end(); ++it)
+    {
+        valueSize.add(it->size());
+        blobs.add(*it);
+    }
+
     // Flags
-    *mem.at<flags_t>(offset) = node->nodeType();
+    *mem.at<flags_t>(offset) = node->nodeType() | FLAG_COLUMNS | blobs.flags();
     offset += sizeof(flags_t);
 
     // Count
@@ -426,11 +811,10 @@ mempage SerializeOverflowNode(const overflownode_ptr &node)
     offset += sizeof(keycount_t);
 
     // Values
+    ColumnWriter values(mem, offset, valueSize);
     for (valuelist_t::const_iterator it = node->values.begin(); it != node->values.end(); ++it)
-    {
-        memcpy(mem.at<char>(offset), it->ptr(), it->size());
-        offset += it->size();
-    }
+        values.append(*it);
+    offset = blobs.write(mem, values.offset());
 
     // Next overflow block
     *mem.at<itemcount_t>(offset) = node->next.count;
@@ -439,6 +823,8 @@ mempage SerializeOverflowNode(const overflownode_ptr &node)
     *mem.at<nodeid_t>(offset) = node->next.nodeID;
     offset += sizeof(nodeid_t);
 
+    assert(offset == mem.size());
+
     return mem;
 }
 
@@ -450,7 +836,7 @@ mempage SerializeInternalNode(const internalnode_ptr &node)
     uint32_t offset = 0;
 
     // Flags
-    *mem.at<flags_t>(offset) = node->nodeType();
+    *mem.at<flags_t>(offset) = node->nodeType() | FLAG_COLUMNS;
     offset += sizeof(flags_t);
 
     // Count
@@ -462,16 +848,20 @@ mempage SerializeInternalNode(const internalnode_ptr &node)
     offset += sizeof(keycount_t);
 
     // Keys (except the 1st one)
-    bool first = true;
+    ColumnSize keySize;
     for (branchlist_t::const_iterator it = node->branches.begin(); it != node->branches.end(); ++it)
     {
-        if (!first)
-        {
-            memcpy(mem.at<char>(offset), it->minKey.ptr(), it->minKey.size());
-            offset += it->minKey.size();
-        }
-        first = false;
+        if (it != node->branches.begin())
+            keySize.addKey(it->minKey);
+    }
+
+    ColumnWriter keys(mem, offset, keySize);
+    for (branchlist_t::const_iterator it = node->branches.begin(); it != node->branches.end(); ++it)
+    {
+        if (it != node->branches.begin())
+            keys.append(it->minKey);
     }
+    offset = keys.offset();
 
     // IDs
     for (branchlist_t::const_iterator it = node->branches.begin(); it != node->branches.end(); ++it)
@@ -487,28 +877,30 @@ mempage SerializeInternalNode(const internalnode_ptr &node)
         offset += sizeof(itemcount_t);
     }
 
-    // Edit types
-    for (editlist_t::const_iterator it = node->editQueue.begin(); it != node->editQueue.end(); ++it)
-    {
-        *mem.at<uint8_t>(offset) = it->edit;
-        offset += sizeof(uint8_t);
-    }
-
-    // Edit keys
-    for (editlist_t::const_iterator it = node->editQueue.begin(); it != node->editQueue.end(); ++it)
-    {
-        memcpy(mem.at<char>(offset), it->key.ptr(), it->key.size());
-        offset += it->key.size();
-    }
-
-    // Edit values
-    for (editlist_t::const_iterator it = node->editQueue.begin(); it != node->editQueue.end(); ++it)
+    if (!node->editQueue.empty())
     {
-        if (it->edit != REMOVE_KEY) // Doesn't have a value
+        // Edit types
+        ColumnSize editKeySize, editValueSize;
+        for (editlist_t::const_iterator it = node->editQueue.begin(); it != node->editQueue.end(); ++it)
         {
-            memcpy(mem.at<char>(offset), it->value.ptr(), it->value.size());
-            offset += it->value.size();
+            *mem.at<uint8_t>(offset) = it->edit | (it->guaranteed ? EDIT_GUARANTEED : 0);
+            offset += sizeof(uint8_t);
+
+            editKeySize.add(it->key.size());
+            editValueSize.add(it->edit != REMOVE_KEY ? it->value.size() : 0);
         }
+
+        // Edit keys
+        ColumnWriter editKeys(mem, offset, editKeySize);
+        for (editlist_t::const_iterator it = node->editQueue.begin(); it != node->editQueue.end(); ++it)
+            editKeys.append(it->key);
+        offset = editKeys.offset();
+
+        // Edit values (removes don't have one)
+        ColumnWriter editValues(mem, offset, editValueSize);
+        for (editlist_t::const_iterator it = node->editQueue.begin(); it != node->editQueue.end(); ++it)
+            editValues.append(it->edit != REMOVE_KEY ? it->value : memslice());
+        offset = editValues.offset();
     }
 
     assert(offset == mem.size());
@@ -526,7 +918,10 @@ mempage SerializeNode(const node_ptr &node)
             return SerializeInternalNode(boost::static_pointer_cast<InternalNode>(node));
         case TYPE_OVERFLOW:
             return SerializeOverflowNode(boost::static_pointer_cast<OverflowNode>(node));
+        case TYPE_BLOB:
+            throw std::runtime_error("Blob pages are not nodes");
     }
+    throw std::runtime_error("Unknown node type");
 }
 
 }
@@ -17,6 +17,7 @@
  *        0x0000   leaf node
  *        0x0001   internal node
  *        0x0002   overflow node
+ *        0x0003   blob (see below)
  *
  * The invariant for overflow blocks is that the keys in there must ALL be the
  * same as the final key in the leaf block. In other words, we never split a key
@@ -59,6 +60,70 @@
  *       | = a key that divides the keyspace for the node s.t. the key is >
  *       than the largest key in the left node and <= the smallest key in the
  *       right node.
+ *
+ * COLUMNS
+ * -------
+ * The above is the original layout, which can only be read front to back by
+ * asking the type functions for the size of every key and value. Pages are
+ * now written with FLAG_COLUMNS set in the flags, and every list of keys or
+ * values is stored as a column that can be indexed directly:
+ *
+ *   [ uint32 ]           W, the size of every item, or 0 if they differ
+ *   if W > 0:
+ *   [ N x W bytes ]      the items
+ *   if W == 0 and N > 0:
+ *   [ N+1 x uint32 ]     page offsets, item i is [o(i), o(i+1))
+ *   [ ... bytes ]        the items
+ *
+ * Key columns may instead be front coded, if that makes them smaller:
+ *
+ *   [ uint32 ]           0xFFFFFFFF
+ *   [ uint32 ]           R, the restart interval
+ *   [ K+1 x uint32 ]     page offsets of every R-th item, K = ceil(N/R)
+ *   [ N x ... ]          [ uint16 ] bytes shared with the previous key
+ *                        [ uint16 ] size of the rest
+ *                        [ ... ]    the rest of the key
+ *
+ * Every R-th key (a restart point) is stored in full, so a lookup can binary
+ * search the restart points and only decode the keys after one of them.
+ *
+ * Or, if keys repeat, run-length encoded:
+ *
+ *   [ uint32 ]           0xFFFFFFFE
+ *   [ uint32 ]           R, the number of runs of equal keys
+ *   [ R+1 x uint32 ]     index of the first key of every run, and then N
+ *   [ ... ]              column with the key of every run, not run-length
+ *                        encoded itself
+ *
+ * Keys of a run all point at the same stored key when the page is read.
+ *
+ * Columns of fixed-size types don't take more space than before. The other
+ * fields are laid out as in the original format, with the columns in place
+ * of the serialized keys and values. Internal nodes without queued edits
+ * don't have the edit key and value columns, and the value of a removed key
+ * is an empty item. The type of a guaranteed edit has EDIT_GUARANTEED (0x80)
+ * set, so it can still be counted without looking at the leaves after the
+ * page is read back.
+ *
+ * Pages without the flag are still parsed the old way.
+ *
+ * BLOBS
+ * -----
+ * Values larger than the blob threshold of a tree are written to a page of
+ * their own:
+ *
+ *   [ uint16 ]           0x0003
+ *   [ uint64 ]           salt, so equal values don't end up in one block
+ *   [ ... bytes ]        the value
+ *
+ * The leaf or overflow page stores a reference in place of the value:
+ *
+ *   [ hash160 ]          blob page identifier
+ *   [ uint32 ]           size of the value
+ *
+ * Such pages have FLAG_BLOBS (0x0200) set, and a bitmap right after the
+ * values column in which bit i % 8 of byte i / 8 is set if value i is a
+ * reference.
  */
 
 #include <stdint.h>
@@ -70,14 +135,67 @@
 #include <libbruce/types.h>
 
 #include "nodes.h"
+#include "pages.h"
 #include "leaf_node.h"
 #include "internal_node.h"
 #include "overflow_node.h"
 
 namespace libbruce {
 
-// Sizes of types inside the block
-typedef uint16_t flags_t;
+/**
+ * Calculates the size of a column from the sizes of its items
+ *
+ * Key columns are given the keys themselves, so front coding and run-length
+ * encoding can be considered; the smallest encoding is used.
+ */
+struct ColumnSize
+{
+    ColumnSize() : m_count(0), m_dataSize(0), m_width(0), m_sameWidth(true), m_frontCodable(false), m_frontSize(0) { }
+
+    void add(uint32_t size);
+    void addKey(const memslice &key);
+
+    uint32_t count() const { return m_count; }
+    bool fixed() const { return !runLength() && !frontCoded() && fixedIfPlain(); }
+    bool frontCoded() const { return !runLength() && frontSmaller(); }
+    bool runLength() const;
+    uint32_t width() const { return fixed() ? m_width : 0; }
+
+    // The column of distinct keys inside a run-length encoded column
+    const ColumnSize &distinct() const { return *m_distinct; }
+
+    // Bytes per item in addition to the item itself, if not front coded
+    uint32_t itemOverhead() const { return fixed() ? 0 : sizeof(offset_t); }
+
+    /**
+     * Bytes taken by the i-th item, which has the given size
+     */
+    uint32_t itemSize(size_t i, uint32_t size) const;
+
+    // Bytes for the column regardless of the items
+    uint32_t headerSize() const;
+    uint32_t size() const;
+private:
+    uint32_t m_count;
+    uint32_t m_dataSize;
+    uint32_t m_width;
+    bool m_sameWidth;
+
+    bool m_frontCodable;
+    uint32_t m_frontSize;
+    memslice m_previous;
+    std::vector<uint32_t> m_suffixSizes;
+
+    boost::shared_ptr<ColumnSize> m_distinct;
+    std::vector<uint32_t> m_runs; // Index of the run of every key
+
+    void addFrontCoded(const memslice &key);
+    uint32_t plainSize() const;
+    uint32_t runLengthSize() const;
+    bool frontSmaller() const { return m_frontCodable && m_frontSize < plainSize(); }
+    bool fixedIfPlain() const { return m_count && m_sameWidth && m_width; }
+};
+
 
 node_ptr ParseNode(const mempage &input, const tree_functions &fns);
 
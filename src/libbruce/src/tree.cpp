@@ -30,6 +30,26 @@ void tree_unsafe::remove(const memslice &key, const memslice &value, bool guaran
     m_impl->remove(key, value, guaranteed);
 }
 
+void tree_unsafe::insert_many(const std::vector<memslice> &keys, const std::vector<memslice> &values)
+{
+    m_impl->insertMany(keys, values);
+}
+
+void tree_unsafe::upsert_many(const std::vector<memslice> &keys, const std::vector<memslice> &values, bool guaranteed)
+{
+    m_impl->upsertMany(keys, values, guaranteed);
+}
+
+void tree_unsafe::remove_many(const std::vector<memslice> &keys, bool guaranteed)
+{
+    m_impl->removeMany(keys, guaranteed);
+}
+
+void tree_unsafe::setBlobThreshold(uint32_t threshold)
+{
+    m_impl->setBlobThreshold(threshold);
+}
+
 mutation tree_unsafe::write()
 {
     return m_impl->write();
@@ -40,19 +60,19 @@ bool tree_unsafe::get(const memslice &key, memslice *value)
     return m_impl->get(key, value);
 }
 
-tree_iterator_unsafe tree_unsafe::find(const memslice &key)
+tree_iterator_unsafe tree_unsafe::find(const memslice &key, be::fetch_hint_t hint)
 {
-    return tree_iterator_unsafe(m_impl->find(key));
+    return tree_iterator_unsafe(m_impl->find(key, hint));
 }
 
-tree_iterator_unsafe tree_unsafe::seek(itemcount_t n)
+tree_iterator_unsafe tree_unsafe::seek(itemcount_t n, be::fetch_hint_t hint)
 {
-    return tree_iterator_unsafe(m_impl->seek(n));
+    return tree_iterator_unsafe(m_impl->seek(n, hint));
 }
 
-tree_iterator_unsafe tree_unsafe::begin()
+tree_iterator_unsafe tree_unsafe::begin(be::fetch_hint_t hint)
 {
-    return tree_iterator_unsafe(m_impl->begin());
+    return tree_iterator_unsafe(m_impl->begin(hint));
 }
 
 tree_iterator_unsafe tree_unsafe::end()
@@ -4,14 +4,64 @@
 #include "leaf_node.h"
 #include "internal_node.h"
 #include "overflow_node.h"
+#include "node_cache.h"
+#include "util/thread_pool.h"
 #include "helpers.h"
 
+#include <boost/bind.hpp>
+#include <random>
 #include <set>
 
 namespace libbruce {
 
+namespace {
+
+uint64_t blobSalt()
+{
+    static thread_local std::mt19937_64 rng((std::random_device())());
+    return rng();
+}
+
+// Fewer nodes than this aren't worth handing to another thread
+const size_t MIN_NODES_PER_TASK = 8;
+
+/**
+ * Workers that serialize the dirty nodes of a level in parallel
+ *
+ * Shared by all trees in the process; writes come in bursts, and a pool per
+ * tree would mostly sit idle.
+ */
+util::thread_pool &serializerPool(unsigned *threads)
+{
+    static const unsigned count = std::max(std::thread::hardware_concurrency(), 1u);
+    static util::thread_pool pool(count);
+    *threads = count;
+    return pool;
+}
+
+/**
+ * Serialize nodes [begin, end) of a level, and hash them if a block engine is given
+ */
+void serializePart(const std::vector<std::pair<node_ptr, nodeid_t*> > *level,
+                   be::mempagelist_t *pages, be::blockidlist_t *ids, be::be *hasher,
+                   size_t begin, size_t end)
+{
+    for (size_t i = begin; i < end; i++)
+        (*pages)[i] = SerializeNode((*level)[i].first);
+
+    if (hasher)
+    {
+        be::blockidlist_t partIDs = hasher->ids(be::mempagelist_t(pages->begin() + begin, pages->begin() + end));
+        std::copy(partIDs.begin(), partIDs.end(), ids->begin() + begin);
+    }
+}
+
+}
+
 tree_impl::tree_impl(be::be &be, maybe_nodeid rootID, mempool &mempool, const tree_functions &fns)
-    : m_be(be), m_rootID(rootID), m_mempool(mempool), m_fns(fns)
+    : m_be(be), m_rootID(rootID), m_mempool(mempool), m_fns(fns),
+      m_shareNodes(be.contentAddressed() && NodeCache::instance().enabled()),
+      m_blobThreshold(0)
 {
 }
 
@@ -19,24 +69,64 @@ void tree_impl::insert(const memslice &key, const memslice &value)
 {
     validateKVSize(key, value);
 
-    apply(root(), pending_edit(INSERT, key, value, true), SHALLOW);
+    apply(ownRoot(), pending_edit(INSERT, key, value, true), SHALLOW);
 }
 
 void tree_impl::upsert(const memslice &key, const memslice &value, bool guaranteed)
 {
     validateKVSize(key, value);
 
-    apply(root(), pending_edit(UPSERT, key, value, guaranteed), SHALLOW);
+    apply(ownRoot(), pending_edit(UPSERT, key, value, guaranteed), SHALLOW);
 }
 
 void tree_impl::remove(const memslice &key, bool guaranteed)
 {
-    apply(root(), pending_edit(REMOVE_KEY, key, memslice(), guaranteed), SHALLOW);
+    apply(ownRoot(), pending_edit(REMOVE_KEY, key, memslice(), guaranteed), SHALLOW);
 }
 
 void tree_impl::remove(const memslice &key, const memslice &value, bool guaranteed)
 {
-    apply(root(), pending_edit(REMOVE_KV, key, value, guaranteed), SHALLOW);
+    apply(ownRoot(), pending_edit(REMOVE_KV, key, value, guaranteed), SHALLOW);
+}
+
+void tree_impl::insertMany(const std::vector<memslice> &keys, const std::vector<memslice> &values)
+{
+    checkBatchSize(keys, values);
+
+    editlist_t edits;
+    edits.reserve(keys.size());
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        validateKVSize(keys[i], values[i]);
+        edits.push_back(pending_edit(INSERT, keys[i], values[i], true));
+    }
+
+    applyMany(edits);
+}
+
+void tree_impl::upsertMany(const std::vector<memslice> &keys, const std::vector<memslice> &values, bool guaranteed)
+{
+    checkBatchSize(keys, values);
+
+    editlist_t edits;
+    edits.reserve(keys.size());
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        validateKVSize(keys[i], values[i]);
+        edits.push_back(pending_edit(UPSERT, keys[i], values[i], guaranteed));
+    }
+
+    applyMany(edits);
+}
+
+void tree_impl::removeMany(const std::vector<memslice> &keys, bool guaranteed)
+{
+    editlist_t edits;
+    edits.reserve(keys.size());
+    for (size_t i = 0; i < keys.size(); i++)
+        edits.push_back(pending_edit(REMOVE_KEY, keys[i], memslice(), guaranteed));
+
+    applyMany(edits);
 }
 
 //----------------------------------------------------------------------
@@ -57,29 +147,152 @@ node_ptr &tree_impl::root()
     return m_root;
 }
 
-const node_ptr &tree_impl::child(node_branch &branch)
+/**
+ * The node of branch i, for reading
+ *
+ * Children are linked into their parent, unless the parent is shared.
+ */
+node_ptr tree_impl::child(const internalnode_ptr &internal, keycount_t i, be::fetch_hint_t hint)
 {
-    if (!branch.child) branch.child = load(branch.nodeID);
-    return branch.child;
+    node_branch &branch = internal->branches[i];
+    if (branch.child) return branch.child;
+    if (internal->shared()) return unlinkedNode(branch.nodeID, hint);
+    return branch.child = load(branch.nodeID, hint);
 }
 
-const node_ptr &tree_impl::overflowNode(overflow_t &overflow)
+/**
+ * The next node of an overflow chain, for reading
+ */
+node_ptr tree_impl::overflowNode(const node_ptr &owner, overflow_t &overflow, be::fetch_hint_t hint)
 {
     assert(!overflow.empty());
-    if (!overflow.node) overflow.node = load(overflow.nodeID);
-    return overflow.node;
+    if (overflow.node) return overflow.node;
+    if (owner->shared()) return unlinkedNode(overflow.nodeID, hint);
+    return overflow.node = load(overflow.nodeID, hint);
 }
 
-node_ptr tree_impl::load(nodeid_t id)
+/**
+ * Load a node below a shared node
+ *
+ * These are kept by ID, so that every lookup doesn't load them again. Once
+ * the parent is copied they can be in two places, so they are shared too.
+ */
+node_ptr tree_impl::unlinkedNode(const nodeid_t &id, be::fetch_hint_t hint)
 {
-    m_loadedIDs.push_back(id);
-    return deserialize(m_be.get(id));
+    nodemap_t::const_iterator it = m_unlinked.find(id);
+    if (it != m_unlinked.end())
+        return it->second;
+
+    node_ptr ret = load(id, hint);
+    ret->markShared();
+    m_unlinked[id] = ret;
+    return ret;
 }
 
-node_ptr tree_impl::deserialize(const mempage &mem)
+node_ptr tree_impl::load(nodeid_t id, be::fetch_hint_t hint)
+{
+    node_ptr ret;
+    if (!loadShared(id, &ret))
+        ret = deserialize(id, m_be.get(id, hint), hint);
+
+    // Shared nodes are recorded when we copy them
+    if (!ret->shared())
+        m_loaded.push_back(std::make_pair(id, ret));
+    return ret;
+}
+
+/**
+ * Get a node from the process-wide node cache
+ *
+ * The node is shared, so it has to be copied before it's changed.
+ */
+bool tree_impl::loadShared(const nodeid_t &id, node_ptr *node)
+{
+    mempage page;
+    if (!m_shareNodes || !NodeCache::instance().get(id, m_fns, node, &page))
+        return false;
+
+    m_mempool.retain(page);
+    return true;
+}
+
+node_ptr tree_impl::deserialize(const nodeid_t &id, const mempage &mem, be::fetch_hint_t hint)
 {
     m_mempool.retain(mem);
-    return ParseNode(mem, m_fns);
+    node_ptr ret = ParseNode(mem, m_fns);
+
+    // From here on, other trees may use the node as well
+    if (m_shareNodes && hint != be::FETCH_SCAN)
+        NodeCache::instance().put(id, m_fns, ret, mem);
+
+    return ret;
+}
+
+/**
+ * Replace a shared node by a copy of our own, so that it can be changed
+ */
+void tree_impl::own(node_ptr &node, const nodeid_t &id)
+{
+    if (!node->shared())
+        return;
+
+    node = CopyNode(node);
+    m_loaded.push_back(std::make_pair(id, node));
+}
+
+const node_ptr &tree_impl::ownRoot()
+{
+    node_ptr &node = root();
+    if (m_rootID) own(node, *m_rootID);
+    return node;
+}
+
+/**
+ * The node of branch i, for editing
+ *
+ * The parent must be our own.
+ */
+const node_ptr &tree_impl::ownChild(const internalnode_ptr &internal, keycount_t i)
+{
+    assert(!internal->shared());
+
+    node_branch &branch = internal->branches[i];
+    if (!branch.child) branch.child = load(branch.nodeID);
+    own(branch.child, branch.nodeID);
+    return branch.child;
+}
+
+/**
+ * The next node of an overflow chain, for editing
+ *
+ * The owner of the record must be our own.
+ */
+const node_ptr &tree_impl::ownOverflow(overflow_t &overflow)
+{
+    assert(!overflow.empty() || overflow.node);
+
+    if (!overflow.node) overflow.node = load(overflow.nodeID);
+    own(overflow.node, overflow.nodeID);
+    return overflow.node;
+}
+
+/**
+ * Make the first n nodes of a path from the root our own
+ *
+ * Copies are linked into their (copied) parents, and replace the nodes in
+ * the path.
+ */
+void tree_impl::ownPath(treepath_t &path, size_t n)
+{
+    path[0].node = ownRoot();
+
+    for (size_t j = 1; j < n; j++)
+    {
+        node_branch &branch = path[j - 1].asInternal()->branches[path[j - 1].index];
+        if (!branch.child) branch.child = path[j].node;
+        own(branch.child, branch.nodeID);
+        path[j].node = branch.child;
+    }
 }
 
 //----------------------------------------------------------------------
@@ -88,7 +301,7 @@ node_ptr tree_impl::deserialize(const mempage &mem)
 
 void tree_impl::apply(const pending_edit &edit, Depth depth)
 {
-    apply(root(), edit, depth);
+    apply(ownRoot(), edit, depth);
 }
 
 void tree_impl::apply(const node_ptr &node, const pending_edit &edit, Depth depth)
@@ -116,10 +329,12 @@ NODE_CASE_OVERFLOW
     assert(false);
 
 NODE_CASE_INT
+    internal->markDirty();
+
     if (depth == DEEP)
     {
         keycount_t i = FindInternalKey(internal, edit.key, m_fns);
-        apply(child(internal->branches[i]), edit, depth);
+        apply(ownChild(internal, i), edit, depth);
         internal->branches[i].itemCount = internal->branches[i].child->itemCount();
     }
     else
@@ -135,12 +350,62 @@ NODE_CASE_INT
 NODE_CASE_END
 }
 
+/**
+ * Apply a batch of edits with one sort and one merge
+ *
+ * Applying them one by one would do a sorted insert into the root's edit
+ * queue for every edit, which is quadratic for large batches. A batch that
+ * makes the queue too large is pushed down right away, which only loads the
+ * children it touches.
+ */
+void tree_impl::applyMany(editlist_t &edits)
+{
+    if (edits.empty())
+        return;
+
+    std::stable_sort(edits.begin(), edits.end(), EditOrder(m_fns));
+
+    const node_ptr &node = ownRoot();
+    if (node->nodeType() == TYPE_LEAF)
+    {
+        leafnode_ptr leaf = boost::static_pointer_cast<LeafNode>(node);
+        if (!applyEditsToLeaf(leaf, edits.begin(), edits.end()))
+        {
+            for (editlist_t::const_iterator it = edits.begin(); it != edits.end(); ++it)
+                apply(leaf, *it, SHALLOW);
+        }
+        return;
+    }
+
+    internalnode_ptr internal = boost::static_pointer_cast<InternalNode>(node);
+    mergeEdits(internal, edits.begin(), edits.end());
+    maybeApplyEdits(internal);
+}
+
+/**
+ * Add a sorted range of edits to the edit queue of a node
+ *
+ * The same as adding them one at a time: edits end up after queued edits
+ * for the same key.
+ */
+void tree_impl::mergeEdits(const internalnode_ptr &internal, const editlist_t::iterator &begin, const editlist_t::iterator &end)
+{
+    internal->markDirty();
+
+    size_t queued = internal->editQueue.size();
+    internal->editQueue.insert(internal->editQueue.end(), begin, end);
+    std::inplace_merge(internal->editQueue.begin(), internal->editQueue.begin() + queued, internal->editQueue.end(), EditOrder(m_fns));
+}
+
 void tree_impl::leafInsert(const leafnode_ptr &leaf, const memslice &key, const memslice &value, bool upsert, uint32_t *delta)
 {
+    leaf->markDirty();
+
     pairlist_t::iterator it = leaf->find(key);
-    if (upsert && it != leaf->pairs.end())
+    if (upsert && it != leaf->pairs().end())
     {
         // Update
+        dropValue(it->second);
         leaf->update_value(it, value);
     }
     else
@@ -149,19 +414,19 @@ void tree_impl::leafInsert(const leafnode_ptr &leaf, const memslice &key, const
 
         // If we found PAST the final key and there is an overflow block, we need to pull the entire
         // overflow block in and insert it after that.
-        if (it == leaf->pairs.end() && !leaf->overflow.empty())
+        if (it == leaf->pairs().end() && !leaf->overflow.empty())
         {
-            memslice o_key = leaf->pairs.rbegin()->first;
+            memslice o_key = leaf->pairs().rbegin()->first;
             while (!leaf->overflow.empty())
             {
-                memslice o_value = overflowPull(leaf->overflow);
+                stored_value o_value = overflowPull(leaf->overflow);
                 leaf->insert(kv_pair(o_key, o_value));
             }
             leaf->insert(kv_pair(key, value));
             if (delta) (*delta)++;
         }
         // If we found the final key, insert into the overflow block
-        else if (it == (--leaf->pairs.end()) && !leaf->overflow.empty())
+        else if (it == (--leaf->pairs().end()) && !leaf->overflow.empty())
         {
             // There is an overflow block already. Insert in there.
             overflowInsert(leaf->overflow, value, delta);
@@ -176,39 +441,42 @@ void tree_impl::leafInsert(const leafnode_ptr &leaf, const memslice &key, const
 
 void tree_impl::leafRemove(const leafnode_ptr &leaf, const memslice &key, const memslice *value, uint32_t *delta)
 {
-    if (leaf->pairs.empty()) return;
+    if (!leaf->pairCount()) return;
 
-    pairlist_t::iterator begin, end;
+    // Look in the page first, so a remove that doesn't match leaves the node lazy
+    keycount_t begin, end;
     leaf->findRange(key, &begin, &end);
 
-    pairlist_t::iterator eraseLocation = leaf->pairs.end();
+    keycount_t eraseIndex = end;
 
     // Regular old remove from this block
-    for (pairlist_t::iterator it = begin; it != end; ++it)
+    for (keycount_t i = begin; i != end; ++i)
     {
-        if (!value || m_fns.valueCompare(it->second, *value) == 0)
+        if (!value || m_fns.valueCompare(fetchValue(leaf->value(i)), *value) == 0)
         {
-            eraseLocation = it;
+            eraseIndex = i;
             break;
         }
     }
 
-    if (eraseLocation != leaf->pairs.end())
+    if (eraseIndex != end)
     {
         // Did erase in this block
-        eraseLocation = leaf->erase(eraseLocation);
+        leaf->markDirty();
+        dropValue(leaf->value(eraseIndex));
+        pairlist_t::iterator eraseLocation = leaf->erase(leaf->pairs().begin() + eraseIndex);
 
         // If we removed the final position, pull back from the overflow block.
-        if (eraseLocation == leaf->pairs.end() && !leaf->overflow.empty())
+        if (eraseLocation == leaf->pairs().end() && !leaf->overflow.empty())
         {
-            memslice ret = overflowPull(leaf->overflow);
+            stored_value ret = overflowPull(leaf->overflow);
             leaf->insert(kv_pair(key, ret));
         }
 
         if (delta) (*delta)--;
     }
     // If we did not erase here, but the key matches the last key, search in the overflow block
-    else if (!leaf->overflow.empty() && key == leaf->pairs.rbegin()->first)
+    else if (!leaf->overflow.empty() && key == leaf->key(leaf->pairCount() - 1))
     {
         // Did not erase from this leaf but key matches overflow key, recurse
         return overflowRemove(leaf->overflow, value, delta);
@@ -217,7 +485,8 @@ void tree_impl::leafRemove(const leafnode_ptr &leaf, const memslice &key, const
 
 void tree_impl::overflowInsert(overflow_t &overflow_rec, const memslice &value, uint32_t *delta)
 {
-    overflownode_ptr overflow = boost::static_pointer_cast<OverflowNode>(overflowNode(overflow_rec));
+    overflownode_ptr overflow = boost::static_pointer_cast<OverflowNode>(ownOverflow(overflow_rec));
+    overflow->markDirty();
     overflow->append(value);
     if (delta) (*delta)++;
     overflow_rec.count = overflow->itemCount();
@@ -225,14 +494,16 @@ void tree_impl::overflowInsert(overflow_t &overflow_rec, const memslice &value,
 
 void tree_impl::overflowRemove(overflow_t &overflow_rec, const memslice *value, uint32_t *delta)
 {
-    overflownode_ptr overflow = boost::static_pointer_cast<OverflowNode>(overflowNode(overflow_rec));
+    overflownode_ptr overflow = boost::static_pointer_cast<OverflowNode>(ownOverflow(overflow_rec));
 
     // Try to remove from this block
     bool erased = false;
     for (valuelist_t::iterator it = overflow->values.begin(); it != overflow->values.end(); ++it)
     {
-        if (!value || m_fns.valueCompare(*it, *value) == 0)
+        if (!value || m_fns.valueCompare(fetchValue(*it), *value) == 0)
         {
+            overflow->markDirty();
+            dropValue(*it);
             overflow->values.erase(it);
             erased = true;
         }
@@ -247,7 +518,8 @@ void tree_impl::overflowRemove(overflow_t &overflow_rec, const memslice *value,
     // If this block is now empty, pull a value from the next one
     if (!overflow->itemCount() && !overflow->next.empty())
     {
-        memslice value = overflowPull(overflow->next);
+        overflow->markDirty();
+        stored_value value = overflowPull(overflow->next);
         overflow->append(value);
     }
 
@@ -256,23 +528,50 @@ void tree_impl::overflowRemove(overflow_t &overflow_rec, const memslice *value,
     if (erased && delta) (*delta)--;
 }
 
-memslice tree_impl::overflowPull(overflow_t &overflow_rec)
+stored_value tree_impl::overflowPull(overflow_t &overflow_rec)
 {
-    overflownode_ptr overflow = boost::static_pointer_cast<OverflowNode>(overflowNode(overflow_rec));
+    overflownode_ptr overflow = boost::static_pointer_cast<OverflowNode>(ownOverflow(overflow_rec));
+    overflow->markDirty();
 
     if (overflow->next.empty())
     {
-        memslice ret = overflow->values.back();
+        stored_value ret = overflow->values.back();
         overflow->erase(overflow->valueCount() - 1);
         overflow_rec.count = overflow->values.size();
         return ret;
     }
 
-    memslice ret = overflowPull(overflow->next);
+    stored_value ret = overflowPull(overflow->next);
     overflow_rec.count = overflow->values.size() + overflow->next.count;
     return ret;
 }
 
+/**
+ * Merge a sorted range of edits into a leaf in one pass
+ *
+ * Returns false if they have to be applied one at a time instead.
+ */
+bool tree_impl::applyEditsToLeaf(const leafnode_ptr &leaf, const editlist_t::iterator &begin, const editlist_t::iterator &end)
+{
+    // applyAll doesn't know about overflow blocks, which edits after the last key would have to pull in
+    if (!leaf->overflow.empty())
+        return false;
+
+    // Removing by value compares with the values, and applyAll can't fetch the ones in blobs
+    bool removesByValue = false;
+    for (editlist_t::const_iterator it = begin; it != end && !removesByValue; ++it)
+        removesByValue = it->edit == REMOVE_KV;
+    if (removesByValue && leaf->hasBlobs())
+        return false;
+
+    std::vector<stored_value> dropped;
+    leaf->markDirty();
+    leaf->applyAll(begin, end, &dropped);
+    for (std::vector<stored_value>::const_iterator it = dropped.begin(); it != dropped.end(); ++it)
+        dropValue(*it);
+    return true;
+}
+
 void tree_impl::applyEditsToBranch(const internalnode_ptr &internal, const keycount_t &i)
 {
     editlist_t::iterator editBegin = internal->editQueue.begin();
@@ -284,37 +583,161 @@ void tree_impl::applyEditsToBranch(const internalnode_ptr &internal, const keyco
     if (editBegin == editEnd) return; // Nothing to apply
 
     assert(internal->branches[i].child);
+    own(internal->branches[i].child, internal->branches[i].nodeID);
 
     // This is a little nasty; we shouldn't be doing type analysis in the parent node, BUT this way
     // we can do optimized change application.
     if (internal->branches[i].child->nodeType() == TYPE_LEAF)
-        boost::static_pointer_cast<LeafNode>(internal->branches[i].child)->applyAll(editBegin, editEnd);
+    {
+        leafnode_ptr leaf = boost::static_pointer_cast<LeafNode>(internal->branches[i].child);
+        if (applyEditsToLeaf(leaf, editBegin, editEnd))
+            return;
+    }
     else
     {
-        for (editlist_t::const_iterator it = editBegin; it != editEnd; ++it)
+        // Guaranteed edits all go into the child's queue, so they can be merged in at once
+        bool allGuaranteed = true;
+        for (editlist_t::const_iterator it = editBegin; it != editEnd && allGuaranteed; ++it)
+            allGuaranteed = it->guaranteed;
+
+        if (allGuaranteed)
         {
-            // Unguaranteed changes need to be pushed all the way down when applied the first time
-            apply(internal->branches[i].child, *it, it->guaranteed ? SHALLOW : DEEP);
+            mergeEdits(boost::static_pointer_cast<InternalNode>(internal->branches[i].child), editBegin, editEnd);
+            return;
         }
     }
+
+    for (editlist_t::const_iterator it = editBegin; it != editEnd; ++it)
+    {
+        // Unguaranteed changes need to be pushed all the way down when applied the first time
+        apply(internal->branches[i].child, *it, it->guaranteed ? SHALLOW : DEEP);
+    }
 }
 
 void tree_impl::validateKVSize(const memslice &key, const memslice &value)
 {
     uint32_t maxSize = m_be.maxBlockSize();
-    if (key.size() + value.size() > maxSize)
+
+    // A value that goes in a blob only leaves its reference in the leaf
+    bool blob = m_blobThreshold && value.size() > m_blobThreshold;
+    size_t inLeaf = blob ? BLOB_REF_SIZE : value.size();
+
+    if (key.size() + inLeaf > maxSize || (blob && BLOB_HEADER_SIZE + value.size() > maxSize))
         throw std::runtime_error("Key/value too large to insert, max size: " +
                                  boost::lexical_cast<std::string>(maxSize));
 }
 
+void tree_impl::checkBatchSize(const std::vector<memslice> &keys, const std::vector<memslice> &values)
+{
+    if (keys.size() != values.size())
+        throw std::runtime_error("Batch has " + boost::lexical_cast<std::string>(keys.size()) + " keys but "
+                                 + boost::lexical_cast<std::string>(values.size()) + " values");
+}
+
+/**
+ * Move the values that are too large to blob pages of their own
+ *
+ * Values read from a page already went through here, so only nodes that were
+ * edited can have any.
+ */
+void tree_impl::storeBlobs(const leafnode_ptr &leaf)
+{
+    if (!m_blobThreshold || !leaf->dirty() || leaf->lazy())
+        return;
+
+    for (pairlist_t::iterator it = leaf->pairs().begin(); it != leaf->pairs().end(); ++it)
+    {
+        if (!it->second.blob && it->second.size() > m_blobThreshold)
+            leaf->update_value(it, storeBlob(it->second));
+    }
+}
+
+void tree_impl::storeBlobs(const overflownode_ptr &overflow)
+{
+    if (!m_blobThreshold || !overflow->dirty())
+        return;
+
+    for (valuelist_t::iterator it = overflow->values.begin(); it != overflow->values.end(); ++it)
+    {
+        if (!it->blob && it->size() > m_blobThreshold)
+            *it = storeBlob(*it);
+    }
+}
+
+/**
+ * Make the blob page for a value and return the reference to it
+ *
+ * The ID in the reference is filled in by collectBlobs().
+ */
+stored_value tree_impl::storeBlob(const memslice &value)
+{
+    memslice ref = m_mempool.alloc(BLOB_REF_SIZE);
+    *ref.at<uint32_t>(sizeof(nodeid_t)) = value.size();
+
+    m_newBlobs.push_back(std::make_pair(MakeBlobPage(value, blobSalt()), ref));
+    return stored_value(ref, true);
+}
+
+void tree_impl::collectBlobs()
+{
+    if (m_newBlobs.empty())
+        return;
+
+    be::mempagelist_t pages;
+    pages.reserve(m_newBlobs.size());
+    for (size_t i = 0; i < m_newBlobs.size(); i++)
+        pages.push_back(m_newBlobs[i].first);
+
+    be::blockidlist_t ids = m_be.ids(pages);
+    for (size_t i = 0; i < pages.size(); i++)
+        *m_newBlobs[i].second.at<nodeid_t>(0) = ids[i];
+
+    putBatch(pages, ids);
+}
+
+/**
+ * Start writing a batch of blocks, without waiting for the engine to finish
+ */
+void tree_impl::putBatch(const be::mempagelist_t &pages, const be::blockidlist_t &ids)
+{
+    if (pages.empty())
+        return;
+
+    m_putBatches.push_back(be::putblocklist_t());
+    be::putblocklist_t &batch = m_putBatches.back();
+
+    batch.reserve(pages.size());
+    for (size_t i = 0; i < pages.size(); i++)
+        batch.push_back(be::putblock_t(ids[i], pages[i]));
+
+    m_putFutures.push_back(m_be.put_all_async(batch));
+}
+
+/**
+ * Remember the blob of a value that is no longer in the tree
+ */
+void tree_impl::dropValue(const stored_value &value)
+{
+    if (value.blob)
+        m_obsoleteBlobs.push_back(BlobID(value));
+}
+
+memslice tree_impl::fetchValue(const stored_value &value, be::fetch_hint_t hint)
+{
+    if (!value.blob)
+        return value;
+
+    mempage page = m_be.get(BlobID(value), hint);
+    m_mempool.retain(page);
+    return BlobPageValue(page, value);
+}
+
 mutation tree_impl::write()
 {
     // Root not loaded == no changes
     if (!m_root)
         return mutation(m_rootID);
 
-    // FIXME: Check if we actually did any changes. Otherwise we have nothing to write.
-
     splitresult_t rootSplit = flushAndSplitRec(root());
 
     // Try splitting the new root node a max number of times.
@@ -336,25 +759,73 @@ mutation tree_impl::write()
 
     m_root = rootSplit.left().child;
 
-    m_rootID = collectBlocksRec(root());
+    // Every batch is handed to the engine as soon as its IDs are known, so
+    // the lower levels are being written while the upper ones are built.
+    try
+    {
+        // The leaves refer to the blobs, so those need their IDs first
+        collectBlobs();
+
+        // Clean subtrees (including a clean root) keep their existing IDs
+        nodeid_t rootID = m_rootID ? *m_rootID : nodeid_t();
+        collectBlocks(root(), &rootID);
+        m_rootID = rootID;
+    }
+    catch (...)
+    {
+        // Don't leave the engine writing from lists we're about to drop
+        for (std::vector<be::putfuture_t>::iterator it = m_putFutures.begin(); it != m_putFutures.end(); ++it)
+            it->wait();
+        clearWrite();
+        throw;
+    }
+
+    try
+    {
+        util::thread_pool::wait_all(m_putFutures);
+    }
+    catch (...)
+    {
+        clearWrite();
+        throw;
+    }
 
-    m_be.put_all(m_putBlocks);
+    mutation ret = collectMutation();
+    clearWrite();
+    return ret;
+}
 
-    return collectMutation();
+/**
+ * Forget what the last write did, so the next one starts from scratch
+ */
+void tree_impl::clearWrite()
+{
+    m_newBlobs.clear();
+    m_obsoleteBlobs.clear();
+    m_putBatches.clear();
+    m_putFutures.clear();
 }
 
 splitresult_t tree_impl::flushAndSplitRec(node_ptr &node)
 {
+    // Shared nodes haven't been edited, and neither has anything below them
+    if (node->shared())
+        return splitresult_t(node);
+
 NODE_CASE_LEAF
     // Make sure that we recurse into the overflow nodes
     // (This will never produce a split)
     if (!leaf->overflow.empty() && leaf->overflow.node)
         flushAndSplitRec(leaf->overflow.node);
 
+    storeBlobs(leaf);
+
     // Finally split this node if necessary
     return maybeSplitLeaf(leaf);
 
 NODE_CASE_OVERFLOW
+    storeBlobs(overflow);
+
     // Make sure that the overflow blocks are not too big
     pushDownOverflowNodeSize(overflow);
     return splitresult_t(overflow);
@@ -385,9 +856,12 @@ splitresult_t tree_impl::maybeSplitLeaf(const leafnode_ptr &leaf)
     if (!size.shouldSplit())
         return splitresult_t(leaf);
 
+    // The original leaf is replaced by the split nodes, so its block is obsolete
+    leaf->markDirty();
+
     // Child needs to split
     leafnode_ptr left = boost::make_shared<LeafNode>(
-            leaf->pairs.begin(),
+            leaf->pairs().begin(),
             size.overflowStart(),
             m_fns);
     overflownode_ptr overflow = boost::make_shared<OverflowNode>(
@@ -395,7 +869,7 @@ splitresult_t tree_impl::maybeSplitLeaf(const leafnode_ptr &leaf)
             size.splitStart());
     leafnode_ptr right = boost::make_shared<LeafNode>(
             size.splitStart(),
-            leaf->pairs.end(),
+            leaf->pairs().end(),
             m_fns);
 
     // It should not be possible that the original leaf had an overflow
@@ -419,7 +893,7 @@ splitresult_t tree_impl::maybeSplitLeaf(const leafnode_ptr &leaf)
         // so check for splitting it again, and then simply adjust the keys
         // on the return object and prepend the left branch.
         splitresult_t split = maybeSplitLeaf(right);
-        split.left().minKey = right->minKey();
+        split.left().minKey = separator(left, right);
         split.branches.insert(split.branches.begin(), node_branch(memslice(), left));
         return split;
     }
@@ -427,6 +901,22 @@ splitresult_t tree_impl::maybeSplitLeaf(const leafnode_ptr &leaf)
         return splitresult_t(left);
 }
 
+/**
+ * The key to put between two leaves that came out of a split
+ *
+ * Anything that sorts after the last key of the left leaf and not after the
+ * first key of the right leaf will do, so use the shortest one if the key
+ * type can tell us. Internal nodes split on one of these, so they get the
+ * short keys as well.
+ */
+memslice tree_impl::separator(const leafnode_ptr &left, const leafnode_ptr &right)
+{
+    if (!m_fns.keySeparator || !left->pairCount())
+        return right->minKey();
+
+    return m_fns.keySeparator(left->key(left->pairCount() - 1), right->minKey(), m_mempool);
+}
+
 void tree_impl::pushDownOverflowNodeSize(const overflownode_ptr &overflow)
 {
     OverflowNodeSize size(overflow, m_be.maxBlockSize());
@@ -434,10 +924,11 @@ void tree_impl::pushDownOverflowNodeSize(const overflownode_ptr &overflow)
         return;
 
     // Move values exceeding size to the next block
+    overflow->markDirty();
     if (overflow->next.empty())
         overflow->next.node = boost::make_shared<OverflowNode>();
 
-    overflownode_ptr next = boost::static_pointer_cast<OverflowNode>(overflow->next.node);
+    overflownode_ptr next = boost::static_pointer_cast<OverflowNode>(ownOverflow(overflow->next));
 
     // Push everything exceeding the size to the next block
     for (unsigned i = size.splitIndex(); i < overflow->values.size(); i++)
@@ -463,6 +954,7 @@ void tree_impl::maybeApplyEdits(const internalnode_ptr &internal)
         return;
 
     loadBlocksToEdit(internal);
+    internal->markDirty();
 
     // Now apply edits to leaves below and clear
     for (keycount_t i = 0; i < internal->branchCount(); i++)
@@ -475,34 +967,47 @@ void tree_impl::maybeApplyEdits(const internalnode_ptr &internal)
 
 void tree_impl::loadBlocksToEdit(const internalnode_ptr &internal)
 {
-    be::blockidlist_t ids = findBlocksToFetch(internal);
+    std::vector<keycount_t> indexes;
+    std::vector<keycount_t> wanted = findBranchesToFetch(internal);
 
-    be::getblockresult_t pages = m_be.get_all(ids);
+    be::blockidlist_t ids;
+    ids.reserve(wanted.size());
+    for (std::vector<keycount_t>::const_iterator it = wanted.begin(); it != wanted.end(); ++it)
+    {
+        // Shared children are copied when the edits are applied to them
+        node_branch &branch = internal->branches[*it];
+        if (loadShared(branch.nodeID, &branch.child))
+            continue;
+
+        indexes.push_back(*it);
+        ids.push_back(branch.nodeID);
+    }
+
+    // Pages are returned in request order
+    be::mempagelist_t pages = m_be.get_all_async(ids).get();
 
     // Deserialize blocks and assign to branches
-    for (branchlist_t::iterator it = internal->branches.begin(); it != internal->branches.end(); ++it)
+    for (size_t i = 0; i < indexes.size(); i++)
     {
-        be::getblockresult_t::const_iterator found = pages.find(it->nodeID);
-        if (found != pages.end())
-        {
-            m_loadedIDs.push_back(found->first);
-            it->child = deserialize(found->second);
-        }
+        node_branch &branch = internal->branches[indexes[i]];
+        branch.child = deserialize(branch.nodeID, pages[i]);
+        if (!branch.child->shared())
+            m_loaded.push_back(std::make_pair(branch.nodeID, branch.child));
     }
 }
 
-be::blockidlist_t tree_impl::findBlocksToFetch(const internalnode_ptr &internal)
+std::vector<keycount_t> tree_impl::findBranchesToFetch(const internalnode_ptr &internal)
 {
-    std::set<nodeid_t> ids;
+    std::set<keycount_t> indexes;
 
     for (editlist_t::const_iterator it = internal->editQueue.begin(); it != internal->editQueue.end(); ++it)
     {
         keycount_t i = FindInternalKey(internal, it->key, m_fns);
         // Only if not loaded yet
-        if (!internal->branches[i].child) ids.insert(internal->branches[i].nodeID);
+        if (!internal->branches[i].child) indexes.insert(i);
     }
 
-    return be::blockidlist_t(ids.begin(), ids.end());
+    return std::vector<keycount_t>(indexes.begin(), indexes.end());
 }
 
 splitresult_t tree_impl::maybeSplitInternal(const internalnode_ptr &internal)
@@ -513,6 +1018,9 @@ splitresult_t tree_impl::maybeSplitInternal(const internalnode_ptr &internal)
     if (!size.shouldSplit())
         return splitresult_t(internal);
 
+    // The original node is replaced by the split nodes, so its block is obsolete
+    internal->markDirty();
+
     keycount_t j = size.splitIndex();
     internalnode_ptr left = boost::make_shared<InternalNode>(internal->branches.begin(), internal->branches.begin() + j);
     internalnode_ptr right = boost::make_shared<InternalNode>(internal->branches.begin() + j, internal->branches.end());
@@ -540,7 +1048,10 @@ branchlist_t::iterator tree_impl::updateBranch(const internalnode_ptr &internal,
     {
         // Child didn't split, so maybe it got reduced and is now empty
         if (!it->itemCount)
+        {
+            internal->markDirty();
             return internal->branches.erase(it);
+        }
     }
 
     // Insert the rest (saving the iterator)
@@ -552,30 +1063,111 @@ branchlist_t::iterator tree_impl::updateBranch(const internalnode_ptr &internal,
     return internal->branches.begin() + index + split.branches.size() - 1;
 }
 
-nodeid_t tree_impl::collectBlocksRec(node_ptr &node)
+/**
+ * Serialize all dirty nodes in the given tree and start writing them
+ *
+ * Nodes are serialized bottom-up, one level at a time, so that the IDs of
+ * each level can be requested from the block engine in one batch. Each level
+ * is put as soon as its IDs are filled into the parents. Clean nodes are
+ * skipped and keep the ID they were loaded from; in that case, *id is left
+ * untouched.
+ */
+void tree_impl::collectBlocks(const node_ptr &root, nodeid_t *rootID)
+{
+    dirtylevels_t levels;
+    collectDirtyRec(root, rootID, levels);
+
+    for (dirtylevels_t::const_iterator level = levels.begin(); level != levels.end(); ++level)
+    {
+        be::mempagelist_t pages;
+        be::blockidlist_t ids;
+        serializeLevel(*level, &pages, &ids);
+
+        for (size_t i = 0; i < pages.size(); i++)
+            *(*level)[i].second = ids[i];
+
+        putBatch(pages, ids);
+    }
+}
+
+/**
+ * Serialize the nodes of one level and get their IDs
+ *
+ * Nodes of the same level don't refer to each other, so large levels are
+ * split over the serializer pool. If the IDs follow from the contents, the
+ * workers hash their own part as well; otherwise the engine may number
+ * blocks in order, so the IDs are requested from this thread.
+ */
+void tree_impl::serializeLevel(const dirtylist_t &level, be::mempagelist_t *pages, be::blockidlist_t *ids)
 {
+    pages->resize(level.size());
+    ids->resize(level.size());
+
+    be::be *hasher = m_be.contentAddressed() ? &m_be : NULL;
+
+    unsigned threads;
+    util::thread_pool &pool = serializerPool(&threads);
+    size_t parts = std::min(level.size() / MIN_NODES_PER_TASK, (size_t)threads);
+
+    if (parts < 2)
+        serializePart(&level, pages, ids, hasher, 0, level.size());
+    else
+    {
+        std::vector<std::future<void> > futures;
+        for (size_t i = 0; i < parts; i++)
+            futures.push_back(pool.submit(boost::bind(&serializePart, &level, pages, ids, hasher,
+                                                      i * level.size() / parts, (i + 1) * level.size() / parts)));
+        util::thread_pool::wait_all(futures);
+    }
+
+    if (!hasher)
+        *ids = m_be.ids(*pages);
+}
+
+/**
+ * Find the dirty nodes in the given subtree, grouped by height
+ *
+ * A dirty child makes its parent dirty as well. Nodes of the same height
+ * never refer to each other, so they can be serialized in the same batch.
+ * Returns the height of the node.
+ */
+size_t tree_impl::collectDirtyRec(const node_ptr &node, nodeid_t *id, dirtylevels_t &levels)
+{
+    size_t height = 0;
+
 NODE_CASE_LEAF
     if (!leaf->overflow.empty() && leaf->overflow.node)
-        leaf->overflow.nodeID = collectBlocksRec(leaf->overflow.node);
+        height = collectChild(node, leaf->overflow.node, &leaf->overflow.nodeID, levels);
 
 NODE_CASE_OVERFLOW
     if (!overflow->next.empty() && overflow->next.node)
-        overflow->next.nodeID = collectBlocksRec(overflow->next.node);
+        height = collectChild(node, overflow->next.node, &overflow->next.nodeID, levels);
 
 NODE_CASE_INT
     for (branchlist_t::iterator it = internal->branches.begin(); it != internal->branches.end(); ++it)
     {
         if (it->child)
-            it->nodeID = collectBlocksRec(it->child);
+            height = std::max(height, collectChild(node, it->child, &it->nodeID, levels));
     }
 
 NODE_CASE_END
 
-    // Serialize this node, request an ID for it, and store it to put later
-    mempage serialized = SerializeNode(node);
-    nodeid_t id = m_be.id(serialized);
-    m_putBlocks.push_back(be::putblock_t(id, serialized));
-    return id;
+    if (node->dirty())
+    {
+        if (levels.size() <= height)
+            levels.resize(height + 1);
+        levels[height].push_back(std::make_pair(node, id));
+    }
+
+    return height;
+}
+
+size_t tree_impl::collectChild(const node_ptr &parent, const node_ptr &child, nodeid_t *id, dirtylevels_t &levels)
+{
+    size_t height = collectDirtyRec(child, id, levels);
+    if (child->dirty())
+        parent->markDirty();
+    return height + 1;
 }
 
 mutation tree_impl::collectMutation()
@@ -583,17 +1175,27 @@ mutation tree_impl::collectMutation()
     mutation ret(m_rootID);
     bool failed = false;
 
-    for (be::putblocklist_t::const_iterator it = m_putBlocks.begin(); it != m_putBlocks.end(); ++it)
+    for (std::list<be::putblocklist_t>::const_iterator batch = m_putBatches.begin(); batch != m_putBatches.end(); ++batch)
     {
-        if (it->success)
-            ret.addCreated(it->id);
-        else
-            failed = true;
+        for (be::putblocklist_t::const_iterator it = batch->begin(); it != batch->end(); ++it)
+        {
+            if (it->success)
+                ret.addCreated(it->id);
+            else
+                failed = true;
+        }
     }
     if (failed)
         ret.fail("Failed to write some blocks to the block engine");
 
-    for (std::vector<nodeid_t>::const_iterator it = m_loadedIDs.begin(); it != m_loadedIDs.end(); ++it)
+    // Only blocks that were actually replaced are obsolete
+    for (loadedlist_t::const_iterator it = m_loaded.begin(); it != m_loaded.end(); ++it)
+    {
+        if (it->second->dirty())
+            ret.addObsolete(it->first);
+    }
+
+    for (std::vector<nodeid_t>::const_iterator it = m_obsoleteBlobs.begin(); it != m_obsoleteBlobs.end(); ++it)
         ret.addObsolete(*it);
 
     return ret;
@@ -606,50 +1208,62 @@ bool tree_impl::get(const memslice &key, memslice *value)
     return it;
 }
 
-tree_iterator_impl_ptr tree_impl::find(const memslice &key)
+tree_iterator_impl_ptr tree_impl::find(const memslice &key, be::fetch_hint_t hint)
 {
     treepath_t rootPath;
     rootPath.push_back(fork(root(), memslice(), memslice()));
 
     tree_iterator_impl_ptr it;
-    findRec(rootPath, &key, &it);
+    findRec(rootPath, &key, &it, hint);
     return it;
 }
 
-tree_iterator_impl_ptr tree_impl::seek(itemcount_t n)
+tree_iterator_impl_ptr tree_impl::seek(itemcount_t n, be::fetch_hint_t hint)
 {
     treepath_t rootPath;
     rootPath.push_back(fork(root(), memslice(), memslice()));
 
     tree_iterator_impl_ptr it;
-    seekRec(rootPath, n, &it);
+    seekRec(rootPath, n, &it, hint);
     return it;
 }
 
-fork tree_impl::travelDown(const fork &top, keycount_t i)
+fork tree_impl::travelDown(const fork &top, keycount_t i, be::fetch_hint_t hint)
+{
+    internalnode_ptr internal = boost::static_pointer_cast<InternalNode>(top.node);
+
+    fork ret = branchBounds(top, i);
+    ret.node = child(internal, i, hint);
+    return ret;
+}
+
+/**
+ * The fork for a branch without loading its node, for looking at queued edits
+ */
+fork tree_impl::branchBounds(const fork &top, keycount_t i)
 {
     internalnode_ptr internal = boost::static_pointer_cast<InternalNode>(top.node);
 
     const memslice &minK = internal->branch(i).minKey.size() ? internal->branch(i).minKey : top.minKey;
     const memslice &maxK = i < internal->branchCount() - 1 ? internal->branch(i+1).minKey : top.maxKey;
 
-    node_ptr node = child(internal->branches[i]);
-    return fork(node, minK, maxK);
+    return fork(node_ptr(), minK, maxK);
 }
 
-void tree_impl::findRec(treepath_t &rootPath, const memslice *key, tree_iterator_impl_ptr *iter_ptr)
+void tree_impl::findRec(treepath_t &rootPath, const memslice *key, tree_iterator_impl_ptr *iter_ptr, be::fetch_hint_t hint)
 {
     fork &top = rootPath.back();
     node_ptr node = rootPath.back().node;
 
 NODE_CASE_LEAF
-    pairlist_t::iterator begin = leaf->pairs.begin();
-    pairlist_t::iterator end = leaf->pairs.end();
+    keycount_t begin = 0;
+    keycount_t end = leaf->pairCount();
     if (key) leaf->findRange(*key, &begin, &end);
 
-    for (top.leafIter = begin; top.leafIter != end; ++top.leafIter)
+    if (begin != end)
     {
-        iter_ptr->reset(new tree_iterator_impl(shared_from_this(), rootPath));
+        top.index = begin;
+        iter_ptr->reset(new tree_iterator_impl(shared_from_this(), rootPath, hint));
         return;
     }
 
@@ -660,17 +1274,17 @@ NODE_CASE_OVERFLOW
 
 NODE_CASE_INT
     top.index = key ? FindInternalKey(internal, *key, m_fns) : 0;
-    fork branch = travelDown(rootPath.back(), top.index);
+    fork branch = travelDown(rootPath.back(), top.index, hint);
 
-    applyPendingEdits(internal, branch, internal->branches[top.index], SHALLOW);
+    applyPendingEdits(rootPath, rootPath.size() - 1, top.index, branch, SHALLOW);
 
     rootPath.push_back(branch);
-    findRec(rootPath, key, iter_ptr);
+    findRec(rootPath, key, iter_ptr, hint);
 
 NODE_CASE_END
 }
 
-void tree_impl::seekRec(treepath_t &rootPath, itemcount_t n, tree_iterator_impl_ptr *iter_ptr)
+void tree_impl::seekRec(treepath_t &rootPath, itemcount_t n, tree_iterator_impl_ptr *iter_ptr, be::fetch_hint_t hint)
 {
     fork &top = rootPath.back();
     node_ptr node = rootPath.back().node;
@@ -678,8 +1292,8 @@ void tree_impl::seekRec(treepath_t &rootPath, itemcount_t n, tree_iterator_impl_
 NODE_CASE_LEAF
     if (n < leaf->pairCount())
     {
-        top.leafIter = leaf->get_at(n);
-        iter_ptr->reset(new tree_iterator_impl(shared_from_this(), rootPath));
+        top.index = n;
+        iter_ptr->reset(new tree_iterator_impl(shared_from_this(), rootPath, hint));
         return;
     }
 
@@ -687,8 +1301,8 @@ NODE_CASE_LEAF
 
     if (!leaf->overflow.empty())
     {
-        rootPath.push_back(fork(overflowNode(leaf->overflow), memslice(), memslice()));
-        seekRec(rootPath, n, iter_ptr);
+        rootPath.push_back(fork(overflowNode(leaf, leaf->overflow, hint), memslice(), memslice()));
+        seekRec(rootPath, n, iter_ptr, hint);
     }
 
 NODE_CASE_OVERFLOW
@@ -696,15 +1310,15 @@ NODE_CASE_OVERFLOW
     if (n < overflow->valueCount())
     {
         top.index = n;
-        iter_ptr->reset(new tree_iterator_impl(shared_from_this(), rootPath));
+        iter_ptr->reset(new tree_iterator_impl(shared_from_this(), rootPath, hint));
         return;
     }
 
     n -= overflow->valueCount();
 
     if (!overflow->next.empty())
-        rootPath.push_back(fork(overflowNode(overflow->next), memslice(), memslice()));
-        seekRec(rootPath, n, iter_ptr);
+        rootPath.push_back(fork(overflowNode(overflow, overflow->next, hint), memslice(), memslice()));
+        seekRec(rootPath, n, iter_ptr, hint);
 
 NODE_CASE_INT
     top.index = 0;
@@ -712,15 +1326,17 @@ NODE_CASE_INT
     while (top.index < internal->branchCount())
     {
         // Look for pending changes to apply here
-        fork potential = travelDown(rootPath.back(), top.index);
-        int delta = pendingRankDelta(internal, potential, internal->branches[top.index]);
+        fork potential = branchBounds(rootPath.back(), top.index);
+        int delta = pendingRankDelta(rootPath, rootPath.size() - 1, top.index, potential, hint);
+        internal = top.asInternal(); // May have been copied to apply edits
 
         if (n < internal->branch(top.index).itemCount + delta)
         {
             // Found where to descend
-            applyPendingEdits(internal, potential, internal->branches[top.index], SHALLOW);
+            if (!potential.node) potential.node = child(internal, top.index, hint);
+            applyPendingEdits(rootPath, rootPath.size() - 1, top.index, potential, SHALLOW);
             rootPath.push_back(potential);
-            seekRec(rootPath, n, iter_ptr);
+            seekRec(rootPath, n, iter_ptr, hint);
             return;
         }
         else
@@ -733,22 +1349,29 @@ NODE_CASE_INT
 NODE_CASE_END
 }
 
-void tree_impl::applyPendingEdits(const internalnode_ptr &internal, fork &frk, node_branch &branch, Depth depth)
+void tree_impl::applyPendingEdits(treepath_t &path, size_t k, keycount_t i, fork &frk, Depth depth)
 {
-    // If we're applying to a leaf, be sure to save and restore the iterator while modifying
-    int index;
-    if (frk.nodeType() == TYPE_LEAF) index = frk.leafIndex();
-
     editlist_t::iterator editBegin, editEnd;
+    findPendingEdits(path[k].asInternal(), frk, &editBegin, &editEnd);
+    if (editBegin == editEnd)
+        return;
+
+    // The edits move from the parent into the child, so both must be our own
+    ownPath(path, k + 1);
+    internalnode_ptr internal = path[k].asInternal();
+    node_branch &branch = internal->branches[i];
+    if (!branch.child) branch.child = frk.node;
+    own(branch.child, branch.nodeID);
+    frk.node = branch.child;
+
     findPendingEdits(internal, frk, &editBegin, &editEnd);
+    if (editBegin != editEnd) internal->markDirty();
     for (editlist_t::iterator it = editBegin; it != editEnd; ++it)
         apply(frk.node, *it, depth);
 
     internal->editQueue.erase(editBegin, editEnd);
 
     branch.itemCount = frk.node->itemCount();
-
-    if (frk.nodeType() == TYPE_LEAF) frk.setLeafIndex(index);
 }
 
 void tree_impl::findPendingEdits(const internalnode_ptr &internal, fork &frk, editlist_t::iterator *editBegin, editlist_t::iterator *editEnd)
@@ -775,33 +1398,28 @@ bool tree_impl::isGuaranteed(const editlist_t::iterator &begin, const editlist_t
     return true;
 }
 
-itemcount_t tree_impl::rank(treepath_t &rootPath)
+itemcount_t tree_impl::rank(treepath_t &rootPath, be::fetch_hint_t hint)
 {
     itemcount_t ret = 0;
-    for (treepath_t::iterator it = rootPath.begin(); it != rootPath.end(); ++it)
+    for (size_t k = 0; k < rootPath.size(); k++)
     {
-        node_ptr node = it->node;
+        node_ptr node = rootPath[k].node;
 
     NODE_CASE_LEAF
-        // This will invalidate the iterator we have into the leaf,
-        // so get the index before and readjust afterwards.
-        int index = it->leafIndex();
-        int delta = 0;
-        index += delta;
-        it->setLeafIndex(index);
-
-        ret += index;
+        ret += rootPath[k].index;
     NODE_CASE_OVERFLOW
-        ret += it->index;
+        ret += rootPath[k].index;
     NODE_CASE_INT
-        assert(it->index < internal->branchCount());
+        assert(rootPath[k].index < internal->branchCount());
 
-        for (keycount_t i = 0; i < it->index; i++)
+        for (keycount_t i = 0; i < rootPath[k].index; i++)
         {
             // Look for pending changes to apply here
-            ret += internal->branches[i].itemCount;
-            fork potential = travelDown(*it, i);
-            ret += pendingRankDelta(internal, potential, internal->branches[i]);
+            fork potential = branchBounds(rootPath[k], i);
+            int delta = pendingRankDelta(rootPath, k, i, potential, hint);
+
+            // The node may have been copied to apply edits
+            ret += rootPath[k].asInternal()->branches[i].itemCount + delta;
         }
 
     NODE_CASE_END
@@ -810,17 +1428,19 @@ itemcount_t tree_impl::rank(treepath_t &rootPath)
     return ret;
 }
 
-int tree_impl::pendingRankDelta(const internalnode_ptr &internal, fork &top, node_branch &branch)
+int tree_impl::pendingRankDelta(treepath_t &path, size_t k, keycount_t i, fork &top, be::fetch_hint_t hint)
 {
     // If all pending changes are guaranteed, just calculate the delta. Otherwise apply them deeply
-    // and then calculate the delta.
+    // and then calculate the delta. Only the latter needs the branch to be loaded.
 
+    internalnode_ptr internal = path[k].asInternal();
     editlist_t::iterator editBegin, editEnd;
     findPendingEdits(internal, top, &editBegin, &editEnd);
 
     if (!isGuaranteed(editBegin, editEnd))
     {
-        applyPendingEdits(internal, top, branch, DEEP); // deep apply for correct counts
+        if (!top.node) top.node = child(internal, i, hint);
+        applyPendingEdits(path, k, i, top, DEEP); // deep apply for correct counts
         return 0; // The new count is now in the itemcount
     }
 
@@ -833,12 +1453,12 @@ int tree_impl::pendingRankDelta(const internalnode_ptr &internal, fork &top, nod
     return delta;
 }
 
-tree_iterator_impl_ptr tree_impl::begin()
+tree_iterator_impl_ptr tree_impl::begin(be::fetch_hint_t hint)
 {
     treepath_t rootPath;
     rootPath.push_back(fork(root(), memslice(), memslice()));
     tree_iterator_impl_ptr it;
-    findRec(rootPath, NULL, &it);
+    findRec(rootPath, NULL, &it, hint);
     return it;
 }
 
@@ -2,7 +2,9 @@
 #ifndef BRUCE_TREE_IMPL_H
 #define BRUCE_TREE_IMPL_H
 
+#include <list>
 #include <boost/enable_shared_from_this.hpp>
+#include <boost/unordered_map.hpp>
 
 #include <libbruce/be/be.h>
 #include <libbruce/mempool.h>
@@ -25,6 +27,21 @@ struct tree_impl : public boost::enable_shared_from_this<tree_impl>
     void remove(const memslice &key, bool guaranteed);
     void remove(const memslice &key, const memslice &value, bool guaranteed);
 
+    /**
+     * Apply a batch of edits of the same kind
+     *
+     * The batch is sorted once and merged into the root's edit queue (or
+     * leaf) in a single pass. Edits for the same key keep their order.
+     */
+    void insertMany(const std::vector<memslice> &keys, const std::vector<memslice> &values);
+    void upsertMany(const std::vector<memslice> &keys, const std::vector<memslice> &values, bool guaranteed);
+    void removeMany(const std::vector<memslice> &keys, bool guaranteed);
+
+    /**
+     * Values larger than this are written to blob pages of their own (0 = never)
+     */
+    void setBlobThreshold(uint32_t threshold) { m_blobThreshold = threshold; }
+
     /**
      * Flush changes to the block engine (this only writes new blocks).
      *
@@ -34,34 +51,76 @@ struct tree_impl : public boost::enable_shared_from_this<tree_impl>
     mutation write();
 
     bool get(const memslice &key, memslice *value);
-    tree_iterator_impl_ptr find(const memslice &key);
-    tree_iterator_impl_ptr seek(itemcount_t n);
-    tree_iterator_impl_ptr begin();
 
-    itemcount_t rank(treepath_t &rootPath);
+    /**
+     * The hint is passed to the block engine for every block the iterator
+     * loads, now and while it moves.
+     */
+    tree_iterator_impl_ptr find(const memslice &key, be::fetch_hint_t hint=be::FETCH_NORMAL);
+    tree_iterator_impl_ptr seek(itemcount_t n, be::fetch_hint_t hint=be::FETCH_NORMAL);
+    tree_iterator_impl_ptr begin(be::fetch_hint_t hint=be::FETCH_NORMAL);
 
-    fork travelDown(const fork &top, keycount_t i);
-    void applyPendingEdits(const internalnode_ptr &internal, fork &fork, node_branch &branch, Depth depth);
+    itemcount_t rank(treepath_t &rootPath, be::fetch_hint_t hint=be::FETCH_NORMAL);
 
-    const node_ptr &child(node_branch &branch);
-    const node_ptr &overflowNode(overflow_t &leaf);
+    fork travelDown(const fork &top, keycount_t i, be::fetch_hint_t hint=be::FETCH_NORMAL);
+    fork branchBounds(const fork &top, keycount_t i);
+
+    /**
+     * Apply the queued edits of branch i of path[k] to the node in frk
+     *
+     * Shared nodes are copied first, which may replace the nodes of the path.
+     */
+    void applyPendingEdits(treepath_t &path, size_t k, keycount_t i, fork &frk, Depth depth);
+
+    node_ptr child(const internalnode_ptr &internal, keycount_t i, be::fetch_hint_t hint=be::FETCH_NORMAL);
+    node_ptr overflowNode(const node_ptr &owner, overflow_t &overflow, be::fetch_hint_t hint=be::FETCH_NORMAL);
+
+    /**
+     * The value itself, fetched from its blob page if it's not in the node
+     */
+    memslice fetchValue(const stored_value &value, be::fetch_hint_t hint=be::FETCH_NORMAL);
 
 private:
     be::be &m_be;
     maybe_nodeid m_rootID;
     mempool &m_mempool;
     tree_functions m_fns;
-
-    std::vector<nodeid_t> m_loadedIDs;
+    bool m_shareNodes; // Whether to use the process-wide node cache
+    uint32_t m_blobThreshold;
+
+    // Blob pages made while writing, and the references to fill in their IDs
+    std::vector<std::pair<mempage, memslice> > m_newBlobs;
+    // Blobs of values that were removed or replaced
+    std::vector<nodeid_t> m_obsoleteBlobs;
+
+    // Every node of our own loaded from the block engine (or copied from a
+    // shared one), with the ID it was loaded from
+    typedef std::vector<std::pair<nodeid_t, node_ptr> > loadedlist_t;
+    loadedlist_t m_loaded;
     node_ptr m_root;
 
+    // Nodes below shared nodes, which can't be linked into their parent
+    typedef boost::unordered_map<nodeid_t, node_ptr> nodemap_t;
+    nodemap_t m_unlinked;
+
     node_ptr &root();
 
-    node_ptr load(nodeid_t id);
-    node_ptr deserialize(const mempage &page);
+    node_ptr load(nodeid_t id, be::fetch_hint_t hint=be::FETCH_NORMAL);
+    bool loadShared(const nodeid_t &id, node_ptr *node);
+    node_ptr deserialize(const nodeid_t &id, const mempage &page, be::fetch_hint_t hint=be::FETCH_NORMAL);
+    node_ptr unlinkedNode(const nodeid_t &id, be::fetch_hint_t hint);
+
+    void own(node_ptr &node, const nodeid_t &id);
+    const node_ptr &ownRoot();
+    const node_ptr &ownChild(const internalnode_ptr &internal, keycount_t i);
+    const node_ptr &ownOverflow(overflow_t &overflow);
+    void ownPath(treepath_t &path, size_t n);
 
     void apply(const pending_edit &edit, Depth depth);
     void apply(const node_ptr &node, const pending_edit &edit, Depth depth);
+    void applyMany(editlist_t &edits);
+    void mergeEdits(const internalnode_ptr &internal, const editlist_t::iterator &begin, const editlist_t::iterator &end);
+    bool applyEditsToLeaf(const leafnode_ptr &leaf, const editlist_t::iterator &begin, const editlist_t::iterator &end);
 
     void applyLeaf(const leafnode_ptr &leaf, const pending_edit &edit, int *delta);
 
@@ -69,32 +128,51 @@ private:
     void leafRemove(const leafnode_ptr &leaf, const memslice &key, const memslice *value, uint32_t *delta);
     void overflowInsert(overflow_t &overflow_rec, const memslice &value, uint32_t *delta);
     void overflowRemove(overflow_t &overflow_rec, const memslice *value, uint32_t *delta);
-    memslice overflowPull(overflow_t &overflow_rec);
+    stored_value overflowPull(overflow_t &overflow_rec);
     void applyEditsToBranch(const internalnode_ptr &internal, const keycount_t &i);
 
-    be::putblocklist_t m_putBlocks;
+    // Batches handed to the block engine while writing, lowest level first.
+    // The engine fills in their success flags, so they must stay in place
+    // until all futures have resolved.
+    std::list<be::putblocklist_t> m_putBatches;
+    std::vector<be::putfuture_t> m_putFutures;
 
     void validateKVSize(const memslice &key, const memslice &value);
+    void checkBatchSize(const std::vector<memslice> &keys, const std::vector<memslice> &values);
+
+    void storeBlobs(const leafnode_ptr &leaf);
+    void storeBlobs(const overflownode_ptr &overflow);
+    stored_value storeBlob(const memslice &value);
+    void collectBlobs();
+    void putBatch(const be::mempagelist_t &pages, const be::blockidlist_t &ids);
+    void clearWrite();
+    void dropValue(const stored_value &value);
 
     splitresult_t flushAndSplitRec(node_ptr &node);
-    nodeid_t collectBlocksRec(node_ptr &node);
+    typedef std::vector<std::pair<node_ptr, nodeid_t*> > dirtylist_t;
+    typedef std::vector<dirtylist_t> dirtylevels_t;
+    void collectBlocks(const node_ptr &root, nodeid_t *rootID);
+    void serializeLevel(const dirtylist_t &level, be::mempagelist_t *pages, be::blockidlist_t *ids);
+    size_t collectDirtyRec(const node_ptr &node, nodeid_t *id, dirtylevels_t &levels);
+    size_t collectChild(const node_ptr &parent, const node_ptr &child, nodeid_t *id, dirtylevels_t &levels);
 
     mutation collectMutation();
 
     void pushDownOverflowNodeSize(const overflownode_ptr &overflow);
     splitresult_t maybeSplitLeaf(const leafnode_ptr &leaf);
+    memslice separator(const leafnode_ptr &left, const leafnode_ptr &right);
     void maybeApplyEdits(const internalnode_ptr &internal);
     splitresult_t maybeSplitInternal(const internalnode_ptr &internal);
 
     branchlist_t::iterator updateBranch(const internalnode_ptr &internal, branchlist_t::iterator i, const splitresult_t &split);
-    be::blockidlist_t findBlocksToFetch(const internalnode_ptr &internal);
+    std::vector<keycount_t> findBranchesToFetch(const internalnode_ptr &internal);
     void loadBlocksToEdit(const internalnode_ptr &internal);
 
-    void findRec(treepath_t &rootPath, const memslice *key, tree_iterator_impl_ptr *iter_ptr);
-    void seekRec(treepath_t &rootPath, itemcount_t n, tree_iterator_impl_ptr *iter_ptr);
+    void findRec(treepath_t &rootPath, const memslice *key, tree_iterator_impl_ptr *iter_ptr, be::fetch_hint_t hint);
+    void seekRec(treepath_t &rootPath, itemcount_t n, tree_iterator_impl_ptr *iter_ptr, be::fetch_hint_t hint);
     bool isGuaranteed(const editlist_t::iterator &cur, const editlist_t::iterator &end);
     itemcount_t rankRec(const treepath_t &rootPath, unsigned i);
-    int pendingRankDelta(const internalnode_ptr &node, fork &top, node_branch &branch);
+    int pendingRankDelta(treepath_t &path, size_t k, keycount_t i, fork &top, be::fetch_hint_t hint);
     void findPendingEdits(const internalnode_ptr &internal, fork &fork,
                           editlist_t::iterator *editBegin, editlist_t::iterator *editEnd);
 };
@@ -26,13 +26,13 @@ tree_iterator_unsafe &tree_iterator_unsafe::operator=(const tree_iterator_unsafe
     return *this;
 }
 
-const memslice &tree_iterator_unsafe::key() const
+memslice tree_iterator_unsafe::key() const
 {
     checkValid();
     return m_impl->key();
 }
 
-const memslice &tree_iterator_unsafe::value() const
+memslice tree_iterator_unsafe::value() const
 {
     checkValid();
     return m_impl->value();
@@ -30,8 +30,8 @@ overflownode_ptr fork::asOverflow() const
     return boost::static_pointer_cast<OverflowNode>(node);
 }
 
-tree_iterator_impl::tree_iterator_impl(tree_impl_ptr tree, const std::vector<fork> &rootPath)
-    : m_tree(tree), m_rootPath(rootPath)
+tree_iterator_impl::tree_iterator_impl(tree_impl_ptr tree, const std::vector<fork> &rootPath, be::fetch_hint_t hint)
+    : m_tree(tree), m_rootPath(rootPath), m_hint(hint)
 {
 }
 
@@ -44,38 +44,35 @@ const fork &tree_iterator_impl::leaf() const
     return m_rootPath.back();
 }
 
-const memslice &tree_iterator_impl::key() const
+memslice tree_iterator_impl::key() const
 {
     switch (current().nodeType())
     {
-        case TYPE_LEAF: return current().leafIter->first;
-        case TYPE_OVERFLOW: return current().asLeaf()->pairs.rbegin()->first;  // Because we've already exceeded the index at that level
+        case TYPE_LEAF: return current().asLeaf()->key(current().index);
+        case TYPE_OVERFLOW: return leaf().asLeaf()->key(leaf().asLeaf()->pairCount() - 1);  // Because we've already exceeded the index at that level
         default: throw std::runtime_error("Illegal case");
     }
 }
 
-const memslice &tree_iterator_impl::value() const
+memslice tree_iterator_impl::value() const
 {
     switch (current().nodeType())
     {
-        case TYPE_OVERFLOW: return current().asOverflow()->values[current().index];
-        case TYPE_LEAF: return current().leafIter->second;
+        case TYPE_OVERFLOW: return m_tree->fetchValue(current().asOverflow()->values[current().index], m_hint);
+        case TYPE_LEAF: return m_tree->fetchValue(current().asLeaf()->value(current().index), m_hint);
         default: throw std::runtime_error("Illegal case");
     }
 }
 
 itemcount_t tree_iterator_impl::rank() const
 {
-    return m_tree->rank(m_rootPath);
+    return m_tree->rank(m_rootPath, m_hint);
 }
 
 bool tree_iterator_impl::valid() const
 {
     if (!m_rootPath.size()) return false;
 
-    if (current().nodeType() == TYPE_LEAF)
-        return current().leafIter != current().asLeaf()->pairs.end();
-
     return validIndex(current().index);
 }
 
@@ -83,7 +80,7 @@ bool tree_iterator_impl::validIndex(int i) const
 {
     switch (current().nodeType())
     {
-        case TYPE_LEAF: assert(false); return false;
+        case TYPE_LEAF: return i < current().asLeaf()->pairCount();
         case TYPE_INTERNAL: return i < current().asInternal()->branchCount();
         case TYPE_OVERFLOW: return i < current().asOverflow()->valueCount();
         default: throw std::runtime_error("Illegal case");
@@ -98,10 +95,10 @@ void tree_iterator_impl::skip(int n)
         case TYPE_LEAF:
             {
                 int i = 0;
-                while (i < n && current().leafIter != current().asLeaf()->pairs.end())
+                while (i < n && current().index < current().asLeaf()->pairCount())
                 {
                     ++i;
-                    ++current().leafIter;
+                    ++current().index;
                 }
                 if (i == n) return; // Success
                 break;
@@ -119,7 +116,7 @@ void tree_iterator_impl::skip(int n)
     }
 
     // Otherwise do a complete re-seek
-    *this = *m_tree->seek(rank() + n);
+    *this = *m_tree->seek(rank() + n, m_hint);
 }
 
 bool tree_iterator_impl::pastCurrentEnd() const
@@ -127,20 +124,15 @@ bool tree_iterator_impl::pastCurrentEnd() const
     switch (current().nodeType())
     {
         case TYPE_OVERFLOW: return current().asOverflow()->values.size() <= current().index;
-        case TYPE_LEAF: return current().leafIter == current().asLeaf()->pairs.end();
+        case TYPE_LEAF: return current().asLeaf()->pairCount() <= current().index;
         default: throw std::runtime_error("Illegal case");
     }
 }
 
 void tree_iterator_impl::next()
 {
-    if (current().nodeType() == TYPE_LEAF)
-    {
-        assert(current().leafIter != current().asLeaf()->pairs.end());
-        ++current().leafIter;
-    }
-    else
-        ++current().index;
+    assert(current().nodeType() != TYPE_LEAF || current().index < current().asLeaf()->pairCount());
+    ++current().index;
     if (pastCurrentEnd()) advanceCurrent();
 }
 
@@ -149,12 +141,12 @@ void tree_iterator_impl::advanceCurrent()
     // Move on to overflow chain
     if (current().nodeType() == TYPE_OVERFLOW && !current().asOverflow()->next.empty())
     {
-        pushOverflow(m_tree->overflowNode(current().asOverflow()->next));
+        pushOverflow(m_tree->overflowNode(current().node, current().asOverflow()->next, m_hint));
         return;
     }
     if (current().nodeType() == TYPE_LEAF && !current().asLeaf()->overflow.empty())
     {
-        pushOverflow(m_tree->overflowNode(current().asLeaf()->overflow));
+        pushOverflow(m_tree->overflowNode(current().node, current().asLeaf()->overflow, m_hint));
         return;
     }
 
@@ -180,10 +172,11 @@ void tree_iterator_impl::travelToNextLeaf()
 
         if (current().index < internal->branchCount())
         {
-            fork next = m_tree->travelDown(m_rootPath.back(), current().index);
+            keycount_t i = current().index;
+            fork next = m_tree->travelDown(m_rootPath.back(), i, m_hint);
             m_rootPath.push_back(next);
 
-            m_tree->applyPendingEdits(internal, m_rootPath.back(), internal->branches[current().index], SHALLOW);
+            m_tree->applyPendingEdits(m_rootPath, m_rootPath.size() - 2, i, m_rootPath.back(), SHALLOW);
         }
         else
             popCurrentNode();
@@ -15,24 +15,10 @@ struct fork
 {
     fork() : index(0) {}
     fork(node_ptr node, const memslice &minKey, const memslice &maxKey)
-        : node(node), index(0), minKey(minKey), maxKey(maxKey)
-    {
-        if (nodeType() == TYPE_LEAF) leafIter = asLeaf()->pairs.begin();
-    }
-
-    keycount_t leafIndex() const
-    {
-        return leafIter - asLeaf()->pairs.begin();
-    }
-
-    void setLeafIndex(keycount_t index)
-    {
-        leafIter = asLeaf()->pairs.begin() + index;
-    }
+        : node(node), index(0), minKey(minKey), maxKey(maxKey) { }
 
     node_ptr node;
-    pairlist_t::iterator leafIter;
-    keycount_t index;
+    keycount_t index; // Of the branch, pair or value
     memslice minKey;
     memslice maxKey;
 
@@ -49,10 +35,10 @@ typedef std::vector<fork> treepath_t;
 
 struct tree_iterator_impl
 {
-    tree_iterator_impl(tree_impl_ptr tree, const treepath_t &rootPath);
+    tree_iterator_impl(tree_impl_ptr tree, const treepath_t &rootPath, be::fetch_hint_t hint=be::FETCH_NORMAL);
 
-    const memslice &key() const;
-    const memslice &value() const;
+    memslice key() const;
+    memslice value() const;
     itemcount_t rank() const;
     bool valid() const;
 
@@ -64,6 +50,7 @@ struct tree_iterator_impl
 private:
     tree_impl_ptr m_tree;
     mutable treepath_t m_rootPath;
+    be::fetch_hint_t m_hint;
 
     const fork &leaf() const;
     fork &current() { return m_rootPath.back(); }
@@ -43,7 +43,9 @@ spec_parts parse_spec(const std::string &spec)
         if (equals != std::string::npos)
         {
             std::string key = spec.substr(semi + 1, equals - semi - 1);
-            std::string value = spec.substr(equals + 1, next_semi);
+            std::string value = next_semi == std::string::npos
+                ? spec.substr(equals + 1)
+                : spec.substr(equals + 1, next_semi - equals - 1);
 
             ret.options[key] = value;
         }
@@ -95,6 +97,14 @@ be::be_ptr create_be(const std::string &spec)
                         ". Available: " + list_engines()).c_str());
 }
 
+be::be_ptr create_inner_be(const std::string &location, const options_t &options)
+{
+    std::string spec = location;
+    for (options_t::const_iterator it = options.begin(); it != options.end(); ++it)
+        spec += ";" + it->first + "=" + it->second;
+    return create_be(spec);
+}
+
 FactoryRegistration::FactoryRegistration(const char *scheme, be_factory factory)
 {
     printf("I'm called\n");
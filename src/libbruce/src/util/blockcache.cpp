@@ -1,47 +1,140 @@
 #include <libbruce/bruce.h>
 #include <libbruce/util/blockcache.h>
+#include "util/cache_policy.h"
+#include <algorithm>
 
 namespace libbruce { namespace util {
 
-BlockCache::BlockCache(size_t maxSize)
-    : m_maxSize(maxSize), m_size(0)
+CacheShard::CacheShard()
+    : maxSize(0), size(0)
 {
 }
 
-bool BlockCache::get(nodeid_t id, mempage *mem)
+CacheShard::~CacheShard()
 {
-    map_t::iterator it = m_cache.get<0>().find(id);
-    if (it == m_cache.get<0>().end())
-        return false;
+    // Unlink the entries before they are destroyed
+    policy.reset();
+}
+
+namespace {
+
+unsigned shardCount(size_t maxSize, unsigned shards, size_t maxBlockSize)
+{
+    if (maxBlockSize)
+        shards = (unsigned)std::min((size_t)shards, maxSize / maxBlockSize);
+    return shards ? shards : 1;
+}
+
+}
+
+BlockCache::BlockCache(size_t maxSize, cache_policy_t policy, unsigned shards, size_t maxBlockSize)
+    : m_shardCount(shardCount(maxSize, shards, maxBlockSize))
+{
+    m_shards.reset(new CacheShard[m_shardCount]);
+    for (unsigned i = 0; i < m_shardCount; i++)
+    {
+        m_shards[i].maxSize = maxSize / m_shardCount;
+        m_shards[i].policy.reset(make_cache_policy(policy, m_shards[i].maxSize));
+    }
+}
 
-    *mem = it->block;
+CacheShard &BlockCache::shard(const nodeid_t &id)
+{
+    return m_shards[hash_value(id) % m_shardCount];
+}
 
-    // Remove and re-insert the block to force it to the end of the sequence,
-    // effectively updating its lifetime.
-    CacheEntry e = *it;
-    it = m_cache.get<0>().erase(it);
-    m_cache.get<0>().insert(it, e);
+bool BlockCache::get(const nodeid_t &id, mempage *mem)
+{
+    CacheShard &s = shard(id);
+    std::lock_guard<std::mutex> lock(s.mutex);
+
+    cachemap_t::iterator it = s.map.find(id);
+    if (it == s.map.end())
+    {
+        s.policy->accessed(id, NULL);
+        return false;
+    }
+
+    *mem = it->second.block;
+    s.policy->accessed(id, &it->second);
 
     return true;
 }
 
-void BlockCache::put(nodeid_t id, const mempage &mem)
+void BlockCache::put(const nodeid_t &id, const mempage &mem)
 {
-    m_cache.insert(CacheEntry(id, mem));
-    m_size += mem.size();
+    CacheShard &s = shard(id);
+    std::lock_guard<std::mutex> lock(s.mutex);
 
-    while (m_size > m_maxSize && !m_cache.empty())
+    std::pair<cachemap_t::iterator, bool> ins = s.map.insert(std::make_pair(id, CacheEntry(id, mem)));
+    if (!ins.second)
     {
-        m_size -= m_cache.get<1>().front().block.size();
-        m_cache.get<1>().pop_front();
+        // Blocks are content-addressed, so this is the same block again
+        s.policy->accessed(id, &ins.first->second);
+        return;
+    }
+
+    s.policy->inserted(ins.first->second);
+    s.size += mem.size();
+
+    while (s.size > s.maxSize)
+    {
+        CacheEntry *victim = s.policy->evict();
+        if (!victim)
+            break;
+
+        nodeid_t victimID = victim->id;
+        s.size -= victim->block.size();
+        s.map.erase(victimID);
     }
 }
 
-void BlockCache::del(nodeid_t id)
+void BlockCache::del(const nodeid_t &id)
 {
-    map_t::iterator it = m_cache.get<0>().find(id);
-    if (it != m_cache.get<0>().end())
-        m_cache.get<0>().erase(it);
+    CacheShard &s = shard(id);
+    std::lock_guard<std::mutex> lock(s.mutex);
+
+    cachemap_t::iterator it = s.map.find(id);
+    if (it == s.map.end())
+        return;
+
+    s.size -= it->second.block.size();
+    s.policy->removed(it->second);
+    s.map.erase(it);
+}
+
+size_t BlockCache::size() const
+{
+    size_t ret = 0;
+    for (unsigned i = 0; i < m_shardCount; i++)
+    {
+        std::lock_guard<std::mutex> lock(m_shards[i].mutex);
+        ret += m_shards[i].size;
+    }
+    return ret;
+}
+
+size_t BlockCache::count() const
+{
+    size_t ret = 0;
+    for (unsigned i = 0; i < m_shardCount; i++)
+    {
+        std::lock_guard<std::mutex> lock(m_shards[i].mutex);
+        ret += m_shards[i].map.size();
+    }
+    return ret;
+}
+
+std::vector<nodeid_t> BlockCache::ids() const
+{
+    std::vector<nodeid_t> ret;
+    for (unsigned i = 0; i < m_shardCount; i++)
+    {
+        std::lock_guard<std::mutex> lock(m_shards[i].mutex);
+        for (cachemap_t::const_iterator it = m_shards[i].map.begin(); it != m_shards[i].map.end(); ++it)
+            ret.push_back(it->first);
+    }
+    return ret;
 }
 
-}};
+}}
@@ -0,0 +1,335 @@
+#include "util/cache_policy.h"
+
+#include <stdexcept>
+
+// Average block size assumed to size the frequency sketch
+#define SKETCH_BLOCK_SIZE 4096
+
+namespace libbruce { namespace util {
+
+cache_policy_t parse_cache_policy(const std::string &name)
+{
+    if (name == "lru") return CACHE_LRU;
+    if (name == "2q") return CACHE_2Q;
+    if (name == "tinylfu") return CACHE_TINYLFU;
+    throw std::runtime_error("Unknown cache policy: " + name);
+}
+
+CachePolicy::~CachePolicy()
+{
+}
+
+CachePolicy *make_cache_policy(cache_policy_t policy, size_t maxSize)
+{
+    switch (policy)
+    {
+        case CACHE_LRU: return new LruPolicy();
+        case CACHE_2Q: return new TwoQueuePolicy(maxSize);
+        case CACHE_TINYLFU: return new TinyLfuPolicy(maxSize);
+    }
+    throw std::runtime_error("Unknown cache policy");
+}
+
+//----------------------------------------------------------------------
+//  LRU
+//
+
+void LruPolicy::accessed(const nodeid_t &, CacheEntry *entry)
+{
+    if (entry)
+        m_lru.splice(m_lru.end(), m_lru, m_lru.iterator_to(*entry));
+}
+
+void LruPolicy::inserted(CacheEntry &entry)
+{
+    m_lru.push_back(entry);
+}
+
+void LruPolicy::removed(CacheEntry &entry)
+{
+    m_lru.erase(m_lru.iterator_to(entry));
+}
+
+CacheEntry *LruPolicy::evict()
+{
+    if (m_lru.empty())
+        return NULL;
+
+    CacheEntry *ret = &m_lru.front();
+    m_lru.pop_front();
+    return ret;
+}
+
+//----------------------------------------------------------------------
+//  2Q
+//
+
+TwoQueuePolicy::TwoQueuePolicy(size_t maxSize)
+    : m_inSize(0), m_inMaxSize(maxSize / 4), m_ghostSeq(0), m_ghostSize(0), m_ghostMaxSize(maxSize / 2)
+{
+}
+
+void TwoQueuePolicy::accessed(const nodeid_t &, CacheEntry *entry)
+{
+    // Hits on A1in don't count; those are likely to be correlated references
+    if (entry && entry->queue == AM)
+        m_main.splice(m_main.end(), m_main, m_main.iterator_to(*entry));
+}
+
+void TwoQueuePolicy::inserted(CacheEntry &entry)
+{
+    if (m_ghostIndex.erase(entry.id))
+    {
+        // Its ghost stays in the FIFO until it falls off
+        entry.queue = AM;
+        m_main.push_back(entry);
+        return;
+    }
+
+    entry.queue = A1IN;
+    m_in.push_back(entry);
+    m_inSize += entry.block.size();
+}
+
+void TwoQueuePolicy::removed(CacheEntry &entry)
+{
+    if (entry.queue == A1IN)
+    {
+        m_in.erase(m_in.iterator_to(entry));
+        m_inSize -= entry.block.size();
+    }
+    else
+        m_main.erase(m_main.iterator_to(entry));
+}
+
+CacheEntry *TwoQueuePolicy::evict()
+{
+    CacheEntry *ret;
+    if (!m_in.empty() && (m_inSize > m_inMaxSize || m_main.empty()))
+    {
+        ret = &m_in.front();
+        m_in.pop_front();
+        m_inSize -= ret->block.size();
+
+        // Remember it, so it goes to the main list if it comes back
+        m_ghosts.push_back(ghost(ret->id, ret->block.size(), ++m_ghostSeq));
+        m_ghostIndex[ret->id] = m_ghostSeq;
+        m_ghostSize += ret->block.size();
+        while (m_ghostSize > m_ghostMaxSize && !m_ghosts.empty())
+        {
+            const ghost &oldest = m_ghosts.front();
+            boost::unordered_map<nodeid_t, uint64_t>::iterator it = m_ghostIndex.find(oldest.id);
+            if (it != m_ghostIndex.end() && it->second == oldest.seq)
+                m_ghostIndex.erase(it);
+            m_ghostSize -= oldest.size;
+            m_ghosts.pop_front();
+        }
+    }
+    else if (!m_main.empty())
+    {
+        ret = &m_main.front();
+        m_main.pop_front();
+    }
+    else
+        return NULL;
+
+    return ret;
+}
+
+//----------------------------------------------------------------------
+//  Frequency sketch
+//
+
+FrequencySketch::FrequencySketch(size_t expectedEntries)
+    : m_additions(0)
+{
+    size_t width = 256;
+    while (width < expectedEntries)
+        width *= 2;
+
+    m_table.resize(width * 4);
+    m_mask = width - 1;
+    m_sampleSize = width * 10;
+}
+
+size_t FrequencySketch::index(const nodeid_t &id, int row) const
+{
+    static const uint64_t seeds[] = {
+        0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL,
+        0x9ae16a3b2f90404fULL, 0xcbf29ce484222325ULL };
+
+    uint64_t a, b;
+    memcpy(&a, id.data(), sizeof(a));
+    memcpy(&b, id.data() + sizeof(a), sizeof(b));
+
+    uint64_t h = (a ^ seeds[row]) * 0x9e3779b97f4a7c15ULL + b;
+    h ^= h >> 32;
+    h *= 0xd6e8feb86659fd93ULL;
+    h ^= h >> 32;
+    return row * (m_mask + 1) + (h & m_mask);
+}
+
+void FrequencySketch::increment(const nodeid_t &id)
+{
+    for (int row = 0; row < 4; row++)
+    {
+        uint8_t &counter = m_table[index(id, row)];
+        if (counter < 15)
+            counter++;
+    }
+
+    if (++m_additions >= m_sampleSize)
+        age();
+}
+
+unsigned FrequencySketch::frequency(const nodeid_t &id) const
+{
+    unsigned ret = 15;
+    for (int row = 0; row < 4; row++)
+        ret = std::min(ret, (unsigned)m_table[index(id, row)]);
+    return ret;
+}
+
+void FrequencySketch::age()
+{
+    for (std::vector<uint8_t>::iterator it = m_table.begin(); it != m_table.end(); ++it)
+        *it /= 2;
+    m_additions /= 2;
+}
+
+//----------------------------------------------------------------------
+//  W-TinyLFU
+//
+
+TinyLfuPolicy::TinyLfuPolicy(size_t maxSize)
+    : m_sketch(maxSize / SKETCH_BLOCK_SIZE),
+      m_windowSize(0), m_windowMaxSize(maxSize / 100), m_probationSize(0),
+      m_protectedSize(0), m_protectedMaxSize((maxSize - maxSize / 100) * 4 / 5),
+      m_mainMaxSize(maxSize - maxSize / 100)
+{
+}
+
+void TinyLfuPolicy::accessed(const nodeid_t &id, CacheEntry *entry)
+{
+    m_sketch.increment(id);
+    if (!entry)
+        return;
+
+    if (entry->queue == PROBATION)
+    {
+        // Used again, so protect it, demoting the oldest protected entries
+        unlink(*entry);
+        link(*entry, PROTECTED);
+        while (m_protectedSize > m_protectedMaxSize && m_protected.size() > 1)
+        {
+            CacheEntry &demoted = m_protected.front();
+            unlink(demoted);
+            link(demoted, PROBATION);
+        }
+    }
+    else
+    {
+        unlink(*entry);
+        link(*entry, entry->queue);
+    }
+}
+
+void TinyLfuPolicy::inserted(CacheEntry &entry)
+{
+    link(entry, WINDOW);
+
+    // While the main cache has room, blocks falling off the window go
+    // straight in; once it's full, evict() makes them compete.
+    while (m_windowSize > m_windowMaxSize)
+    {
+        CacheEntry &oldest = m_window.front();
+        if (m_probationSize + m_protectedSize + oldest.block.size() > m_mainMaxSize)
+            break;
+
+        unlink(oldest);
+        link(oldest, PROBATION);
+    }
+}
+
+void TinyLfuPolicy::removed(CacheEntry &entry)
+{
+    unlink(entry);
+}
+
+CacheEntry *TinyLfuPolicy::evict()
+{
+    // Blocks falling off the window have to beat the main cache's victim
+    while (m_windowSize > m_windowMaxSize && !m_window.empty())
+    {
+        CacheEntry *candidate = &m_window.front();
+        unlink(*candidate);
+
+        CacheEntry *victim = !m_probation.empty() ? &m_probation.front()
+                           : !m_protected.empty() ? &m_protected.front()
+                           : NULL;
+
+        if (!victim || m_sketch.frequency(candidate->id) > m_sketch.frequency(victim->id))
+        {
+            link(*candidate, PROBATION);
+            if (!victim)
+                continue;
+
+            unlink(*victim);
+            return victim;
+        }
+
+        return candidate;
+    }
+
+    cachelist_t *from = !m_probation.empty() ? &m_probation
+                      : !m_protected.empty() ? &m_protected
+                      : !m_window.empty() ? &m_window
+                      : NULL;
+    if (!from)
+        return NULL;
+
+    CacheEntry *ret = &from->front();
+    unlink(*ret);
+    return ret;
+}
+
+void TinyLfuPolicy::unlink(CacheEntry &entry)
+{
+    switch (entry.queue)
+    {
+        case WINDOW:
+            m_window.erase(m_window.iterator_to(entry));
+            m_windowSize -= entry.block.size();
+            break;
+        case PROBATION:
+            m_probation.erase(m_probation.iterator_to(entry));
+            m_probationSize -= entry.block.size();
+            break;
+        case PROTECTED:
+            m_protected.erase(m_protected.iterator_to(entry));
+            m_protectedSize -= entry.block.size();
+            break;
+    }
+}
+
+void TinyLfuPolicy::link(CacheEntry &entry, int queue)
+{
+    entry.queue = queue;
+    switch (queue)
+    {
+        case WINDOW:
+            m_window.push_back(entry);
+            m_windowSize += entry.block.size();
+            break;
+        case PROBATION:
+            m_probation.push_back(entry);
+            m_probationSize += entry.block.size();
+            break;
+        case PROTECTED:
+            m_protected.push_back(entry);
+            m_protectedSize += entry.block.size();
+            break;
+    }
+}
+
+}}
@@ -0,0 +1,168 @@
+#pragma once
+#ifndef LIBBRUCE_CACHE_POLICY_H
+#define LIBBRUCE_CACHE_POLICY_H
+
+#include <deque>
+#include <vector>
+#include <boost/intrusive/list.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/unordered_map.hpp>
+
+#include <libbruce/util/blockcache.h>
+
+namespace libbruce { namespace util {
+
+typedef boost::intrusive::list<CacheEntry> cachelist_t;
+
+/**
+ * Decides which entries of a cache shard to evict
+ *
+ * Called with the shard locked. The shard adds and removes entries from its
+ * map; the policy keeps them in order on its own lists.
+ */
+class CachePolicy : private boost::noncopyable
+{
+public:
+    virtual ~CachePolicy();
+
+    /**
+     * A block was looked up (entry is NULL on a miss)
+     */
+    virtual void accessed(const nodeid_t &id, CacheEntry *entry) = 0;
+
+    /**
+     * A new entry was added to the shard
+     */
+    virtual void inserted(CacheEntry &entry) = 0;
+
+    /**
+     * An entry is being deleted from the shard
+     */
+    virtual void removed(CacheEntry &entry) = 0;
+
+    /**
+     * The shard is too big: unlink the entry to evict, and return it
+     */
+    virtual CacheEntry *evict() = 0;
+};
+
+CachePolicy *make_cache_policy(cache_policy_t policy, size_t maxSize);
+
+/**
+ * Plain LRU
+ */
+class LruPolicy : public CachePolicy
+{
+public:
+    virtual void accessed(const nodeid_t &id, CacheEntry *entry);
+    virtual void inserted(CacheEntry &entry);
+    virtual void removed(CacheEntry &entry);
+    virtual CacheEntry *evict();
+private:
+    cachelist_t m_lru; // Least recently used at the front
+};
+
+/**
+ * 2Q
+ *
+ * New blocks go on a FIFO (A1in). Blocks falling off it are remembered by ID
+ * only (A1out); when such a block is put again, it goes on the main LRU list
+ * (Am). Blocks that are used once, like the ones of a scan, only ever pass
+ * through the FIFO.
+ */
+class TwoQueuePolicy : public CachePolicy
+{
+public:
+    TwoQueuePolicy(size_t maxSize);
+
+    virtual void accessed(const nodeid_t &id, CacheEntry *entry);
+    virtual void inserted(CacheEntry &entry);
+    virtual void removed(CacheEntry &entry);
+    virtual CacheEntry *evict();
+private:
+    enum { A1IN, AM };
+
+    cachelist_t m_in;
+    cachelist_t m_main;
+    size_t m_inSize;
+    size_t m_inMaxSize;
+
+    struct ghost
+    {
+        ghost(const nodeid_t &id, size_t size, uint64_t seq) : id(id), size(size), seq(seq) { }
+
+        nodeid_t id;
+        size_t size;
+        uint64_t seq;
+    };
+
+    // Evicted from A1in, oldest at the front. A ghost is only valid if its
+    // sequence number is still in the index.
+    std::deque<ghost> m_ghosts;
+    boost::unordered_map<nodeid_t, uint64_t> m_ghostIndex;
+    uint64_t m_ghostSeq;
+    size_t m_ghostSize;
+    size_t m_ghostMaxSize;
+};
+
+/**
+ * Approximate recent access counts of block IDs
+ *
+ * A count-min sketch of 4-bit counters, which are halved periodically so that
+ * old popularity fades.
+ */
+class FrequencySketch
+{
+public:
+    FrequencySketch(size_t expectedEntries);
+
+    void increment(const nodeid_t &id);
+    unsigned frequency(const nodeid_t &id) const;
+private:
+    std::vector<uint8_t> m_table;
+    size_t m_mask;
+    size_t m_additions;
+    size_t m_sampleSize;
+
+    size_t index(const nodeid_t &id, int row) const;
+    void age();
+};
+
+/**
+ * W-TinyLFU
+ *
+ * New blocks go on a small LRU window. Blocks falling off the window compete
+ * with the eviction candidate of the main cache, and only the one that was
+ * used more often recently stays. The main cache is a segmented LRU: blocks
+ * start in probation and are protected when used again.
+ */
+class TinyLfuPolicy : public CachePolicy
+{
+public:
+    TinyLfuPolicy(size_t maxSize);
+
+    virtual void accessed(const nodeid_t &id, CacheEntry *entry);
+    virtual void inserted(CacheEntry &entry);
+    virtual void removed(CacheEntry &entry);
+    virtual CacheEntry *evict();
+private:
+    enum { WINDOW, PROBATION, PROTECTED };
+
+    FrequencySketch m_sketch;
+    cachelist_t m_window;
+    cachelist_t m_probation;
+    cachelist_t m_protected;
+    size_t m_windowSize;
+    size_t m_windowMaxSize;
+    size_t m_probationSize;
+    size_t m_protectedSize;
+    size_t m_protectedMaxSize;
+    size_t m_mainMaxSize;
+
+    void unlink(CacheEntry &entry);
+    void link(CacheEntry &entry, int queue);
+};
+
+}}
+
+#endif
@@ -0,0 +1,76 @@
+#include "thread_pool.h"
+
+namespace libbruce { namespace util {
+
+thread_pool::thread_pool(unsigned threads)
+    : m_stopping(false)
+{
+    for (unsigned i = 0; i < threads; i++)
+        m_workers.push_back(std::thread(&thread_pool::work, this));
+}
+
+thread_pool::~thread_pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_wakeup.notify_all();
+
+    for (std::vector<std::thread>::iterator it = m_workers.begin(); it != m_workers.end(); ++it)
+        it->join();
+}
+
+std::future<void> thread_pool::submit(const task_t &task)
+{
+    std::packaged_task<void()> packaged(task);
+    std::future<void> ret = packaged.get_future();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_tasks.push_back(std::move(packaged));
+    }
+    m_wakeup.notify_one();
+    return ret;
+}
+
+void thread_pool::wait_all(std::vector<std::future<void> > &futures)
+{
+    std::exception_ptr error;
+    for (std::vector<std::future<void> >::iterator it = futures.begin(); it != futures.end(); ++it)
+    {
+        try
+        {
+            it->get();
+        }
+        catch (...)
+        {
+            if (!error) error = std::current_exception();
+        }
+    }
+
+    if (error)
+        std::rethrow_exception(error);
+}
+
+void thread_pool::work()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+        while (!m_stopping && m_tasks.empty())
+            m_wakeup.wait(lock);
+
+        // Finish whatever is queued before stopping
+        if (m_tasks.empty())
+            return;
+
+        std::packaged_task<void()> task(std::move(m_tasks.front()));
+        m_tasks.pop_front();
+
+        lock.unlock();
+        task();
+        lock.lock();
+    }
+}
+
+}}
@@ -0,0 +1,50 @@
+#pragma once
+#ifndef BRUCE_UTIL_THREAD_POOL_H
+#define BRUCE_UTIL_THREAD_POOL_H
+
+#include <deque>
+#include <vector>
+#include <future>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <boost/noncopyable.hpp>
+
+namespace libbruce { namespace util {
+
+/**
+ * Fixed number of worker threads working off a shared task queue
+ */
+class thread_pool : private boost::noncopyable
+{
+public:
+    typedef std::function<void()> task_t;
+
+    thread_pool(unsigned threads);
+    ~thread_pool();
+
+    /**
+     * Run a task on one of the workers
+     *
+     * Exceptions thrown by the task end up in the returned future.
+     */
+    std::future<void> submit(const task_t &task);
+
+    /**
+     * Wait for all futures, then rethrow the first exception (if any)
+     */
+    static void wait_all(std::vector<std::future<void> > &futures);
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_wakeup;
+    std::deque<std::packaged_task<void()> > m_tasks;
+    std::vector<std::thread> m_workers;
+    bool m_stopping;
+
+    void work();
+};
+
+}}
+
+#endif
@@ -0,0 +1,214 @@
+#include <catch/catch.hpp>
+#include <libbruce/bruce.h>
+
+#include <algorithm>
+#include <map>
+#include <random>
+
+#include "testhelpers.h"
+
+using namespace libbruce;
+
+typedef bruce<int, int> intbruce;
+typedef bruce<std::string, int> stringbruce;
+
+namespace {
+
+bool keyBefore(const std::pair<int, int> &a, const std::pair<int, int> &b)
+{
+    return a.first < b.first;
+}
+
+}
+
+TEST_CASE("bulk loading sorted pairs")
+{
+    be::mem mem(1024);
+    intbruce b(mem);
+
+    std::map<int, int> pairs;
+    for (int i = 0; i < 10000; i++)
+        pairs[i * 2] = i;
+
+    mutation mut = b.bulk_load(pairs.begin(), pairs.end());
+    REQUIRE( mut.success() );
+    REQUIRE( mut.createdIDs().size() == mem.blockCount() );
+    b.finish(mut, true);
+
+    // No node is larger than a block
+    for (be::mem::blockmap_t::const_iterator it = mem.blocks().begin(); it != mem.blocks().end(); ++it)
+        REQUIRE( it->second.size() <= 1024 );
+
+    intbruce::tree_ptr t = b.query(*mut.newRootID());
+
+    SECTION("all pairs are there, in order")
+    {
+        int n = 0;
+        for (intbruce::iterator it = t->begin(); it; ++it, ++n)
+        {
+            REQUIRE( it.key() == n * 2 );
+            REQUIRE( it.value() == n );
+        }
+        REQUIRE( n == 10000 );
+    }
+
+    SECTION("item counts add up")
+    {
+        REQUIRE( t->seek(1234).key() == 2468 );
+        REQUIRE( t->find(5000).rank() == 2500 );
+        REQUIRE( !t->find(5001) );
+    }
+
+    SECTION("the tree can be edited afterwards")
+    {
+        intbruce::tree_ptr u = b.edit(*mut.newRootID());
+        for (int i = 0; i < 1000; i++)
+            u->insert(i * 2 + 1, -i);
+        mutation mut2 = u->write();
+        b.finish(mut2, true);
+
+        intbruce::tree_ptr v = b.query(*mut2.newRootID());
+        REQUIRE( *v->get(1999) == -999 );
+        REQUIRE( *v->get(1998) == 999 );
+        REQUIRE( *v->get(19998) == 9999 );
+    }
+
+    SECTION("nodes are filled up to the fill factor")
+    {
+        be::mem fuller(1024);
+        bruce<int, int> c(fuller);
+        bulk_options options;
+        options.fill = 1.0;
+        c.bulk_load(pairs.begin(), pairs.end(), options);
+
+        REQUIRE( fuller.blockCount() < mem.blockCount() );
+    }
+}
+
+TEST_CASE("bulk loading many values for one key")
+{
+    be::mem mem(256);
+    stringbruce b(mem);
+
+    std::vector<std::pair<std::string, int> > pairs;
+    pairs.push_back(std::make_pair("aardvark", 0));
+    for (int i = 0; i < 500; i++)
+        pairs.push_back(std::make_pair("banana", i));
+    for (int i = 0; i < 100; i++)
+        pairs.push_back(std::make_pair("cherry" + boost::lexical_cast<std::string>(1000 + i), i));
+
+    mutation mut = b.bulk_load(pairs.begin(), pairs.end());
+    b.finish(mut, true);
+    stringbruce::tree_ptr t = b.query(*mut.newRootID());
+
+    // Values of a key keep their order, across the overflow chain
+    stringbruce::iterator it = t->find("banana");
+    REQUIRE( it.rank() == 1 );
+    for (int i = 0; i < 500; i++, ++it)
+    {
+        REQUIRE( it.key() == "banana" );
+        REQUIRE( it.value() == i );
+    }
+    REQUIRE( it.key() == "cherry1000" );
+
+    REQUIRE( *t->get("cherry1099") == 99 );
+    REQUIRE( t->seek(pairs.size() - 1).key() == "cherry1099" );
+}
+
+TEST_CASE("bulk loading more values for one key than fit in memory")
+{
+    std::vector<std::pair<std::string, int> > pairs;
+    pairs.push_back(std::make_pair("aardvark", 0));
+    for (int i = 0; i < 5000; i++)
+        pairs.push_back(std::make_pair("banana", i));
+    pairs.push_back(std::make_pair("cherry", 0));
+
+    // Read back in several batches as well
+    bulk_options options;
+    options.overflowMemory = 1024;
+    options.batchSize = 4;
+
+    SECTION("the overflow chain is the same as without spilling")
+    {
+        temp_dir dir;
+        be::disk disk(dir.path() + "/", 256);
+        stringbruce b(disk);
+
+        mutation inMemory = b.bulk_load(pairs.begin(), pairs.end());
+        mutation spilled = b.bulk_load(pairs.begin(), pairs.end(), options);
+        REQUIRE( spilled.success() );
+        REQUIRE( *spilled.newRootID() == *inMemory.newRootID() );
+    }
+
+    SECTION("values keep their order")
+    {
+        be::mem mem(256);
+        stringbruce b(mem);
+
+        mutation mut = b.bulk_load(pairs.begin(), pairs.end(), options);
+        REQUIRE( mut.success() );
+        b.finish(mut, true);
+        stringbruce::tree_ptr t = b.query(*mut.newRootID());
+
+        stringbruce::iterator it = t->find("banana");
+        for (int i = 0; i < 5000; i++, ++it)
+        {
+            REQUIRE( it.key() == "banana" );
+            REQUIRE( it.value() == i );
+        }
+        REQUIRE( it.key() == "cherry" );
+        REQUIRE( t->seek(pairs.size() - 1).key() == "cherry" );
+    }
+}
+
+TEST_CASE("bulk loading unsorted pairs")
+{
+    be::mem mem(1024);
+    intbruce b(mem);
+
+    std::vector<std::pair<int, int> > pairs;
+    for (int i = 0; i < 20000; i++)
+        pairs.push_back(std::make_pair(i % 5000, i));
+    std::shuffle(pairs.begin(), pairs.end(), std::mt19937(42));
+
+    // Small enough for many runs, so that they're merged in more than one pass
+    bulk_options options;
+    options.sorted = false;
+    options.sortMemory = 4096;
+
+    mutation mut = b.bulk_load(pairs.begin(), pairs.end(), options);
+    REQUIRE( mut.success() );
+    b.finish(mut, true);
+
+    // Pairs with the same key stay in the order they were added in
+    std::stable_sort(pairs.begin(), pairs.end(), keyBefore);
+
+    intbruce::tree_ptr t = b.query(*mut.newRootID());
+    size_t n = 0;
+    for (intbruce::iterator it = t->begin(); it; ++it, ++n)
+    {
+        REQUIRE( it.key() == pairs[n].first );
+        REQUIRE( it.value() == pairs[n].second );
+    }
+    REQUIRE( n == pairs.size() );
+}
+
+TEST_CASE("bulk loading checks its input")
+{
+    be::mem mem(1024);
+    bulk_loader<int, int> loader(mem);
+
+    SECTION("an empty load has no tree")
+    {
+        mutation mut = loader.finish();
+        REQUIRE( mut.success() );
+        REQUIRE( !mut.newRootID() );
+    }
+
+    SECTION("keys must be in order")
+    {
+        loader.add(2, 0);
+        loader.add(2, 1);
+        REQUIRE_THROWS( loader.add(1, 0) );
+    }
+}
@@ -115,6 +115,42 @@ TEST_CASE("split is kosher")
     }
 }
 
+TEST_CASE("split key is the shortest separator of long keys")
+{
+    be::mem mem(1024);
+    tree<std::string, uint32_t> t(maybe_nodeid(), mem);
+
+    for (uint32_t i = 0; i < 40; i++)
+        t.insert(std::string(1, 'a' + i % 26) + std::string(1, 'a' + i / 26) + std::string(60, 'x'), i);
+    mutation mut = t.write();
+
+    mempage rootPage = mem.get(*mut.newRootID());
+    internalnode_ptr rootNode = boost::dynamic_pointer_cast<InternalNode>(ParseNode(rootPage, tree<std::string, uint32_t>::fns));
+    REQUIRE( rootNode->branchCount() > 1 );
+
+    for (int i = 1; i < rootNode->branchCount(); i++)
+    {
+        std::string sep = traits::convert<std::string>::from_bytes(rootNode->branch(i).minKey);
+        REQUIRE( sep.size() <= 2 );
+
+        mempage leftPage = mem.get(rootNode->branch(i - 1).nodeID);
+        mempage rightPage = mem.get(rootNode->branch(i).nodeID);
+        leafnode_ptr leftNode = boost::dynamic_pointer_cast<LeafNode>(ParseNode(leftPage, tree<std::string, uint32_t>::fns));
+        leafnode_ptr rightNode = boost::dynamic_pointer_cast<LeafNode>(ParseNode(rightPage, tree<std::string, uint32_t>::fns));
+        REQUIRE( traits::convert<std::string>::from_bytes(leftNode->key(leftNode->pairCount() - 1)) < sep );
+        REQUIRE( sep <= traits::convert<std::string>::from_bytes(rightNode->key(0)) );
+    }
+
+    for (uint32_t i = 0; i < 40; i++)
+    {
+        std::string key = std::string(1, 'a' + i % 26) + std::string(1, 'a' + i / 26) + std::string(60, 'x');
+        tree<std::string, uint32_t> t2(*mut.newRootID(), mem);
+        tree<std::string, uint32_t>::iterator it = t2.find(key);
+        REQUIRE( it );
+        REQUIRE( it.value() == i );
+    }
+}
+
 TEST_CASE("inserting then deleting from a leaf")
 {
     be::mem mem(1024);
@@ -223,14 +259,33 @@ TEST_CASE("write new pages, delete old ones")
     }
 }
 
+TEST_CASE("writing the same tree twice")
+{
+    be::mem mem(1024);
+    tree<int, int> edit(maybe_nodeid(), mem);
+
+    edit.insert(1, 1);
+    mutation first = edit.write();
+    REQUIRE( first.success() );
+
+    edit.insert(2, 2);
+    mutation second = edit.write();
+    REQUIRE( second.success() );
+    REQUIRE( !second.createdIDs().empty() );
+
+    tree<int, int> query(*second.newRootID(), mem);
+    REQUIRE( *query.get(1) == 1 );
+    REQUIRE( *query.get(2) == 2 );
+}
+
 TEST_CASE("postfix a whole bunch of the same keys into anode")
 {
     be::mem mem(1024);
     tree_impl tree(mem, maybe_nodeid(), g_testPool, intToIntTree);
-    for (unsigned i = 0; i < 50; i++)
+    for (unsigned i = 0; i < 10; i++)
         tree.insert(intCopy(i), intCopy(i));
-    for (unsigned i = 50; i < 400; i++)
-        tree.insert(intCopy(50), intCopy(i));
+    for (unsigned i = 10; i < 400; i++)
+        tree.insert(intCopy(10), intCopy(i));
     mutation mut = tree.write();
 
     REQUIRE( mem.blockCount() == 3 ); // Expecting leaf and two overflows
@@ -417,28 +472,22 @@ TEST_CASE("inserting after overflow node")
 
     // THEN
     leafnode_ptr node = loadLeaf(mem, *mut.newRootID());
-    REQUIRE( node->pairs.size() == 5);
+    REQUIRE( node->pairs().size() == 5);
 }
 
 TEST_CASE("inserting after overflow node too big to pull in")
 {
-    be::mem mem(100);
+    be::mem mem(160);
 
     // GIVEN
+    make_overflow overflow;
+    for (uint32_t i = 4; i < 24; i++)
+        overflow.val(i);
     put_result root = make_leaf(intToIntTree)
            .kv(1, 1)
            .kv(2, 2)
            .kv(3, 3)
-           .overflow(make_overflow()
-                .val(4)
-                .val(5)
-                .val(6)
-                .val(7)
-                .val(8)
-                .val(9)
-                .val(10)
-                .val(11)
-                .put(mem))
+           .overflow(overflow.put(mem))
            .put(mem);
     tree<int, int> edit(root.nodeID, mem);
 
@@ -451,14 +500,14 @@ TEST_CASE("inserting after overflow node too big to pull in")
     leafnode_ptr left = loadLeaf(mem, internal->branches[0].nodeID);
     leafnode_ptr right = loadLeaf(mem, internal->branches[1].nodeID);
 
-    REQUIRE(left->pairs.size() == 3);
+    REQUIRE(left->pairs().size() == 3);
     REQUIRE(!left->overflow.empty());
-    REQUIRE(right->pairs.size() == 1);
+    REQUIRE(right->pairs().size() == 1);
 }
 
 TEST_CASE("root has to split because its too large")
 {
-    be::mem mem(64);
+    be::mem mem(68);
 
     // GIVEN
     put_result root = make_leaf(intToIntTree)
@@ -519,7 +568,7 @@ TEST_CASE("seeking after moving guaranteed changes into a subnode")
 
     // THEN: leaf unchanged
     leafnode_ptr leaf = loadLeaf(mem, nodeid_t((size_t)0));
-    REQUIRE( leaf->pairs.size() == 1 );
+    REQUIRE( leaf->pairs().size() == 1 );
 }
 
 TEST_CASE("keeping unpushed unguaranteed changes in the top node")
@@ -586,3 +635,232 @@ TEST_CASE("seeking after moving unguaranteed changes into a subnode")
     tree<int, int> query(*mut.newRootID(), mem);
     REQUIRE( query.seek(1).value() == 30 );
 }
+
+TEST_CASE("reading before writing does not rewrite untouched nodes")
+{
+    be::mem mem(1024, 256);
+
+    // GIVEN
+    put_result leaf1 = make_leaf(intToIntTree).kv(10, 10).put(mem);
+    put_result leaf2 = make_leaf(intToIntTree).kv(20, 20).put(mem);
+    put_result root = make_internal()
+        .brn(leaf1)
+        .brn(leaf2)
+        .put(mem);
+
+    tree<int, int> edit(root.nodeID, mem);
+    REQUIRE( *edit.get(10) == 10 );
+    REQUIRE( edit.seek(1).value() == 20 );
+
+    SECTION("writing without changes writes nothing")
+    {
+        mutation mut = edit.write();
+
+        REQUIRE( mut.success() );
+        REQUIRE( *mut.newRootID() == root.nodeID );
+        REQUIRE( mut.createdIDs().empty() );
+        REQUIRE( mut.obsoleteIDs().empty() );
+        REQUIRE( mem.blockCount() == 3 );
+    }
+
+    SECTION("queueing an edit only rewrites the root")
+    {
+        edit.insert(15, 15);
+        mutation mut = edit.write();
+
+        REQUIRE( mut.createdIDs().size() == 1 );
+        REQUIRE( mut.obsoleteIDs().size() == 1 );
+        REQUIRE( mut.obsoleteIDs()[0] == root.nodeID );
+
+        internalnode_ptr newRoot = loadInternal(mem, *mut.newRootID());
+        REQUIRE( newRoot->branches[0].nodeID == leaf1.nodeID );
+        REQUIRE( newRoot->branches[1].nodeID == leaf2.nodeID );
+    }
+}
+
+TEST_CASE("pushing queued edits down on read rewrites the affected path only")
+{
+    be::mem mem(1024, 256);
+
+    // GIVEN
+    put_result leaf1 = make_leaf(intToIntTree).kv(10, 10).put(mem);
+    put_result leaf2 = make_leaf(intToIntTree).kv(20, 20).put(mem);
+    put_result root = make_internal()
+        .brn(leaf1)
+        .brn(leaf2)
+        .edit(pending_edit(INSERT, intCopy(21), intCopy(21), true))
+        .put(mem);
+
+    // WHEN
+    tree<int, int> edit(root.nodeID, mem);
+    REQUIRE( *edit.get(10) == 10 );
+    REQUIRE( *edit.get(21) == 21 );
+    mutation mut = edit.write();
+
+    // THEN
+    REQUIRE( mut.createdIDs().size() == 2 );
+    REQUIRE( mut.obsoleteIDs().size() == 2 );
+    REQUIRE( std::find(mut.obsoleteIDs().begin(), mut.obsoleteIDs().end(), leaf1.nodeID) == mut.obsoleteIDs().end() );
+
+    internalnode_ptr newRoot = loadInternal(mem, *mut.newRootID());
+    REQUIRE( newRoot->editQueue.empty() );
+    REQUIRE( newRoot->branches[0].nodeID == leaf1.nodeID );
+    REQUIRE( newRoot->branches[1].itemCount == 2 );
+}
+
+namespace {
+
+void requireSameTree(be::be &be, const mutation &a, const mutation &b)
+{
+    tree<int, int> ta(*a.newRootID(), be);
+    tree<int, int> tb(*b.newRootID(), be);
+
+    tree<int, int>::iterator ia = ta.begin();
+    tree<int, int>::iterator ib = tb.begin();
+    for (; ia && ib; ++ia, ++ib)
+    {
+        REQUIRE( ia.key() == ib.key() );
+        REQUIRE( ia.value() == ib.value() );
+    }
+    REQUIRE( !ia );
+    REQUIRE( !ib );
+}
+
+}
+
+TEST_CASE("batched edits do the same as single edits")
+{
+    be::mem mem(1024, 256);
+
+    std::vector<std::pair<int, int> > pairs;
+    for (int i = 0; i < 3000; i++)
+        pairs.push_back(std::make_pair((i * 7919) % 1000, i));
+
+    SECTION("on a leaf")
+    {
+        std::vector<std::pair<int, int> > few(pairs.begin(), pairs.begin() + 20);
+
+        tree<int, int> batched(maybe_nodeid(), mem);
+        batched.insert_many(few.begin(), few.end());
+
+        tree<int, int> single(maybe_nodeid(), mem);
+        for (size_t i = 0; i < few.size(); i++)
+            single.insert(few[i].first, few[i].second);
+
+        requireSameTree(mem, batched.write(), single.write());
+    }
+
+    SECTION("on an existing tree")
+    {
+        tree<int, int> base(maybe_nodeid(), mem);
+        for (int i = 0; i < 1000; i += 2)
+            base.insert(i, -i);
+        mutation mut = base.write();
+
+        std::vector<std::pair<int, int> > upserts;
+        std::vector<int> removes;
+        for (int i = 0; i < 1000; i += 3)
+        {
+            upserts.push_back(std::make_pair(i, i));
+            removes.push_back(i + 1);
+        }
+
+        tree<int, int> batched(*mut.newRootID(), mem);
+        batched.insert_many(pairs.begin(), pairs.end());
+        batched.upsert_many(upserts.begin(), upserts.end(), true);
+        batched.remove_many(removes.begin(), removes.end(), true);
+
+        tree<int, int> single(*mut.newRootID(), mem);
+        for (size_t i = 0; i < pairs.size(); i++)
+            single.insert(pairs[i].first, pairs[i].second);
+        for (size_t i = 0; i < upserts.size(); i++)
+            single.upsert(upserts[i].first, upserts[i].second, true);
+        for (size_t i = 0; i < removes.size(); i++)
+            single.remove(removes[i], true);
+
+        requireSameTree(mem, batched.write(), single.write());
+    }
+}
+
+TEST_CASE("a small batch is queued in the root")
+{
+    be::mem mem(1024, 256);
+
+    // GIVEN
+    put_result leaf1 = make_leaf(intToIntTree).kv(10, 10).put(mem);
+    put_result leaf2 = make_leaf(intToIntTree).kv(20, 20).put(mem);
+    put_result root = make_internal()
+        .brn(leaf1)
+        .brn(leaf2)
+        .put(mem);
+
+    // WHEN
+    std::vector<std::pair<int, int> > pairs;
+    pairs.push_back(std::make_pair(22, 22));
+    pairs.push_back(std::make_pair(21, 21));
+
+    tree<int, int> edit(root.nodeID, mem);
+    edit.insert_many(pairs.begin(), pairs.end());
+    mutation mut = edit.write();
+
+    // THEN
+    internalnode_ptr newRoot = loadInternal(mem, *mut.newRootID());
+    REQUIRE( newRoot->editQueue.size() == 2 );
+    REQUIRE( newRoot->editQueue[0].key == intCopy(21) );
+    REQUIRE( newRoot->branches[0].nodeID == leaf1.nodeID );
+    REQUIRE( newRoot->branches[1].nodeID == leaf2.nodeID );
+    REQUIRE( newRoot->itemCount() == 4 );
+}
+
+TEST_CASE("a batch that overflows the root only touches the leaves it edits")
+{
+    be::mem mem(1024, 64);
+
+    // GIVEN
+    put_result leaf1 = make_leaf(intToIntTree).kv(10, 10).put(mem);
+    put_result leaf2 = make_leaf(intToIntTree).kv(20, 20).put(mem);
+    put_result leaf3 = make_leaf(intToIntTree).kv(30, 30).put(mem);
+    put_result root = make_internal()
+        .brn(leaf1)
+        .brn(leaf2)
+        .brn(leaf3)
+        .put(mem);
+
+    // Loading these would fail
+    mem.blocks().erase(leaf1.nodeID);
+    mem.blocks().erase(leaf3.nodeID);
+
+    // WHEN
+    std::vector<std::pair<int, int> > pairs;
+    for (int i = 21; i < 30; i++)
+        pairs.push_back(std::make_pair(i, i));
+
+    tree<int, int> edit(root.nodeID, mem);
+    edit.insert_many(pairs.begin(), pairs.end());
+    mutation mut = edit.write();
+
+    // THEN
+    REQUIRE( mut.success() );
+    internalnode_ptr newRoot = loadInternal(mem, *mut.newRootID());
+    REQUIRE( newRoot->editQueue.empty() );
+    REQUIRE( newRoot->branches[0].nodeID == leaf1.nodeID );
+    REQUIRE( !(newRoot->branches[1].nodeID == leaf2.nodeID) );
+    REQUIRE( newRoot->branches[2].nodeID == leaf3.nodeID );
+    REQUIRE( newRoot->itemCount() == 12 );
+}
+
+TEST_CASE("a batch needs a value for every key")
+{
+    be::mem mem(1024, 256);
+    mempool pool;
+    tree_unsafe edit(maybe_nodeid(), mem, pool, intToIntTree);
+
+    std::vector<memslice> keys;
+    keys.push_back(intCopy(1));
+    keys.push_back(intCopy(2));
+    std::vector<memslice> values;
+    values.push_back(intCopy(1));
+
+    REQUIRE_THROWS( edit.insert_many(keys, values) );
+    REQUIRE_THROWS( edit.upsert_many(keys, values, true) );
+}
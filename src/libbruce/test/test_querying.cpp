@@ -155,6 +155,27 @@ TEST_CASE("seeking in a tree with guaranteed changes", "[query][rank]")
     }
 }
 
+TEST_CASE("seeking past guaranteed changes that were written doesn't load their leaf", "[query][rank]")
+{
+    be::mem mem(1024);
+    put_result left = make_leaf(intToIntTree).kv(1, 1).kv(3, 3).put(mem);
+    put_result root = make_internal()
+        .brn(left)
+        .brn(make_leaf(intToIntTree)
+           .kv(5, 5).kv(7, 7).put(mem))
+        .edit(pending_edit(INSERT, intCopy(2), intCopy(2), true))
+        .put(mem);
+
+    // Seeking has to count the queued insert without looking at the leaf
+    be::delblocklist_t dels;
+    dels.push_back(be::delblock_t(left.nodeID));
+    mem.del_all(dels);
+
+    tree<uint32_t, uint32_t> query(root.nodeID, mem);
+    REQUIRE(query.seek(3).value() == 5);
+    REQUIRE(query.seek(4).value() == 7);
+}
+
 TEST_CASE("seeking in a tree with nonguaranteed changes", "[query][rank]")
 {
     be::mem mem(1024);
@@ -348,3 +369,118 @@ TEST_CASE("queued upsert")
     }
 
 }
+
+TEST_CASE("reading back front-coded keys after splits", "[query]")
+{
+    be::mem mem(1024);
+    tree<std::string, int> t(maybe_nodeid(), mem);
+    for (int i = 0; i < 2000; i++)
+    {
+        char key[64];
+        snprintf(key, sizeof(key), "tenant-0042/objects/photos/%04d.jpg", i);
+        t.insert(key, i);
+    }
+    mutation mut = t.write();
+
+    tree<std::string, int> q(*mut.newRootID(), mem);
+    REQUIRE( *q.get("tenant-0042/objects/photos/1234.jpg") == 1234 );
+    REQUIRE( !q.get("tenant-0042/objects/photos/1234") );
+
+    int i = 0;
+    for (tree<std::string, int>::iterator it = q.begin(); it; ++it, ++i)
+        REQUIRE( it.value() == i );
+    REQUIRE( i == 2000 );
+}
+
+TEST_CASE("values of a repeated key fit in one leaf", "[query]")
+{
+    be::mem mem(1024);
+    tree<std::string, uint32_t> t(maybe_nodeid(), mem);
+
+    // Without storing the key once, this would need overflow blocks
+    std::string key = "index/color/a-rather-long-value";
+    for (uint32_t i = 0; i < 200; i++)
+        t.insert(key, i);
+    mutation mut = t.write();
+    REQUIRE( mem.blockCount() == 1 );
+
+    tree<std::string, uint32_t> query(*mut.newRootID(), mem);
+    tree<std::string, uint32_t>::iterator it = query.find(key);
+    for (uint32_t i = 0; i < 200; i++, ++it)
+    {
+        REQUIRE( it.key() == key );
+        REQUIRE( it.value() == i );
+    }
+    REQUIRE( !it );
+}
+
+TEST_CASE("large values are kept out of the leaves", "[query]")
+{
+    be::mem mem(1024);
+    tree<uint32_t, std::string> t(maybe_nodeid(), mem);
+    t.setBlobThreshold(100);
+
+    std::string big(800, 'x');
+    for (uint32_t i = 0; i < 100; i++)
+        t.insert(i, i % 2 ? big + boost::lexical_cast<std::string>(i) : "small");
+    mutation mut = t.write();
+
+    be::delblocklist_t blobs;
+    for (mutation::nodes::const_iterator it = mut.createdIDs().begin(); it != mut.createdIDs().end(); ++it)
+    {
+        if (PageNodeType(mem.get(*it)) == TYPE_BLOB)
+            blobs.push_back(be::delblock_t(*it));
+    }
+    REQUIRE( blobs.size() == 50 );
+    REQUIRE( mem.blockCount() == mut.createdIDs().size() );
+
+    tree<uint32_t, std::string> query(*mut.newRootID(), mem);
+    REQUIRE( *query.get(3) == big + "3" );
+    REQUIRE( *query.get(4) == "small" );
+
+    SECTION("keys and ranks don't need the blobs")
+    {
+        mem.del_all(blobs);
+
+        REQUIRE( query.find(77).rank() == 77 );
+        REQUIRE( query.seek(40).key() == 40 );
+        REQUIRE( query.seek(40).value() == "small" );
+        REQUIRE_THROWS( query.seek(41).value() );
+
+        uint32_t i = 0;
+        for (tree<uint32_t, std::string>::iterator it = query.begin(); it; ++it, ++i)
+            REQUIRE( it.key() == i );
+        REQUIRE( i == 100 );
+    }
+
+    SECTION("replaced and removed values make their blobs obsolete")
+    {
+        tree<uint32_t, std::string> edit(*mut.newRootID(), mem);
+        edit.setBlobThreshold(100);
+        edit.upsert(1, "small", true);
+        edit.remove(3, true);
+        edit.remove(95, big + "95", true);
+        edit.insert(200, big);
+        mutation mut2 = edit.write();
+
+        int obsoleteBlobs = 0;
+        for (mutation::nodes::const_iterator it = mut2.obsoleteIDs().begin(); it != mut2.obsoleteIDs().end(); ++it)
+            obsoleteBlobs += PageNodeType(mem.get(*it)) == TYPE_BLOB;
+        REQUIRE( obsoleteBlobs == 3 );
+
+        int createdBlobs = 0;
+        for (mutation::nodes::const_iterator it = mut2.createdIDs().begin(); it != mut2.createdIDs().end(); ++it)
+            createdBlobs += PageNodeType(mem.get(*it)) == TYPE_BLOB;
+        REQUIRE( createdBlobs == 1 );
+
+        REQUIRE( finish_mutation(mem, mut2, true) );
+
+        tree<uint32_t, std::string> query2(*mut2.newRootID(), mem);
+        REQUIRE( *query2.get(1) == "small" );
+        REQUIRE( !query2.get(3) );
+        REQUIRE( *query2.get(5) == big + "5" );
+        REQUIRE( !query2.get(95) );
+        REQUIRE( *query2.get(97) == big + "97" );
+        REQUIRE( *query2.get(200) == big );
+    }
+}
@@ -76,7 +76,7 @@ TEST_CASE("flushing edit queue causes a leaf node to split")
 
 TEST_CASE("splitting an internal node does not lose the edit queue")
 {
-    be::mem mem(65 + 256, 256);
+    be::mem mem(80 + 256, 256);
 
     // GIVEN (a node that must split on write)
     put_result root = make_internal()
@@ -0,0 +1,713 @@
+#include <catch/catch.hpp>
+#include <libbruce/bruce.h>
+#include <libbruce/be/cache.h>
+#include <libbruce/be/compress.h>
+#include <libbruce/be/pack.h>
+#include <libbruce/be/parallel.h>
+#include <libbruce/be/tiered.h>
+#include <libbruce/util/be_registry.h>
+#ifdef HAVE_URING
+#include <libbruce/be/uring.h>
+#endif
+
+#include <thread>
+#include <sys/stat.h>
+
+#include "testhelpers.h"
+
+using namespace libbruce;
+
+TEST_CASE("asynchronous block engine calls", "[be]")
+{
+    be::mem mem(1024);
+
+    be::putblocklist_t blocks;
+    for (uint32_t i = 0; i < 3; i++)
+    {
+        mempage page(sizeof(i));
+        *page.at<uint32_t>(0) = i;
+        blocks.push_back(be::putblock_t(mem.id(page), page));
+    }
+
+    be::putfuture_t put = mem.put_all_async(blocks);
+    put.get();
+    for (int i = 0; i < blocks.size(); i++)
+        REQUIRE( blocks[i].success );
+
+    SECTION("get_all_async returns pages in request order")
+    {
+        be::blockidlist_t ids;
+        ids.push_back(blocks[2].id);
+        ids.push_back(blocks[0].id);
+        ids.push_back(blocks[1].id);
+
+        be::mempagelist_t pages = mem.get_all_async(ids).get();
+        REQUIRE( pages.size() == 3 );
+        REQUIRE( *pages[0].at<uint32_t>(0) == 2 );
+        REQUIRE( *pages[1].at<uint32_t>(0) == 0 );
+        REQUIRE( *pages[2].at<uint32_t>(0) == 1 );
+    }
+
+    SECTION("hinted calls can be made on the engine itself")
+    {
+        REQUIRE( *mem.get(blocks[1].id, be::FETCH_SCAN).at<uint32_t>(0) == 1 );
+        REQUIRE( mem.get_all_async(be::blockidlist_t(1, blocks[2].id), be::FETCH_SCAN).get().size() == 1 );
+    }
+
+    SECTION("errors are reported through the future")
+    {
+        be::getfuture_t f = mem.get_async(nodeid_t((size_t)100));
+        REQUIRE_THROWS_AS( f.get(), be::block_not_found );
+    }
+}
+
+#ifdef HAVE_URING
+namespace {
+
+void readRepeatedly(be::be *engine, const be::blockidlist_t &ids, int *failures)
+{
+    for (int round = 0; round < 50; round++)
+    {
+        try
+        {
+            be::mempagelist_t pages = engine->get_all_async(ids).get();
+            for (uint32_t i = 0; i < pages.size(); i++)
+            {
+                if (*pages[i].at<uint32_t>(0) != i)
+                    (*failures)++;
+            }
+        }
+        catch (std::exception &)
+        {
+            (*failures)++;
+        }
+    }
+}
+
+}
+
+TEST_CASE("uring engine round trip", "[be]")
+{
+    temp_dir dir;
+    std::string prefix = dir.path() + "/";
+
+    be::uring uring(prefix, 1024, 0, 8);
+
+    // More blocks than fit in the queue at once
+    be::putblocklist_t blocks;
+    for (uint32_t i = 0; i < 10; i++)
+    {
+        mempage page(sizeof(i));
+        *page.at<uint32_t>(0) = i;
+        blocks.push_back(be::putblock_t(uring.id(page), page));
+    }
+    uring.put_all(blocks);
+    for (int i = 0; i < blocks.size(); i++)
+        REQUIRE( blocks[i].success );
+
+    SECTION("blocks can be read back, also by the disk engine")
+    {
+        be::blockidlist_t ids;
+        for (int i = 0; i < blocks.size(); i++)
+            ids.push_back(blocks[i].id);
+
+        be::mempagelist_t pages = uring.get_all_async(ids).get();
+        for (uint32_t i = 0; i < pages.size(); i++)
+            REQUIRE( *pages[i].at<uint32_t>(0) == i );
+
+        be::disk disk(prefix, 1024);
+        REQUIRE( *disk.get(blocks[3].id).at<uint32_t>(0) == 3 );
+    }
+
+    SECTION("several threads can read at once")
+    {
+        be::blockidlist_t ids;
+        for (int i = 0; i < blocks.size(); i++)
+            ids.push_back(blocks[i].id);
+
+        std::vector<int> failures(4);
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < failures.size(); i++)
+            threads.push_back(std::thread(readRepeatedly, &uring, ids, &failures[i]));
+        for (size_t i = 0; i < threads.size(); i++)
+            threads[i].join();
+
+        for (size_t i = 0; i < failures.size(); i++)
+            REQUIRE( failures[i] == 0 );
+    }
+
+    SECTION("reading with O_DIRECT")
+    {
+        be::uring direct(prefix, 1024, 0, 8, true);
+        mempage page = direct.get(blocks[5].id);
+        REQUIRE( page.size() == sizeof(uint32_t) );
+        REQUIRE( *page.at<uint32_t>(0) == 5 );
+    }
+
+    be::delblocklist_t dels;
+    for (int i = 0; i < blocks.size(); i++)
+        dels.push_back(be::delblock_t(blocks[i].id));
+    uring.del_all(dels);
+    for (int i = 0; i < dels.size(); i++)
+        REQUIRE( dels[i].success );
+
+    REQUIRE_THROWS_AS( uring.get(blocks[0].id), be::block_not_found );
+}
+#endif
+
+TEST_CASE("external mempages", "[be]")
+{
+    int released = 0;
+    struct release
+    {
+        release(int *counter) : counter(counter) { }
+        void operator()(uint8_t *) { (*counter)++; }
+        int *counter;
+    };
+
+    uint8_t data[4] = { 1, 2, 3, 4 };
+    {
+        mempage page = mempage::external(data, sizeof(data), release(&released));
+        mempage copy = page;
+        REQUIRE( (const void*)copy.ptr() == (const void*)data );
+        REQUIRE( copy.size() == 4 );
+    }
+    REQUIRE( released == 1 );
+}
+
+TEST_CASE("disk engine can mmap blocks", "[be]")
+{
+    temp_dir dir;
+    std::string prefix = dir.path() + "/";
+
+    be::disk disk(prefix, 1024);
+    be::putblocklist_t blocks;
+    mempage page(sizeof(uint32_t));
+    *page.at<uint32_t>(0) = 42;
+    blocks.push_back(be::putblock_t(disk.id(page), page));
+    disk.put_all(blocks);
+
+    be::disk mapped(prefix, 0, 0, true);
+    REQUIRE( *mapped.get(blocks[0].id).at<uint32_t>(0) == 42 );
+
+    be::delblocklist_t dels;
+    dels.push_back(be::delblock_t(blocks[0].id));
+    disk.del_all(dels);
+}
+
+TEST_CASE("pack engine", "[be]")
+{
+    temp_dir dir;
+
+    be::putblocklist_t blocks;
+    for (uint32_t i = 0; i < 10; i++)
+    {
+        mempage page(sizeof(i));
+        *page.at<uint32_t>(0) = i;
+        blocks.push_back(be::putblock_t(nodeid_t(), page));
+    }
+
+    {
+        // Room for 4 blocks per segment
+        be::pack pack(dir.path(), 1024, 0, 16);
+        for (int i = 0; i < blocks.size(); i++)
+            blocks[i].id = pack.id(blocks[i].mem);
+        pack.put_all(blocks);
+        for (int i = 0; i < blocks.size(); i++)
+            REQUIRE( blocks[i].success );
+
+        REQUIRE( pack.blockCount() == 10 );
+        REQUIRE( pack.segmentCount() == 3 );
+    }
+
+    SECTION("index is persisted")
+    {
+        be::pack pack(dir.path(), 0);
+        REQUIRE( pack.blockCount() == 10 );
+
+        be::blockidlist_t ids;
+        for (int i = 0; i < blocks.size(); i++)
+            ids.push_back(blocks[i].id);
+
+        be::mempagelist_t pages = pack.get_all_async(ids).get();
+        for (uint32_t i = 0; i < pages.size(); i++)
+            REQUIRE( *pages[i].at<uint32_t>(0) == i );
+    }
+
+    SECTION("read-only pack can be mapped")
+    {
+        REQUIRE_THROWS_AS( be::pack(dir.path(), 1024, 0, 16, 0.5, true), be::be_error );
+
+        mempage page;
+        {
+            be::pack pack(dir.path(), 0, 0, 16, 0.5, true);
+            page = pack.get(blocks[7].id);
+        }
+
+        // Page keeps the mapping alive
+        REQUIRE( *page.at<uint32_t>(0) == 7 );
+    }
+
+    SECTION("putting the same blocks again doesn't write them twice")
+    {
+        be::pack pack(dir.path(), 1024, 0, 16);
+        pack.put_all(blocks);
+        REQUIRE( blocks[0].success );
+        REQUIRE( pack.segmentCount() == 3 );
+    }
+
+    SECTION("deleting and compacting")
+    {
+        {
+            be::pack pack(dir.path(), 1024, 0, 16);
+
+            be::delblocklist_t dels;
+            for (int i = 0; i < 3; i++)
+                dels.push_back(be::delblock_t(blocks[i].id));
+            pack.del_all(dels);
+            REQUIRE( dels[0].success );
+            REQUIRE_THROWS_AS( pack.get(blocks[0].id), be::block_not_found );
+
+            // First segment only has one live block left, which is moved
+            pack.compact();
+            REQUIRE( pack.segmentCount() == 2 );
+            REQUIRE( pack.compactFailures() == 0 );
+            REQUIRE( *pack.get(blocks[3].id).at<uint32_t>(0) == 3 );
+        }
+
+        be::pack pack(dir.path(), 0);
+        REQUIRE( pack.blockCount() == 7 );
+        REQUIRE( pack.segmentCount() == 2 );
+        for (uint32_t i = 3; i < blocks.size(); i++)
+            REQUIRE( *pack.get(blocks[i].id).at<uint32_t>(0) == i );
+    }
+
+    SECTION("failed background compaction is counted")
+    {
+        {
+            be::pack pack(dir.path(), 1024, 0, 16, 0);
+
+            be::delblocklist_t dels;
+            for (int i = 0; i < 3; i++)
+                dels.push_back(be::delblock_t(blocks[i].id));
+            pack.del_all(dels);
+        }
+
+        // Stands in the way of the rewritten index
+        mkdir((dir.path() + "/index.tmp").c_str(), 0755);
+
+        be::pack pack(dir.path(), 1024, 0, 16);
+        for (int i = 0; i < 500 && pack.compactFailures() == 0; i++)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        REQUIRE( pack.compactFailures() == 1 );
+        REQUIRE( pack.lastCompactError().find("pack index") != std::string::npos );
+        REQUIRE( *pack.get(blocks[3].id).at<uint32_t>(0) == 3 );
+    }
+}
+
+namespace {
+
+util::options_t g_probedOptions;
+
+be::be_ptr createProbeEngine(const std::string &, size_t block_size, size_t queue_size, const util::options_t &options)
+{
+    g_probedOptions = options;
+    return boost::make_shared<be::mem>(block_size, queue_size);
+}
+
+}
+
+TEST_CASE("decorators keep their own options from the inner engine", "[be]")
+{
+    util::register_be_factory("probe", &createProbeEngine);
+    be::register_cache_engine();
+    be::register_compress_engine();
+    be::register_parallel_engine();
+
+    util::create_be("cache://compress://parallel://probe://;cache=4096;cachepolicy=2q;codec=zlib;level=1;threads=2;bs=1024;qs=64;other=1");
+    REQUIRE( g_probedOptions.size() == 3 );
+    REQUIRE( g_probedOptions.get<size_t>("bs", 0) == 1024 );
+    REQUIRE( g_probedOptions.get<size_t>("qs", 0) == 64 );
+    REQUIRE( g_probedOptions.get<int>("other", 0) == 1 );
+}
+
+TEST_CASE("parallel engine", "[be]")
+{
+    temp_dir dir;
+
+    be::register_disk_engine();
+    be::register_parallel_engine();
+    be::be_ptr engine = util::create_be("parallel://file://" + dir.path() + "/;threads=4;bs=1024");
+    REQUIRE( engine->maxBlockSize() == 1024 );
+
+    be::putblocklist_t blocks;
+    for (uint32_t i = 0; i < 10; i++)
+    {
+        mempage page(sizeof(i));
+        *page.at<uint32_t>(0) = i;
+        blocks.push_back(be::putblock_t(engine->id(page), page));
+    }
+    engine->put_all(blocks);
+    for (int i = 0; i < blocks.size(); i++)
+        REQUIRE( blocks[i].success );
+
+    // Asynchronous puts fill in the flags once they're waited on
+    be::putblocklist_t more;
+    for (uint32_t i = 10; i < 20; i++)
+    {
+        mempage page(sizeof(i));
+        *page.at<uint32_t>(0) = i;
+        more.push_back(be::putblock_t(engine->id(page), page));
+    }
+    engine->put_all_async(more).get();
+    for (int i = 0; i < more.size(); i++)
+        REQUIRE( more[i].success );
+    for (int i = 0; i < more.size(); i++)
+        blocks.push_back(more[i]);
+
+    be::blockidlist_t ids;
+    for (int i = 0; i < blocks.size(); i++)
+        ids.push_back(blocks[i].id);
+    be::mempagelist_t pages = engine->get_all_async(ids).get();
+    for (uint32_t i = 0; i < pages.size(); i++)
+        REQUIRE( *pages[i].at<uint32_t>(0) == i );
+
+    // Scans are split up the same way
+    pages = engine->get_all_async(ids, be::FETCH_SCAN).get();
+    REQUIRE( pages.size() == ids.size() );
+    for (uint32_t i = 0; i < pages.size(); i++)
+        REQUIRE( *pages[i].at<uint32_t>(0) == i );
+
+    be::delblocklist_t dels;
+    for (int i = 0; i < blocks.size(); i++)
+        dels.push_back(be::delblock_t(blocks[i].id));
+    engine->del_all(dels);
+    for (int i = 0; i < dels.size(); i++)
+        REQUIRE( dels[i].success );
+
+    REQUIRE_THROWS( engine->get_all(ids) );
+}
+
+TEST_CASE("large trees are written through the parallel engine", "[be]")
+{
+    temp_dir dir;
+
+    be::register_disk_engine();
+    be::register_parallel_engine();
+    be::be_ptr engine = util::create_be("parallel://file://" + dir.path() + "/;threads=4;bs=1024");
+    bruce<int, int> b(*engine);
+
+    // Enough leaves for the serializer to split the level over its workers
+    bruce<int, int>::tree_ptr t = b.create();
+    for (int i = 0; i < 20000; i++)
+        t->insert(i, i * 2);
+    mutation mut = t->write();
+    REQUIRE( mut.success() );
+    REQUIRE( mut.createdIDs().size() > 100 );
+
+    bruce<int, int>::tree_ptr u = b.query(*mut.newRootID());
+    int n = 0;
+    for (bruce<int, int>::iterator it = u->begin(); it; ++it, ++n)
+    {
+        REQUIRE( it.key() == n );
+        REQUIRE( it.value() == n * 2 );
+    }
+    REQUIRE( n == 20000 );
+
+    b.finish(mut, false);
+}
+
+namespace {
+
+mempage textPage(size_t size, int variant)
+{
+    const char *words[] = { "alpha ", "bravo ", "charlie ", "delta ", "echo " };
+    mempage page(size);
+    for (size_t i = 0; i < size; i++)
+        page.ptr()[i] = words[(i / 7 + variant) % 5][i % 6];
+    return page;
+}
+
+void checkCodec(be::compress::codec_t codec)
+{
+    boost::shared_ptr<be::mem> mem = boost::make_shared<be::mem>(65536);
+    be::compress compress(mem, codec, codec == be::compress::CODEC_ZSTD ? 3 : 6);
+
+    be::putblocklist_t blocks;
+    blocks.push_back(be::putblock_t(nodeid_t((size_t)1), textPage(4096, 0)));
+    blocks.push_back(be::putblock_t(nodeid_t((size_t)2), mempage(1)));
+    compress.put_all(blocks);
+    REQUIRE( blocks[0].success );
+    REQUIRE( blocks[1].success );
+
+    SECTION("compressible pages get smaller")
+    {
+        REQUIRE( mem->get(nodeid_t((size_t)1)).size() < 4096 );
+        mempage page = compress.get(nodeid_t((size_t)1));
+        REQUIRE( page.size() == 4096 );
+        REQUIRE( memcmp(page.ptr(), blocks[0].mem.ptr(), 4096) == 0 );
+        REQUIRE( compress.stats().ratio() > 1 );
+    }
+
+    SECTION("pages that don't get smaller are stored as they are")
+    {
+        REQUIRE( mem->get(nodeid_t((size_t)2)).size() == 9 );
+        REQUIRE( compress.get(nodeid_t((size_t)2)).size() == 1 );
+    }
+
+    SECTION("blocks written without compression are passed through")
+    {
+        be::putblocklist_t raw;
+        raw.push_back(be::putblock_t(nodeid_t((size_t)3), textPage(100, 0)));
+        mem->put_all(raw);
+        REQUIRE( compress.get(nodeid_t((size_t)3)).size() == 100 );
+    }
+
+    SECTION("dictionaries are stored in the inner engine")
+    {
+        be::mempagelist_t samples;
+        for (int i = 0; i < 20; i++)
+            samples.push_back(textPage(512, i));
+        nodeid_t dictID = compress.train(samples);
+
+        be::putblocklist_t small;
+        small.push_back(be::putblock_t(nodeid_t((size_t)4), textPage(512, 3)));
+        compress.put_all(small);
+
+        // A fresh engine finds the dictionary by itself
+        be::compress reader(mem, codec, 0);
+        mempage page = reader.get(nodeid_t((size_t)4));
+        REQUIRE( memcmp(page.ptr(), small[0].mem.ptr(), 512) == 0 );
+        REQUIRE( mem->get(dictID).size() > 0 );
+        REQUIRE( compress.dictionaries() == be::blockidlist_t(1, dictID) );
+        REQUIRE( reader.dictionaries().empty() );
+    }
+}
+
+}
+
+TEST_CASE("compress engine with zlib", "[be]")
+{
+    checkCodec(be::compress::CODEC_ZLIB);
+}
+
+#ifdef HAVE_ZSTD
+TEST_CASE("compress engine with zstd", "[be]")
+{
+    checkCodec(be::compress::CODEC_ZSTD);
+}
+#endif
+
+TEST_CASE("trees can be stored compressed", "[be]")
+{
+    boost::shared_ptr<be::mem> mem = boost::make_shared<be::mem>(1024);
+    be::compress compress(mem, be::compress::CODEC_ZLIB, 6, 2);
+    bruce<int, int> b(compress);
+
+    bruce<int, int>::tree_ptr t = b.create();
+    for (int i = 0; i < 1000; i++)
+        t->insert(i, i * 2);
+    mutation mut = t->write();
+    b.finish(mut, true);
+
+    // Train on the first leaves, then compress the rest with the dictionary
+    REQUIRE( compress.stats().pagesCompressed > 2 );
+    REQUIRE( compress.dictionaries().size() == 1 );
+
+    bruce<int, int>::tree_ptr u = b.query(*mut.newRootID());
+    REQUIRE( *u->get(999) == 1998 );
+}
+
+TEST_CASE("cache engine pins internal pages", "[be]")
+{
+    boost::shared_ptr<be::mem> mem = boost::make_shared<be::mem>(1024);
+    bruce<int, int> writer(*mem);
+
+    bruce<int, int>::tree_ptr t = writer.create();
+    for (int i = 0; i < 1000; i++)
+        t->insert(i, i * 2);
+    mutation mut = t->write();
+    writer.finish(mut, true);
+
+    be::cache cache(mem, 1024 * 1024, 1024 * 1024);
+    bruce<int, int> b(cache);
+
+    REQUIRE( *b.query(*mut.newRootID())->get(10) == 20 );
+    be::cache_stats first = cache.stats();
+    REQUIRE( first.pinnedCount > 0 );
+    REQUIRE( first.hits == 0 );
+
+    // Only the leaf isn't pinned yet
+    REQUIRE( *b.query(*mut.newRootID())->get(990) == 1980 );
+    be::cache_stats second = cache.stats();
+    REQUIRE( second.misses == first.misses + 1 );
+    REQUIRE( second.pinnedHits >= first.pinnedCount );
+
+    SECTION("leaves are cached")
+    {
+        REQUIRE( *b.query(*mut.newRootID())->get(990) == 1980 );
+        REQUIRE( cache.stats().misses == second.misses );
+    }
+
+    SECTION("deleted blocks are forgotten")
+    {
+        be::delblocklist_t dels;
+        dels.push_back(be::delblock_t(*mut.newRootID()));
+        cache.del_all(dels);
+        REQUIRE( cache.stats().pinnedCount == first.pinnedCount - 1 );
+    }
+
+    SECTION("the pinned budget is respected")
+    {
+        be::cache small(mem, 1024 * 1024, 0);
+        bruce<int, int> c(small);
+        REQUIRE( *c.query(*mut.newRootID())->get(10) == 20 );
+        REQUIRE( small.stats().pinnedCount == 0 );
+    }
+}
+
+TEST_CASE("tiered engine keeps blocks on local disk", "[be]")
+{
+    temp_dir dir;
+
+    boost::shared_ptr<be::mem> remote = boost::make_shared<be::mem>(1024);
+    be::putblocklist_t blocks;
+    for (size_t i = 0; i < 4; i++)
+        blocks.push_back(be::putblock_t(nodeid_t(i + 1), mempage(100)));
+
+    {
+        be::tiered tiered(remote, dir.path(), 350);
+        tiered.put_all(blocks);
+
+        // The oldest block didn't fit
+        REQUIRE( tiered.stats().count == 3 );
+        REQUIRE( tiered.stats().size == 300 );
+        REQUIRE( tiered.get(nodeid_t((size_t)1)).size() == 100 );
+        REQUIRE( tiered.stats().misses == 1 );
+    }
+
+    SECTION("blocks survive a restart")
+    {
+        be::tiered tiered(remote, dir.path(), 350);
+        REQUIRE( tiered.stats().count == 3 );
+
+        // Served without going to the remote engine
+        be::delblocklist_t dels;
+        dels.push_back(be::delblock_t(nodeid_t((size_t)4)));
+        remote->del_all(dels);
+        REQUIRE( tiered.get(nodeid_t((size_t)4)).size() == 100 );
+        REQUIRE( tiered.stats().hits == 1 );
+    }
+
+    SECTION("a lower limit evicts at startup")
+    {
+        be::tiered tiered(remote, dir.path(), 150);
+        REQUIRE( tiered.stats().count == 1 );
+    }
+
+    SECTION("scans don't populate the cache")
+    {
+        be::tiered tiered(remote, dir.path(), 1000);
+        be::delblocklist_t dels;
+        dels.push_back(be::delblock_t(nodeid_t((size_t)1)));
+        tiered.del_all(dels);
+        REQUIRE( tiered.stats().count == 2 );
+
+        remote->put_all(blocks);
+        tiered.get_all_async(be::blockidlist_t(1, nodeid_t((size_t)1)), be::FETCH_SCAN).get();
+        REQUIRE( tiered.stats().count == 2 );
+        tiered.get_all_async(be::blockidlist_t(1, nodeid_t((size_t)1))).get();
+        REQUIRE( tiered.stats().count == 3 );
+    }
+}
+
+TEST_CASE("tiered engine fetches damaged local copies again", "[be]")
+{
+    temp_dir remoteDir;
+    temp_dir dir;
+
+    boost::shared_ptr<be::disk> remote = boost::make_shared<be::disk>(remoteDir.path() + "/", 1024);
+    mempage page(100);
+    memset(page.ptr(), 7, page.size());
+    be::putblocklist_t blocks;
+    blocks.push_back(be::putblock_t(remote->id(page), page));
+
+    be::tiered tiered(remote, dir.path(), 1000);
+    tiered.put_all(blocks);
+    REQUIRE( tiered.stats().count == 1 );
+
+    // Damage the local copy
+    std::string local = dir.path() + "/" + boost::lexical_cast<std::string>(blocks[0].id);
+    FILE *f = fopen(local.c_str(), "r+b");
+    REQUIRE( f );
+    fputc(8, f);
+    fclose(f);
+
+    REQUIRE( tiered.get(blocks[0].id).ptr()[0] == 7 );
+    REQUIRE( tiered.stats().hits == 0 );
+
+    // The remote copy replaced it
+    REQUIRE( tiered.get(blocks[0].id).ptr()[0] == 7 );
+    REQUIRE( tiered.stats().hits == 1 );
+}
+
+TEST_CASE("warming up a tree loads its top levels", "[be]")
+{
+    boost::shared_ptr<be::mem> mem = boost::make_shared<be::mem>(1024);
+    bruce<int, int> writer(*mem);
+
+    bruce<int, int>::tree_ptr t = writer.create();
+    for (int i = 0; i < 1000; i++)
+        t->insert(i, i * 2);
+    mutation mut = t->write();
+    writer.finish(mut, true);
+
+    be::cache cache(mem, 1024 * 1024, 1024 * 1024);
+    bruce<int, int> b(cache);
+
+    SECTION("only the internal levels")
+    {
+        size_t loaded = b.warm(*mut.newRootID(), 1);
+        REQUIRE( loaded == 1 );
+        REQUIRE( cache.stats().pinnedCount == 1 );
+    }
+
+    SECTION("all the way down")
+    {
+        size_t loaded = b.warm(*mut.newRootID(), 100);
+        REQUIRE( loaded > cache.stats().pinnedCount );
+
+        be::cache_stats before = cache.stats();
+        REQUIRE( *b.query(*mut.newRootID())->get(500) == 1000 );
+        REQUIRE( cache.stats().misses == before.misses );
+    }
+}
+
+TEST_CASE("cache engine remembers hot blocks across restarts", "[be]")
+{
+    temp_dir dir;
+    std::string hotFile = dir.path() + "/hot";
+
+    boost::shared_ptr<be::mem> mem = boost::make_shared<be::mem>(1024);
+    be::putblocklist_t blocks;
+    for (size_t i = 0; i < 3; i++)
+        blocks.push_back(be::putblock_t(nodeid_t(i + 1), mempage(100)));
+    mem->put_all(blocks);
+
+    {
+        be::cache cache(mem, 1024 * 1024, 0, util::CACHE_LRU, hotFile);
+        cache.get(nodeid_t((size_t)1));
+        cache.get(nodeid_t((size_t)2));
+    }
+
+    // One of them has gone away in the meantime
+    be::delblocklist_t dels;
+    dels.push_back(be::delblock_t(nodeid_t((size_t)2)));
+    mem->del_all(dels);
+
+    be::cache cache(mem, 1024 * 1024, 0, util::CACHE_LRU, hotFile);
+    be::cache_stats before = cache.stats();
+    cache.get(nodeid_t((size_t)1));
+    REQUIRE( cache.stats().hits == before.hits + 1 );
+    REQUIRE( cache.hotIDs().size() == 1 );
+}
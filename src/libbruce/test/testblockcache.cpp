@@ -0,0 +1,184 @@
+#include <catch/catch.hpp>
+#include <libbruce/bruce.h>
+#include <libbruce/util/blockcache.h>
+
+#include <thread>
+
+using namespace libbruce;
+
+namespace {
+
+mempage block(size_t size, uint8_t fill)
+{
+    mempage page(size);
+    memset(page.ptr(), fill, size);
+    return page;
+}
+
+bool access(util::BlockCache &cache, size_t id)
+{
+    mempage page;
+    if (cache.get(nodeid_t(id), &page))
+        return true;
+    cache.put(nodeid_t(id), block(100, id));
+    return false;
+}
+
+/**
+ * Use a few hot blocks among a stream of cold ones, then scan, and return how
+ * many of the hot blocks survived the scan
+ */
+int hotAfterScan(util::cache_policy_t policy)
+{
+    util::BlockCache cache(2000, policy, 1);
+
+    for (size_t round = 0; round < 50; round++)
+    {
+        for (size_t i = 1; i <= 5; i++)
+            access(cache, i);
+        for (size_t i = 0; i < 5; i++)
+            access(cache, 1000 + round * 5 + i);
+    }
+
+    for (size_t i = 0; i < 200; i++)
+        access(cache, 100000 + i);
+
+    int ret = 0;
+    mempage page;
+    for (size_t i = 1; i <= 5; i++)
+        if (cache.get(nodeid_t(i), &page))
+            ret++;
+    return ret;
+}
+
+void hammer(util::BlockCache *cache, size_t seed)
+{
+    for (size_t i = 0; i < 10000; i++)
+    {
+        nodeid_t id((seed * 7919 + i) % 500);
+        mempage page;
+        if (!cache->get(id, &page))
+            cache->put(id, block(100, i));
+        if (i % 7 == 0)
+            cache->del(id);
+    }
+}
+
+}
+
+TEST_CASE("block cache")
+{
+    util::BlockCache cache(1000, util::CACHE_LRU, 1);
+
+    SECTION("returns what was put")
+    {
+        cache.put(nodeid_t(1), block(100, 'a'));
+
+        mempage page;
+        REQUIRE(cache.get(nodeid_t(1), &page));
+        REQUIRE(page.size() == 100);
+        REQUIRE(*page.at<uint8_t>(0) == 'a');
+        REQUIRE(!cache.get(nodeid_t(2), &page));
+    }
+
+    SECTION("putting the same block twice counts it once")
+    {
+        cache.put(nodeid_t(1), block(100, 'a'));
+        cache.put(nodeid_t(1), block(100, 'a'));
+        REQUIRE(cache.size() == 100);
+        REQUIRE(cache.count() == 1);
+    }
+
+    SECTION("delete releases the size")
+    {
+        cache.put(nodeid_t(1), block(100, 'a'));
+        cache.put(nodeid_t(2), block(100, 'b'));
+        cache.del(nodeid_t(1));
+        REQUIRE(cache.size() == 100);
+        REQUIRE(cache.count() == 1);
+
+        mempage page;
+        REQUIRE(!cache.get(nodeid_t(1), &page));
+    }
+
+    SECTION("evicts least recently used blocks")
+    {
+        for (size_t i = 0; i < 10; i++)
+            cache.put(nodeid_t(i), block(100, i));
+
+        mempage page;
+        REQUIRE(cache.get(nodeid_t((size_t)0), &page));
+
+        cache.put(nodeid_t(10), block(100, 10));
+        REQUIRE(cache.size() == 1000);
+        REQUIRE(cache.get(nodeid_t((size_t)0), &page));
+        REQUIRE(!cache.get(nodeid_t(1), &page));
+        REQUIRE(cache.get(nodeid_t(2), &page));
+    }
+}
+
+TEST_CASE("sharded block cache can be used from multiple threads")
+{
+    util::BlockCache cache(20000, util::CACHE_LRU, 4);
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < 4; i++)
+        threads.push_back(std::thread(hammer, &cache, i));
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+
+    REQUIRE(cache.size() <= 20000);
+    REQUIRE(cache.size() == cache.count() * 100);
+}
+
+TEST_CASE("blocks that fit in the cache fit in a shard")
+{
+    // 16 shards of 62 bytes each would never keep this block
+    util::BlockCache cache(1000, util::CACHE_LRU, 16, 500);
+    cache.put(nodeid_t(1), block(500, 1));
+
+    mempage page;
+    REQUIRE( cache.get(nodeid_t(1), &page) );
+    REQUIRE( page.size() == 500 );
+}
+
+TEST_CASE("block cache policies")
+{
+    SECTION("a scan flushes an LRU cache")
+    {
+        REQUIRE( hotAfterScan(util::CACHE_LRU) == 0 );
+    }
+
+    SECTION("2Q keeps hot blocks during a scan")
+    {
+        REQUIRE( hotAfterScan(util::CACHE_2Q) == 5 );
+    }
+
+    SECTION("TinyLFU keeps hot blocks during a scan")
+    {
+        REQUIRE( hotAfterScan(util::CACHE_TINYLFU) == 5 );
+    }
+
+    SECTION("all policies stay within their size")
+    {
+        util::cache_policy_t policies[] = { util::CACHE_LRU, util::CACHE_2Q, util::CACHE_TINYLFU };
+        for (int p = 0; p < 3; p++)
+        {
+            util::BlockCache cache(1000, policies[p], 1);
+            for (size_t i = 0; i < 500; i++)
+            {
+                access(cache, i % 37);
+                if (i % 11 == 0)
+                    cache.del(nodeid_t(i % 37));
+                REQUIRE( cache.size() <= 1000 );
+                REQUIRE( cache.size() == cache.count() * 100 );
+            }
+        }
+    }
+
+    SECTION("policies can be named")
+    {
+        REQUIRE( util::parse_cache_policy("tinylfu") == util::CACHE_TINYLFU );
+        REQUIRE_THROWS( util::parse_cache_policy("mru") );
+    }
+}
@@ -5,6 +5,10 @@
 #include "nodes.h"
 #include "serializing.h"
 #include <ostream>
+#include <stdexcept>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ftw.h>
 
 namespace libbruce {
 
@@ -66,6 +70,30 @@ nodeid_t putNode(be::mem &mem, const node_ptr &node)
     return id;
 }
 
+namespace {
+
+int removeEntry(const char *path, const struct stat *, int, struct FTW *)
+{
+    remove(path);
+    return 0;
+}
+
+}
+
+temp_dir::temp_dir()
+{
+    char dir[] = "/tmp/testbruce.XXXXXX";
+    if (!mkdtemp(dir))
+        throw std::runtime_error("Error creating temporary directory");
+    m_path = dir;
+}
+
+temp_dir::~temp_dir()
+{
+    // Depth first, so directories are empty by the time they are removed
+    nftw(m_path.c_str(), &removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
 //----------------------------------------------------------------------
 
 make_leaf::make_leaf(const tree_functions &fns)
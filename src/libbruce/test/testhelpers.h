@@ -4,6 +4,7 @@
 
 #include <libbruce/bruce.h>
 #include <libbruce/mempool.h>
+#include <boost/noncopyable.hpp>
 #include "nodes.h"
 
 namespace libbruce {
@@ -32,6 +33,20 @@ void putNode(be::mem &mem, nodeid_t id, const node_ptr &node);
 leafnode_ptr loadLeaf(be::mem &mem, const nodeid_t &id);
 internalnode_ptr loadInternal(be::mem &mem, const nodeid_t &id);
 
+/**
+ * A fresh directory under /tmp, removed along with its contents when it goes out of scope
+ */
+struct temp_dir : private boost::noncopyable
+{
+    temp_dir();
+    ~temp_dir();
+
+    const std::string &path() const { return m_path; }
+
+private:
+    std::string m_path;
+};
+
 //----------------------------------------------------------------------
 // BUILDERS
 //
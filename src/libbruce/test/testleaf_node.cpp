@@ -4,6 +4,7 @@
 #include <catch/catch.hpp>
 #include "testhelpers.h"
 #include "leaf_node.h"
+#include "serializing.h"
 #include <libbruce/bruce.h>
 
 #include <stdio.h>
@@ -48,9 +49,9 @@ struct ApplyTests
     {
         leaf->applyAll(edits.begin(), edits.end());
 
-        for (pairlist_t::iterator it = leaf->pairs.begin(); it != leaf->pairs.end(); ++it)
+        for (pairlist_t::iterator it = leaf->pairs().begin(); it != leaf->pairs().end(); ++it)
         {
-            if (it != leaf->pairs.begin()) values += ", ";
+            if (it != leaf->pairs().begin()) values += ", ";
             int *p = (int*)it->second.ptr();
             if (p) values += boost::lexical_cast<std::string>(*p);
         }
@@ -59,7 +60,7 @@ struct ApplyTests
     void verifySize()
     {
         // Construct a new leaf node and check that the size of the modified leaf node is the same.
-        leafnode_ptr reference = boost::make_shared<LeafNode>(leaf->pairs.begin(), leaf->pairs.end(), intToIntTree);
+        leafnode_ptr reference = boost::make_shared<LeafNode>(leaf->pairs().begin(), leaf->pairs().end(), intToIntTree);
         REQUIRE( reference->elementsSize() == leaf->elementsSize() );
     }
 
@@ -218,3 +219,35 @@ TEST_CASE_METHOD(ApplyTests, "upsert then remove")
         verifySize();
     }
 }
+
+TEST_CASE("parsed leaf is only materialized when it is edited")
+{
+    leafnode_ptr orig = boost::make_shared<LeafNode>(intToIntTree);
+    orig->insert(mkPair(5, 50));
+    orig->insert(mkPair(10, 100));
+    orig->insert(mkPair(10, 101));
+    orig->insert(mkPair(20, 200));
+
+    mempage page = SerializeNode(orig);
+    leafnode_ptr leaf = boost::dynamic_pointer_cast<LeafNode>(ParseNode(page, intToIntTree));
+    REQUIRE( leaf->lazy() );
+
+    // Lookups come from the page
+    keycount_t begin, end;
+    leaf->findRange(intCopy(10), &begin, &end);
+    REQUIRE( begin == 1 );
+    REQUIRE( end == 3 );
+    REQUIRE( rngcmp(leaf->value(2), intCopy(101)) == 0 );
+    REQUIRE( rngcmp(leaf->minKey(), intCopy(5)) == 0 );
+    REQUIRE( leaf->itemCount() == 4 );
+    REQUIRE( leaf->lazy() );
+
+    // Edits copy the pairs out first
+    editlist_t edits;
+    edits.push_back(pending_edit(INSERT, intCopy(15), intCopy(150), true));
+    leaf->applyAll(edits.begin(), edits.end());
+    REQUIRE( !leaf->lazy() );
+    REQUIRE( leaf->pairCount() == 5 );
+    REQUIRE( rngcmp(leaf->key(3), intCopy(15)) == 0 );
+    REQUIRE( leaf->elementsSize() == 5 * 8 );
+}
@@ -0,0 +1,126 @@
+#include <catch/catch.hpp>
+#include <libbruce/bruce.h>
+#include <libbruce/util/node_cache.h>
+
+#include "testhelpers.h"
+
+using namespace libbruce;
+
+namespace {
+
+nodeid_t makeTree(be::be &be, int n)
+{
+    bruce<int, int> b(be);
+    bruce<int, int>::tree_ptr t = b.create();
+    for (int i = 0; i < n; i++)
+        t->insert(i, i * 2);
+    mutation mut = t->write();
+    b.finish(mut, true);
+    return *mut.newRootID();
+}
+
+}
+
+TEST_CASE("parsed nodes are shared between trees", "[nodecache]")
+{
+    temp_dir dir;
+    be::disk disk(dir.path() + "/", 1024);
+    bruce<int, int> b(disk);
+
+    nodeid_t root = makeTree(disk, 1000);
+    util::clear_node_cache();
+
+    REQUIRE( *b.query(root)->get(500) == 1000 );
+    util::node_cache_stats first = util::get_node_cache_stats();
+    REQUIRE( first.hits == 0 );
+    REQUIRE( first.count > 0 );
+
+    SECTION("the second query finds them")
+    {
+        REQUIRE( *b.query(root)->get(500) == 1000 );
+        util::node_cache_stats second = util::get_node_cache_stats();
+        REQUIRE( second.hits == first.misses );
+        REQUIRE( second.misses == first.misses );
+    }
+
+    SECTION("editing a tree doesn't change the shared nodes")
+    {
+        bruce<int, int>::tree_ptr t = b.edit(root);
+        t->upsert(500, 1, false);
+        t->remove(501, false);
+        mutation mut = t->write();
+
+        REQUIRE( *b.query(*mut.newRootID())->get(500) == 1 );
+        REQUIRE( *b.query(root)->get(500) == 1000 );
+        REQUIRE( *b.query(root)->get(501) == 1002 );
+        REQUIRE( util::get_node_cache_stats().hits > 0 );
+    }
+
+    SECTION("scans don't fill the cache")
+    {
+        util::clear_node_cache();
+        int n = 0;
+        bruce<int, int>::tree_ptr t = b.query(root);
+        for (bruce<int, int>::iterator it = t->begin(be::FETCH_SCAN); it; ++it)
+            n++;
+        REQUIRE( n == 1000 );
+
+        // Only the root
+        REQUIRE( util::get_node_cache_stats().count == 1 );
+    }
+
+    SECTION("capacity limits the cache")
+    {
+        util::set_node_cache_capacity(1);
+        REQUIRE( util::get_node_cache_stats().count == 0 );
+        REQUIRE( *b.query(root)->get(500) == 1000 );
+        REQUIRE( util::get_node_cache_stats().hits == 0 );
+        util::set_node_cache_capacity(32 * 1024 * 1024);
+    }
+}
+
+TEST_CASE("queued edits are applied to copies of shared nodes", "[nodecache]")
+{
+    temp_dir dir;
+    be::disk disk(dir.path() + "/", 1024, 512);
+    bruce<int, int> b(disk);
+
+    nodeid_t root = makeTree(disk, 1000);
+
+    // Leave the edits queued in the root
+    bruce<int, int>::tree_ptr t = b.edit(root);
+    for (int i = 0; i < 10; i++)
+        t->upsert(i * 100, -i, true);
+    mutation mut = t->write();
+    nodeid_t edited = *mut.newRootID();
+
+    util::clear_node_cache();
+    REQUIRE( *b.query(edited)->get(500) == -5 );
+
+    bruce<int, int>::tree_ptr q = b.query(edited);
+    REQUIRE( *q->get(500) == -5 );
+    REQUIRE( *q->get(501) == 1002 );
+    REQUIRE( q->find(300).rank() == 300 );
+    REQUIRE( q->seek(700).value() == -7 );
+
+    int n = 0;
+    for (bruce<int, int>::iterator it = q->begin(); it; ++it)
+        n++;
+    REQUIRE( n == 1000 );
+
+    REQUIRE( util::get_node_cache_stats().hits > 0 );
+    REQUIRE( *b.query(edited)->get(300) == -3 );
+    REQUIRE( *b.query(root)->get(300) == 600 );
+}
+
+TEST_CASE("engines with arbitrary IDs don't share nodes", "[nodecache]")
+{
+    be::mem mem(1024);
+    bruce<int, int> b(mem);
+
+    nodeid_t root = makeTree(mem, 1000);
+    util::clear_node_cache();
+
+    REQUIRE( *b.query(root)->get(500) == 1000 );
+    REQUIRE( util::get_node_cache_stats().count == 0 );
+}
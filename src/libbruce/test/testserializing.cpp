@@ -3,6 +3,7 @@
 #include "serializing.h"
 #include "testhelpers.h"
 
+#include <algorithm>
 #include <stdio.h>
 
 using namespace libbruce;
@@ -76,41 +77,40 @@ TEST_CASE("calculating size of leaf node with different keys", "[serializing]")
         leaf->insert(kv_pair(intCopy(i), intCopy(i)));
 
     LeafNodeSize s(leaf, 1024);
-    REQUIRE( s.splitStart() == leaf->get_at(61));
-    // 61 * 8 + (2 + 2 + 4 + 8) ~ just under 512, which is half of the block size
-    REQUIRE( s.overflowStart() == leaf->get_at(61));
+    REQUIRE( s.splitStart() == leaf->get_at(60));
+    // 60 * 8 + (2 + 4 + 2 * 4 + 24) ~ just under 512, which is half of the block size
+    REQUIRE( s.overflowStart() == leaf->get_at(60));
 }
 
 TEST_CASE("calculate overflow when postfix is all the same key", "[serializing]")
 {
     leafnode_ptr leaf = boost::make_shared<LeafNode>(intToIntTree);
-    for (unsigned i = 0; i < 50; i++)
+    for (unsigned i = 0; i < 10; i++)
         leaf->insert(kv_pair(intCopy(i), intCopy(i)));
-    for (unsigned i = 50; i < 128; i++)
-        leaf->insert(kv_pair(intCopy(50), intCopy(i)));
+    for (unsigned i = 10; i < 300; i++)
+        leaf->insert(kv_pair(intCopy(10), intCopy(i)));
 
     LeafNodeSize s(leaf, 1024);
     REQUIRE( s.shouldSplit() );
-    REQUIRE( s.overflowStart() == leaf->get_at(51));
-    // Put everything after 64 in the overflow block
-    // 64 * 8 == 512, which is half of the block size
-    REQUIRE( s.splitStart() == leaf->get_at(128));
+    REQUIRE( s.overflowStart() == leaf->get_at(11));
+    // Half of the block size is reached in the run of 10s, whose key is
+    // stored once: the rest of the run goes in the overflow block
+    REQUIRE( s.splitStart() == leaf->get_at(300));
 }
 
 TEST_CASE("calculate overflow when middle is the same key", "[serializing]")
 {
     leafnode_ptr leaf = boost::make_shared<LeafNode>(intToIntTree);
-    for (unsigned i = 0; i < 50; i++)
+    for (unsigned i = 0; i < 10; i++)
         leaf->insert(kv_pair(intCopy(i), intCopy(i)));
-    for (unsigned i = 50; i < 128; i++)
-        leaf->insert(kv_pair(intCopy(50), intCopy(i)));
-    leaf->insert(kv_pair(intCopy(51), intCopy(51)));
+    for (unsigned i = 10; i < 300; i++)
+        leaf->insert(kv_pair(intCopy(10), intCopy(i)));
+    leaf->insert(kv_pair(intCopy(11), intCopy(11)));
 
     LeafNodeSize s(leaf, 1024);
-    REQUIRE( s.overflowStart() == leaf->get_at(51));
-    // Put everything after 64 in the overflow block
-    // 64 * 8 == 512, which is half of the block size
-    REQUIRE( s.splitStart() == leaf->get_at(128) );
+    REQUIRE( s.overflowStart() == leaf->get_at(11));
+    // The rest of the run of 10s goes in the overflow block
+    REQUIRE( s.splitStart() == leaf->get_at(300) );
 }
 
 
@@ -121,5 +121,361 @@ TEST_CASE("calculating size of overflow node", "[serializing]")
         overflow->append(intCopy(i));
 
     OverflowNodeSize s(overflow, 1024);
-    REQUIRE( s.splitIndex() == 248 );
+    REQUIRE( s.splitIndex() == 247 );
+}
+
+TEST_CASE("pages without columns can still be parsed", "[serializing]")
+{
+    SECTION("leaf")
+    {
+        // A leaf in the original layout: flags, count, keys, values, overflow
+        mempage page(sizeof(flags_t) + sizeof(keycount_t) + 4 * sizeof(uint32_t) + sizeof(itemcount_t) + sizeof(nodeid_t));
+        memset(page.ptr(), 0, page.size());
+        *page.at<flags_t>(0) = TYPE_LEAF;
+        *page.at<keycount_t>(2) = 2;
+        *page.at<uint32_t>(6) = 1;
+        *page.at<uint32_t>(10) = 2;
+        *page.at<uint32_t>(14) = 2;
+        *page.at<uint32_t>(18) = 1;
+
+        REQUIRE( !HasColumns(page) );
+        leafnode_ptr r = boost::dynamic_pointer_cast<LeafNode>(ParseNode(page, intToIntTree));
+        REQUIRE( r->pairCount() == 2 );
+        REQUIRE( rngcmp(r->get_at(0)->first, one_r) == 0 );
+        REQUIRE( rngcmp(r->get_at(0)->second, two_r) == 0 );
+        REQUIRE( rngcmp(r->get_at(1)->first, two_r) == 0 );
+        REQUIRE( rngcmp(r->get_at(1)->second, one_r) == 0 );
+        REQUIRE( r->overflow.empty() );
+    }
+
+    SECTION("internal node with a queued edit")
+    {
+        // flags, count, edit count, keys (but the first), IDs, item counts,
+        // edit types, edit keys, edit values
+        mempage page(sizeof(flags_t) + 2 * sizeof(keycount_t) + sizeof(uint32_t)
+                     + 2 * sizeof(nodeid_t) + 2 * sizeof(itemcount_t)
+                     + sizeof(uint8_t) + 2 * sizeof(uint32_t));
+        size_t offset = 0;
+        *page.at<flags_t>(offset) = TYPE_INTERNAL; offset += sizeof(flags_t);
+        *page.at<keycount_t>(offset) = 2; offset += sizeof(keycount_t);
+        *page.at<keycount_t>(offset) = 1; offset += sizeof(keycount_t);
+        *page.at<uint32_t>(offset) = 5; offset += sizeof(uint32_t);
+        *page.at<nodeid_t>(offset) = nodeid_t((size_t)1); offset += sizeof(nodeid_t);
+        *page.at<nodeid_t>(offset) = nodeid_t((size_t)2); offset += sizeof(nodeid_t);
+        *page.at<itemcount_t>(offset) = 10; offset += sizeof(itemcount_t);
+        *page.at<itemcount_t>(offset) = 20; offset += sizeof(itemcount_t);
+        *page.at<uint8_t>(offset) = INSERT; offset += sizeof(uint8_t);
+        *page.at<uint32_t>(offset) = 7; offset += sizeof(uint32_t);
+        *page.at<uint32_t>(offset) = 70; offset += sizeof(uint32_t);
+        REQUIRE( offset == page.size() );
+
+        REQUIRE( !HasColumns(page) );
+        internalnode_ptr r = boost::dynamic_pointer_cast<InternalNode>(ParseNode(page, intToIntTree));
+        REQUIRE( r->branchCount() == 2 );
+        REQUIRE( r->branch(0).minKey.empty() );
+        REQUIRE( r->branch(0).nodeID == nodeid_t((size_t)1) );
+        REQUIRE( r->branch(0).itemCount == 10 );
+        REQUIRE( rngcmp(r->branch(1).minKey, intCopy(5)) == 0 );
+        REQUIRE( r->branch(1).nodeID == nodeid_t((size_t)2) );
+        REQUIRE( r->branch(1).itemCount == 20 );
+
+        REQUIRE( r->editQueue.size() == 1 );
+        REQUIRE( r->editQueue[0].edit == INSERT );
+        REQUIRE( rngcmp(r->editQueue[0].key, intCopy(7)) == 0 );
+        REQUIRE( rngcmp(r->editQueue[0].value, intCopy(70)) == 0 );
+    }
+
+    SECTION("overflow node")
+    {
+        // flags, count, values, next
+        mempage page(sizeof(flags_t) + sizeof(keycount_t) + 2 * sizeof(uint32_t) + sizeof(itemcount_t) + sizeof(nodeid_t));
+        size_t offset = 0;
+        *page.at<flags_t>(offset) = TYPE_OVERFLOW; offset += sizeof(flags_t);
+        *page.at<keycount_t>(offset) = 2; offset += sizeof(keycount_t);
+        *page.at<uint32_t>(offset) = 3; offset += sizeof(uint32_t);
+        *page.at<uint32_t>(offset) = 4; offset += sizeof(uint32_t);
+        *page.at<itemcount_t>(offset) = 5; offset += sizeof(itemcount_t);
+        *page.at<nodeid_t>(offset) = nodeid_t((size_t)9); offset += sizeof(nodeid_t);
+        REQUIRE( offset == page.size() );
+
+        REQUIRE( !HasColumns(page) );
+        overflownode_ptr r = boost::dynamic_pointer_cast<OverflowNode>(ParseNode(page, intToIntTree));
+        REQUIRE( r->valueCount() == 2 );
+        REQUIRE( rngcmp(r->values[0], intCopy(3)) == 0 );
+        REQUIRE( rngcmp(r->values[1], intCopy(4)) == 0 );
+        REQUIRE( r->next.count == 5 );
+        REQUIRE( r->next.nodeID == nodeid_t((size_t)9) );
+    }
+}
+
+TEST_CASE("reading a leaf page without parsing it", "[serializing]")
+{
+    leafnode_ptr leaf = boost::make_shared<LeafNode>(intToIntTree);
+    for (unsigned i = 0; i < 10; i++)
+        leaf->insert(kv_pair(intCopy(i * 2), intCopy(i)));
+    mempage serialized = SerializeNode(leaf);
+
+    REQUIRE( HasColumns(serialized) );
+    LeafPage page(serialized);
+    REQUIRE( page.count() == 10 );
+    REQUIRE( rngcmp(page.key(3), intCopy(6)) == 0 );
+    REQUIRE( rngcmp(page.value(3), intCopy(3)) == 0 );
+    REQUIRE( page.overflowCount() == 0 );
+
+    REQUIRE( page.lowerBound(intCopy(6), intToIntTree) == 3 );
+    REQUIRE( page.lowerBound(intCopy(7), intToIntTree) == 4 );
+    REQUIRE( page.upperBound(intCopy(6), intToIntTree) == 4 );
+    REQUIRE( page.lowerBound(intCopy(100), intToIntTree) == 10 );
+}
+
+TEST_CASE("reading an internal page without parsing it", "[serializing]")
+{
+    internalnode_ptr internal = boost::make_shared<InternalNode>();
+    internal->insert(0, node_branch(one_r, 1, 1));
+    internal->insert(1, node_branch(two_r, 2, 2));
+    internal->insert(2, node_branch(intCopy(5), 3, 3));
+    internal->editQueue.push_back(pending_edit(INSERT, intCopy(4), intCopy(40), true));
+    internal->editQueue.push_back(pending_edit(REMOVE_KEY, intCopy(2), memslice(), true));
+    mempage serialized = SerializeNode(internal);
+
+    InternalPage page(serialized);
+    REQUIRE( page.count() == 3 );
+    REQUIRE( page.minKey(0).empty() );
+    REQUIRE( rngcmp(page.minKey(2), intCopy(5)) == 0 );
+    REQUIRE( page.nodeID(1) == 2 );
+    REQUIRE( page.itemCount(2) == 3 );
+
+    REQUIRE( page.editCount() == 2 );
+    REQUIRE( page.editType(1) == REMOVE_KEY );
+    REQUIRE( rngcmp(page.editValue(0), intCopy(40)) == 0 );
+    REQUIRE( page.editValue(1).empty() );
+
+    internalnode_ptr r = boost::dynamic_pointer_cast<InternalNode>(ParseNode(serialized, intToIntTree));
+    REQUIRE( r->editQueue.size() == 2 );
+    REQUIRE( r->editQueue[1].edit == REMOVE_KEY );
+    REQUIRE( r->editQueue[1].guaranteed );
+}
+
+TEST_CASE("queued edits keep whether they are guaranteed", "[serializing]")
+{
+    internalnode_ptr internal = boost::make_shared<InternalNode>();
+    internal->insert(0, node_branch(one_r, 1, 1));
+    internal->insert(1, node_branch(two_r, 2, 2));
+    internal->editQueue.push_back(pending_edit(UPSERT, intCopy(1), intCopy(10), true));
+    internal->editQueue.push_back(pending_edit(REMOVE_KV, intCopy(2), intCopy(20), false));
+    internal->editQueue.push_back(pending_edit(REMOVE_KEY, intCopy(3), memslice(), true));
+    mempage page = SerializeNode(internal);
+
+    internalnode_ptr r = boost::dynamic_pointer_cast<InternalNode>(ParseNode(page, intToIntTree));
+    REQUIRE( r->editQueue.size() == 3 );
+    REQUIRE( r->editQueue[0].edit == UPSERT );
+    REQUIRE( r->editQueue[0].guaranteed );
+    REQUIRE( r->editQueue[1].edit == REMOVE_KV );
+    REQUIRE( !r->editQueue[1].guaranteed );
+    REQUIRE( r->editQueue[2].edit == REMOVE_KEY );
+    REQUIRE( r->editQueue[2].guaranteed );
+}
+
+namespace {
+
+memslice pathKey(int i)
+{
+    char buf[64];
+    snprintf(buf, sizeof(buf), "tenant-0042/objects/photos/2016/%04d.jpg", i);
+    return traits::convert<std::string>::to_bytes(buf, g_testPool);
+}
+
+}
+
+TEST_CASE("keys with shared prefixes are front coded", "[serializing]")
+{
+    const tree_functions &fns = bruce<std::string, int>::fns;
+
+    leafnode_ptr leaf = boost::make_shared<LeafNode>(fns);
+    size_t keyBytes = 0;
+    for (int i = 0; i < 40; i++)
+    {
+        leaf->insert(kv_pair(pathKey(i), intCopy(i)));
+        keyBytes += pathKey(i).size();
+    }
+    mempage serialized = SerializeNode(leaf);
+
+    // Much less than the keys themselves take
+    REQUIRE( serialized.size() < keyBytes / 2 );
+    REQUIRE( LeafNodeSize(leaf, 0).size() == serialized.size() );
+
+    LeafPage page(serialized);
+    REQUIRE( page.count() == 40 );
+    for (int i = 0; i < 40; i++)
+        REQUIRE( rngcmp(page.key(i), pathKey(i)) == 0 );
+    REQUIRE( page.lowerBound(pathKey(17), fns) == 17 );
+    REQUIRE( page.upperBound(pathKey(17), fns) == 18 );
+    REQUIRE( page.lowerBound(pathKey(32), fns) == 32 );
+    REQUIRE( page.lowerBound(pathKey(99), fns) == 40 );
+
+    leafnode_ptr r = boost::dynamic_pointer_cast<LeafNode>(ParseNode(serialized, fns));
+    r->pairs(); // Decoded keys have to outlive the lazy view
+    REQUIRE( rngcmp(r->key(39), pathKey(39)) == 0 );
+}
+
+TEST_CASE("front-coded keys are decoded a block at a time", "[serializing]")
+{
+    const tree_functions &fns = bruce<std::string, int>::fns;
+
+    leafnode_ptr leaf = boost::make_shared<LeafNode>(fns);
+    for (int i = 0; i < 40; i++)
+        leaf->insert(kv_pair(pathKey(i), intCopy(i)));
+    mempage serialized = SerializeNode(leaf);
+
+    // Damage the shared prefix of key 35, the last one stored as "5.jpg"
+    const char suffix[] = "5.jpg";
+    uint8_t *begin = serialized.ptr();
+    uint8_t *end = begin + serialized.size();
+    uint8_t *found = end;
+    for (uint8_t *it = begin; (it = std::search(it, end, suffix, suffix + 5)) != end; ++it)
+        found = it;
+    REQUIRE( found != end );
+    *(uint16_t*)(found - 2 * sizeof(uint16_t)) = 0xffff;
+
+    // Only reading from its block finds out
+    LeafPage page(serialized);
+    REQUIRE( rngcmp(page.key(17), pathKey(17)) == 0 );
+    REQUIRE( rngcmp(page.key(32), pathKey(32)) == 0 );
+    REQUIRE( page.lowerBound(pathKey(20), fns) == 20 );
+    REQUIRE_THROWS( page.key(35) );
+}
+
+TEST_CASE("internal node keys are front coded", "[serializing]")
+{
+    const tree_functions &fns = bruce<std::string, int>::fns;
+
+    internalnode_ptr internal = boost::make_shared<InternalNode>();
+    for (int i = 0; i < 20; i++)
+        internal->append(node_branch(i ? pathKey(i * 10) : memslice(), i, i));
+    mempage serialized = SerializeNode(internal);
+
+    REQUIRE( InternalNodeSize(internal, 0, 0).size() == serialized.size() );
+
+    internalnode_ptr r = boost::dynamic_pointer_cast<InternalNode>(ParseNode(serialized, fns));
+    REQUIRE( r->branchCount() == 20 );
+    REQUIRE( r->branches[0].minKey.empty() );
+    REQUIRE( rngcmp(r->branches[19].minKey, pathKey(190)) == 0 );
+    REQUIRE( FindInternalKey(r, pathKey(55), fns) == 5 );
+}
+
+TEST_CASE("repeated keys are run-length encoded", "[serializing]")
+{
+    leafnode_ptr leaf = boost::make_shared<LeafNode>(intToIntTree);
+    for (uint32_t i = 0; i < 100; i++)
+        leaf->insert(kv_pair(intCopy(i < 60 ? 1 : i < 99 ? 2 : 3), intCopy(i)));
+    mempage serialized = SerializeNode(leaf);
+
+    // One stored key and a run start per distinct key, instead of 100 keys
+    REQUIRE( serialized.size() < 100 * 4 + 3 * 8 + 60 );
+    REQUIRE( LeafNodeSize(leaf, 0).size() == serialized.size() );
+
+    LeafPage page(serialized);
+    REQUIRE( page.count() == 100 );
+    REQUIRE( rngcmp(page.key(0), intCopy(1)) == 0 );
+    REQUIRE( rngcmp(page.key(59), intCopy(1)) == 0 );
+    REQUIRE( rngcmp(page.key(60), intCopy(2)) == 0 );
+    REQUIRE( rngcmp(page.key(98), intCopy(2)) == 0 );
+    REQUIRE( rngcmp(page.key(99), intCopy(3)) == 0 );
+    REQUIRE( rngcmp(page.value(70), intCopy(70)) == 0 );
+    REQUIRE( page.key(0).ptr() == page.key(59).ptr() );
+
+    REQUIRE( page.lowerBound(intCopy(2), intToIntTree) == 60 );
+    REQUIRE( page.upperBound(intCopy(2), intToIntTree) == 99 );
+    REQUIRE( page.lowerBound(intCopy(0), intToIntTree) == 0 );
+    REQUIRE( page.lowerBound(intCopy(4), intToIntTree) == 100 );
+
+    leafnode_ptr r = boost::dynamic_pointer_cast<LeafNode>(ParseNode(serialized, intToIntTree));
+    REQUIRE( r->pairCount() == 100 );
+    REQUIRE( r->pairs()[10].first.ptr() == r->pairs()[20].first.ptr() );
+}
+
+TEST_CASE("runs of front-coded keys", "[serializing]")
+{
+    const tree_functions &fns = bruce<std::string, int>::fns;
+
+    leafnode_ptr leaf = boost::make_shared<LeafNode>(fns);
+    for (int i = 0; i < 200; i++)
+        leaf->insert(kv_pair(pathKey(i / 5), intCopy(i)));
+    mempage serialized = SerializeNode(leaf);
+
+    REQUIRE( LeafNodeSize(leaf, 0).size() == serialized.size() );
+
+    LeafPage page(serialized);
+    for (int i = 0; i < 200; i++)
+        REQUIRE( rngcmp(page.key(i), pathKey(i / 5)) == 0 );
+    REQUIRE( page.lowerBound(pathKey(33), fns) == 165 );
+    REQUIRE( page.upperBound(pathKey(33), fns) == 170 );
+}
+
+TEST_CASE("values in blobs are marked in the page", "[serializing]")
+{
+    leafnode_ptr leaf = boost::make_shared<LeafNode>(intToIntTree);
+    for (uint32_t i = 0; i < 10; i++)
+        leaf->insert(kv_pair(intCopy(i), stored_value(intCopy(i), i % 3 == 0)));
+    mempage serialized = SerializeNode(leaf);
+
+    REQUIRE( LeafNodeSize(leaf, 0).size() == serialized.size() );
+
+    LeafPage page(serialized);
+    REQUIRE( page.hasBlobs() );
+    REQUIRE( page.blob(0) );
+    REQUIRE( !page.blob(4) );
+    REQUIRE( page.blob(9) );
+    REQUIRE( rngcmp(page.value(4), intCopy(4)) == 0 );
+    REQUIRE( page.overflowCount() == 0 );
+
+    leafnode_ptr r = boost::dynamic_pointer_cast<LeafNode>(ParseNode(serialized, intToIntTree));
+    REQUIRE( r->value(6).blob );
+    REQUIRE( !r->value(7).blob );
+    REQUIRE( r->pairs()[3].second.blob );
+    REQUIRE( !r->pairs()[5].second.blob );
+
+    WHEN("the values are in an overflow node")
+    {
+        overflownode_ptr overflow = boost::make_shared<OverflowNode>();
+        overflow->append(one_r);
+        overflow->append(stored_value(two_r, true));
+        mempage serialized = SerializeNode(overflow);
+
+        REQUIRE( OverflowNodeSize(overflow, 0).size() == serialized.size() );
+
+        overflownode_ptr r = boost::dynamic_pointer_cast<OverflowNode>(ParseNode(serialized, intToIntTree));
+        REQUIRE( !r->values[0].blob );
+        REQUIRE( r->values[1].blob );
+        REQUIRE( r->values[1] == two_r );
+    }
+
+    WHEN("no value is in a blob")
+    {
+        leafnode_ptr plain = boost::make_shared<LeafNode>(intToIntTree);
+        plain->insert(kv_pair(one_r, two_r));
+        REQUIRE( !LeafPage(SerializeNode(plain)).hasBlobs() );
+    }
+}
+
+TEST_CASE("blob pages hold a single value", "[serializing]")
+{
+    mempage value(100);
+    memset(value.ptr(), 'x', value.size());
+
+    mempage ref(BLOB_REF_SIZE);
+    *ref.at<nodeid_t>(0) = nodeid_t(1);
+    *ref.at<uint32_t>(sizeof(nodeid_t)) = value.size();
+
+    mempage blob = MakeBlobPage(value.all(), 1);
+    REQUIRE( PageNodeType(blob) == TYPE_BLOB );
+    REQUIRE( BlobPageValue(blob, ref.all()) == value.all() );
+
+    // Equal values still get pages of their own
+    REQUIRE( !(MakeBlobPage(value.all(), 2).all() == blob.all()) );
+
+    // The reference has to agree with the page
+    *ref.at<uint32_t>(sizeof(nodeid_t)) = 99;
+    REQUIRE_THROWS( BlobPageValue(blob, ref.all()) );
+    REQUIRE_THROWS( ParseNode(blob, intToIntTree) );
 }
@@ -0,0 +1,110 @@
+#include <catch/catch.hpp>
+#include <libbruce/bruce.h>
+#include "be/sha1.h"
+
+#include <sys/time.h>
+#include <stdio.h>
+
+using namespace libbruce;
+
+namespace {
+
+mempage pattern(size_t size, uint32_t seed)
+{
+    mempage page(size);
+    for (size_t i = 0; i < size; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        page.ptr()[i] = seed >> 24;
+    }
+    return page;
+}
+
+be::sha1_impl impls[] = { be::SHA1_SCALAR, be::SHA1_AVX2, be::SHA1_SHANI };
+const char *implNames[] = { "scalar", "avx2", "shani" };
+
+double now()
+{
+    timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + (tv.tv_usec / 1e6);
+}
+
+}
+
+TEST_CASE("SHA1 of a known message", "[sha1]")
+{
+    mempage abc(3);
+    memcpy(abc.ptr(), "abc", 3);
+
+    // Node IDs contain the state words in host order
+    nodeid_t id = be::sha1_id(abc);
+    const uint32_t *words = (const uint32_t*)id.data();
+    REQUIRE( words[0] == 0xa9993e36 );
+    REQUIRE( words[1] == 0x4706816a );
+    REQUIRE( words[2] == 0xba3e2571 );
+    REQUIRE( words[3] == 0x7850c26c );
+    REQUIRE( words[4] == 0x9cd0d89d );
+}
+
+TEST_CASE("all SHA1 implementations agree", "[sha1]")
+{
+    // All lengths around the padding boundaries, and some of different sizes
+    // so the multi-buffer lanes finish at different times.
+    be::mempagelist_t pages;
+    for (size_t size = 0; size < 200; size++)
+        pages.push_back(pattern(size, size));
+    pages.push_back(pattern(4096, 1));
+    pages.push_back(pattern(100000, 2));
+    pages.push_back(pattern(65, 3));
+
+    be::blockidlist_t expected = be::sha1_ids(pages, be::SHA1_SCALAR);
+    for (size_t i = 0; i < pages.size(); i++)
+        REQUIRE( be::sha1_id(pages[i]) == expected[i] );
+
+    for (int i = 0; i < 3; i++)
+    {
+        if (!be::sha1_supported(impls[i])) continue;
+
+        INFO( implNames[i] );
+        REQUIRE( be::sha1_ids(pages, impls[i]) == expected );
+
+        // Fewer blocks than lanes
+        be::mempagelist_t few(pages.begin() + 60, pages.begin() + 63);
+        REQUIRE( be::sha1_ids(few, impls[i]) == be::blockidlist_t(expected.begin() + 60, expected.begin() + 63) );
+    }
+}
+
+TEST_CASE("SHA1 implementation depends on the batch size", "[sha1]")
+{
+    // A single block never has the lanes to fill
+    REQUIRE( be::sha1_best(1) != be::SHA1_AVX2 );
+    if (be::sha1_supported(be::SHA1_SHANI))
+        REQUIRE( be::sha1_best(1) == be::SHA1_SHANI );
+    if (be::sha1_supported(be::SHA1_AVX2))
+        REQUIRE( be::sha1_best(8) == be::SHA1_AVX2 );
+}
+
+TEST_CASE("SHA1 throughput", "[.][bench]")
+{
+    size_t sizes[] = { 4 * 1024, 64 * 1024, 1024 * 1024 };
+    for (int s = 0; s < 3; s++)
+    {
+        // 64 MB worth of pages per size
+        be::mempagelist_t pages;
+        for (size_t total = 0; total < 64 * 1024 * 1024; total += sizes[s])
+            pages.push_back(pattern(sizes[s], total));
+
+        for (int i = 0; i < 3; i++)
+        {
+            if (!be::sha1_supported(impls[i])) continue;
+
+            double start = now();
+            be::sha1_ids(pages, impls[i]);
+            double seconds = now() - start;
+
+            printf("%-8s %8zu bytes %10.1f MB/s\n", implNames[i], sizes[s],
+                   pages.size() * sizes[s] / seconds / (1024 * 1024));
+        }
+    }
+}
@@ -12,3 +12,50 @@ TEST_CASE("Deserialize node ID")
     for (int i = 0; i < 20; i++)
         REQUIRE(id.data()[i] == i + 1);
 }
+
+TEST_CASE("string separator is the shortest prefix of the right key")
+{
+    mempool pool;
+    typedef traits::convert<std::string> conv;
+
+    memslice left = conv::to_bytes("apple pie", pool);
+    memslice right = conv::to_bytes("apricot jam", pool);
+    memslice sep = conv::separator(left, right, pool);
+
+    REQUIRE( conv::from_bytes(sep) == "apr" );
+    REQUIRE( conv::compare(left, sep) < 0 );
+    REQUIRE( conv::compare(sep, right) <= 0 );
+
+    WHEN("the left key is a prefix of the right one")
+    {
+        memslice sep = conv::separator(conv::to_bytes("ab", pool), conv::to_bytes("abcdef", pool), pool);
+        REQUIRE( conv::from_bytes(sep) == "abc" );
+    }
+
+    WHEN("the right key can't be shortened")
+    {
+        memslice shortRight = conv::to_bytes("apq", pool);
+        REQUIRE( conv::separator(left, shortRight, pool).ptr() == shortRight.ptr() );
+    }
+}
+
+TEST_CASE("binary separator is the shortest prefix of the right key")
+{
+    mempool pool;
+    typedef traits::convert<binary> conv;
+
+    memslice left = conv::to_bytes(binary("\x01\x00\x05\x07", 4), pool);
+    memslice right = conv::to_bytes(binary("\x01\x00\x06\x00\x09", 5), pool);
+    memslice sep = conv::separator(left, right, pool);
+
+    REQUIRE( conv::from_bytes(sep) == binary("\x01\x00\x06", 3) );
+    REQUIRE( conv::compare(left, sep) < 0 );
+    REQUIRE( conv::compare(sep, right) < 0 );
+}
+
+TEST_CASE("only types that have a separator get one")
+{
+    REQUIRE( traits::separator<std::string>::function() == &traits::convert<std::string>::separator );
+    REQUIRE( traits::separator<binary>::function() == &traits::convert<binary>::separator );
+    REQUIRE( traits::separator<uint32_t>::function() == NULL );
+}